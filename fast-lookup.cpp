@@ -5,14 +5,259 @@
 #include <iostream>
 #include <fstream>
 #include <sstream>
-#include <tr1/memory>
+#include <memory>
 #include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <cstddef>
+#include <cerrno>
+#include <climits>
+#include <cmath>
 #include <iomanip>
 #include <map>
+#include <set>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <future>
+#include <functional>
+#include <condition_variable>
+#include <deque>
+#include <algorithm>
+#include <iterator>
+#include <chrono>
+#include <cctype>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <strings.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdexcept>
+#include <stdint.h>
+#if __cplusplus >= 202002L
+#include <coroutine>
+#endif
 
 using std::cout;
 using std::string;
-using std::tr1::shared_ptr;
+using std::shared_ptr;
+
+
+//
+// EquityCode class
+//
+// A validated equity code ([A-Z0-9], 1..6 chars) packed into a single 64-bit
+// integer.  Each character maps to 1..36 ('0'-'9' -> 1..10, 'A'-'Z' -> 11..36)
+// and occupies 6 bits, first character in the most-significant position and
+// zero padding after the last one.  Integer ordering of the packed value is
+// therefore identical to std::string ordering of the original text, so codes
+// can be used directly as ordered map keys without any allocation.
+class EquityCode {
+public:
+    enum { MaxLen=6, BitsPerChar=6 };
+
+    // The null code (packed value 0) never matches a valid equity:
+    EquityCode() : _Packed(0) {
+    }
+
+    // Parses 'len' chars of 'text' into 'target'.  Returns false (leaving
+    // 'target' untouched) if the text is not a valid equity code.
+    static bool Parse(const char* text, size_t len, EquityCode& target) {
+        if ( (len < 1) || (len > (size_t)MaxLen) )
+            return false;
+        uint64_t packed=0;
+        for (size_t i = 0; i < (size_t)MaxLen; ++i) {
+            unsigned v=0;
+            if (i < len) {
+                v=Encode(text[i]);
+                if (!v)
+                    return false;
+            }
+            packed=(packed << BitsPerChar) | v;
+        }
+        target._Packed=packed;
+        return true;
+    }
+
+    static bool Parse(const char* text, EquityCode& target) {
+        if (!text)
+            return false;
+        // Don't scan further than one char past the longest legal code:
+        size_t len=0;
+        while ( (len <= (size_t)MaxLen) && text[len] )
+            ++len;
+        return Parse(text, len, target);
+    }
+
+    static bool Parse(const string& text, EquityCode& target) {
+        return Parse(text.data(), text.size(), target);
+    }
+
+    // Writes the code's text to 'buf' (at least MaxLen+1 chars), NUL-terminated.
+    // Returns the number of chars written, excluding the NUL.
+    size_t Format(char* buf) const {
+        size_t len=0;
+        for (int i = MaxLen-1; i >= 0; --i) {
+            unsigned v=(unsigned)(_Packed >> (i*BitsPerChar)) & 0x3f;
+            if (!v)
+                break;
+            buf[len++]=Decode(v);
+        }
+        buf[len]=0;
+        return len;
+    }
+
+    string ToString() const {
+        char buf[MaxLen+1];
+        return string(buf, Format(buf));
+    }
+
+    uint64_t Packed() const {
+        return _Packed;
+    }
+
+    // Rebuilds a code from its Packed() value.  Returns false (leaving
+    // 'target' untouched) if 'packed' isn't the packing of a valid code.
+    static bool Unpack(uint64_t packed, EquityCode& target) {
+        if ( !packed || (packed >> (MaxLen*BitsPerChar)) )
+            return false;
+        bool ended=false;
+        for (int i = MaxLen-1; i >= 0; --i) {
+            unsigned v=(unsigned)(packed >> (i*BitsPerChar)) & 0x3f;
+            if (!v)
+                ended=true;
+            else if ( ended || v > Encode('Z') )
+                return false;
+        }
+        target._Packed=packed;
+        return true;
+    }
+
+    // Sets [lo,hi] to the range of packed values taken by codes which start
+    // with the 'len' chars at 'prefix'.  Since packing preserves ordering,
+    // those codes are contiguous in code order.  Every code starts with the
+    // empty prefix.  Returns false if no code can start with 'prefix'.
+    static bool PrefixRange(const char* prefix, size_t len, uint64_t& lo, uint64_t& hi) {
+        if (len > (size_t)MaxLen)
+            return false;
+        uint64_t packed=0;
+        for (size_t i = 0; i < len; ++i) {
+            unsigned v=Encode(prefix[i]);
+            if (!v)
+                return false;
+            packed=(packed << BitsPerChar) | v;
+        }
+        unsigned rest=BitsPerChar*(MaxLen-(unsigned)len);
+        lo=packed << rest;
+        hi=lo | ((uint64_t(1) << rest)-1);
+        return true;
+    }
+
+    // Returns the code spelled backwards, which turns suffix matches into
+    // prefix matches:
+    EquityCode Reversed() const {
+        char buf[MaxLen+1];
+        size_t len=Format(buf);
+        std::reverse(buf, buf+len);
+        EquityCode reversed;
+        Parse(buf, len, reversed);
+        return reversed;
+    }
+
+    bool IsNull() const {
+        return _Packed==0;
+    }
+
+    bool operator < (const EquityCode& other) const {
+        return _Packed < other._Packed;
+    }
+    bool operator == (const EquityCode& other) const {
+        return _Packed == other._Packed;
+    }
+    bool operator != (const EquityCode& other) const {
+        return _Packed != other._Packed;
+    }
+
+private:
+    // Maps a code character to 1..36, or 0 if it's not in [A-Z0-9]:
+    static unsigned Encode(char c) {
+        if ( (c >= '0') && (c <= '9') )
+            return (unsigned)(c-'0')+1;
+        if ( (c >= 'A') && (c <= 'Z') )
+            return (unsigned)(c-'A')+11;
+        return 0;
+    }
+
+    static char Decode(unsigned v) {
+        return (v <= 10) ? (char)('0'+v-1) : (char)('A'+v-11);
+    }
+
+    uint64_t _Packed;
+};
+
+std::ostream& operator << (std::ostream& output, const EquityCode& code) {
+    char buf[EquityCode::MaxLen+1];
+    return output.write(buf, code.Format(buf));
+}
+
+
+// StringRef is a non-owning view of 'Size()' chars at 'Data()'.  It does not
+// manage the lifetime of the characters it refers to.
+class StringRef {
+public:
+    StringRef() : _Data(""), _Len(0) {
+    }
+    StringRef(const char* data, size_t len) : _Data(data), _Len(len) {
+    }
+    StringRef(const string& str) : _Data(str.data()), _Len(str.size()) {
+    }
+    StringRef(const char* str) : _Data(str), _Len(strlen(str)) {
+    }
+
+    const char* Data() const {
+        return _Data;
+    }
+    size_t Size() const {
+        return _Len;
+    }
+    bool Empty() const {
+        return _Len==0;
+    }
+    char operator [] (size_t ix) const {
+        return _Data[ix];
+    }
+    string ToString() const {
+        return string(_Data, _Len);
+    }
+
+    bool operator == (const StringRef& other) const {
+        return (_Len==other._Len) && (memcmp(_Data, other._Data, _Len)==0);
+    }
+    bool operator != (const StringRef& other) const {
+        return !(*this==other);
+    }
+
+private:
+    const char* _Data;
+    size_t      _Len;
+};
+
+std::ostream& operator << (std::ostream& output, const StringRef& ref) {
+    return output.write(ref.Data(), ref.Size());
+}
 
 
 //
@@ -22,7 +267,8 @@ using std::tr1::shared_ptr;
 class Equity {
 
 public:
-    // Construct an Equity from its component parts:
+    // Construct an Equity from its component parts.  Throws std::invalid_argument
+    // if equityName isn't a valid equity code:
     Equity(
         const char* equityName,  //  Name/symbol
         const char* description, //  Plain-text description
@@ -30,31 +276,76 @@ public:
         double      price,       //  Price, US$
         double      PE_ratio     //  P/E ratio
     ) :
-        _EquityName(equityName),
-        _Description(description),
+        _EquityName(ParseCode(equityName)),
+        _DescriptionText(description),
+        _Description(_DescriptionText),
         _MarketCap(marketCap),
         _Price(price),
-        _PE_ratio(PE_ratio) {
+        _PE_ratio(PE_ratio),
+        _Rendered(0) {
     }
 
     // Default constructor zeroes out the POD fields only:
     Equity(const char* equityName="") :
-        _EquityName(equityName),
+        _EquityName(ParseCode(equityName)),
+        _Description(_DescriptionText),
         _MarketCap(0),
         _Price(0),
-        _PE_ratio(0) {
+        _PE_ratio(0),
+        _Rendered(0) {
     }
 
-    // Returns the equity name/symbol:
-    const string & GetEquityName() const {
+    // Copies refer to their own copy of an owned description, but share a
+    // borrowed one:
+    Equity(const Equity& other) :
+        _EquityName(other._EquityName),
+        _DescriptionText(other._DescriptionText),
+        _Description(other.OwnsDescription() ? StringRef(_DescriptionText) : other._Description),
+        _MarketCap(other._MarketCap),
+        _Price(other._Price),
+        _PE_ratio(other._PE_ratio),
+        _Rendered(0) {
+    }
+
+    ~Equity() {
+        delete [] _Rendered.load(std::memory_order_relaxed);
+    }
+
+    Equity& operator = (const Equity& other) {
+        if (this != &other) {
+            bool owned=other.OwnsDescription();
+            _EquityName=other._EquityName;
+            _DescriptionText=other._DescriptionText;
+            _Description= owned ? StringRef(_DescriptionText) : other._Description;
+            _MarketCap=other._MarketCap;
+            _Price=other._Price;
+            _PE_ratio=other._PE_ratio;
+            delete [] _Rendered.exchange(0);
+        }
+        return *this;
+    }
+
+    // Returns the packed equity code:
+    const EquityCode & GetEquityCode() const {
         return _EquityName;
     }
 
+    // Returns the equity name/symbol:
+    string GetEquityName() const {
+        return _EquityName.ToString();
+    }
+
     // Returns a plain-text description of the equity:
-    const string & GetDescription() const {
+    const StringRef & GetDescription() const {
         return _Description;
     }
 
+    // Returns false if the description text is borrowed from storage owned
+    // by someone else (e.g. a memory-mapped input file):
+    bool OwnsDescription() const {
+        return _Description.Data()==_DescriptionText.data();
+    }
+
     // Returns the market capitalization for this equity in USD$:
     long long GetMarketCap() const {
         return _MarketCap;
@@ -71,542 +362,9241 @@ public:
     }
 
 private:
-    string      _EquityName;
-    string      _Description;
+    // An empty name gives the null code; anything else must validate:
+    static EquityCode ParseCode(const char* equityName) {
+        EquityCode code;
+        if ( equityName && *equityName && !EquityCode::Parse(equityName, code) )
+            throw std::invalid_argument("Invalid equity code");
+        return code;
+    }
+
+    EquityCode  _EquityName;
+    string      _DescriptionText;   // Owned description, if any
+    StringRef   _Description;       // _DescriptionText, or borrowed text
     long long   _MarketCap;
     double      _Price;
     double      _PE_ratio;
 
+    // The line EquityFormatter::Cached() rendered, prefixed by its length.
+    // Copies and updates start without one.
+    mutable std::atomic<char*> _Rendered;
+
     friend class EquityTextFactory;
+    friend class EquityArena;
+    friend class EquityMap;
+    friend class EquityFormatter;
 
 };
 
-// Stub is a diagnostic aid, printing to stderr:
-struct Stub  {
-    std::ostream& operator << (const char* msg) {
-        std::cerr << msg;
-        return std::cerr;
-    }
-    std::ostream& operator << (const string& msg) {
-        std::cerr << msg;
-        return std::cerr;
-    }
-};
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MADV_COLLAPSE
+#define MADV_COLLAPSE 25
+#endif
 
-typedef shared_ptr<Equity> EquityPtr;
+// HugePages allocates memory backed by 2MB or 1GB pages, so that large
+// arrays cost a handful of TLB entries instead of one per 4KB page.
+//
+// Explicit huge pages (MAP_HUGETLB) come from the pool reserved through
+// /proc/sys/vm/nr_hugepages (or hugepages=N on the kernel command line for
+// 1GB pages).  When none are free, the allocation falls back to an ordinary
+// 2MB-aligned mapping marked MADV_HUGEPAGE, which the kernel backs with
+// transparent huge pages as it can.  None of this changes the memory's
+// contents or lifetime, so a policy is only ever a hint.
+class HugePages {
+public:
+    enum Policy {
+        Pages_Default,      // ordinary heap memory
+        Pages_Transparent,  // 2MB-aligned mapping, MADV_HUGEPAGE
+        Pages_2MB,          // MAP_HUGETLB 2MB pages, else transparent
+        Pages_1GB           // MAP_HUGETLB 1GB pages, else transparent
+    };
 
-// Base class for Equity filter functor types.
-struct EquityFilter {
-    virtual const Equity& Compare(const Equity& left, const Equity& right) const {
-        return left;
-    }
-    virtual bool Select(const Equity& elem) const {
-        return false;
-    }
-};
+    enum { Size2MB=2*1024*1024 };
 
+    // Allocation sizes under 'policy' are rounded up to a multiple of this:
+    static size_t Granularity(Policy policy) {
+        if (policy==Pages_Default)
+            return 1;
+        return policy==Pages_1GB ? (size_t)1 << 30 : (size_t)Size2MB;
+    }
 
-// The EquityMap class is an associative array which provides a fast-lookup container
-// for Equity objects:
-class EquityMap {
-public:
-    EquityMap() {
+    static size_t RoundUp(size_t bytes, Policy policy) {
+        size_t g=Granularity(policy);
+        return (bytes+g-1)/g*g;
     }
 
-    virtual ~EquityMap() {
+    // Returns at least 'bytes' of writable memory under 'policy'.  Release
+    // it with Free(), passing the same size and policy.  Throws
+    // std::bad_alloc.
+    static void* Allocate(size_t bytes, Policy policy) {
+        if (policy==Pages_Default)
+            return ::operator new(bytes);
+        size_t size=RoundUp(bytes, policy);
+        if (policy != Pages_Transparent) {
+            int flags=MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (policy==Pages_1GB ? MAP_HUGE_1GB : MAP_HUGE_2MB);
+            void* p=mmap(0, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+            if (p != MAP_FAILED)
+                return p;
+        }
+        // Map an extra 2MB, so the mapping can be trimmed to start on a huge
+        // page boundary:
+        void* p=mmap(0, size+Size2MB, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p==MAP_FAILED)
+            throw std::bad_alloc();
+        uintptr_t base=(uintptr_t)p;
+        uintptr_t aligned=(base+Size2MB-1) & ~(uintptr_t)(Size2MB-1);
+        if (aligned > base)
+            munmap(p, aligned-base);
+        munmap((void*)(aligned+size), base+Size2MB-aligned);
+        madvise((void*)aligned, size, MADV_HUGEPAGE);
+        return (void*)aligned;
     }
 
-    typedef std::map<string,EquityPtr> MapT;
-    typedef MapT::const_iterator const_iterator;
-    const_iterator begin() const {
-        return _Map.begin();
+    static void Free(void* p, size_t bytes, Policy policy) {
+        if (policy==Pages_Default)
+            ::operator delete(p);
+        else if (p)
+            munmap(p, RoundUp(bytes, policy));
     }
-    const_iterator end() const {
-        return _Map.end();
+
+    // Asks for the whole 2MB pages within an existing allocation (a
+    // std::vector's storage, say) to be backed by transparent huge pages, and
+    // where the kernel supports MADV_COLLAPSE, for that to happen now rather
+    // than whenever khugepaged gets round to it.  Small ranges are ignored.
+    static void Advise(const void* p, size_t bytes) {
+        uintptr_t begin=((uintptr_t)p+Size2MB-1) & ~(uintptr_t)(Size2MB-1);
+        uintptr_t end=((uintptr_t)p+bytes) & ~(uintptr_t)(Size2MB-1);
+        if (end <= begin)
+            return;
+        madvise((void*)begin, end-begin, MADV_HUGEPAGE);
+        madvise((void*)begin, end-begin, MADV_COLLAPSE);
     }
 
-    void Insert(const EquityPtr& e) {
-        _Map[e->GetEquityName()] = e;
+    template <class T>
+    static void Advise(const std::vector<T>& v) {
+        if (!v.empty())
+            Advise(&v[0], v.size()*sizeof(T));
     }
+};
 
-    // Finds an Equity object by name.  Throws a domain_error if not found.
-    EquityPtr  FindByEquityName(const char* name) const {
-        MapT::const_iterator it=_Map.find(name);
-        if (it==_Map.end()) {
-            throw new std::domain_error("No such equity name");
-        }
-        return it->second;
+
+// StringPool is an append-only store for string data.  Strings are copied into
+// large chunks which are never reallocated, so a StringRef returned by Add()
+// stays valid for the lifetime of the pool.  Under a huge page policy, each
+// chunk is one huge page.
+class StringPool {
+public:
+    enum { ChunkSize=64*1024 };
+
+    explicit StringPool(HugePages::Policy pages=HugePages::Pages_Default) :
+        _Pages(pages), _ChunkSize(pages==HugePages::Pages_Default ? (size_t)ChunkSize : HugePages::Granularity(pages)),
+        _Used(_ChunkSize), _Bytes(0) {
     }
 
-    // Iteratively invokes a selection filter on each element in the collection to
-    // produce a selected-items collection.  Returns number of elements added
-    // to the 'result' collection.
-    int SelectByFilter( const EquityFilter& filter, EquityMap & result) const {
-        // If the map is empty, return an empty pointer:
-        if ( _Map.size()== 0)
-            return 0;
+    ~StringPool() {
+        for (size_t i = 0; i < _Chunks.size(); ++i)
+            HugePages::Free(_Chunks[i].first, _Chunks[i].second, _Pages);
+    }
 
-        int nAdded=0;
-        for (const_iterator it= begin(); it !=end(); ++it) {
-            if (filter.Select(*it->second)) {
-                ++nAdded;
-                result.Insert(it->second);
+    // Copies 'len' chars of 'data' into the pool:
+    StringRef Add(const char* data, size_t len) {
+        if (!len)
+            return StringRef();
+        char* dest;
+        if (len > _ChunkSize/4) {
+            // Large strings get a chunk of their own, so we don't waste the
+            // tail of the current chunk:
+            dest=NewChunk(len, true);
+        }
+        else {
+            if (_Used+len > _ChunkSize) {
+                NewChunk(_ChunkSize, false);
+                _Used=0;
             }
+            dest=_Chunks.back().first+_Used;
+            _Used+=len;
         }
-        return nAdded;
+        memcpy(dest, data, len);
+        _Bytes+=len;
+        return StringRef(dest, len);
     }
 
-    // Iteratively compares each element in the collection using a caller-supplied
-    // comparison filter.  Returns the element which the filter determines to be
-    // best-fit:
-    EquityPtr FindByCompareFilter( const EquityFilter& filter) const {
-        // Our initial first-item is the first item in the collection.
-        if ( _Map.size()== 0)
-            return EquityPtr();
-        // In a 1-element collection, the compare filter is irrelevant:
-        if (_Map.size()==1)
-            return _Map.begin()->second;
-
-        EquityPtr cur=_Map.begin()->second;
-        for (const_iterator it= ++begin(); it !=end(); ++it) {
-            const Equity& selected = filter.Compare(*cur, *it->second);
-            if ( &selected != &*cur )
-                // The filter chose the right-side equity:
-                cur=it->second;
+    StringRef Add(const StringRef& str) {
+        return Add(str.Data(), str.Size());
+    }
 
-        }
-        return cur;
+    // Returns the number of string bytes stored:
+    size_t BytesUsed() const {
+        return _Bytes;
     }
 
 private:
-    // We really don't want people accidentally copying this.  It's expensive.  If that operation
-    // is needed, we'll add a Clone() method.
-    EquityMap(const EquityMap& );
-    void operator = (const EquityMap&);
-
-    MapT _Map;
+    StringPool(const StringPool&);
+    void operator = (const StringPool&);
 
+    // A 'dedicated' chunk holds one large string, whatever its size, and is
+    // never the current chunk:
+    char* NewChunk(size_t size, bool dedicated) {
+        _Chunks.reserve(_Chunks.size()+1);
+        std::pair<char*,size_t> chunk((char*)HugePages::Allocate(size, _Pages), size);
+        if (!dedicated) {
+            _Chunks.push_back(chunk);
+        }
+        else {
+            // Keep the current partially-filled chunk at the back:
+            _Chunks.insert(_Chunks.empty() ? _Chunks.end() : _Chunks.end()-1, chunk);
+        }
+        return chunk.first;
+    }
 
+    const HugePages::Policy _Pages;
+    const size_t            _ChunkSize;
+    std::vector< std::pair<char*,size_t> > _Chunks;   // (chunk, size)
+    size_t                  _Used;   // chars used in _Chunks.back()
+    size_t                  _Bytes;
 };
 
 
-// Split a string on a single-char delimiter, and populate *this
-// with the resulting tokens:
-class StringSplitter : public std::vector<string> {
+// MappedFile maps a whole file read-only into memory.  Throws
+// std::runtime_error if the file can't be opened or mapped.
+class MappedFile {
 public:
-    void Insert( std::stringstream& ss, char delimiter ) {
-        string cur;
-        while (std::getline(ss,cur,delimiter)) {
-            this->push_back(cur);
+    // 'populate' maps the whole file up front (MAP_POPULATE), which is cheaper
+    // than faulting it in page by page when all of it will be read:
+    MappedFile(const char* path, bool populate=false) : _Data(0), _Size(0) {
+        int fd=open(path, O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error(string("Can't open ") + path);
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            throw std::runtime_error(string("Can't stat ") + path);
+        }
+        _Size=(size_t)st.st_size;
+        if (_Size) {
+            void* p=mmap(0, _Size, PROT_READ, MAP_PRIVATE | (populate ? MAP_POPULATE : 0), fd, 0);
+            if (p==MAP_FAILED) {
+                close(fd);
+                throw std::runtime_error(string("Can't map ") + path);
+            }
+            _Data=(const char*)p;
+            // We read the file front to back exactly once while loading:
+            madvise(p, _Size, MADV_SEQUENTIAL);
         }
+        // The mapping stays valid after the descriptor is closed:
+        close(fd);
     }
-    StringSplitter(const char* text, char delimiter) {
-        std::stringstream ss(text);
-        Insert(ss , delimiter);
+
+    ~MappedFile() {
+        if (_Data)
+            munmap((void*)_Data, _Size);
     }
 
-    StringSplitter(const std::string& text, char delimiter) {
-        std::stringstream ss(text);
-        Insert( ss , delimiter);
+    StringRef GetText() const {
+        return _Data ? StringRef(_Data, _Size) : StringRef();
     }
 
+private:
+    MappedFile(const MappedFile&);
+    void operator = (const MappedFile&);
+
+    const char* _Data;
+    size_t      _Size;
 };
 
-// Trim leading whitespace from a string.
-//   Usage:
-//      string newStr =  LTrim(old_string);
+typedef shared_ptr<MappedFile> MappedFilePtr;
+
+
+// EquityArena provides bulk storage for the Equity objects of one load.
+// Records are constructed in large blocks by a bump allocator, and their
+// descriptions are interned in a StringPool, so loading N equities costs a
+// few dozen allocations instead of several per record, and duplicate
+// descriptions are stored once.  Everything is released together when the
+// arena is destroyed.
 //
-struct LTrim {
-    LTrim(const string& orig) {
-        size_t ix=orig.find_first_not_of(" \t\n\r\b");
-        if (ix==string::npos)
-            _Result=orig;
-        else
-            _Result=orig.substr(ix);
+// EquityPtrs to arena records share ownership of the arena itself (see
+// EquityTextFactory::NewEquity), so the arena lives exactly as long as its
+// last outstanding record.  An arena is not thread-safe; parallel loads use
+// one per thread.
+class EquityArena {
+public:
+    enum { BlockRecords=4096 };
 
+    // Under a huge page policy, each block of records is one huge page (so a
+    // 1GB policy only makes sense for very large loads):
+    explicit EquityArena(HugePages::Policy pages=HugePages::Pages_Default) :
+        _Pages(pages),
+        _BlockRecords(pages==HugePages::Pages_Default ? (size_t)BlockRecords : HugePages::Granularity(pages)/sizeof(Equity)),
+        _Used(_BlockRecords), _Count(0), _Strings(pages), _InternedCount(0) {
     }
-    string _Result;
-    operator const string&() const {
-        return _Result;
-    }
-};
 
-// ParseString offers a few conversion functions which return false if
-// 'input' doesn't validate for the 'target' type.  Otherwise, the string
-// is converted and target is updated.
-class ParseString {
-public:
-    ParseString(const string& xinput, long long& target) : _Ok(false) {
-        string input = LTrim( xinput );
-        // Make sure we only have 0-9 in the input:
-        if (input.find_first_not_of("0123456789") != std::string::npos) {
-            return;  //   Oops.  One or more non-digits!
-        }
-        try {
-            target = std::stoll( input );
-        }
-        catch ( std::out_of_range ) {
-            return;
+    ~EquityArena() {
+        for (size_t b = 0; b < _Blocks.size(); ++b) {
+            size_t n= (b+1==_Blocks.size()) ? _Used : _BlockRecords;
+            for (size_t i = 0; i < n; ++i)
+                _Blocks[b][i].~Equity();
+            HugePages::Free(_Blocks[b], _BlockRecords*sizeof(Equity), _Pages);
         }
-        _Ok=true;  // We're happy now.
     }
 
-    ParseString(const string& xinput, double & target) : _Ok(false) {
-        string input = LTrim( xinput );
-        // Make sure we only have 0-9 or '.' in the input:
-        if (input.find_first_not_of("0123456789.") != std::string::npos) {
-            return;  //   Oops.  One or more invalid chars!
-        }
-        try {
-            target = std::stod( input );
+    // Returns a default-constructed Equity in arena storage:
+    Equity* Allocate() {
+        if (_Used==_BlockRecords) {
+            _Blocks.reserve(_Blocks.size()+1);
+            _Blocks.push_back((Equity*)HugePages::Allocate(_BlockRecords*sizeof(Equity), _Pages));
+            _Used=0;
         }
-        catch ( std::out_of_range ) {
-            return;
+        Equity* e=new (&_Blocks.back()[_Used]) Equity;
+        ++_Used;
+        ++_Count;
+        return e;
+    }
+
+    // Returns a copy of 'e' in arena storage, its description interned:
+    Equity* Copy(const Equity& e) {
+        Equity* copy=Allocate();
+        copy->_EquityName=e._EquityName;
+        copy->_Description=Intern(e.GetDescription());
+        copy->_MarketCap=e._MarketCap;
+        copy->_Price=e._Price;
+        copy->_PE_ratio=e._PE_ratio;
+        return copy;
+    }
+
+    // Returns the pooled copy of 'str', adding it to the pool if it's new:
+    StringRef Intern(const StringRef& str) {
+        if ( (_InternedCount+1)*4 > _Interned.size()*3 )
+            GrowInterned();
+        size_t mask=_Interned.size()-1;
+        for (size_t ix = Hash(str) & mask; ; ix=(ix+1) & mask) {
+            if (!_Interned[ix].Data()) {
+                _Interned[ix]=_Strings.Add(str);
+                if (!_Interned[ix].Data())
+                    _Interned[ix]=StringRef("", 0);   // Empty strings get a non-null marker.
+                ++_InternedCount;
+                return _Interned[ix];
+            }
+            if (_Interned[ix]==str)
+                return _Interned[ix];
         }
-        _Ok=true;  // We're happy now.
     }
 
-    operator bool() const {
-        return _Ok;
+    // Number of Equity records allocated:
+    size_t Count() const {
+        return _Count;
     }
 
-private:
-    bool _Ok;
-};
+    // Bytes of interned string data:
+    size_t StringBytes() const {
+        return _Strings.BytesUsed();
+    }
 
+    // Keeps 'backing' (e.g. a MappedFile) alive as long as the arena, for
+    // records which borrow their descriptions from it:
+    void RetainBacking(const shared_ptr<void>& backing) {
+        _Backing.push_back(backing);
+    }
 
-//  Prints an Equity object to a stream:
-std::ostream& operator << (std::ostream& output, const Equity& val) {
-    double cap=(double)val.GetMarketCap()/(double)1000000.0;
-    output
-            << "code: " << val.GetEquityName()
-            << " description: " << val.GetDescription()
-            << std::fixed << std::setprecision(3)
-            << " last price: " << val.GetPrice()
-            << " market cap: " << cap << " Million "
-            << " P/E: " << val.GetPE_ratio()
-            ;
-}
+private:
+    EquityArena(const EquityArena&);
+    void operator = (const EquityArena&);
 
+    // FNV-1a:
+    static size_t Hash(const StringRef& str) {
+        uint64_t h=14695981039346656037ULL;
+        for (size_t i = 0; i < str.Size(); ++i)
+            h=(h ^ (unsigned char)str[i]) * 1099511628211ULL;
+        return (size_t)(h ^ (h >> 32));
+    }
 
-// This class creates Equity objects by parsing a line of text formatted as
-// follows:
-//
-// HEADER:Code|Description|Market Cap|Price|P/E Ratio
-// IBMUS|International Business Machines|198657057012|182.95|11.18
-//
-//
-class EquityTextFactory {
-public:
+    // Empty slots hold a StringRef with null Data():
+    void GrowInterned() {
+        std::vector<StringRef> old;
+        old.swap(_Interned);
+        _Interned.assign(old.empty() ? 1024 : old.size()*2, StringRef(0, 0));
+        size_t mask=_Interned.size()-1;
+        for (size_t i = 0; i < old.size(); ++i) {
+            if (!old[i].Data())
+                continue;
+            size_t ix=Hash(old[i]) & mask;
+            while (_Interned[ix].Data())
+                ix=(ix+1) & mask;
+            _Interned[ix]=old[i];
+        }
+    }
 
+    const HugePages::Policy _Pages;
+    const size_t           _BlockRecords;
+    std::vector<Equity*>   _Blocks;
+    size_t                 _Used;           // records used in _Blocks.back()
+    size_t                 _Count;
+    StringPool             _Strings;
+    std::vector<StringRef> _Interned;       // open-addressing set over _Strings
+    size_t                 _InternedCount;
+    std::vector< shared_ptr<void> > _Backing;
+};
 
-    // Our field schema:
-    enum { F_EquityName=0, F_Description, F_MarketCap, F_Price, F_PE_ratio, F_COUNT };
+typedef shared_ptr<EquityArena> EquityArenaPtr;
 
-    // Parse an Equity object from a line of text, using the field schema
-    // described above.   If the text cannot be parsed, the EquityPtr returned
+
+// Stub is a diagnostic aid, printing to stderr:
+struct Stub  {
+    std::ostream& operator << (const char* msg) {
+        std::cerr << msg;
+        return std::cerr;
+    }
+    std::ostream& operator << (const string& msg) {
+        std::cerr << msg;
+        return std::cerr;
+    }
+};
+
+// Outcome of a lookup (see EquityMap::TryFind, EquityService::getSecurityInfoBatch):
+enum LookupStatus {
+    Lookup_Found,
+    Lookup_NotFound,
+    Lookup_InvalidCode      // not a well-formed equity code
+};
+
+
+// Builds with _COMPILE_METRICS defined instrument the service: every public
+// EquityService method records its latency, the loaders time their phases, and
+// lookups, rejected records, inserts and updates are counted.  Without it the
+// FAST_LOOKUP_TIMED and FAST_LOOKUP_COUNT macros expand to nothing, and none of
+// the code below is compiled.
+#ifdef _COMPILE_METRICS
+
+// LatencyHistogram counts nanosecond latencies in log-linear buckets, HDR
+// histogram style: each power of two is split into 16 linear sub-buckets, so
+// a bucket's bounds are within 1/16th of the values in it.  The range is 1ns
+// to about 18 minutes; longer latencies are counted as the maximum.  Only one
+// thread may record into a histogram, but any thread may read it.
+class LatencyHistogram {
+public:
+    enum { SubBits=4, SubBuckets=1 << SubBits, MaxBits=40, Buckets=(MaxBits-SubBits+1)*SubBuckets };
+
+    LatencyHistogram() {
+        for (size_t b = 0; b < Buckets; ++b)
+            _Buckets[b].store(0, std::memory_order_relaxed);
+        _Count.store(0, std::memory_order_relaxed);
+        _Sum.store(0, std::memory_order_relaxed);
+    }
+
+    void Record(uint64_t ns) {
+        Bump(_Buckets[Bucket(ns)], 1);
+        Bump(_Count, 1);
+        Bump(_Sum, ns);
+    }
+
+    static size_t Bucket(uint64_t ns) {
+        if (ns >= ((uint64_t)1 << MaxBits))
+            ns=((uint64_t)1 << MaxBits)-1;
+        if (ns < SubBuckets)
+            return (size_t)ns;
+        int shift=63-__builtin_clzll(ns)-SubBits;
+        return (size_t)(shift+1)*SubBuckets + (size_t)((ns >> shift) & (SubBuckets-1));
+    }
+
+    // Returns the largest latency counted in bucket 'b':
+    static uint64_t UpperBound(size_t b) {
+        if (b < SubBuckets)
+            return b;
+        size_t shift=b/SubBuckets-1;
+        return ((uint64_t)(SubBuckets + b%SubBuckets + 1) << shift) - 1;
+    }
+
+    // A histogram's counts, or several histograms' added up:
+    struct Totals {
+        Totals() : Buckets(LatencyHistogram::Buckets, 0), Count(0), Sum(0) {
+        }
+        // Returns the latency below which fraction 'q' of the samples fall:
+        uint64_t Quantile(double q) const {
+            uint64_t rank=(uint64_t)std::ceil(q*(double)Count), seen=0;
+            for (size_t b = 0; b < Buckets.size(); ++b) {
+                seen += Buckets[b];
+                if (seen && seen >= rank)
+                    return UpperBound(b);
+            }
+            return 0;
+        }
+        std::vector<uint64_t> Buckets;
+        uint64_t              Count;
+        uint64_t              Sum;
+    };
+
+    void AddTo(Totals& totals) const {
+        for (size_t b = 0; b < Buckets; ++b)
+            totals.Buckets[b] += _Buckets[b].load(std::memory_order_relaxed);
+        totals.Count += _Count.load(std::memory_order_relaxed);
+        totals.Sum += _Sum.load(std::memory_order_relaxed);
+    }
+
+    // The owning thread's increment: no read-modify-write needed.
+    static void Bump(std::atomic<uint64_t>& value, uint64_t n) {
+        value.store(value.load(std::memory_order_relaxed)+n, std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<uint64_t> _Buckets[Buckets];
+    std::atomic<uint64_t> _Count;
+    std::atomic<uint64_t> _Sum;
+};
+
+// Metrics keeps the counters and histograms, one set per thread so that
+// recording never contends, and adds them up when they're exported.  A
+// thread's set is handed on to a later thread when it exits, so nothing
+// recorded is lost, and short-lived loader threads don't pile up sets.
+class Metrics {
+public:
+    // Timed operations.  The Phase_ ones time the stages of a load: reading
+    // the input, parsing each record, inserting each record (or each sorted
+    // batch, for parallel loads), and building indexes.
+    enum Op {
+        Op_Initialize, Op_LoadSnapshot, Op_SaveSnapshot, Op_ApplyUpdates,
+        Op_GetSecurityInfo, Op_GetSecurityInfoBatch, Op_AllSecurityCodes, Op_WriteSecurityCodes,
+        Op_LowestPE, Op_GetPERange, Op_Screen, Op_Query, Op_Count, Op_FindByCode, Op_FindByDescription,
+        Phase_Read, Phase_Parse, Phase_Insert, Phase_IndexBuild,
+        OpCount
+    };
+
+    enum Counter {
+        Counter_Hits, Counter_Misses, Counter_InvalidCodes,     // lookups, by LookupStatus
+        Counter_ParseRejects, Counter_Inserts, Counter_Updates,
+        CounterCount
+    };
+
+    static Counter LookupCounter(LookupStatus status) {
+        return status==Lookup_Found ? Counter_Hits : status==Lookup_NotFound ? Counter_Misses : Counter_InvalidCodes;
+    }
+
+    static void Count(Counter counter, uint64_t n=1) {
+        LatencyHistogram::Bump(Local()->Counters[counter], n);
+    }
+
+    static void Record(Op op, uint64_t ns) {
+        Local()->Latency[op].Record(ns);
+    }
+
+    static uint64_t Now() {
+        return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Writes everything in the Prometheus text exposition format.  Latencies
+    // are summaries (quantiles, sum and count), in seconds.
+    static void WritePrometheus(std::ostream& out) {
+        std::vector<LatencyHistogram::Totals> latency;
+        std::vector<uint64_t> counters;
+        Collect(latency, counters);
+        out << "# TYPE fast_lookup_events_total counter\n";
+        for (int c = 0; c < CounterCount; ++c)
+            out << "fast_lookup_events_total{event=\"" << CounterName((Counter)c) << "\"} " << counters[c] << "\n";
+        out << "# TYPE fast_lookup_latency_seconds summary\n";
+        for (int op = 0; op < OpCount; ++op) {
+            const LatencyHistogram::Totals& t=latency[op];
+            const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+            for (size_t q = 0; q < sizeof(quantiles)/sizeof(*quantiles); ++q) {
+                out << "fast_lookup_latency_seconds{op=\"" << OpName((Op)op) << "\",quantile=\"" << quantiles[q] << "\"} "
+                    << (double)t.Quantile(quantiles[q])*1e-9 << "\n";
+            }
+            out << "fast_lookup_latency_seconds_sum{op=\"" << OpName((Op)op) << "\"} " << (double)t.Sum*1e-9 << "\n";
+            out << "fast_lookup_latency_seconds_count{op=\"" << OpName((Op)op) << "\"} " << t.Count << "\n";
+        }
+    }
+
+    // Writes a human-readable table of whatever has been recorded:
+    static void WriteSummary(std::ostream& out) {
+        std::vector<LatencyHistogram::Totals> latency;
+        std::vector<uint64_t> counters;
+        Collect(latency, counters);
+        for (int c = 0; c < CounterCount; ++c)
+            out << std::left << std::setw(24) << CounterName((Counter)c) << std::right << counters[c] << "\n";
+        out << std::left << std::setw(24) << "op (ns)" << std::right << std::setw(10) << "count" << std::setw(14) << "mean"
+            << std::setw(12) << "p50" << std::setw(12) << "p99" << std::setw(12) << "p99.9" << std::setw(14) << "max" << "\n";
+        for (int op = 0; op < OpCount; ++op) {
+            const LatencyHistogram::Totals& t=latency[op];
+            if (!t.Count)
+                continue;
+            out << std::left << std::setw(24) << OpName((Op)op) << std::right << std::setw(10) << t.Count
+                << std::setw(14) << t.Sum/t.Count << std::setw(12) << t.Quantile(0.5) << std::setw(12) << t.Quantile(0.99)
+                << std::setw(12) << t.Quantile(0.999) << std::setw(14) << t.Quantile(1.0) << "\n";
+        }
+    }
+
+    static const char* OpName(Op op) {
+        static const char* names[OpCount] = {
+            "initialize", "loadSnapshot", "saveSnapshot", "applyUpdates",
+            "getSecurityInfo", "getSecurityInfoBatch", "allSecurityCodes", "writeSecurityCodes",
+            "lowestPE", "getPERange", "screen", "query", "count", "findByCode", "findByDescription",
+            "load_read", "load_parse", "load_insert", "load_index_build"
+        };
+        return names[op];
+    }
+
+    static const char* CounterName(Counter counter) {
+        static const char* names[CounterCount] = {
+            "lookup_hit", "lookup_miss", "lookup_invalid_code", "parse_reject", "insert", "update"
+        };
+        return names[counter];
+    }
+
+private:
+    // One thread's metrics.  Sets are never freed, so walking the list is
+    // always safe.
+    struct Set {
+        Set() : Next(0), InUse(true) {
+            for (int c = 0; c < CounterCount; ++c)
+                Counters[c].store(0, std::memory_order_relaxed);
+        }
+        LatencyHistogram      Latency[OpCount];
+        std::atomic<uint64_t> Counters[CounterCount];
+        Set*                  Next;
+        std::atomic<bool>     InUse;
+    };
+
+    // Releases the thread's set for reuse when the thread exits:
+    struct SetHolder {
+        SetHolder() : _Set(0) {
+        }
+        ~SetHolder() {
+            if (_Set)
+                _Set->InUse.store(false, std::memory_order_release);
+        }
+        Set* _Set;
+    };
+
+    static std::atomic<Set*>& Sets() {
+        static std::atomic<Set*> sets(0);
+        return sets;
+    }
+
+    static Set* Local() {
+        static thread_local SetHolder holder;
+        if (!holder._Set)
+            holder._Set=ClaimSet();
+        return holder._Set;
+    }
+
+    // Reuses a released set if there is one, otherwise pushes a new one:
+    static Set* ClaimSet() {
+        for (Set* s = Sets().load(std::memory_order_acquire); s; s=s->Next) {
+            bool expected=false;
+            if ( !s->InUse.load(std::memory_order_relaxed) &&
+                    s->InUse.compare_exchange_strong(expected, true, std::memory_order_acquire) )
+                return s;
+        }
+        Set* s=new Set;
+        s->Next=Sets().load(std::memory_order_relaxed);
+        while (!Sets().compare_exchange_weak(s->Next, s, std::memory_order_release, std::memory_order_relaxed))
+            ;
+        return s;
+    }
+
+    static void Collect(std::vector<LatencyHistogram::Totals>& latency, std::vector<uint64_t>& counters) {
+        latency.assign(OpCount, LatencyHistogram::Totals());
+        counters.assign(CounterCount, 0);
+        for (Set* s = Sets().load(std::memory_order_acquire); s; s=s->Next) {
+            for (int op = 0; op < OpCount; ++op)
+                s->Latency[op].AddTo(latency[op]);
+            for (int c = 0; c < CounterCount; ++c)
+                counters[c] += s->Counters[c].load(std::memory_order_relaxed);
+        }
+    }
+};
+
+// Records its lifetime as one sample of a Metrics::Op:
+class ScopedLatency {
+public:
+    ScopedLatency(Metrics::Op op) : _Op(op), _Start(Metrics::Now()) {
+    }
+    ~ScopedLatency() {
+        Metrics::Record(_Op, Metrics::Now()-_Start);
+    }
+private:
+    ScopedLatency(const ScopedLatency&);
+    void operator = (const ScopedLatency&);
+
+    Metrics::Op _Op;
+    uint64_t    _Start;
+};
+
+#define FAST_LOOKUP_TIMED(op)           ScopedLatency fastLookupTimed_(Metrics::op)
+#define FAST_LOOKUP_COUNT(counter, n)   Metrics::Count(counter, n)
+
+#else
+
+#define FAST_LOOKUP_TIMED(op)
+#define FAST_LOOKUP_COUNT(counter, n)
+
+#endif
+
+
+typedef shared_ptr<Equity> EquityPtr;
+
+// Base class for Equity filter functor types.
+struct EquityFilter {
+    virtual const Equity& Compare(const Equity& left, const Equity& right) const {
+        return left;
+    }
+    virtual bool Select(const Equity& elem) const {
+        return false;
+    }
+};
+
+
+// EquityHashIndex is a flat open-addressing hash table mapping packed
+// EquityCodes to row numbers, laid out SwissTable-style: slots are grouped
+// GroupSize at a time, and each slot has a control byte which is either
+// Ctrl_Empty or the low 7 bits of the key's hash.  A probe compares a whole
+// group of control bytes against the hash tag in one SSE2 instruction, so a
+// lookup typically touches one control-byte line and one slot line.
+//
+// A slot packs the 36-bit code and a 28-bit row number into one 64-bit word.
+// Entries are never erased (reloads build a new index), so there are no
+// tombstones.
+class EquityHashIndex {
+public:
+    typedef uint32_t RowT;
+    enum { GroupSize=16, RowBits=28 };
+    static const RowT NotFound=0xffffffffu;
+    static const RowT MaxRows=(1u << RowBits);
+
+    EquityHashIndex() : _Size(0), _GroupMask(0) {
+    }
+
+    size_t Size() const {
+        return _Size;
+    }
+
+    void Clear() {
+        _Ctrl.clear();
+        _Slots.clear();
+        _Size=0;
+        _GroupMask=0;
+    }
+
+    // See HugePages::Advise():
+    void AdviseHugePages() const {
+        HugePages::Advise(_Ctrl);
+        HugePages::Advise(_Slots);
+    }
+
+    // Pre-sizes the table so that 'n' entries fit without rehashing:
+    void Reserve(size_t n) {
+        size_t groups=1;
+        while (groups*GroupSize*MaxLoadNum < n*MaxLoadDen)
+            groups <<= 1;
+        if (groups > _GroupMask+1 || _Ctrl.empty())
+            Rehash(groups);
+    }
+
+    // Returns the row stored for 'code', or NotFound:
+    RowT Find(const EquityCode& code) const {
+        if (_Ctrl.empty())
+            return NotFound;
+        return FindHashed(code.Packed(), Hash(code.Packed()));
+    }
+
+    // Looks up 'n' codes, storing each one's row (or NotFound) in 'rows'.
+    // Codes are taken BatchSize at a time: all of them are hashed and their
+    // first groups prefetched before any is probed, so the cache misses of a
+    // batch overlap instead of being taken one after another.
+    void FindBatch(const EquityCode* codes, size_t n, RowT* rows) const {
+        if (_Ctrl.empty()) {
+            for (size_t i = 0; i < n; ++i)
+                rows[i]=NotFound;
+            return;
+        }
+        uint64_t hashes[BatchSize];
+        for (size_t base = 0; base < n; base += BatchSize) {
+            size_t k=std::min((size_t)BatchSize, n-base);
+            for (size_t i = 0; i < k; ++i) {
+                hashes[i]=Hash(codes[base+i].Packed());
+                size_t g=(size_t)(hashes[i] >> 7) & _GroupMask;
+                __builtin_prefetch(&_Ctrl[g*GroupSize]);
+                __builtin_prefetch(&_Slots[g*GroupSize]);
+            }
+            for (size_t i = 0; i < k; ++i)
+                rows[base+i]=FindHashed(codes[base+i].Packed(), hashes[i]);
+        }
+    }
+
+    // Returns the row already stored for 'code'; otherwise stores 'row' for it
+    // and returns 'row'.
+    RowT FindOrInsert(const EquityCode& code, RowT row) {
+        if (row >= MaxRows)
+            throw std::length_error("EquityHashIndex row limit exceeded");
+        RowT existing=Find(code);
+        if (existing != NotFound)
+            return existing;
+        if ( (_Size+1)*MaxLoadDen > Capacity()*MaxLoadNum )
+            Rehash(_Ctrl.empty() ? 1 : 2*(_GroupMask+1));
+        Place(code.Packed(), row);
+        ++_Size;
+        return row;
+    }
+
+private:
+    enum { Ctrl_Empty=0x80, MaxLoadNum=7, MaxLoadDen=8, BatchSize=16 };
+
+    RowT FindHashed(uint64_t packed, uint64_t h) const {
+        uint8_t tag=Tag(h);
+        size_t g=(size_t)(h >> 7) & _GroupMask;
+        for (size_t probe=1; ; ++probe) {
+            const uint8_t* ctrl=&_Ctrl[g*GroupSize];
+            for (uint32_t m=MatchTag(ctrl, tag); m; m &= m-1) {
+                uint64_t slot=_Slots[g*GroupSize + CountTrailingZeros(m)];
+                if ( (slot >> RowBits) == packed )
+                    return (RowT)(slot & (MaxRows-1));
+            }
+            if (MatchTag(ctrl, Ctrl_Empty))
+                return NotFound;
+            g=(g+probe) & _GroupMask;    // Triangular probing visits every group.
+        }
+    }
+
+    size_t Capacity() const {
+        return _Ctrl.empty() ? 0 : (_GroupMask+1)*GroupSize;
+    }
+
+    // A 64-bit finalizer (from MurmurHash3) to spread the packed code bits:
+    static uint64_t Hash(uint64_t k) {
+        k ^= k >> 33;
+        k *= 0xff51afd7ed558ccdULL;
+        k ^= k >> 33;
+        k *= 0xc4ceb9fe1a85ec53ULL;
+        k ^= k >> 33;
+        return k;
+    }
+
+    static uint8_t Tag(uint64_t h) {
+        return (uint8_t)(h & 0x7f);
+    }
+
+    static unsigned CountTrailingZeros(uint32_t m) {
+        return (unsigned)__builtin_ctz(m);
+    }
+
+    // Returns a bitmask of the slots in the group whose control byte is 'tag':
+    static uint32_t MatchTag(const uint8_t* ctrl, uint8_t tag) {
+#ifdef __SSE2__
+        __m128i group=_mm_loadu_si128((const __m128i*)ctrl);
+        return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)tag)));
+#else
+        uint32_t m=0;
+        for (unsigned i = 0; i < GroupSize; ++i) {
+            if (ctrl[i]==tag)
+                m |= 1u << i;
+        }
+        return m;
+#endif
+    }
+
+    // Stores a key known to be absent into the first empty slot on its probe path:
+    void Place(uint64_t packed, RowT row) {
+        uint64_t h=Hash(packed);
+        size_t g=(size_t)(h >> 7) & _GroupMask;
+        for (size_t probe=1; ; ++probe) {
+            uint32_t empty=MatchTag(&_Ctrl[g*GroupSize], Ctrl_Empty);
+            if (empty) {
+                size_t ix=g*GroupSize + CountTrailingZeros(empty);
+                _Ctrl[ix]=Tag(h);
+                _Slots[ix]=(packed << RowBits) | row;
+                return;
+            }
+            g=(g+probe) & _GroupMask;
+        }
+    }
+
+    void Rehash(size_t groups) {
+        std::vector<uint8_t> oldCtrl;
+        std::vector<uint64_t> oldSlots;
+        oldCtrl.swap(_Ctrl);
+        oldSlots.swap(_Slots);
+
+        _Ctrl.assign(groups*GroupSize, (uint8_t)Ctrl_Empty);
+        _Slots.assign(groups*GroupSize, 0);
+        _GroupMask=groups-1;
+        for (size_t i = 0; i < oldCtrl.size(); ++i) {
+            if (oldCtrl[i] != Ctrl_Empty)
+                Place(oldSlots[i] >> RowBits, (RowT)(oldSlots[i] & (MaxRows-1)));
+        }
+    }
+
+    std::vector<uint8_t>  _Ctrl;
+    std::vector<uint64_t> _Slots;
+    size_t                _Size;
+    size_t                _GroupMask;
+
+    friend class EquityMapFile;
+};
+
+
+// RangeScan evaluates the predicate lo <= v[i] <= hi over a contiguous array
+// of doubles, emitting either the indices of the matching elements or a
+// selection bitmap (bit i%64 of word i/64 set for a match).  There are
+// scalar, SSE2, AVX2 and AVX-512 implementations; the widest one the CPU
+// supports is chosen at runtime via CPUID.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FAST_LOOKUP_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+class RangeScan {
+public:
+    enum Level { L_Scalar=0, L_SSE2, L_AVX2, L_AVX512, L_COUNT };
+
+    // Writes the indices of matching elements to 'out', which must have room
+    // for 'n' entries, and returns the number written:
+    typedef size_t (*SelectFn)(const double* v, size_t n, double lo, double hi, uint32_t* out);
+    // Fills (n+63)/64 words of 'bits', with the bits past 'n' cleared:
+    typedef void (*BitmapFn)(const double* v, size_t n, double lo, double hi, uint64_t* bits);
+
+    static size_t Select(const double* v, size_t n, double lo, double hi, uint32_t* out) {
+        static const SelectFn fn=GetSelect(BestLevel());
+        return fn(v, n, lo, hi, out);
+    }
+
+    static void Bitmap(const double* v, size_t n, double lo, double hi, uint64_t* bits) {
+        static const BitmapFn fn=GetBitmap(BestLevel());
+        fn(v, n, lo, hi, bits);
+    }
+
+    // Returns true if this CPU can run the kernels for 'level':
+    static bool Supported(Level level) {
+        switch (level) {
+        case L_Scalar:
+            return true;
+#ifdef FAST_LOOKUP_X86_KERNELS
+        case L_SSE2:
+            return __builtin_cpu_supports("sse2");
+        case L_AVX2:
+            return __builtin_cpu_supports("avx2");
+        case L_AVX512:
+            return __builtin_cpu_supports("avx512f");
+#endif
+        default:
+            return false;
+        }
+    }
+
+    static Level BestLevel() {
+        for (int level = L_COUNT-1; level > L_Scalar; --level) {
+            if (Supported((Level)level))
+                return (Level)level;
+        }
+        return L_Scalar;
+    }
+
+    static SelectFn GetSelect(Level level) {
+        switch (level) {
+#ifdef FAST_LOOKUP_X86_KERNELS
+        case L_SSE2:
+            return &Select_SSE2;
+        case L_AVX2:
+            return &Select_AVX2;
+        case L_AVX512:
+            return &Select_AVX512;
+#endif
+        default:
+            return &Select_Scalar;
+        }
+    }
+
+    static BitmapFn GetBitmap(Level level) {
+        switch (level) {
+#ifdef FAST_LOOKUP_X86_KERNELS
+        case L_SSE2:
+            return &Bitmap_SSE2;
+        case L_AVX2:
+            return &Bitmap_AVX2;
+        case L_AVX512:
+            return &Bitmap_AVX512;
+#endif
+        default:
+            return &Bitmap_Scalar;
+        }
+    }
+
+private:
+    // Expands the set bits of 'mask' into element indices starting at 'base':
+    static size_t EmitMask(uint32_t mask, uint32_t base, uint32_t* out) {
+        size_t k=0;
+        for ( ; mask; mask &= mask-1)
+            out[k++]=base + (uint32_t)__builtin_ctz(mask);
+        return k;
+    }
+
+    static size_t Select_Scalar(const double* v, size_t n, double lo, double hi, uint32_t* out) {
+        size_t k=0;
+        for (size_t i = 0; i < n; ++i) {
+            // Branch-free: always store, only advance on a match.
+            out[k]=(uint32_t)i;
+            k += (v[i] >= lo) & (v[i] <= hi);
+        }
+        return k;
+    }
+
+    static void Bitmap_Scalar(const double* v, size_t n, double lo, double hi, uint64_t* bits) {
+        for (size_t w = 0; w*64 < n; ++w) {
+            uint64_t word=0;
+            size_t end=std::min(n, w*64+64);
+            for (size_t i = w*64; i < end; ++i)
+                word |= (uint64_t)((v[i] >= lo) & (v[i] <= hi)) << (i & 63);
+            bits[w]=word;
+        }
+    }
+
+#ifdef FAST_LOOKUP_X86_KERNELS
+    __attribute__((target("sse2")))
+    static uint32_t Mask_SSE2(const double* v, __m128d lo, __m128d hi) {
+        __m128d x=_mm_loadu_pd(v);
+        return (uint32_t)_mm_movemask_pd(_mm_and_pd(_mm_cmpge_pd(x, lo), _mm_cmple_pd(x, hi)));
+    }
+
+    __attribute__((target("sse2")))
+    static size_t Select_SSE2(const double* v, size_t n, double lo, double hi, uint32_t* out) {
+        __m128d vlo=_mm_set1_pd(lo), vhi=_mm_set1_pd(hi);
+        size_t i=0, k=0;
+        for ( ; i+8 <= n; i+=8) {
+            uint32_t m = Mask_SSE2(v+i, vlo, vhi)
+                         | (Mask_SSE2(v+i+2, vlo, vhi) << 2)
+                         | (Mask_SSE2(v+i+4, vlo, vhi) << 4)
+                         | (Mask_SSE2(v+i+6, vlo, vhi) << 6);
+            k += EmitMask(m, (uint32_t)i, out+k);
+        }
+        size_t tail=Select_Scalar(v+i, n-i, lo, hi, out+k);
+        for (size_t j = k; j < k+tail; ++j)
+            out[j] += (uint32_t)i;
+        return k+tail;
+    }
+
+    __attribute__((target("sse2")))
+    static void Bitmap_SSE2(const double* v, size_t n, double lo, double hi, uint64_t* bits) {
+        __m128d vlo=_mm_set1_pd(lo), vhi=_mm_set1_pd(hi);
+        size_t w=0;
+        for ( ; (w+1)*64 <= n; ++w) {
+            uint64_t word=0;
+            for (unsigned j = 0; j < 64; j+=2)
+                word |= (uint64_t)Mask_SSE2(v+w*64+j, vlo, vhi) << j;
+            bits[w]=word;
+        }
+        if (w*64 < n)
+            Bitmap_Scalar(v+w*64, n-w*64, lo, hi, bits+w);
+    }
+
+    __attribute__((target("avx2")))
+    static uint32_t Mask_AVX2(const double* v, __m256d lo, __m256d hi) {
+        __m256d x=_mm256_loadu_pd(v);
+        return (uint32_t)_mm256_movemask_pd(_mm256_and_pd(_mm256_cmp_pd(x, lo, _CMP_GE_OQ),
+                                            _mm256_cmp_pd(x, hi, _CMP_LE_OQ)));
+    }
+
+    __attribute__((target("avx2")))
+    static size_t Select_AVX2(const double* v, size_t n, double lo, double hi, uint32_t* out) {
+        __m256d vlo=_mm256_set1_pd(lo), vhi=_mm256_set1_pd(hi);
+        size_t i=0, k=0;
+        for ( ; i+16 <= n; i+=16) {
+            uint32_t m = Mask_AVX2(v+i, vlo, vhi)
+                         | (Mask_AVX2(v+i+4, vlo, vhi) << 4)
+                         | (Mask_AVX2(v+i+8, vlo, vhi) << 8)
+                         | (Mask_AVX2(v+i+12, vlo, vhi) << 12);
+            k += EmitMask(m, (uint32_t)i, out+k);
+        }
+        size_t tail=Select_Scalar(v+i, n-i, lo, hi, out+k);
+        for (size_t j = k; j < k+tail; ++j)
+            out[j] += (uint32_t)i;
+        return k+tail;
+    }
+
+    __attribute__((target("avx2")))
+    static void Bitmap_AVX2(const double* v, size_t n, double lo, double hi, uint64_t* bits) {
+        __m256d vlo=_mm256_set1_pd(lo), vhi=_mm256_set1_pd(hi);
+        size_t w=0;
+        for ( ; (w+1)*64 <= n; ++w) {
+            uint64_t word=0;
+            for (unsigned j = 0; j < 64; j+=4)
+                word |= (uint64_t)Mask_AVX2(v+w*64+j, vlo, vhi) << j;
+            bits[w]=word;
+        }
+        if (w*64 < n)
+            Bitmap_Scalar(v+w*64, n-w*64, lo, hi, bits+w);
+    }
+
+    // AVX-512 compares 8 doubles at a time, and compress-stores the matching
+    // lanes of an index vector, 16 elements per iteration:
+    __attribute__((target("avx512f")))
+    static uint32_t Mask_AVX512(const double* v, __m512d lo, __m512d hi) {
+        __m512d x=_mm512_loadu_pd(v);
+        return (uint32_t)_mm512_mask_cmp_pd_mask(_mm512_cmp_pd_mask(x, lo, _CMP_GE_OQ), x, hi, _CMP_LE_OQ);
+    }
+
+    __attribute__((target("avx512f")))
+    static size_t Select_AVX512(const double* v, size_t n, double lo, double hi, uint32_t* out) {
+        __m512d vlo=_mm512_set1_pd(lo), vhi=_mm512_set1_pd(hi);
+        __m512i ix=_mm512_setr_epi32(0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15);
+        const __m512i step=_mm512_set1_epi32(16);
+        size_t i=0, k=0;
+        for ( ; i+16 <= n; i+=16) {
+            __mmask16 m=(__mmask16)(Mask_AVX512(v+i, vlo, vhi) | (Mask_AVX512(v+i+8, vlo, vhi) << 8));
+            _mm512_mask_compressstoreu_epi32(out+k, m, ix);
+            k += (size_t)__builtin_popcount(m);
+            ix=_mm512_add_epi32(ix, step);
+        }
+        size_t tail=Select_Scalar(v+i, n-i, lo, hi, out+k);
+        for (size_t j = k; j < k+tail; ++j)
+            out[j] += (uint32_t)i;
+        return k+tail;
+    }
+
+    __attribute__((target("avx512f")))
+    static void Bitmap_AVX512(const double* v, size_t n, double lo, double hi, uint64_t* bits) {
+        __m512d vlo=_mm512_set1_pd(lo), vhi=_mm512_set1_pd(hi);
+        size_t w=0;
+        for ( ; (w+1)*64 <= n; ++w) {
+            uint64_t word=0;
+            for (unsigned j = 0; j < 64; j+=8)
+                word |= (uint64_t)Mask_AVX512(v+w*64+j, vlo, vhi) << j;
+            bits[w]=word;
+        }
+        if (w*64 < n)
+            Bitmap_Scalar(v+w*64, n-w*64, lo, hi, bits+w);
+    }
+#endif
+};
+
+
+// MorselPool runs the morsels (independent slices) of a job on its worker
+// threads and the calling thread together.  Each thread starts with an equal
+// share of the morsels, which it takes front to back; once its share is gone
+// it steals from the backs of the others', so an uneven job still finishes
+// together.  Shares are packed [begin,end) pairs updated by compare-and-swap,
+// so taking a morsel costs one atomic operation.
+//
+// One job runs at a time.  A Run() which finds the pool busy runs its job on
+// the calling thread: with many queries in flight, the cores are better used
+// by the queries themselves than by splitting each of them up.  The worker
+// threads are started by the first Run() with more than one morsel.
+class MorselPool {
+public:
+    // 'threads' includes the caller, so a pool of 1 runs everything inline:
+    explicit MorselPool(unsigned threads) : _Threads(std::max(1u, threads)), _Stop(false), _Generation(0) {
+    }
+
+    ~MorselPool() {
+        {
+            std::lock_guard<std::mutex> lock(_Lock);
+            _Stop=true;
+        }
+        _Wake.notify_all();
+        for (size_t i = 0; i < _Workers.size(); ++i)
+            _Workers[i].join();
+    }
+
+    // The process-wide pool, with a thread per hardware thread:
+    static MorselPool& Global() {
+        static MorselPool pool(std::max(1u, std::thread::hardware_concurrency()));
+        return pool;
+    }
+
+    unsigned Threads() const {
+        return _Threads;
+    }
+
+    // Calls body(i) for each i in [0,count), and returns once every call has.
+    // The calls may run concurrently, in any order, and must not throw.
+    template <class F>
+    void Run(size_t count, const F& body) {
+        std::unique_lock<std::mutex> busy(_Busy, std::try_to_lock);
+        if ( !busy.owns_lock() || _Threads < 2 || count < 2 ) {
+            for (size_t i = 0; i < count; ++i)
+                body(i);
+            return;
+        }
+        for (unsigned i = (unsigned)_Workers.size()+1; i < _Threads; ++i)
+            _Workers.push_back(std::thread(&MorselPool::Work, this, i));
+        shared_ptr<Job> job(new Job(Threads(), count, &Call<F>, &body));
+        {
+            std::lock_guard<std::mutex> lock(_Lock);
+            _Job=job;
+            ++_Generation;
+        }
+        _Wake.notify_all();
+        job->Participate(0);
+        job->Wait();
+        std::lock_guard<std::mutex> lock(_Lock);
+        _Job.reset();
+    }
+
+private:
+    MorselPool(const MorselPool&);
+    void operator = (const MorselPool&);
+
+    template <class F>
+    static void Call(const void* body, size_t i) {
+        (*static_cast<const F*>(body))(i);
+    }
+
+    // A job outlives its Run() call for any worker which wakes too late to
+    // help; that worker finds every share empty.
+    struct Job {
+        Job(unsigned threads, size_t count, void (*call)(const void*, size_t), const void* body) :
+            Shares(threads), Call(call), Body(body), Left(count) {
+            for (unsigned t = 0; t < threads; ++t)
+                Shares[t].Range.store(Pack(count*t/threads, count*(t+1)/threads));
+        }
+
+        void Participate(unsigned self) {
+            size_t i;
+            while (Take(self, false, i))
+                Finish(i);
+            for (size_t k = 1; k < Shares.size(); ++k) {
+                while (Take((self+k) % Shares.size(), true, i))
+                    Finish(i);
+            }
+        }
+
+        void Wait() {
+            std::unique_lock<std::mutex> lock(Lock);
+            while (Left.load() != 0)
+                Done.wait(lock);
+        }
+
+        static uint64_t Pack(size_t begin, size_t end) {
+            return ((uint64_t)begin << 32) | (uint64_t)end;
+        }
+
+        // Takes the first (or last) morsel of a share:
+        bool Take(size_t share, bool last, size_t& i) {
+            std::atomic<uint64_t>& range=Shares[share].Range;
+            uint64_t cur=range.load();
+            for (;;) {
+                size_t begin=(size_t)(cur >> 32), end=(size_t)(cur & 0xffffffffu);
+                if (begin >= end)
+                    return false;
+                i= last ? end-1 : begin;
+                if (range.compare_exchange_weak(cur, last ? Pack(begin, end-1) : Pack(begin+1, end)))
+                    return true;
+            }
+        }
+
+        void Finish(size_t i) {
+            Call(Body, i);
+            if (Left.fetch_sub(1)==1) {
+                std::lock_guard<std::mutex> lock(Lock);
+                Done.notify_all();
+            }
+        }
+
+        struct Share {
+            std::atomic<uint64_t> Range;
+            char                  Pad[64-sizeof(std::atomic<uint64_t>)];    // one per cache line
+        };
+        std::vector<Share>      Shares;
+        void                  (*Call)(const void*, size_t);
+        const void*             Body;
+        std::atomic<size_t>     Left;
+        std::mutex              Lock;
+        std::condition_variable Done;
+    };
+
+    void Work(unsigned self) {
+        uint64_t seen=0;
+        for (;;) {
+            shared_ptr<Job> job;
+            {
+                std::unique_lock<std::mutex> lock(_Lock);
+                while ( !_Stop && _Generation==seen )
+                    _Wake.wait(lock);
+                if (_Stop)
+                    return;
+                seen=_Generation;
+                job=_Job;
+            }
+            if (job)
+                job->Participate(self);
+        }
+    }
+
+    const unsigned           _Threads;
+    std::vector<std::thread> _Workers;  // started by Run(), under _Busy
+    std::mutex               _Busy;     // held by the Run() using the workers
+    std::mutex               _Lock;
+    std::condition_variable  _Wake;
+    bool                     _Stop;
+    uint64_t                 _Generation;
+    shared_ptr<Job>          _Job;
+};
+
+
+// Varint reads and writes unsigned integers 7 bits per byte, low bits first,
+// with the top bit of each byte set if more follow.
+struct Varint {
+    static void Put(std::vector<uint8_t>& out, uint64_t v) {
+        for ( ; v >= 0x80; v >>= 7)
+            out.push_back((uint8_t)(v | 0x80));
+        out.push_back((uint8_t)v);
+    }
+
+    static uint64_t Get(const uint8_t*& p) {
+        uint64_t v=0;
+        for (int shift = 0; ; shift += 7) {
+            uint8_t b=*p++;
+            v |= (uint64_t)(b & 0x7f) << shift;
+            if (!(b & 0x80))
+                return v;
+        }
+    }
+};
+
+
+// DescriptionIndex is an inverted index of the words in row descriptions,
+// for name searches ("mach" finds "International Business Machines").
+//
+// Text is case folded, and anything other than a letter or a digit separates
+// words.  Each distinct 2- and 3-character run within a word (a gram) has a
+// posting list of the rows containing it.  A query word of 3 or more chars
+// needs all of its trigrams, and a 2-char one its bigram, so intersecting
+// those lists gives a small superset of the matches, which Matches() then
+// checks against the text itself.  1-char words have no grams: they are only
+// checked.
+//
+// Posting lists are sorted row numbers, stored as varint deltas in blocks of
+// Block, with each block's first row kept uncompressed.  Intersection is
+// leapfrogging from the shortest list, and a cursor seeking far ahead gallops
+// over the block heads instead of decoding what it skips.
+//
+// Rows must be added in increasing order, which new rows of an EquityMap
+// are, so the index grows in place.  A row whose text changes after it was
+// added is noted with Changed(), and is returned as a candidate of every
+// query from then on; its old postings are weeded out by Matches().
+class DescriptionIndex {
+public:
+    typedef uint32_t RowT;
+    enum { Block=64, Symbols=37, Grams=Symbols*Symbols*Symbols };
+
+    // A search string broken into folded words:
+    struct Query {
+        explicit Query(const StringRef& text) {
+            string folded;
+            Fold(text, folded);
+            std::istringstream words(folded);
+            for (string word; words >> word; )
+                Words.push_back(word);
+        }
+        std::vector<string> Words;
+    };
+
+    void Clear() {
+        _ListOf.clear();
+        _Lists.clear();
+        _Changed.clear();
+    }
+
+    // Indexes 'text' as 'row', which must be greater than any row added so far:
+    void Add(RowT row, const StringRef& text) {
+        if (_ListOf.empty())
+            _ListOf.assign(Grams, 0);
+        size_t i=0;
+        while (i < text.Size()) {
+            while (i < text.Size() && !Symbol(text[i]))
+                ++i;
+            uint32_t a=0, b=0;
+            for ( ; i < text.Size() && Symbol(text[i]); ++i) {
+                uint32_t c=Symbol(text[i]);
+                if (b)
+                    Post(b*Symbols+c, row);
+                if (a)
+                    Post((a*Symbols+b)*Symbols+c, row);
+                a=b;
+                b=c;
+            }
+        }
+    }
+
+    // Notes that the text of an already-indexed row has changed:
+    void Changed(RowT row) {
+        std::vector<RowT>::iterator it=std::lower_bound(_Changed.begin(), _Changed.end(), row);
+        if ( it==_Changed.end() || *it != row )
+            _Changed.insert(it, row);
+    }
+
+    size_t ChangedCount() const {
+        return _Changed.size();
+    }
+
+    // Appends the rows which may match 'query' to 'rows', in increasing order.
+    // Returns false, appending nothing, if no word of the query has grams, in
+    // which case any row may match.
+    bool Candidates(const Query& query, std::vector<RowT>& rows) const {
+        std::vector<uint32_t> grams;
+        for (size_t w = 0; w < query.Words.size(); ++w) {
+            const string& word=query.Words[w];
+            if (word.size()==2)
+                grams.push_back(Symbol(word[0])*Symbols+Symbol(word[1]));
+            for (size_t i = 2; i < word.size(); ++i)
+                grams.push_back((Symbol(word[i-2])*Symbols+Symbol(word[i-1]))*Symbols+Symbol(word[i]));
+        }
+        if (grams.empty())
+            return false;
+        std::vector<Cursor> cursors;
+        for (size_t g = 0; g < grams.size(); ++g) {
+            uint32_t list= _ListOf.empty() ? 0 : _ListOf[grams[g]];
+            if (!list) {
+                cursors.clear();
+                break;
+            }
+            cursors.push_back(Cursor(_Lists[list-1]));
+        }
+        std::vector<RowT> found;
+        if (!cursors.empty()) {
+            std::sort(cursors.begin(), cursors.end());
+            Intersect(cursors, found);
+        }
+        size_t first=rows.size();
+        rows.resize(first+found.size()+_Changed.size());
+        rows.erase(std::set_union(found.begin(), found.end(), _Changed.begin(), _Changed.end(), rows.begin()+first), rows.end());
+        return true;
+    }
+
+    // True if every word of 'query' occurs in 'text'.  'scratch' is working
+    // storage, which can be reused across calls.
+    static bool Matches(const Query& query, const StringRef& text, string& scratch) {
+        Fold(text, scratch);
+        for (size_t w = 0; w < query.Words.size(); ++w) {
+            if (scratch.find(query.Words[w])==string::npos)
+                return false;
+        }
+        return true;
+    }
+
+private:
+    // Maps a char to 1..36 if it's part of a word (case folded), or else 0:
+    static uint32_t Symbol(char c) {
+        if ( c >= '0' && c <= '9' )
+            return (uint32_t)(c-'0')+1;
+        if ( c >= 'a' && c <= 'z' )
+            return (uint32_t)(c-'a')+11;
+        if ( c >= 'A' && c <= 'Z' )
+            return (uint32_t)(c-'A')+11;
+        return 0;
+    }
+
+    // Lower-cases 'text' into 'folded', with a space for each separator:
+    static void Fold(const StringRef& text, string& folded) {
+        folded.resize(text.Size());
+        for (size_t i = 0; i < text.Size(); ++i) {
+            char c=text[i];
+            folded[i]= Symbol(c) ? (char)((c >= 'A' && c <= 'Z') ? c-'A'+'a' : c) : ' ';
+        }
+    }
+
+    struct PostingList {
+        PostingList() : Last(0), Count(0) {
+        }
+        void Append(RowT row) {
+            if (Count % Block==0) {
+                First.push_back(row);
+                Offset.push_back((uint32_t)Deltas.size());
+            }
+            else {
+                Varint::Put(Deltas, row-Last);
+            }
+            Last=row;
+            ++Count;
+        }
+        std::vector<RowT>     First;    // each block's first row
+        std::vector<uint32_t> Offset;   // each block's deltas in Deltas
+        std::vector<uint8_t>  Deltas;
+        RowT                  Last;
+        size_t                Count;
+    };
+
+    // Adds 'row' to the gram's list, unless it's there already from an
+    // earlier gram of the same text:
+    void Post(uint32_t gram, RowT row) {
+        uint32_t& list=_ListOf[gram];
+        if (!list) {
+            _Lists.push_back(PostingList());
+            list=(uint32_t)_Lists.size();
+        }
+        PostingList& postings=_Lists[list-1];
+        if ( !postings.Count || postings.Last != row )
+            postings.Append(row);
+    }
+
+    // Walks a posting list in order:
+    class Cursor {
+    public:
+        explicit Cursor(const PostingList& list) : _List(&list) {
+            Start(0);
+        }
+        bool Done() const {
+            return _Pos >= _List->Count;
+        }
+        RowT Value() const {
+            return _Value;
+        }
+        void Next() {
+            if (++_Pos % Block==0)
+                Start(_Pos/Block);
+            else if (!Done())
+                _Value += (RowT)Varint::Get(_Next);
+        }
+        // Moves to the first row >= 'target', if we're not there already:
+        void SeekTo(RowT target) {
+            if ( Done() || _Value >= target )
+                return;
+            const std::vector<RowT>& first=_List->First;
+            size_t block=_Pos/Block, step=1;
+            while ( block+step < first.size() && first[block+step] <= target ) {
+                block += step;
+                step *= 2;
+            }
+            // The answer's block starts at or before 'target', and before
+            // block+step (or the end):
+            size_t end=std::min(block+step, first.size());
+            block=(std::upper_bound(first.begin()+block, first.begin()+end, target)-first.begin())-1;
+            if (block != _Pos/Block)
+                Start(block);
+            while ( !Done() && _Value < target )
+                Next();
+        }
+        bool operator < (const Cursor& other) const {
+            return _List->Count < other._List->Count;
+        }
+    private:
+        void Start(size_t block) {
+            _Pos=block*Block;
+            if (!Done()) {
+                _Value=_List->First[block];
+                _Next=_List->Deltas.data()+_List->Offset[block];
+            }
+        }
+        const PostingList* _List;
+        size_t             _Pos;
+        RowT               _Value;
+        const uint8_t*     _Next;
+    };
+
+    // Appends the rows on every list to 'out'.  cursors[0] is the shortest.
+    static void Intersect(std::vector<Cursor>& cursors, std::vector<RowT>& out) {
+        Cursor& lead=cursors[0];
+        while (!lead.Done()) {
+            RowT candidate=lead.Value();
+            size_t i=1;
+            for ( ; i < cursors.size(); ++i) {
+                cursors[i].SeekTo(candidate);
+                if (cursors[i].Done())
+                    return;
+                if (cursors[i].Value() != candidate)
+                    break;
+            }
+            if (i==cursors.size()) {
+                out.push_back(candidate);
+                lead.Next();
+            }
+            else {
+                lead.SeekTo(cursors[i].Value());
+            }
+        }
+    }
+
+    std::vector<uint32_t>    _ListOf;   // gram -> 1+its _Lists index, or 0
+    std::vector<PostingList> _Lists;
+    std::vector<RowT>        _Changed;  // sorted
+};
+
+
+// The EquityMap class is an associative array which provides a fast-lookup container
+// for Equity objects.
+//
+// Rows are stored densely in insertion order.  Point lookups go through an
+// EquityHashIndex on the packed code; ordered iteration goes through a side
+// array of row numbers sorted by code, which is appended to cheaply while
+// codes arrive in order and otherwise re-sorted lazily on the next begin().
+// That lazy re-sort mutates internal state, so a map being read from several
+// threads must not be written to concurrently.
+//
+// The numeric fields of every row are also kept in a structure-of-arrays
+// Columns store, so full scans read contiguous doubles instead of chasing an
+// EquityPtr per row.
+//
+// BuildIndexes() adds a secondary index of rows sorted by P/E, which turns
+// P/E range queries into two binary searches and a slice, and caches the
+// row with the lowest P/E.  Replacing an existing row (Insert() of a known
+// code, or ApplyUpdate()) maintains that index incrementally: the row's old
+// entry is marked stale and its new one goes into a small ordered side set,
+// which is merged back once it grows past 1/16th of the map.  Inserting a new
+// code drops the index; until it is rebuilt, P/E queries fall back to column
+// scans.
+//
+// BuildIndexes() also sorts the codes spelled backwards, for suffix searches
+// (exchange tags such as "*HK").  Prefix searches need no extra index: the
+// codes with a given prefix are a contiguous run of the code order.
+//
+// Finally, it builds a DescriptionIndex for word searches of descriptions.
+// That one is kept up to date by inserts: new rows are added to it, and rows
+// whose descriptions change are tracked until they number 1/16th of the map,
+// when the index is dropped for the next BuildIndexes() to rebuild.  Without
+// it, description searches scan every row.
+
+// A price tick for an equity which is already loaded (see EquityMap::ApplyUpdate):
+struct EquityUpdate {
+    EquityCode Code;
+    double     Price;
+    double     PE_ratio;
+    long long  MarketCap;
+};
+
+// EquityQuery describes a screen to run over an EquityMap (see
+// EquityMap::Query): a conjunction of inclusive ranges on P/E, price and
+// market cap, a result order, and an optional limit, which makes it a top-K
+// or bottom-K query.  For example, the ten biggest companies with a P/E of 10
+// or less:
+//
+//      EquityQuery().Where(EquityQuery::PE, -HUGE_VAL, 10).OrderBy(EquityQuery::MarketCap, true).Limit(10)
+//
+// Ordering by P/E breaks ties as lowestPE() does (by price, then the later
+// code first); the other orders break ties by code.  A descending order is
+// the exact reverse of the ascending one.
+class EquityQuery {
+public:
+    enum Field { PE=0, Price, MarketCap, RangeFields, Code=RangeFields };
+    static const size_t NoLimit=(size_t)-1;
+
+    EquityQuery() : _Order(Code), _Descending(false), _Limit(NoLimit) {
+        for (int f = 0; f < RangeFields; ++f) {
+            _Has[f]=false;
+            _Min[f]=-HUGE_VAL;
+            _Max[f]=HUGE_VAL;
+        }
+    }
+
+    // Requires 'field' (not Code) to be in [min,max].  Repeated ranges on a
+    // field intersect.  Market caps are compared exactly, as integers.
+    EquityQuery& Where(Field field, double min, double max) {
+        if (field < 0 || field >= RangeFields)
+            throw std::invalid_argument("EquityQuery range on a non-numeric field");
+        _Has[field]=true;
+        _Min[field]=std::max(_Min[field], min);
+        _Max[field]=std::min(_Max[field], max);
+        return *this;
+    }
+
+    EquityQuery& OrderBy(Field field, bool descending=false) {
+        _Order=field;
+        _Descending=descending;
+        return *this;
+    }
+
+    // Keeps only the first 'n' results in the query's order:
+    EquityQuery& Limit(size_t n) {
+        _Limit=n;
+        return *this;
+    }
+
+    bool HasRange(Field field) const {
+        return _Has[field];
+    }
+    bool HasRanges() const {
+        return _Has[PE] || _Has[Price] || _Has[MarketCap];
+    }
+    double Min(Field field) const {
+        return _Min[field];
+    }
+    double Max(Field field) const {
+        return _Max[field];
+    }
+    Field GetOrder() const {
+        return _Order;
+    }
+    bool IsDescending() const {
+        return _Descending;
+    }
+    size_t GetLimit() const {
+        return _Limit;
+    }
+
+private:
+    bool   _Has[RangeFields];
+    double _Min[RangeFields];
+    double _Max[RangeFields];
+    Field  _Order;
+    bool   _Descending;
+    size_t _Limit;
+};
+
+class EquityMap {
+public:
+    typedef std::pair<EquityCode,EquityPtr>  value_type;
+    typedef EquityHashIndex::RowT            RowT;
+
+    // Columnar copy of each row's fields.  Element i of every array
+    // describes row i.  Descriptions are stored in the map's string pool.
+    struct Columns {
+        std::vector<uint64_t>  Code;         // EquityCode::Packed()
+        std::vector<double>    PE;
+        std::vector<double>    Price;
+        std::vector<long long> MarketCap;
+        std::vector<StringRef> Description;
+
+        void Reserve(size_t n) {
+            Code.reserve(n);
+            PE.reserve(n);
+            Price.reserve(n);
+            MarketCap.reserve(n);
+            Description.reserve(n);
+        }
+    };
+
+    EquityMap() : _Descriptions(new StringPool), _SortedValid(true), _ByPEValid(false), _ByPEFront(0), _LowestPE(0), _BySuffixValid(false), _TextValid(false), _Pool(&MorselPool::Global()), _HugePages(false) {
+    }
+
+    // Result ordering for P/E range queries:
+    enum ResultOrder {
+        Order_Code,   // alphabetical by equity code
+        Order_PE      // by (P/E, price), as for lowestPE()
+    };
+
+    virtual ~EquityMap() {
+    }
+
+    // Iterates the map's elements in alphabetical order of equity code:
+    class const_iterator {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef EquityMap::value_type     value_type;
+        typedef std::ptrdiff_t            difference_type;
+        typedef const value_type*         pointer;
+        typedef const value_type&         reference;
+
+        const_iterator() : _Rows(0), _Pos(0) {
+        }
+        reference operator * () const {
+            return (*_Rows)[*_Pos];
+        }
+        pointer operator -> () const {
+            return &(*_Rows)[*_Pos];
+        }
+        const_iterator& operator ++ () {
+            ++_Pos;
+            return *this;
+        }
+        const_iterator operator ++ (int) {
+            const_iterator prev(*this);
+            ++_Pos;
+            return prev;
+        }
+        bool operator == (const const_iterator& other) const {
+            return _Pos==other._Pos;
+        }
+        bool operator != (const const_iterator& other) const {
+            return _Pos!=other._Pos;
+        }
+    private:
+        friend class EquityMap;
+        const_iterator(const std::vector<value_type>* rows, const RowT* pos) : _Rows(rows), _Pos(pos) {
+        }
+        const std::vector<value_type>* _Rows;
+        const RowT*                    _Pos;
+    };
+
+    const_iterator begin() const {
+        EnsureSorted();
+        return const_iterator(&_Rows, _Sorted.empty() ? 0 : &_Sorted[0]);
+    }
+    const_iterator end() const {
+        EnsureSorted();
+        return const_iterator(&_Rows, _Sorted.empty() ? 0 : &_Sorted[0]+_Sorted.size());
+    }
+
+    size_t Size() const {
+        return _Rows.size();
+    }
+
+    // Pre-sizes internal storage for 'n' elements:
+    void Reserve(size_t n) {
+        _Rows.reserve(n);
+        _Sorted.reserve(n);
+        _Index.Reserve(n);
+        _Columns.Reserve(n);
+    }
+
+    // Keeps 'backing' (a MappedFile, EquityArena, etc.) alive for as long as
+    // this map exists, for Equity objects which borrow storage from it:
+    void RetainBacking(const shared_ptr<void>& backing) {
+        _Backing.push_back(backing);
+    }
+
+    // Returns the columnar store.  Row numbers index its arrays:
+    const Columns& GetColumns() const {
+        return _Columns;
+    }
+
+    // Returns the Equity stored at 'row':
+    const EquityPtr& GetRow(RowT row) const {
+        return _Rows[row].second;
+    }
+
+    // Adds an Equity to the map, replacing any existing Equity with the same code:
+    void Insert(const EquityPtr& e) {
+        const EquityCode& code=e->GetEquityCode();
+        RowT row=_Index.FindOrInsert(code, (RowT)_Rows.size());
+        if (row < _Rows.size()) {
+            PEKey before=KeyOf(row);
+            _Rows[row].second=e;
+            _Columns.PE[row]=e->GetPE_ratio();
+            _Columns.Price[row]=e->GetPrice();
+            _Columns.MarketCap[row]=e->GetMarketCap();
+            // An unchanged description (the usual case for a tick) isn't pooled
+            // again.  A replaced one stays in the pool until the map is rebuilt.
+            if (_Columns.Description[row] != e->GetDescription()) {
+                _Columns.Description[row]=PoolDescription(*e);
+                if (_TextValid) {
+                    _Text.Changed(row);
+                    _TextValid= (_Text.ChangedCount() <= _Rows.size()/16);
+                }
+            }
+            if (_ByPEValid)
+                Reindex(row, before);
+            return;
+        }
+        _Rows.push_back(value_type(code, e));
+        _Columns.Code.push_back(code.Packed());
+        _Columns.PE.push_back(e->GetPE_ratio());
+        _Columns.Price.push_back(e->GetPrice());
+        _Columns.MarketCap.push_back(e->GetMarketCap());
+        _Columns.Description.push_back(PoolDescription(*e));
+        _ByPEValid=false;
+        _BySuffixValid=false;
+        if (_TextValid)
+            _Text.Add(row, _Columns.Description[row]);
+        if (_SortedValid && ( _Sorted.empty() || _Rows[_Sorted.back()].first < code ))
+            _Sorted.push_back(row);
+        else
+            _SortedValid=false;
+    }
+
+    // Bulk insert of items sorted by code.  Items with equal codes must be in
+    // insertion order: the last of them wins, as with repeated Insert() calls.
+    // On an empty map, every row is appended in code order, so no re-sort is
+    // needed afterwards.
+    void InsertSorted(const std::vector<EquityPtr>& items) {
+        Reserve(_Rows.size()+items.size());
+        for (size_t i = 0; i < items.size(); ++i) {
+            if ( i+1 < items.size() && items[i+1]->GetEquityCode()==items[i]->GetEquityCode() )
+                continue;   // Superseded by a later line.
+            Insert(items[i]);
+        }
+    }
+
+    // Applies a price tick to an existing equity by replacing it with an
+    // updated copy, so EquityPtrs already handed out never change under their
+    // holders.  O(log n) with a P/E index.  Returns the new Equity, or a null
+    // pointer if the code isn't in the map.
+    EquityPtr ApplyUpdate(const EquityUpdate& update) {
+        RowT row=_Index.Find(update.Code);
+        if (row==EquityHashIndex::NotFound)
+            return EquityPtr();
+        const Equity& old=*_Rows[row].second;
+        Equity* e;
+        EquityPtr result;
+        if (old.OwnsDescription()) {
+            e=new Equity(old);
+            result.reset(e);
+        }
+        else {
+            shared_ptr<UpdatedEquity> copy(new UpdatedEquity(old, _Backing));
+            e=&copy->Value;
+            result=EquityPtr(copy, e);
+        }
+        e->_Price=update.Price;
+        e->_PE_ratio=update.PE_ratio;
+        e->_MarketCap=update.MarketCap;
+        Insert(result);
+        return result;
+    }
+
+    // Makes the empty map 'copy' a copy of this one, indexes included.  Equity
+    // objects, retained backing and pooled descriptions are shared, not copied.
+    void Clone(EquityMap& copy) const {
+        copy._Rows=_Rows;
+        copy._Index=_Index;
+        copy._Columns=_Columns;
+        copy._Backing=_Backing;
+        copy._Backing.push_back(_Descriptions);
+        copy._Sorted=_Sorted;
+        copy._SortedValid=_SortedValid;
+        copy._ByPE=_ByPE;
+        copy._ByPEMoved=_ByPEMoved;
+        copy._ByPEStale=_ByPEStale;
+        copy._ByPEValid=_ByPEValid;
+        copy._ByPEFront=_ByPEFront;
+        copy._BySuffix=_BySuffix;
+        copy._BySuffixValid=_BySuffixValid;
+        copy._Text=_Text;
+        copy._TextValid=_TextValid;
+        copy._Pool=_Pool;
+        copy._LowestPE=_LowestPE;
+        copy._HugePages=_HugePages;
+    }
+
+    // Makes the empty map 'copy' a deep copy of this one, in the same row
+    // order: the Equity records and their descriptions are copied into a new
+    // arena, and the indexes rebuilt.  All of the copy's memory is allocated,
+    // and first touched, by the calling thread, so on a NUMA machine it lives
+    // on that thread's node.
+    void DeepCopy(EquityMap& copy) const {
+        EquityArenaPtr arena( new EquityArena(_HugePages ? HugePages::Pages_Transparent : HugePages::Pages_Default) );
+        copy._HugePages=_HugePages;
+        copy._Pool=_Pool;
+        copy.Reserve(_Rows.size());
+        for (size_t i = 0; i < _Rows.size(); ++i)
+            copy.Insert( EquityPtr(arena, arena->Copy(*_Rows[i].second)) );
+        copy.RetainBacking(arena);
+        copy.BuildIndexes();
+    }
+
+    // Looks up 'n' codes at once (see EquityHashIndex::FindBatch), storing
+    // each one's row, or EquityHashIndex::NotFound, in 'rows':
+    void FindRows(const EquityCode* codes, size_t n, RowT* rows) const {
+        _Index.FindBatch(codes, n, rows);
+    }
+
+    // Finds an Equity object by name, without throwing.  On a miss, returns a
+    // null pointer and, if 'status' is given, sets it to say why.
+    EquityPtr  TryFind(const char* name, LookupStatus* status=0) const {
+        EquityCode code;
+        if (!EquityCode::Parse(name, code)) {
+            if (status)
+                *status=Lookup_InvalidCode;
+            return EquityPtr();
+        }
+        return TryFind(code, status);
+    }
+
+    // As above, by packed code.  The null code is reported as invalid.
+    EquityPtr  TryFind(const EquityCode& code, LookupStatus* status=0) const {
+        RowT row=_Index.Find(code);
+        if (status)
+            *status= (row != EquityHashIndex::NotFound) ? Lookup_Found
+                     : code.IsNull() ? Lookup_InvalidCode : Lookup_NotFound;
+        if (row==EquityHashIndex::NotFound)
+            return EquityPtr();
+        return _Rows[row].second;
+    }
+
+    // Finds an Equity object by name.  Throws a domain_error if not found.
+    EquityPtr  FindByEquityName(const char* name) const {
+        EquityPtr e=TryFind(name);
+        if (!e) {
+            throw std::domain_error("No such equity name");
+        }
+        return e;
+    }
+
+    // Finds an Equity object by packed code.  Throws a domain_error if not found.
+    EquityPtr  FindByEquityCode(const EquityCode& code) const {
+        EquityPtr e=TryFind(code);
+        if (!e) {
+            throw std::domain_error("No such equity name");
+        }
+        return e;
+    }
+
+    // Iteratively invokes a selection filter on each element in the collection to
+    // produce a selected-items collection.  Returns number of elements added
+    // to the 'result' collection.
+    int SelectByFilter( const EquityFilter& filter, EquityMap & result) const {
+        return SelectByFilter<EquityFilter>(filter, result);
+    }
+
+    // As above, for any filter type with an EquityFilter-style Select(),
+    // including the FilterExpr combinators.  The call is bound at compile
+    // time, so a final filter class's Select() inlines into the loop.
+    template <class F>
+    int SelectByFilter( const F& filter, EquityMap & result) const {
+        // If the map is empty, return an empty pointer:
+        if ( _Rows.size()== 0)
+            return 0;
+
+        int nAdded=0;
+        for (const_iterator it= begin(); it !=end(); ++it) {
+            if (filter.Select(*it->second)) {
+                ++nAdded;
+                result.Insert(it->second);
+            }
+        }
+        return nAdded;
+    }
+
+    // Builds the secondary indexes now, rather than on first use or not at all.
+    // Call this once loading is done.
+    void BuildIndexes() const {
+        if (_SortedValid && _ByPEValid && _BySuffixValid && _TextValid)
+            return;
+        FAST_LOOKUP_TIMED(Phase_IndexBuild);
+        EnsureSorted();
+        if (!_TextValid) {
+            _Text.Clear();
+            for (size_t i = 0; i < _Rows.size(); ++i)
+                _Text.Add((RowT)i, _Columns.Description[i]);
+            _TextValid=true;
+        }
+        if (!_BySuffixValid) {
+            _BySuffix.resize(_Rows.size());
+            for (size_t i = 0; i < _BySuffix.size(); ++i) {
+                _BySuffix[i].Reversed=_Rows[i].first.Reversed().Packed();
+                _BySuffix[i].Row=(RowT)i;
+            }
+            std::sort(_BySuffix.begin(), _BySuffix.end());
+            _BySuffixValid=true;
+        }
+        if (!_ByPEValid) {
+            _ByPE.resize(_Rows.size());
+            for (size_t i = 0; i < _ByPE.size(); ++i)
+                _ByPE[i]=KeyOf((RowT)i);
+            std::sort(_ByPE.begin(), _ByPE.end());
+            _ByPEMoved.clear();
+            _ByPEStale.assign(_Rows.size(), 0);
+            _ByPEFront=0;
+            _LowestPE= _ByPE.empty() ? 0 : _ByPE.front().Row;
+            _ByPEValid=true;
+        }
+        if (_HugePages)
+            AdviseHugePages();
+    }
+
+    // With this set, BuildIndexes() asks for the map's rows, columns and
+    // indexes to be backed by transparent huge pages (see HugePages).
+    // Clone() copies the setting.
+    void SetHugePages(bool on) {
+        _HugePages=on;
+    }
+
+    bool HasPEIndex() const {
+        return _ByPEValid;
+    }
+
+    // Appends the rows whose descriptions contain every word of 'text' (see
+    // DescriptionIndex) to 'rows', in code order, stopping after 'limit' of
+    // them.  Returns how many were appended.  Text without words matches
+    // nothing.
+    size_t SelectRowsByDescription( const StringRef& text, std::vector<RowT>& rows, size_t limit=EquityQuery::NoLimit ) const {
+        DescriptionIndex::Query query(text);
+        if ( query.Words.empty() || !limit )
+            return 0;
+        std::vector<RowT> candidates;
+        bool indexed=( _TextValid && _Text.Candidates(query, candidates) );
+        size_t first=rows.size();
+        string scratch;
+        for (size_t i = 0, n= indexed ? candidates.size() : _Rows.size(); i < n; ++i) {
+            RowT row= indexed ? candidates[i] : (RowT)i;
+            if (DescriptionIndex::Matches(query, _Columns.Description[row], scratch))
+                rows.push_back(row);
+        }
+        if (rows.size()-first > limit) {
+            std::partial_sort(rows.begin()+first, rows.begin()+first+limit, rows.end(), CodeOrder(_Rows));
+            rows.resize(first+limit);
+        }
+        else {
+            std::sort(rows.begin()+first, rows.end(), CodeOrder(_Rows));
+        }
+        return rows.size()-first;
+    }
+
+    // Appends the rows whose codes start with 'prefix' to 'rows', in code
+    // order, stopping after 'limit' of them.  Returns how many were appended.
+    // One binary search and a slice: O(log n + k).
+    size_t SelectRowsByCodePrefix( const StringRef& prefix, std::vector<RowT>& rows, size_t limit=EquityQuery::NoLimit ) const {
+        uint64_t lo, hi;
+        if (!EquityCode::PrefixRange(prefix.Data(), prefix.Size(), lo, hi))
+            return 0;
+        EnsureSorted();
+        size_t first=rows.size();
+        std::vector<RowT>::const_iterator it=std::lower_bound(_Sorted.begin(), _Sorted.end(), lo, PackedCodeOrder(_Columns));
+        for ( ; it != _Sorted.end() && rows.size()-first < limit && _Columns.Code[*it] <= hi; ++it)
+            rows.push_back(*it);
+        return rows.size()-first;
+    }
+
+    // As above, for codes which end with 'suffix'.  With the suffix index the
+    // m matches are one slice, and the first 'limit' of them in code order are
+    // picked in O(log n + m log k); without it, the code order is filtered.
+    size_t SelectRowsByCodeSuffix( const StringRef& suffix, std::vector<RowT>& rows, size_t limit=EquityQuery::NoLimit ) const {
+        char reversed[EquityCode::MaxLen];
+        uint64_t lo, hi;
+        if (suffix.Size() > sizeof(reversed))
+            return 0;
+        std::reverse_copy(suffix.Data(), suffix.Data()+suffix.Size(), reversed);
+        if (!EquityCode::PrefixRange(reversed, suffix.Size(), lo, hi) || !limit)
+            return 0;
+        size_t first=rows.size();
+        if (!_BySuffixValid) {
+            EnsureSorted();
+            for (size_t i = 0; i < _Sorted.size() && rows.size()-first < limit; ++i) {
+                uint64_t key=_Rows[_Sorted[i]].first.Reversed().Packed();
+                if (key >= lo && key <= hi)
+                    rows.push_back(_Sorted[i]);
+            }
+            return rows.size()-first;
+        }
+        SuffixKey low={ lo, 0 };
+        for (std::vector<SuffixKey>::const_iterator it=std::lower_bound(_BySuffix.begin(), _BySuffix.end(), low);
+             it != _BySuffix.end() && it->Reversed <= hi; ++it)
+            rows.push_back(it->Row);
+        if (rows.size()-first > limit) {
+            std::partial_sort(rows.begin()+first, rows.begin()+first+limit, rows.end(), CodeOrder(_Rows));
+            rows.resize(first+limit);
+        }
+        else {
+            std::sort(rows.begin()+first, rows.end(), CodeOrder(_Rows));
+        }
+        return rows.size()-first;
+    }
+
+    // Runs 'query', appending the matching rows to 'rows' in the query's
+    // order, up to its limit.  Returns the number of rows appended.
+    //
+    // With a P/E index, a query with a P/E range selective enough, or one
+    // ordered by P/E (with a range or a small limit), walks the index: its
+    // results then come out already in P/E order, and a limit stops the walk
+    // early.  Anything else scans the columns a block at a time, ANDing one
+    // vectorized bitmap per range.  Small limits keep the best rows in a
+    // bounded heap as they're found; larger ones use nth_element.  Code
+    // order results, when there are many, are collected by walking the code
+    // order against a bitmap of the matches, rather than sorted.
+    //
+    // Maps of more than ParallelRows rows are scanned in morsels of MorselRows
+    // on the map's MorselPool, each morsel producing a sorted run; the runs
+    // are then merged.
+    size_t Query( const EquityQuery& query, std::vector<RowT>& rows ) const {
+        size_t first=rows.size();
+        size_t limit=query.GetLimit();
+        if (_Rows.empty() || !limit)
+            return 0;
+        bool peOrder=( query.GetOrder()==EquityQuery::PE && !query.IsDescending() );
+        QueryOrder order(*this, query);
+
+        if (UsePEIndex(query)) {
+            if (peOrder && limit==1 && !query.HasRanges()) {
+                rows.push_back(_LowestPE);
+                return 1;
+            }
+            AppendSink sink(rows, peOrder ? limit : EquityQuery::NoLimit);
+            WalkPEIndex(query, sink);
+            if (peOrder)
+                return rows.size()-first;
+        }
+        else if ( limit <= (size_t)HeapLimit && IsParallel() ) {
+            std::vector< std::vector<RowT> > runs(Morsels());
+            RunMorsels(RunTask<HeapSink>(*this, query, order, limit, runs));
+            MergeRuns(runs, order, limit, rows);
+            return rows.size()-first;
+        }
+        else if (limit <= (size_t)HeapLimit) {
+            HeapSink sink(order, limit);
+            ScanColumns(query, sink, 0, _Rows.size());
+            sink.Drain(rows);
+            return rows.size()-first;
+        }
+        else if (query.GetOrder()==EquityQuery::Code) {
+            return SelectInCodeOrder(query, limit, rows);
+        }
+        else if (IsParallel()) {
+            std::vector< std::vector<RowT> > runs(Morsels());
+            RunMorsels(RunTask<AppendSink>(*this, query, order, limit, runs));
+            MergeRuns(runs, order, limit, rows);
+            return rows.size()-first;
+        }
+        else {
+            AppendSink sink(rows, EquityQuery::NoLimit);
+            ScanColumns(query, sink, 0, _Rows.size());
+        }
+
+        std::vector<RowT>::iterator begin=rows.begin()+first;
+        if (limit < rows.size()-first) {
+            std::nth_element(begin, begin+limit, rows.end(), order);
+            rows.resize(first+limit);
+            begin=rows.begin()+first;
+        }
+        std::sort(begin, rows.end(), order);
+        return rows.size()-first;
+    }
+
+    // Returns the number of rows 'query' would return, without listing them:
+    size_t Count( const EquityQuery& query ) const {
+        CountSink sink;
+        if (_Rows.empty())
+            return 0;
+        if (UsePEIndex(query)) {
+            WalkPEIndex(query, sink);
+        }
+        else {
+            std::vector<size_t> counts(Morsels());
+            RunMorsels(CountTask(*this, query, counts));
+            for (size_t m = 0; m < counts.size(); ++m)
+                sink.Count += counts[m];
+        }
+        return std::min(sink.Count, query.GetLimit());
+    }
+
+    // Queries over more than ParallelRows rows run on 'pool' (null for none)
+    // in morsels of MorselRows rows, which is about what the scanned columns
+    // of a morsel can keep in L2.  The default is MorselPool::Global().
+    enum { ParallelRows=64*1024, MorselRows=8*1024 };
+    void SetMorselPool(MorselPool* pool) {
+        _Pool=pool;
+    }
+
+    // Appends the rows whose P/E is in [minPE,maxPE] to 'rows', in the requested
+    // order.  Returns the number of rows appended.
+    size_t SelectRowsByPERange( double minPE, double maxPE, std::vector<RowT>& rows, ResultOrder order ) const {
+        return Query( EquityQuery().Where(EquityQuery::PE, minPE, maxPE)
+                      .OrderBy(order==Order_PE ? EquityQuery::PE : EquityQuery::Code), rows );
+    }
+
+    // Answers several P/E range queries at once: rows[i] gets the rows whose
+    // P/E is in [ranges[i].first, ranges[i].second], in code order.  Ranges
+    // narrow enough for the P/E index are looked up there one by one; the
+    // rest share a single walk of the code order, so a batch of wide ranges
+    // costs about one scan rather than one each.
+    typedef std::pair<double,double> PERange;
+    void SelectRowsByPERanges( const std::vector<PERange>& ranges, std::vector< std::vector<RowT> >& rows ) const {
+        rows.assign(ranges.size(), std::vector<RowT>());
+        std::vector<PERange> wide;
+        std::vector<size_t> wideIx;
+        for (size_t i = 0; i < ranges.size(); ++i) {
+            EquityQuery query=EquityQuery().Where(EquityQuery::PE, ranges[i].first, ranges[i].second);
+            if (UsePEIndex(query)) {
+                Query(query, rows[i]);
+            }
+            else {
+                // As the query sees it, so NaN bounds mean no bound:
+                wide.push_back(PERange(query.Min(EquityQuery::PE), query.Max(EquityQuery::PE)));
+                wideIx.push_back(i);
+            }
+        }
+        if (wide.size() < 2) {
+            // Nothing to share:
+            if (!wide.empty())
+                SelectRowsByPERange(wide[0].first, wide[0].second, rows[wideIx[0]], Order_Code);
+            return;
+        }
+        EnsureSorted();
+        RangeClasses classes(wide);
+        std::vector< std::vector<RowT> > runs(Morsels()*wide.size());
+        RunMorsels(RangesTask(*this, classes, runs));
+        for (size_t r = 0; r < wide.size(); ++r) {
+            std::vector<RowT>& out=rows[wideIx[r]];
+            for (size_t m = r; m < runs.size(); m += wide.size())
+                out.insert(out.end(), runs[m].begin(), runs[m].end());
+        }
+    }
+
+    // Adds every Equity whose P/E is in [minPE,maxPE] to 'result'.  Returns the
+    // number of elements added.
+    int SelectByPERange( double minPE, double maxPE, EquityMap & result) const {
+        std::vector<RowT> rows;
+        SelectRowsByPERange(minPE, maxPE, rows, Order_Code);
+        result.Reserve(result.Size()+rows.size());
+        for (size_t i = 0; i < rows.size(); ++i)
+            result.Insert(_Rows[rows[i]].second);
+        return (int)rows.size();
+    }
+
+    // Returns the Equity with the lowest P/E, breaking ties on lowest price.
+    // Equivalent to FindByCompareFilter() with a LowestPE_filter: when P/E and
+    // price are both equal, the code which sorts last wins, just as it does
+    // in an ordered scan.  O(1) with a P/E index, a column scan without one.
+    EquityPtr FindLowestPE() const {
+        std::vector<RowT> best;
+        if (!Query(EquityQuery().OrderBy(EquityQuery::PE).Limit(1), best))
+            return EquityPtr();
+        return _Rows[best[0]].second;
+    }
+
+    // Appends the rows which 'filter' selects to 'rows', in the requested
+    // order, and returns how many were appended.  'filter' is a FilterExpr,
+    // which is evaluated against the columns in one pass, however many
+    // criteria it combines.
+    template <class F>
+    size_t SelectRows( const F& filter, std::vector<RowT>& rows, ResultOrder order=Order_Code ) const {
+        size_t first=rows.size();
+        for (size_t row = 0; row < _Rows.size(); ++row) {
+            if (filter.Select(_Columns, row))
+                rows.push_back((RowT)row);
+        }
+        if (order==Order_Code)
+            std::sort(rows.begin()+first, rows.end(), CodeOrder(_Rows));
+        else
+            std::sort(rows.begin()+first, rows.end(), PEOrder(_Columns));
+        return rows.size()-first;
+    }
+
+    // Iteratively compares each element in the collection using a caller-supplied
+    // comparison filter.  Returns the element which the filter determines to be
+    // best-fit:
+    EquityPtr FindByCompareFilter( const EquityFilter& filter) const {
+        return FindByCompareFilter<EquityFilter>(filter);
+    }
+
+    // As above, for any filter type with an EquityFilter-style Compare(),
+    // bound at compile time:
+    template <class F>
+    EquityPtr FindByCompareFilter( const F& filter) const {
+        // Our initial first-item is the first item in the collection.
+        if ( _Rows.size()== 0)
+            return EquityPtr();
+        // In a 1-element collection, the compare filter is irrelevant:
+        if (_Rows.size()==1)
+            return _Rows.front().second;
+
+        EquityPtr cur=begin()->second;
+        for (const_iterator it= ++begin(); it !=end(); ++it) {
+            const Equity& selected = filter.Compare(*cur, *it->second);
+            if ( &selected != &*cur )
+                // The filter chose the right-side equity:
+                cur=it->second;
+
+        }
+        return cur;
+    }
+
+private:
+    // We really don't want people accidentally copying this.  It's expensive.  If that operation
+    // is needed, use Clone().
+    EquityMap(const EquityMap& );
+    void operator = (const EquityMap&);
+
+    // An updated copy of an Equity whose description is borrowed from the
+    // map's backing (an arena, a mapped file).  The copy keeps that backing
+    // alive, as the original's owner does.  Holding the original itself
+    // instead would chain every version of a record together.
+    struct UpdatedEquity {
+        UpdatedEquity(const Equity& e, const std::vector< shared_ptr<void> >& backing) : Value(e), Backing(backing) {
+        }
+        Equity                          Value;
+        std::vector< shared_ptr<void> > Backing;
+    };
+
+    // Owned descriptions are copied into our pool, so the column's text is
+    // contiguous.  Borrowed ones already live in a retained backing file.
+    StringRef PoolDescription(const Equity& e) {
+        return e.OwnsDescription() ? _Descriptions->Add(e.GetDescription()) : e.GetDescription();
+    }
+
+    // Query result orders, as described by EquityQuery:
+    struct QueryOrder {
+        QueryOrder(const EquityMap& map, const EquityQuery& query) :
+            _Map(map), _Field(query.GetOrder()), _Descending(query.IsDescending()) {
+        }
+        bool operator () (RowT left, RowT right) const {
+            return _Descending ? Before(right, left) : Before(left, right);
+        }
+        bool Before(RowT left, RowT right) const {
+            const Columns& cols=_Map._Columns;
+            switch (_Field) {
+            case EquityQuery::PE:
+                return PEOrder(cols)(left, right);
+            case EquityQuery::Price:
+                if (cols.Price[left] != cols.Price[right])
+                    return cols.Price[left] < cols.Price[right];
+                break;
+            case EquityQuery::MarketCap:
+                if (cols.MarketCap[left] != cols.MarketCap[right])
+                    return cols.MarketCap[left] < cols.MarketCap[right];
+                break;
+            default:
+                break;
+            }
+            return cols.Code[left] < cols.Code[right];
+        }
+        const EquityMap&   _Map;
+        EquityQuery::Field _Field;
+        bool               _Descending;
+    };
+
+    // Query result sinks.  Scans hand them a word of match bits at a time;
+    // index walks hand them one row at a time, and stop when Add() says so.
+    struct AppendSink {
+        AppendSink(std::vector<RowT>& rows, size_t limit) : _Rows(rows), _Left(limit) {
+        }
+        bool Add(RowT row) {
+            _Rows.push_back(row);
+            return --_Left != 0;
+        }
+        void Word(size_t base, uint64_t bits) {
+            for ( ; bits; bits &= bits-1)
+                _Rows.push_back((RowT)(base+__builtin_ctzll(bits)));
+        }
+        std::vector<RowT>& _Rows;
+        size_t             _Left;
+    };
+
+    struct CountSink {
+        CountSink() : Count(0) {
+        }
+        bool Add(RowT) {
+            ++Count;
+            return true;
+        }
+        void Word(size_t, uint64_t bits) {
+            Count += (size_t)__builtin_popcountll(bits);
+        }
+        size_t Count;
+    };
+
+    // Sets the match bits of whole words in a bitmap of every row:
+    struct BitmapSink {
+        BitmapSink(std::vector<uint64_t>& bits) : _Bits(bits), Count(0) {
+        }
+        void Word(size_t base, uint64_t bits) {
+            _Bits[base/64]=bits;
+            Count += (size_t)__builtin_popcountll(bits);
+        }
+        std::vector<uint64_t>& _Bits;
+        size_t                 Count;
+    };
+
+    // Keeps the best 'limit' rows seen, with the worst of them on top:
+    enum { HeapLimit=256 };
+    struct HeapSink {
+        HeapSink(const QueryOrder& order, size_t limit) : _Order(order), _Limit(limit) {
+            _Heap.reserve(limit);
+        }
+        bool Add(RowT row) {
+            if (_Heap.size() < _Limit) {
+                _Heap.push_back(row);
+                std::push_heap(_Heap.begin(), _Heap.end(), _Order);
+            }
+            else if (_Order(row, _Heap.front())) {
+                std::pop_heap(_Heap.begin(), _Heap.end(), _Order);
+                _Heap.back()=row;
+                std::push_heap(_Heap.begin(), _Heap.end(), _Order);
+            }
+            return true;
+        }
+        void Word(size_t base, uint64_t bits) {
+            for ( ; bits; bits &= bits-1)
+                Add((RowT)(base+__builtin_ctzll(bits)));
+        }
+        void Drain(std::vector<RowT>& rows) {
+            std::sort_heap(_Heap.begin(), _Heap.end(), _Order);
+            rows.insert(rows.end(), _Heap.begin(), _Heap.end());
+        }
+        const QueryOrder&  _Order;
+        size_t             _Limit;
+        std::vector<RowT>  _Heap;
+    };
+
+    // True if 'query' should walk the P/E index rather than scan: if it's
+    // in P/E order, with a P/E range or a limit small enough that the walk
+    // will likely stop early, or if its P/E range is selective.
+    bool UsePEIndex(const EquityQuery& query) const {
+        if (!_ByPEValid)
+            return false;
+        size_t n=_Rows.size();
+        bool peOrder=( query.GetOrder()==EquityQuery::PE && !query.IsDescending() );
+        if (!query.HasRange(EquityQuery::PE))
+            return peOrder && query.GetLimit() <= n/IndexFraction;
+        if (peOrder)
+            return true;
+        // Estimate from the main index alone; updates move at most 1/16th of it.
+        const std::vector<PEKey>& byPE=_ByPE;
+        std::vector<PEKey>::const_iterator lo=std::lower_bound(byPE.begin(), byPE.end(), query.Min(EquityQuery::PE), PEKeyOrder());
+        std::vector<PEKey>::const_iterator hi=std::upper_bound(lo, byPE.end(), query.Max(EquityQuery::PE), PEKeyOrder());
+        return (size_t)(hi-lo) <= n/IndexFraction;
+    }
+    enum { IndexFraction=32 };
+
+    // Tests every range of 'query' against 'row':
+    bool MatchesRow(const EquityQuery& query, RowT row) const {
+        if ( query.HasRange(EquityQuery::Price) &&
+                !(_Columns.Price[row] >= query.Min(EquityQuery::Price) && _Columns.Price[row] <= query.Max(EquityQuery::Price)) )
+            return false;
+        long long capMin, capMax;
+        if ( query.HasRange(EquityQuery::MarketCap) &&
+                ( !CapBounds(query, capMin, capMax) || _Columns.MarketCap[row] < capMin || _Columns.MarketCap[row] > capMax ) )
+            return false;
+        return !query.HasRange(EquityQuery::PE) ||
+               (_Columns.PE[row] >= query.Min(EquityQuery::PE) && _Columns.PE[row] <= query.Max(EquityQuery::PE));
+    }
+
+    // Converts the market cap range to integer bounds.  Returns false if no
+    // integer is in it.
+    static bool CapBounds(const EquityQuery& query, long long& min, long long& max) {
+        double lo=std::ceil(query.Min(EquityQuery::MarketCap)), hi=std::floor(query.Max(EquityQuery::MarketCap));
+        if ( !(lo <= hi) )
+            return false;   // empty, or NaN
+        min= (lo <= (double)LLONG_MIN) ? LLONG_MIN : (long long)lo;
+        max= (hi >= (double)LLONG_MAX) ? LLONG_MAX : (long long)hi;
+        return min <= max;
+    }
+
+    // Visits, in P/E order, the rows in the query's P/E range which match
+    // its other ranges, until the sink has had enough.  Requires the index.
+    template <class Sink>
+    void WalkPEIndex(const EquityQuery& query, Sink& sink) const {
+        double minPE=query.Min(EquityQuery::PE), maxPE=query.Max(EquityQuery::PE);
+        // An empty range would leave the moved entries' bounds crossed:
+        if (!(minPE <= maxPE))
+            return;
+        // Two binary searches each give us the matching slices of the P/E
+        // index and of its moved entries, which we merge:
+        const std::vector<PEKey>& byPE=_ByPE;
+        std::vector<PEKey>::const_iterator lo=std::lower_bound(byPE.begin(), byPE.end(), minPE, PEKeyOrder());
+        std::vector<PEKey>::const_iterator hi=std::upper_bound(lo, byPE.end(), maxPE, PEKeyOrder());
+        std::set<PEKey>::const_iterator mlo=_ByPEMoved.lower_bound(PEKey::Lowest(minPE));
+        std::set<PEKey>::const_iterator mhi=_ByPEMoved.upper_bound(PEKey::Highest(maxPE));
+        bool filter=( query.HasRange(EquityQuery::Price) || query.HasRange(EquityQuery::MarketCap) );
+        while (lo != hi || mlo != mhi) {
+            RowT row;
+            if (lo != hi && _ByPEStale[lo->Row]) {
+                ++lo;
+                continue;
+            }
+            else if (mlo==mhi || (lo != hi && *lo < *mlo))
+                row=(lo++)->Row;
+            else
+                row=(mlo++)->Row;
+            if ( (!filter || MatchesRow(query, row)) && !sink.Add(row) )
+                return;
+        }
+    }
+
+    // Scans rows [begin,end) of the columns in blocks, ANDing a bitmap for
+    // each of the query's ranges, and hands the sink each non-empty word of
+    // the result.  'begin' must be a multiple of 64.
+    template <class Sink>
+    void ScanColumns(const EquityQuery& query, Sink& sink, size_t begin, size_t end) const {
+        enum { Block=1024, Words=Block/64 };
+        uint64_t bits[Words], more[Words];
+        long long capMin=0, capMax=0;
+        bool byCap=query.HasRange(EquityQuery::MarketCap);
+        if ( byCap && !CapBounds(query, capMin, capMax) )
+            return;
+        const size_t n=end;
+        for (size_t base = begin; base < n; base += Block) {
+            size_t k=std::min((size_t)Block, n-base);
+            size_t words=(k+63)/64;
+            if (query.HasRange(EquityQuery::PE)) {
+                RangeScan::Bitmap(&_Columns.PE[base], k, query.Min(EquityQuery::PE), query.Max(EquityQuery::PE), bits);
+            }
+            else {
+                for (size_t w = 0; w < words; ++w)
+                    bits[w]=~(uint64_t)0;
+                if (k % 64)
+                    bits[words-1]=((uint64_t)1 << (k % 64))-1;
+            }
+            if (query.HasRange(EquityQuery::Price)) {
+                RangeScan::Bitmap(&_Columns.Price[base], k, query.Min(EquityQuery::Price), query.Max(EquityQuery::Price), more);
+                for (size_t w = 0; w < words; ++w)
+                    bits[w] &= more[w];
+            }
+            if (byCap) {
+                CapBitmap(&_Columns.MarketCap[base], k, capMin, capMax, more);
+                for (size_t w = 0; w < words; ++w)
+                    bits[w] &= more[w];
+            }
+            for (size_t w = 0; w < words; ++w) {
+                if (bits[w])
+                    sink.Word(base+64*w, bits[w]);
+            }
+        }
+    }
+
+    bool IsParallel() const {
+        return _Pool && _Pool->Threads() > 1 && _Rows.size() > (size_t)ParallelRows;
+    }
+
+    size_t Morsels() const {
+        return (_Rows.size()+MorselRows-1)/MorselRows;
+    }
+
+    // Runs task(m) for every morsel m, in parallel if the map is big enough:
+    template <class Task>
+    void RunMorsels(const Task& task) const {
+        if (IsParallel()) {
+            _Pool->Run(Morsels(), task);
+        }
+        else {
+            for (size_t m = 0; m < Morsels(); ++m)
+                task(m);
+        }
+    }
+
+    // Morsel tasks.  Each writes only its own morsel's slot of the output.
+    //
+    // RunTask scans a morsel into a sink, and leaves the morsel's best
+    // 'limit' rows in its run, in query order:
+    template <class Sink>
+    struct RunTask {
+        RunTask(const EquityMap& map, const EquityQuery& query, const QueryOrder& order, size_t limit,
+                std::vector< std::vector<RowT> >& runs) :
+            _Map(map), _Query(query), _Order(order), _Limit(limit), _Runs(runs) {
+        }
+        void operator () (size_t m) const {
+            Scan(m, _Runs[m], (Sink*)0);
+        }
+        void Scan(size_t m, std::vector<RowT>& run, AppendSink*) const {
+            AppendSink sink(run, EquityQuery::NoLimit);
+            _Map.ScanColumns(_Query, sink, m*MorselRows, std::min(_Map._Rows.size(), (m+1)*MorselRows));
+            if (_Limit < run.size()) {
+                std::nth_element(run.begin(), run.begin()+_Limit, run.end(), _Order);
+                run.resize(_Limit);
+            }
+            std::sort(run.begin(), run.end(), _Order);
+        }
+        void Scan(size_t m, std::vector<RowT>& run, HeapSink*) const {
+            HeapSink sink(_Order, _Limit);
+            _Map.ScanColumns(_Query, sink, m*MorselRows, std::min(_Map._Rows.size(), (m+1)*MorselRows));
+            sink.Drain(run);
+        }
+        const EquityMap&                  _Map;
+        const EquityQuery&                _Query;
+        const QueryOrder&                 _Order;
+        size_t                            _Limit;
+        std::vector< std::vector<RowT> >& _Runs;
+    };
+
+    // CountTask counts a morsel's matches:
+    struct CountTask {
+        CountTask(const EquityMap& map, const EquityQuery& query, std::vector<size_t>& counts) :
+            _Map(map), _Query(query), _Counts(counts) {
+        }
+        void operator () (size_t m) const {
+            CountSink sink;
+            _Map.ScanColumns(_Query, sink, m*MorselRows, std::min(_Map._Rows.size(), (m+1)*MorselRows));
+            _Counts[m]=sink.Count;
+        }
+        const EquityMap&     _Map;
+        const EquityQuery&   _Query;
+        std::vector<size_t>& _Counts;
+    };
+
+    // MarkTask sets a morsel's match bits (morsels are whole words):
+    struct MarkTask {
+        MarkTask(const EquityMap& map, const EquityQuery& query, std::vector<uint64_t>& bits, std::vector<size_t>& counts) :
+            _Map(map), _Query(query), _Bits(bits), _Counts(counts) {
+        }
+        void operator () (size_t m) const {
+            BitmapSink sink(_Bits);
+            _Map.ScanColumns(_Query, sink, m*MorselRows, std::min(_Map._Rows.size(), (m+1)*MorselRows));
+            _Counts[m]=sink.Count;
+        }
+        const EquityMap&       _Map;
+        const EquityQuery&     _Query;
+        std::vector<uint64_t>& _Bits;
+        std::vector<size_t>&   _Counts;
+    };
+
+    // CollectTask walks a morsel of the code order (backwards, if
+    // descending), and lists its first 'limit' marked rows:
+    struct CollectTask {
+        CollectTask(const EquityMap& map, const std::vector<uint64_t>& bits, bool descending, size_t limit,
+                    std::vector< std::vector<RowT> >& runs) :
+            _Map(map), _Bits(bits), _Descending(descending), _Limit(limit), _Runs(runs) {
+        }
+        void operator () (size_t m) const {
+            const std::vector<RowT>& sorted=_Map._Sorted;
+            const size_t n=sorted.size();
+            std::vector<RowT>& run=_Runs[m];
+            for (size_t i = m*MorselRows, end=std::min(n, (m+1)*MorselRows); i < end && run.size() < _Limit; ++i) {
+                RowT row=sorted[_Descending ? n-1-i : i];
+                if ((_Bits[row/64] >> (row % 64)) & 1)
+                    run.push_back(row);
+            }
+        }
+        const EquityMap&                  _Map;
+        const std::vector<uint64_t>&      _Bits;
+        bool                              _Descending;
+        size_t                            _Limit;
+        std::vector< std::vector<RowT> >& _Runs;
+    };
+
+    // The P/E line cut at every bound of a set of ranges, so that a single
+    // binary search finds all the ranges a value is in.  Class 2j+1 is the
+    // value Bounds[j] itself, and class 2j the open interval below it.
+    struct RangeClasses {
+        RangeClasses(const std::vector<PERange>& ranges) : Count(ranges.size()) {
+            for (size_t r = 0; r < ranges.size(); ++r) {
+                Bounds.push_back(ranges[r].first);
+                Bounds.push_back(ranges[r].second);
+            }
+            std::sort(Bounds.begin(), Bounds.end());
+            Bounds.erase(std::unique(Bounds.begin(), Bounds.end()), Bounds.end());
+            First.push_back(0);
+            for (size_t c = 0; c <= 2*Bounds.size(); ++c) {
+                for (size_t r = 0; r < ranges.size(); ++r) {
+                    if (Covers(ranges[r], c))
+                        Ranges.push_back(r);
+                }
+                First.push_back(Ranges.size());
+            }
+        }
+        // Bounds are all in Bounds, so a range covers an interval whole or not at all:
+        bool Covers(const PERange& range, size_t c) const {
+            size_t j=c/2;
+            if (c % 2)
+                return range.first <= Bounds[j] && Bounds[j] <= range.second;
+            return j > 0 && j < Bounds.size() && range.first <= Bounds[j-1] && range.second >= Bounds[j];
+        }
+        // NaN falls below every bound, so into no range:
+        size_t ClassOf(double pe) const {
+            size_t j=std::lower_bound(Bounds.begin(), Bounds.end(), pe)-Bounds.begin();
+            return 2*j + (j < Bounds.size() && Bounds[j]==pe);
+        }
+        size_t              Count;      // ranges
+        std::vector<double> Bounds;     // sorted, distinct
+        std::vector<size_t> First;      // class c's ranges are Ranges[First[c]..First[c+1])
+        std::vector<size_t> Ranges;
+    };
+
+    // RangesTask walks a morsel of the code order against a set of P/E
+    // ranges, leaving range r's matches in runs[m*classes.Count+r]:
+    struct RangesTask {
+        RangesTask(const EquityMap& map, const RangeClasses& classes, std::vector< std::vector<RowT> >& runs) :
+            _Map(map), _Classes(classes), _Runs(runs) {
+        }
+        void operator () (size_t m) const {
+            const std::vector<RowT>& sorted=_Map._Sorted;
+            const std::vector<double>& pe=_Map._Columns.PE;
+            std::vector<RowT>* runs=&_Runs[m*_Classes.Count];
+            for (size_t i = m*MorselRows, end=std::min(sorted.size(), (m+1)*MorselRows); i < end; ++i) {
+                RowT row=sorted[i];
+                size_t c=_Classes.ClassOf(pe[row]);
+                for (size_t k = _Classes.First[c]; k < _Classes.First[c+1]; ++k)
+                    runs[_Classes.Ranges[k]].push_back(row);
+            }
+        }
+        const EquityMap&                  _Map;
+        const RangeClasses&               _Classes;
+        std::vector< std::vector<RowT> >& _Runs;
+    };
+
+    // Query() for code order without a small limit.  The matches are marked
+    // in a bitmap first.  If there are few, they're sorted; otherwise the
+    // code order is walked against the bitmap, which is O(n) rather than
+    // O(m log m), and splits into runs which just concatenate.
+    enum { WalkFraction=16 };
+    size_t SelectInCodeOrder(const EquityQuery& query, size_t limit, std::vector<RowT>& rows) const {
+        std::vector<uint64_t> bits((_Rows.size()+63)/64);
+        std::vector<size_t> counts(Morsels());
+        RunMorsels(MarkTask(*this, query, bits, counts));
+        size_t matches=0;
+        for (size_t m = 0; m < counts.size(); ++m)
+            matches += counts[m];
+
+        size_t first=rows.size();
+        if (matches < _Rows.size()/WalkFraction) {
+            rows.reserve(first+matches);
+            AppendSink sink(rows, EquityQuery::NoLimit);
+            for (size_t w = 0; w < bits.size(); ++w) {
+                if (bits[w])
+                    sink.Word(w*64, bits[w]);
+            }
+            QueryOrder order(*this, query);
+            std::vector<RowT>::iterator begin=rows.begin()+first;
+            if (limit < matches) {
+                std::nth_element(begin, begin+limit, rows.end(), order);
+                rows.resize(first+limit);
+                begin=rows.begin()+first;
+            }
+            std::sort(begin, rows.end(), order);
+            return rows.size()-first;
+        }
+
+        EnsureSorted();
+        std::vector< std::vector<RowT> > runs(Morsels());
+        RunMorsels(CollectTask(*this, bits, query.IsDescending(), limit, runs));
+        rows.reserve(first+std::min(matches, limit));
+        for (size_t m = 0; m < runs.size() && rows.size()-first < limit; ++m)
+            rows.insert(rows.end(), runs[m].begin(), runs[m].begin()+std::min(runs[m].size(), limit-(rows.size()-first)));
+        return rows.size()-first;
+    }
+
+    // Merges 'runs', each sorted in 'order', onto the end of 'rows', keeping
+    // the first 'limit'.  Pairs of runs are merged until one is left.
+    static void MergeRuns(const std::vector< std::vector<RowT> >& runs, const QueryOrder& order, size_t limit, std::vector<RowT>& rows) {
+        size_t first=rows.size();
+        std::vector<size_t> bounds(1, first);
+        for (size_t m = 0; m < runs.size(); ++m) {
+            rows.insert(rows.end(), runs[m].begin(), runs[m].end());
+            bounds.push_back(rows.size());
+        }
+        while (bounds.size() > 2) {
+            std::vector<size_t> merged(1, first);
+            for (size_t i = 2; i < bounds.size(); i += 2) {
+                std::inplace_merge(rows.begin()+bounds[i-2], rows.begin()+bounds[i-1], rows.begin()+bounds[i], order);
+                merged.push_back(bounds[i]);
+            }
+            if (bounds.size() % 2==0)
+                merged.push_back(bounds.back());
+            bounds.swap(merged);
+        }
+        if (rows.size()-first > limit)
+            rows.resize(first+limit);
+    }
+
+    // RangeScan::Bitmap for the integer market cap column.  This form
+    // auto-vectorizes.
+    static void CapBitmap(const long long* v, size_t n, long long lo, long long hi, uint64_t* bits) {
+        for (size_t base = 0; base < n; base += 64) {
+            size_t k=std::min((size_t)64, n-base);
+            uint64_t word=0;
+            for (size_t i = 0; i < k; ++i)
+                word |= (uint64_t)( (v[base+i] >= lo) & (v[base+i] <= hi) ) << i;
+            bits[base/64]=word;
+        }
+    }
+
+    // An entry of the P/E index.  The sort fields are copied out of the
+    // columns, so an entry keeps its place after its row is updated.  Entries
+    // are in PEOrder.
+    struct PEKey {
+        double   PE;
+        double   Price;
+        uint64_t Code;
+        RowT     Row;
+
+        bool operator < (const PEKey& other) const {
+            if (PE != other.PE)
+                return PE < other.PE;
+            if (Price != other.Price)
+                return Price < other.Price;
+            return Code > other.Code;
+        }
+        // Keys which sort before/after every real entry with the given P/E:
+        static PEKey Lowest(double pe) {
+            PEKey k={ pe, -HUGE_VAL, UINT64_MAX, 0 };
+            return k;
+        }
+        static PEKey Highest(double pe) {
+            PEKey k={ pe, HUGE_VAL, 0, 0 };
+            return k;
+        }
+    };
+
+    // Compares index entries against a bare P/E value, for binary searches:
+    struct PEKeyOrder {
+        bool operator () (const PEKey& key, double pe) const {
+            return key.PE < pe;
+        }
+        bool operator () (double pe, const PEKey& key) const {
+            return pe < key.PE;
+        }
+    };
+
+    PEKey KeyOf(RowT row) const {
+        PEKey k={ _Columns.PE[row], _Columns.Price[row], _Columns.Code[row], row };
+        return k;
+    }
+
+    // Moves 'row' from its index entry 'before' to one for its current
+    // column values, and keeps the cached lowest row current.  The lowest
+    // row is only searched for again when it's the one which moved up.
+    void Reindex(RowT row, const PEKey& before) {
+        PEKey after=KeyOf(row);
+        if ( !(before < after) && !(after < before) )
+            return;
+        if (_ByPEStale[row])
+            _ByPEMoved.erase(before);
+        else
+            _ByPEStale[row]=1;
+        _ByPEMoved.insert(after);
+
+        if (row==_LowestPE) {
+            if (before < after)
+                _LowestPE=FirstByPE();
+        }
+        else if (after < KeyOf(_LowestPE)) {
+            _LowestPE=row;
+        }
+
+        if ( _ByPEMoved.size() > std::max((size_t)1024, _Rows.size()/16) )
+            CompactPEIndex();
+    }
+
+    // Returns the row of the first live entry in the P/E index.  Entries only
+    // go stale between compactions, so the first live one in _ByPE is found by
+    // advancing a cursor, in amortized O(1).
+    RowT FirstByPE() const {
+        while (_ByPEFront < _ByPE.size() && _ByPEStale[_ByPE[_ByPEFront].Row])
+            ++_ByPEFront;
+        if ( _ByPEMoved.empty() ||
+             (_ByPEFront < _ByPE.size() && _ByPE[_ByPEFront] < *_ByPEMoved.begin()) )
+            return _ByPE[_ByPEFront].Row;
+        return _ByPEMoved.begin()->Row;
+    }
+
+    // Lists every row in P/E index order, without compacting the index:
+    void PERows(std::vector<RowT>& rows) const {
+        rows.clear();
+        rows.reserve(_Rows.size());
+        std::set<PEKey>::const_iterator moved=_ByPEMoved.begin();
+        for (size_t i = 0; i < _ByPE.size(); ++i) {
+            if (_ByPEStale[_ByPE[i].Row])
+                continue;
+            while (moved != _ByPEMoved.end() && *moved < _ByPE[i])
+                rows.push_back((moved++)->Row);
+            rows.push_back(_ByPE[i].Row);
+        }
+        for ( ; moved != _ByPEMoved.end(); ++moved)
+            rows.push_back(moved->Row);
+    }
+
+    // Merges the moved entries back into _ByPE, dropping the stale ones:
+    void CompactPEIndex() {
+        std::vector<PEKey> merged;
+        merged.reserve(_ByPE.size());
+        std::set<PEKey>::const_iterator moved=_ByPEMoved.begin();
+        for (size_t i = 0; i < _ByPE.size(); ++i) {
+            if (_ByPEStale[_ByPE[i].Row])
+                continue;
+            while (moved != _ByPEMoved.end() && *moved < _ByPE[i])
+                merged.push_back(*moved++);
+            merged.push_back(_ByPE[i]);
+        }
+        merged.insert(merged.end(), moved, _ByPEMoved.end());
+        _ByPE.swap(merged);
+        _ByPEMoved.clear();
+        std::fill(_ByPEStale.begin(), _ByPEStale.end(), 0);
+        _ByPEFront=0;
+    }
+
+    // Orders row numbers by the code stored in each row:
+    struct CodeOrder {
+        CodeOrder(const std::vector<value_type>& rows) : _Rows(rows) {
+        }
+        bool operator () (RowT left, RowT right) const {
+            return _Rows[left].first < _Rows[right].first;
+        }
+        const std::vector<value_type>& _Rows;
+    };
+
+    // For binary searches of code-ordered rows by packed code:
+    struct PackedCodeOrder {
+        PackedCodeOrder(const Columns& cols) : _Cols(cols) {
+        }
+        bool operator () (RowT row, uint64_t packed) const {
+            return _Cols.Code[row] < packed;
+        }
+        const Columns& _Cols;
+    };
+
+    // A suffix index entry: a row's code spelled backwards (packed), and the row.
+    struct SuffixKey {
+        uint64_t Reversed;
+        RowT     Row;
+        bool operator < (const SuffixKey& other) const {
+            return Reversed < other.Reversed;
+        }
+    };
+
+    // Orders row numbers by (P/E, price, code), which is the LowestPE_filter
+    // preference order.  The code is compared descending, since that filter
+    // picks the later of two otherwise-equal equities.
+    struct PEOrder {
+        PEOrder(const Columns& cols) : _Cols(cols) {
+        }
+        bool operator () (RowT left, RowT right) const {
+            if (_Cols.PE[left] != _Cols.PE[right])
+                return _Cols.PE[left] < _Cols.PE[right];
+            if (_Cols.Price[left] != _Cols.Price[right])
+                return _Cols.Price[left] < _Cols.Price[right];
+            return _Cols.Code[left] > _Cols.Code[right];
+        }
+        const Columns& _Cols;
+    };
+
+    // The arrays a query or lookup walks; see SetHugePages():
+    void AdviseHugePages() const {
+        HugePages::Advise(_Rows);
+        _Index.AdviseHugePages();
+        HugePages::Advise(_Columns.Code);
+        HugePages::Advise(_Columns.PE);
+        HugePages::Advise(_Columns.Price);
+        HugePages::Advise(_Columns.MarketCap);
+        HugePages::Advise(_Columns.Description);
+        HugePages::Advise(_Sorted);
+        HugePages::Advise(_ByPE);
+        HugePages::Advise(_BySuffix);
+    }
+
+    void EnsureSorted() const {
+        if (_SortedValid)
+            return;
+        _Sorted.resize(_Rows.size());
+        for (size_t i = 0; i < _Sorted.size(); ++i)
+            _Sorted[i]=(RowT)i;
+        std::sort(_Sorted.begin(), _Sorted.end(), CodeOrder(_Rows));
+        _SortedValid=true;
+    }
+
+    std::vector<value_type> _Rows;     // Dense, in first-insertion order
+    EquityHashIndex         _Index;    // code -> row
+    Columns                 _Columns;
+    shared_ptr<StringPool>  _Descriptions;
+    std::vector< shared_ptr<void> > _Backing;
+    mutable std::vector<RowT>    _Sorted;     // rows in code order
+    mutable bool                 _SortedValid;
+    mutable std::vector<PEKey>   _ByPE;       // P/E index, as of the last build or compaction
+    mutable std::set<PEKey>      _ByPEMoved;  // entries for rows updated since then
+    mutable std::vector<uint8_t> _ByPEStale;  // per row: its _ByPE entry is superseded
+    mutable bool                 _ByPEValid;
+    mutable size_t               _ByPEFront;  // no live _ByPE entries before this
+    mutable RowT                 _LowestPE;
+    mutable std::vector<SuffixKey> _BySuffix; // rows by reversed code
+    mutable bool                 _BySuffixValid;
+    mutable DescriptionIndex     _Text;       // words of descriptions
+    mutable bool                 _TextValid;
+    MorselPool*                  _Pool;       // for parallel scans, or null
+    bool                         _HugePages;
+
+    friend class EquityMapFile;
+
+};
+
+
+// EquitySelection is a query result expressed as row numbers into the
+// EquityMap that produced it, so iterating a result allocates nothing and
+// touches no reference counts.  It is only valid while that map is alive and
+// unmodified; selections made by EquityService pin the snapshot they came
+// from.  Reusing one EquitySelection across queries reuses its storage.
+class EquitySelection {
+public:
+    typedef EquityMap::RowT RowT;
+
+    EquitySelection() : _Map(0) {
+    }
+
+    class const_iterator {
+    public:
+        typedef std::random_access_iterator_tag iterator_category;
+        typedef Equity                          value_type;
+        typedef std::ptrdiff_t                  difference_type;
+        typedef const Equity*                   pointer;
+        typedef const Equity&                   reference;
+
+        const_iterator() : _Map(0), _Pos(0) {
+        }
+        reference operator * () const {
+            return *_Map->GetRow(*_Pos);
+        }
+        pointer operator -> () const {
+            return &*_Map->GetRow(*_Pos);
+        }
+        const_iterator& operator ++ () {
+            ++_Pos;
+            return *this;
+        }
+        const_iterator operator ++ (int) {
+            const_iterator prev(*this);
+            ++_Pos;
+            return prev;
+        }
+        difference_type operator - (const const_iterator& other) const {
+            return _Pos-other._Pos;
+        }
+        bool operator == (const const_iterator& other) const {
+            return _Pos==other._Pos;
+        }
+        bool operator != (const const_iterator& other) const {
+            return _Pos!=other._Pos;
+        }
+        // Returns the row this iterator refers to:
+        RowT Row() const {
+            return *_Pos;
+        }
+    private:
+        friend class EquitySelection;
+        const_iterator(const EquityMap* map, const RowT* pos) : _Map(map), _Pos(pos) {
+        }
+        const EquityMap* _Map;
+        const RowT*      _Pos;
+    };
+
+    const_iterator begin() const {
+        return const_iterator(_Map, _Rows.empty() ? 0 : &_Rows[0]);
+    }
+    const_iterator end() const {
+        return const_iterator(_Map, _Rows.empty() ? 0 : &_Rows[0]+_Rows.size());
+    }
+
+    size_t Size() const {
+        return _Rows.size();
+    }
+    bool Empty() const {
+        return _Rows.empty();
+    }
+    const Equity& operator [] (size_t ix) const {
+        return *_Map->GetRow(_Rows[ix]);
+    }
+    // Returns a counted reference to an element, for callers which need to
+    // keep it beyond the lifetime of the map:
+    EquityPtr GetPtr(size_t ix) const {
+        return _Map->GetRow(_Rows[ix]);
+    }
+    const std::vector<RowT>& GetRows() const {
+        return _Rows;
+    }
+
+    // Empties the selection and attaches it to 'map', keeping its storage.
+    // 'pin', if given, keeps whatever owns the map alive while the selection
+    // refers to it:
+    std::vector<RowT>& Reset(const EquityMap* map, const shared_ptr<const void>& pin=shared_ptr<const void>()) {
+        _Map=map;
+        _Pin=pin;
+        _Rows.clear();
+        return _Rows;
+    }
+
+private:
+    const EquityMap*       _Map;
+    shared_ptr<const void> _Pin;
+    std::vector<RowT>      _Rows;
+};
+
+
+// EquityCodeList is a lazily-generated, alphabetically ordered list of the
+// codes in an EquityMap.  Codes are decoded as they are iterated; nothing is
+// materialized up front.  It is only valid while the map is alive and
+// unmodified, which 'pin' may be used to guarantee.
+class EquityCodeList {
+public:
+    EquityCodeList(const EquityMap& map, const shared_ptr<const void>& pin=shared_ptr<const void>()) :
+        _Map(&map), _Pin(pin) {
+    }
+
+    class const_iterator {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef EquityCode                value_type;
+        typedef std::ptrdiff_t            difference_type;
+        typedef const EquityCode*         pointer;
+        typedef const EquityCode&         reference;
+
+        const_iterator() {
+        }
+        reference operator * () const {
+            return _It->first;
+        }
+        pointer operator -> () const {
+            return &_It->first;
+        }
+        const_iterator& operator ++ () {
+            ++_It;
+            return *this;
+        }
+        const_iterator operator ++ (int) {
+            const_iterator prev(*this);
+            ++_It;
+            return prev;
+        }
+        bool operator == (const const_iterator& other) const {
+            return _It==other._It;
+        }
+        bool operator != (const const_iterator& other) const {
+            return _It!=other._It;
+        }
+    private:
+        friend class EquityCodeList;
+        const_iterator(const EquityMap::const_iterator& it) : _It(it) {
+        }
+        EquityMap::const_iterator _It;
+    };
+
+    const_iterator begin() const {
+        return const_iterator(_Map->begin());
+    }
+    const_iterator end() const {
+        return const_iterator(_Map->end());
+    }
+    size_t Size() const {
+        return _Map->Size();
+    }
+
+    // Returns the number of bytes needed to write every code followed by
+    // a newline:
+    size_t TextSize() const {
+        size_t bytes=0;
+        char buf[EquityCode::MaxLen+1];
+        for (const_iterator it=begin(); it != end(); ++it)
+            bytes += it->Format(buf)+1;
+        return bytes;
+    }
+
+private:
+    const EquityMap*       _Map;
+    shared_ptr<const void> _Pin;
+};
+
+
+// Split a string on a single-char delimiter, and populate *this
+// with the resulting tokens:
+class StringSplitter : public std::vector<string> {
+public:
+    void Insert( std::stringstream& ss, char delimiter ) {
+        string cur;
+        while (std::getline(ss,cur,delimiter)) {
+            this->push_back(cur);
+        }
+    }
+    StringSplitter(const char* text, char delimiter) {
+        std::stringstream ss(text);
+        Insert(ss , delimiter);
+    }
+
+    StringSplitter(const std::string& text, char delimiter) {
+        std::stringstream ss(text);
+        Insert( ss , delimiter);
+    }
+
+};
+
+// Trim leading whitespace from a string.
+//   Usage:
+//      string newStr =  LTrim(old_string);
+//
+struct LTrim {
+    LTrim(const string& orig) {
+        size_t ix=orig.find_first_not_of(" \t\n\r\b");
+        if (ix==string::npos)
+            _Result=orig;
+        else
+            _Result=orig.substr(ix);
+
+    }
+    string _Result;
+    operator const string&() const {
+        return _Result;
+    }
+};
+
+// FieldScanner provides allocation-free versions of the field conversions
+// above, working directly on StringRefs.  They accept exactly the inputs
+// ParseString accepts, and produce bit-identical values:
+//
+//  - leading " \t\n\r\b" is skipped, as LTrim does;
+//  - integers must be all digits and fit in a long long, as for std::stoll;
+//  - reals may only contain digits and '.', and convert the longest leading
+//    [digits][.digits] prefix, as std::stod does; overflow or underflow is
+//    rejected, as std::stod's out_of_range is.
+//
+// Empty or digit-free fields are rejected (std::stoll/std::stod would throw
+// invalid_argument for them).
+struct FieldScanner {
+    static StringRef LTrim(const StringRef& field) {
+        size_t ix=0;
+        while ( ix < field.Size() && IsLeadingSpace(field[ix]) )
+            ++ix;
+        return StringRef(field.Data()+ix, field.Size()-ix);
+    }
+
+    static bool ParseInt(const StringRef& rawField, long long& target) {
+        StringRef field=LTrim(rawField);
+        if (field.Empty())
+            return false;
+        unsigned long long value=0;
+        const unsigned long long limit=(unsigned long long)LLONG_MAX;
+        for (size_t i = 0; i < field.Size(); ++i) {
+            unsigned d=(unsigned)(field[i]-'0');
+            if (d > 9)
+                return false;
+            if (value > (limit-d)/10)
+                return false;   // Out of range.
+            value=value*10+d;
+        }
+        target=(long long)value;
+        return true;
+    }
+
+    static bool ParseDouble(const StringRef& rawField, double& target) {
+        StringRef field=LTrim(rawField);
+        const char* p=field.Data();
+        const char* end=p+field.Size();
+
+        // Validate the character set first, just as ParseString does:
+        for (const char* q = p; q < end; ++q) {
+            if ( !IsDigit(*q) && *q != '.' )
+                return false;
+        }
+
+        // Scan the convertible prefix: [digits][.digits]
+        unsigned long long mantissa=0;
+        int  sigDigits=0, fracDigits=0, nDigits=0;
+        bool exact=true;
+        const char* q=p;
+        for ( ; q < end && IsDigit(*q); ++q)
+            Accumulate(*q, mantissa, sigDigits, exact, nDigits);
+        if ( q < end && *q=='.' ) {
+            for (++q; q < end && IsDigit(*q); ++q) {
+                Accumulate(*q, mantissa, sigDigits, exact, nDigits);
+                ++fracDigits;
+            }
+        }
+        if (!nDigits)
+            return false;
+
+        // Fast path: both the mantissa and the power of ten are exactly
+        // representable, so one IEEE division is correctly rounded.
+        static const double pow10[] = {
+            1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+        };
+        if ( exact && mantissa <= (1ULL << 53) && fracDigits <= 22 ) {
+            target=(double)mantissa / pow10[fracDigits];
+            return true;
+        }
+
+        // Slow path: let strtod do the rounding, on a NUL-terminated copy.
+        string copy(p, q);
+        char* stop=0;
+        errno=0;
+        double value=strtod(copy.c_str(), &stop);
+        if (errno==ERANGE)
+            return false;
+        target=value;
+        return true;
+    }
+
+private:
+    static bool IsDigit(char c) {
+        return (c >= '0') && (c <= '9');
+    }
+
+    static bool IsLeadingSpace(char c) {
+        return c==' ' || c=='\t' || c=='\n' || c=='\r' || c=='\b';
+    }
+
+    // Folds one more digit into the mantissa.  Leading zeros aren't
+    // significant; past 19 significant digits the mantissa could overflow,
+    // so we stop and flag the value as needing the slow path.
+    static void Accumulate(char c, unsigned long long& mantissa, int& sigDigits, bool& exact, int& nDigits) {
+        ++nDigits;
+        if ( !sigDigits && c=='0' )
+            return;
+        if (++sigDigits > 19) {
+            exact=false;
+            return;
+        }
+        mantissa=mantissa*10+(unsigned)(c-'0');
+    }
+};
+
+// ParseString offers a few conversion functions which return false if
+// 'input' doesn't validate for the 'target' type.  Otherwise, the string
+// is converted and target is updated.
+class ParseString {
+public:
+    ParseString(const string& input, long long& target) :
+        _Ok(FieldScanner::ParseInt(input, target)) {
+    }
+
+    ParseString(const string& input, double & target) :
+        _Ok(FieldScanner::ParseDouble(input, target)) {
+    }
+
+    operator bool() const {
+        return _Ok;
+    }
+
+private:
+    bool _Ok;
+};
+
+
+// EquityFormatter renders the text form of an Equity straight into a char
+// buffer, producing exactly what iostreams would with std::fixed and
+// setprecision(3), but without the per-field stream and locale overhead.
+class EquityFormatter {
+public:
+    // Room for any number Fixed3() writes: DBL_MAX has 309 integer digits.
+    enum { NumberMax=320 };
+
+    // Writes 'v' with 3 decimals, as "%.3f" does, to 'out' (which must have
+    // NumberMax chars).  Returns the length written.
+    static size_t Fixed3(double v, char* out) {
+        // Scale to thousandths and round.  The scaling is off by at most half
+        // an ulp, so unless the result lands that close to a rounding
+        // boundary, it rounds the way the exact value would:
+        double scaled=std::fabs(v)*1000.0;
+        if ( !(scaled < 4503599627370496.0) )  // 2^52; also NaN and infinities
+            return Fallback(v, out);
+        double whole=std::floor(scaled);
+        double frac=scaled-whole;
+        if ( std::fabs(frac-0.5) <= scaled*2.3e-16 )
+            return Fallback(v, out);
+        uint64_t units=(uint64_t)whole + (frac > 0.5);
+
+        char digits[24];
+        char* p=digits+sizeof(digits);
+        for (int i = 0; i < 3; ++i, units /= 10)
+            *--p=(char)('0' + units % 10);
+        *--p='.';
+        do {
+            *--p=(char)('0' + units % 10);
+            units /= 10;
+        } while (units);
+        if (std::signbit(v))
+            *--p='-';
+        size_t len=digits+sizeof(digits)-p;
+        memcpy(out, p, len);
+        return len;
+    }
+
+    // Renders 'e' to 'buf', if it fits in 'size' chars.  Returns the length of
+    // the rendering either way, like snprintf() (but without a terminator).
+    static size_t Format(const Equity& e, char* buf, size_t size) {
+        return Format(e.GetEquityCode(), e.GetDescription(), e.GetPrice(), e.GetMarketCap(), e.GetPE_ratio(), buf, size);
+    }
+
+    // As above, for an equity's fields held elsewhere (see CompactEquityStore):
+    static size_t Format(const EquityCode& equityCode, const StringRef& desc, double priceValue,
+                         long long marketCap, double PE_ratio, char* buf, size_t size) {
+        char code[EquityCode::MaxLen+1], price[NumberMax], cap[NumberMax], pe[NumberMax];
+        size_t codeLen=equityCode.Format(code);
+        size_t priceLen=Fixed3(priceValue, price);
+        size_t capLen=Fixed3((double)marketCap/(double)1000000.0, cap);
+        size_t peLen=Fixed3(PE_ratio, pe);
+
+        size_t len=Text(0, "code: ") + codeLen + Text(0, " description: ") + desc.Size()
+                   + Text(0, " last price: ") + priceLen + Text(0, " market cap: ") + capLen
+                   + Text(0, " Million  P/E: ") + peLen;
+        if (len > size)
+            return len;
+        char* p=buf;
+        p += Text(p, "code: ");
+        p += Copy(p, code, codeLen);
+        p += Text(p, " description: ");
+        p += Copy(p, desc.Data(), desc.Size());
+        p += Text(p, " last price: ");
+        p += Copy(p, price, priceLen);
+        p += Text(p, " market cap: ");
+        p += Copy(p, cap, capLen);
+        p += Text(p, " Million  P/E: ");
+        p += Copy(p, pe, peLen);
+        return len;
+    }
+
+    // Returns the rendering of 'e', rendering it only the first time it's
+    // asked for.  Use this for records printed over and over: the text stays
+    // with the record, which is immutable, so repeat requests are a memcpy.
+    // Safe to call from several threads at once.
+    static StringRef Cached(const Equity& e) {
+        char* line=e._Rendered.load(std::memory_order_acquire);
+        if (!line) {
+            size_t len=Format(e, 0, 0);
+            char* fresh=new char[sizeof(size_t)+len];
+            Format(e, fresh+sizeof(size_t), len);
+            memcpy(fresh, &len, sizeof(len));
+            if (e._Rendered.compare_exchange_strong(line, fresh, std::memory_order_acq_rel))
+                line=fresh;
+            else
+                delete [] fresh;    // Another thread beat us to it
+        }
+        size_t len;
+        memcpy(&len, line, sizeof(len));
+        return StringRef(line+sizeof(size_t), len);
+    }
+
+    // Returns true if Cached() has rendered 'e' already:
+    static bool IsCached(const Equity& e) {
+        return e._Rendered.load(std::memory_order_acquire) != 0;
+    }
+
+    // Writes the rendering of 'e' to 'output', from the cache if it's there:
+    static std::ostream& Write(std::ostream& output, const Equity& e) {
+        if (IsCached(e))
+            return output << Cached(e);
+        char local[512];
+        size_t len=Format(e, local, sizeof(local));
+        if (len <= sizeof(local))
+            return output.write(local, len);
+        std::vector<char> big(len);
+        Format(e, &big[0], len);
+        return output.write(&big[0], len);
+    }
+
+private:
+    static size_t Fallback(double v, char* out) {
+        int len=snprintf(out, NumberMax, "%.3f", v);
+        return (len < 0) ? 0 : std::min((size_t)len, (size_t)NumberMax-1);
+    }
+
+    // Copies a literal, or just returns its length if 'dest' is null:
+    template <size_t N>
+    static size_t Text(char* dest, const char (&text)[N]) {
+        if (dest)
+            memcpy(dest, text, N-1);
+        return N-1;
+    }
+
+    static size_t Copy(char* dest, const char* src, size_t len) {
+        memcpy(dest, src, len);
+        return len;
+    }
+};
+
+//  Prints an Equity object to a stream:
+std::ostream& operator << (std::ostream& output, const Equity& val) {
+    return EquityFormatter::Write(output, val);
+}
+
+
+// OutputBuffer collects text for bulk output, such as a dump of every code or
+// every record in a range, so that it reaches a file descriptor in a few large
+// write()s rather than a line at a time.  The buffer is either its own storage,
+// which grows as needed and is kept between uses (see Clear()), or storage the
+// caller provides.  Bound to a file descriptor, a full buffer is flushed to it;
+// unbound, its own storage grows, and caller storage throws std::length_error.
+// Write errors throw std::runtime_error.
+class OutputBuffer {
+public:
+    enum { DefaultCapacity=64*1024 };
+
+    explicit OutputBuffer(int fd=-1, size_t capacity=DefaultCapacity) :
+        _Data(0), _Size(0), _Capacity(0), _Owned(true), _Fd(fd) {
+        Grow(capacity);
+    }
+
+    OutputBuffer(char* storage, size_t size, int fd=-1) :
+        _Data(storage), _Size(0), _Capacity(size), _Owned(false), _Fd(fd) {
+    }
+
+    // Flushes anything still buffered, if we're bound to a file descriptor.
+    // Call Flush() first to find out whether that worked.
+    ~OutputBuffer() {
+        try {
+            Flush();
+        }
+        catch (std::exception&) {
+        }
+        if (_Owned)
+            delete [] _Data;
+    }
+
+    // Says 'bytes' more are coming, so an unbound buffer, or one bound but
+    // with its own storage, can grow once to hold all of them and be written
+    // in one go.
+    void Expect(size_t bytes) {
+        if (_Owned && _Size+bytes > _Capacity)
+            Grow(_Size+bytes);
+    }
+
+    void Append(const char* data, size_t len) {
+        if (len > _Capacity-_Size && !MakeRoom(len)) {
+            // Bigger than caller storage: send it along with what we have.
+            WriteOut(data, len);
+            return;
+        }
+        memcpy(_Data+_Size, data, len);
+        _Size += len;
+    }
+
+    void Append(const StringRef& text) {
+        Append(text.Data(), text.Size());
+    }
+
+    void Append(char c) {
+        if (_Size==_Capacity)
+            MakeRoom(1);
+        _Data[_Size++]=c;
+    }
+
+    // Appends 'code' and a newline:
+    void AppendLine(const EquityCode& code) {
+        if (EquityCode::MaxLen+1 <= _Capacity-_Size) {
+            size_t len=code.Format(_Data+_Size);
+            _Data[_Size+len]='\n';
+            _Size += len+1;
+        }
+        else {
+            char buf[EquityCode::MaxLen+1];
+            size_t len=code.Format(buf);
+            buf[len]='\n';
+            Append(buf, len+1);
+        }
+    }
+
+    // Appends the rendering of 'e' (see EquityFormatter) and a newline:
+    void AppendLine(const Equity& e) {
+        if (EquityFormatter::IsCached(e)) {
+            Append(EquityFormatter::Cached(e));
+        }
+        else {
+            size_t room=_Capacity-_Size;
+            size_t len=EquityFormatter::Format(e, _Data+_Size, room);
+            if (len <= room)
+                _Size += len;
+            else if (MakeRoom(len))
+                _Size += EquityFormatter::Format(e, _Data+_Size, len);
+            else {
+                std::vector<char> big(len);
+                EquityFormatter::Format(e, &big[0], len);
+                WriteOut(&big[0], len);
+            }
+        }
+        Append('\n');
+    }
+
+    // Appends a line for each record in 'selection':
+    void AppendLines(const EquitySelection& selection) {
+        for (EquitySelection::const_iterator it=selection.begin(); it != selection.end(); ++it)
+            AppendLine(*it);
+    }
+
+    // Writes everything buffered to our file descriptor, if we have one:
+    void Flush() {
+        if (_Fd >= 0 && _Size)
+            WriteOut(0, 0);
+    }
+
+    // Forgets the contents, keeping the storage:
+    void Clear() {
+        _Size=0;
+    }
+
+    const char* Data() const {
+        return _Data;
+    }
+    size_t Size() const {
+        return _Size;
+    }
+
+private:
+    OutputBuffer(const OutputBuffer&);
+    void operator = (const OutputBuffer&);
+
+    // Frees up 'len' contiguous bytes, by flushing, growing, or both.  Returns
+    // false if caller storage is too small for it even when empty.
+    bool MakeRoom(size_t len) {
+        if (_Fd >= 0)
+            Flush();
+        else if (!_Owned)
+            throw std::length_error("OutputBuffer storage is full");
+        if (len <= _Capacity-_Size)
+            return true;
+        if (!_Owned)
+            return false;
+        Grow(std::max(_Size+len, 2*_Capacity));
+        return true;
+    }
+
+    void Grow(size_t capacity) {
+        char* data=new char[capacity];
+        if (_Size)
+            memcpy(data, _Data, _Size);
+        delete [] _Data;
+        _Data=data;
+        _Capacity=capacity;
+    }
+
+    // Writes the buffer, then 'len' bytes of 'extra', in a single writev() call
+    // (barring short writes), and empties the buffer.
+    void WriteOut(const char* extra, size_t len) {
+        struct iovec iov[2];
+        iov[0].iov_base=_Data;
+        iov[0].iov_len=_Size;
+        iov[1].iov_base=const_cast<char*>(extra);
+        iov[1].iov_len=len;
+        struct iovec* pending=iov;
+        int count= len ? 2 : 1;
+        while (count) {
+            ssize_t n=writev(_Fd, pending, count);
+            if (n < 0) {
+                if (errno==EINTR)
+                    continue;
+                throw std::runtime_error(string("OutputBuffer write failed: ") + strerror(errno));
+            }
+            // Skip whatever was written:
+            size_t done=(size_t)n;
+            while (count && done >= pending->iov_len) {
+                done -= pending->iov_len;
+                ++pending;
+                --count;
+            }
+            if (count) {
+                pending->iov_base=(char*)pending->iov_base+done;
+                pending->iov_len -= done;
+            }
+        }
+        _Size=0;
+    }
+
+    char*  _Data;
+    size_t _Size;
+    size_t _Capacity;
+    bool   _Owned;
+    int    _Fd;
+};
+
+
+// This class creates Equity objects by parsing a line of text formatted as
+// follows:
+//
+// HEADER:Code|Description|Market Cap|Price|P/E Ratio
+// IBMUS|International Business Machines|198657057012|182.95|11.18
+//
+//
+class EquityTextFactory {
+public:
+
+    // Bad records are reported to stdout, with diagnostics on stderr:
+    EquityTextFactory() : _Report(&cout), _Diag(&std::cerr) {
+    }
+
+    // As above, but reporting to the caller's streams instead:
+    EquityTextFactory(std::ostream& report, std::ostream& diag) : _Report(&report), _Diag(&diag) {
+    }
+
+    // Our field schema:
+    enum { F_EquityName=0, F_Description, F_MarketCap, F_Price, F_PE_ratio, F_COUNT };
+
+    // The fields of one parsed line.  Description refers into the line that
+    // was parsed, so a Record is only valid as long as that text is.
+    struct Record {
+        EquityCode Code;
+        StringRef  Description;
+        long long  MarketCap;
+        double     Price;
+        double     PE_ratio;
+    };
+
+    // Parse an Equity object from a line of text, using the field schema
+    // described above.   If the text cannot be parsed, the EquityPtr returned
     // will be null and "Not found" is printed to stdout.
     EquityPtr ParseEquity(const char* inputString) {
-        Equity tmp;
-        if (ParseEquity(inputString, tmp)) {
-            return EquityPtr(new Equity( tmp ));
+        return ParseEquity(StringRef(inputString, strlen(inputString)));
+    }
+
+    EquityPtr ParseEquity(const StringRef& line) {
+        Record rec;
+        if (ParseRecord(line, rec)) {
+            return EquityPtr(NewEquity(rec));
+        }
+        return EquityPtr();
+    }
+
+    // Parses a line into 'result' in place, without allocating.  Returns false,
+    // and reports the bad record, if the line doesn't validate.
+    bool ParseRecord(const StringRef& line, /*out*/ Record& result) const {
+
+        // Split the line into tokens, using '|' as a delimiter.
+        StringRef fields[F_COUNT];
+        if (!SplitFields(line, fields)) {
+            printBadRecordMsg(line);
+            return false;
+        }
+
+        // The EquityName field requires validation:
+        if (! parse_EquityName( fields[ F_EquityName ], result.Code )) {
+            printBadRecordMsg(line);
+            return false;
+        }
+
+        // We have no particular requirements for description validation:
+        result.Description = fields[ F_Description ];
+
+        // Parse the MarketCap, Price and PE_ratio fields:
+        if ( !FieldScanner::ParseInt( fields[ F_MarketCap ], result.MarketCap ) ||
+                !FieldScanner::ParseDouble( fields[ F_Price ], result.Price ) ||
+                !FieldScanner::ParseDouble( fields[ F_PE_ratio ], result.PE_ratio ) ) {
+            printBadRecordMsg(line);
+            return false;
+        }
+        return true;
+    }
+
+    // Builds a heap Equity from a parsed record.  If 'borrowDescription' is set,
+    // the Equity refers to the record's description text rather than copying
+    // it, so that text must outlive the Equity.
+    static Equity* NewEquity(const Record& rec, bool borrowDescription=false) {
+        Equity* e=new Equity;
+        e->_EquityName=rec.Code;
+        if (borrowDescription) {
+            e->_Description=rec.Description;
+        }
+        else {
+            e->_DescriptionText.assign(rec.Description.Data(), rec.Description.Size());
+            e->_Description=StringRef(e->_DescriptionText);
+        }
+        e->_MarketCap=rec.MarketCap;
+        e->_Price=rec.Price;
+        e->_PE_ratio=rec.PE_ratio;
+        return e;
+    }
+
+    // Builds an Equity from a parsed record in 'arena' storage, interning its
+    // description there unless 'borrowDescription' is set.  The EquityPtr
+    // shares ownership of the arena rather than owning the record.
+    static EquityPtr NewEquity(const Record& rec, const EquityArenaPtr& arena, bool borrowDescription=false) {
+        Equity* e=arena->Allocate();
+        e->_EquityName=rec.Code;
+        e->_Description= borrowDescription ? rec.Description : arena->Intern(rec.Description);
+        e->_MarketCap=rec.MarketCap;
+        e->_Price=rec.Price;
+        e->_PE_ratio=rec.PE_ratio;
+        return EquityPtr(arena, e);
+    }
+
+private:
+
+
+    void printBadRecordMsg(const StringRef& context) const {
+        FAST_LOOKUP_COUNT(Metrics::Counter_ParseRejects, 1);
+        *_Report << "Not found\n";
+        *_Diag << "Failed at " << context << std::endl;
+    }
+
+    std::ostream* _Report;
+    std::ostream* _Diag;
+
+    // Validates the EquityName against business rules: it must conform to:
+    //      1.  charset: [A-Z0-9]+
+    //      2.  length: 1 <= length <= 6 chars
+    // EquityCode::Parse enforces both while packing the code.
+    bool parse_EquityName( const StringRef& rawField, EquityCode& target ) const {
+        return EquityCode::Parse( rawField.Data(), rawField.Size(), target );
+    }
+
+    // Splits 'line' on '|' into exactly F_COUNT fields, returning false for any
+    // other count.  This matches StringSplitter's tokenizing, under which a
+    // single trailing '|' doesn't start another (empty) field.
+    static bool SplitFields(const StringRef& line, StringRef* fields) {
+        const char* p=line.Data();
+        const char* end=p+line.Size();
+        size_t n=0;
+        while (p < end) {
+            const char* bar=(const char*)memchr(p, '|', end-p);
+            const char* stop= bar ? bar : end;
+            if (n==(size_t)F_COUNT)
+                return false;
+            fields[n++]=StringRef(p, stop-p);
+            p= bar ? bar+1 : end;
+        }
+        return n==(size_t)F_COUNT;
+    }
+};
+
+
+// Given an input stream or filename, this class parses the stream and fills
+// the caller's EquityMap with Equity objects.   If a record error occurs, we
+// just print an error and skip it.  For other errors, we throw std::runtime_error
+//
+// Files are memory-mapped and parsed in place.  With Load_BorrowDescriptions,
+// each Equity's description refers directly into the mapping, which the
+// EquityMap and each such Equity (or the arena holding it) keep alive.
+//
+// With Load_Parallel, the text is cut into chunks at line boundaries and the
+// chunks are parsed on separate threads.  Each thread sorts its records by
+// code; the sorted chunks are merged in input order and bulk-inserted, so
+// duplicate codes resolve to the last line, just as in a sequential load.
+// Bad-record reports are buffered per chunk and written out in input order.
+//
+// With Load_Arena, records and their (interned) descriptions are allocated
+// in EquityArenas (one per thread in a parallel load), which the EquityMap
+// retains until it and every EquityPtr into it are gone.  Load_HugePages and
+// Load_HugePages1G back the arenas with huge pages (see HugePages), and have
+// the map's own arrays advised onto transparent huge pages as it's indexed.
+//
+class EquityLoader {
+public:
+    enum LoadFlags {
+        Load_Default=0,
+        Load_BorrowDescriptions=1,
+        Load_Parallel=2,
+        Load_Arena=4,       // Allocate records and descriptions in EquityArenas
+        Load_HugePages=8,   // Load_Arena, with 2MB pages for the arenas and map
+        Load_HugePages1G=16 // As above, with 1GB pages for the arenas
+    };
+
+    // 'threads' applies to Load_Parallel; 0 means one per hardware thread.
+    EquityLoader( const char* path, EquityMap& output, int flags=Load_Default, unsigned threads=0 ) {
+        flags=ApplyPageFlags(flags, output);
+        MappedFilePtr file;
+        {
+            FAST_LOOKUP_TIMED(Phase_Read);
+            file.reset( new MappedFile(path) );
+        }
+        // Borrowing equities share ownership of the mapping:
+        MappedFilePtr backing( (flags & Load_BorrowDescriptions) ? file : MappedFilePtr() );
+        if (flags & Load_Parallel)
+            LoadTextParallel( file->GetText(), output, flags, threads, backing );
+        else
+            LoadText( file->GetText(), output, flags, backing );
+        if (backing)
+            output.RetainBacking(backing);
+    }
+
+    // Stream loads read line by line, unless Load_Parallel or Load_Arena is
+    // given, in which case the whole stream is read into memory first.
+    // Load_BorrowDescriptions doesn't apply to streams.
+    EquityLoader( std::istream& input, EquityMap& output, int flags, unsigned threads=0 ) {
+        flags=ApplyPageFlags(flags, output);
+        if (flags & (Load_Parallel|Load_Arena)) {
+            string all;
+            {
+                FAST_LOOKUP_TIMED(Phase_Read);
+                std::ostringstream text;
+                text << input.rdbuf();
+                all=text.str();
+            }
+            flags &= ~Load_BorrowDescriptions;
+            if (flags & Load_Parallel)
+                LoadTextParallel( StringRef(all), output, flags, threads );
+            else
+                LoadText( StringRef(all), output, flags );
+        }
+        else {
+            EquityLoader( input, output );
+        }
+    }
+
+    EquityLoader( std::istream& input, EquityMap& output ) {
+
+        EquityTextFactory fact;
+
+        string header;
+        if (!std::getline(input,header)) {
+            throw std::runtime_error("No header line in input");
+        }
+        // Loop the input stream until end-of-file:
+        string line;
+
+        try {
+            while ( std::getline(input, line) ) {
+                try {
+                    EquityPtr newEquity;
+                    {
+                        FAST_LOOKUP_TIMED(Phase_Parse);
+                        newEquity=fact.ParseEquity( StringRef(line) );
+                    }
+                    if (!newEquity) {
+                        // If parse failed, keep going...
+                        continue;
+
+                    }
+
+                    // Save our new Equity object in the caller's collection:
+                    FAST_LOOKUP_TIMED(Phase_Insert);
+                    output.Insert(newEquity);
+                    FAST_LOOKUP_COUNT(Metrics::Counter_Inserts, 1);
+                }
+                catch (std::exception& e) {
+                    std::cerr << e.what() << std::endl;
+                }
+            }
+        }
+        catch (std::exception& e) {
+            std::cerr << e.what() << std::endl;
+        }
+
+    }
+
+private:
+    // Parses a whole buffer of input text, header line first.  Lines are split
+    // on '\n' exactly as std::getline would split them.  'file' is the mapping
+    // of 'text', if descriptions are borrowed from it.
+    static void LoadText( const StringRef& text, EquityMap& output, int flags, const MappedFilePtr& file=MappedFilePtr() ) {
+        const char* p=text.Data();
+        const char* end=p+text.Size();
+        if (p==end) {
+            throw std::runtime_error("No header line in input");
+        }
+        p=NextLine(p, end);
+
+        EquityArenaPtr arena( (flags & Load_Arena) ? new EquityArena(PagePolicy(flags)) : 0 );
+        if (arena && file)
+            arena->RetainBacking(file);
+        EquityTextFactory fact;
+        EquityTextFactory::Record rec;
+        while (p < end) {
+            const char* eol=(const char*)memchr(p, '\n', end-p);
+            StringRef line(p, (eol ? eol : end)-p);
+            p= eol ? eol+1 : end;
+
+            EquityPtr newEquity;
+            {
+                FAST_LOOKUP_TIMED(Phase_Parse);
+                if (!fact.ParseRecord(line, rec)) {
+                    // If parse failed, keep going...
+                    continue;
+                }
+                newEquity=MakeEquity(rec, flags, arena, file);
+            }
+            FAST_LOOKUP_TIMED(Phase_Insert);
+            output.Insert(newEquity);
+            FAST_LOOKUP_COUNT(Metrics::Counter_Inserts, 1);
+        }
+        if (arena)
+            output.RetainBacking(arena);
+    }
+
+    // The huge page flags imply Load_Arena, and have the map advise the
+    // kernel about its own arrays once they're built:
+    static int ApplyPageFlags( int flags, EquityMap& output ) {
+        if (flags & (Load_HugePages|Load_HugePages1G)) {
+            flags |= Load_Arena;
+            output.SetHugePages(true);
+        }
+        return flags;
+    }
+
+    static HugePages::Policy PagePolicy( int flags ) {
+        if (flags & Load_HugePages1G)
+            return HugePages::Pages_1GB;
+        return (flags & Load_HugePages) ? HugePages::Pages_2MB : HugePages::Pages_Default;
+    }
+
+    // Builds an Equity from a record according to the load flags.  An Equity
+    // borrowing its description from 'file' keeps the file mapped; in an
+    // arena, the arena does.
+    static EquityPtr MakeEquity( const EquityTextFactory::Record& rec, int flags, const EquityArenaPtr& arena,
+                                 const MappedFilePtr& file ) {
+        bool borrow=(flags & Load_BorrowDescriptions) != 0;
+        if (arena)
+            return EquityTextFactory::NewEquity(rec, arena, borrow);
+        if (borrow)
+            return EquityPtr( EquityTextFactory::NewEquity(rec, true), ReleaseBorrowed(file) );
+        return EquityPtr( EquityTextFactory::NewEquity(rec, false) );
+    }
+
+    // The deleter of a borrowing Equity, which holds its file until then:
+    struct ReleaseBorrowed {
+        explicit ReleaseBorrowed(const MappedFilePtr& file) : File(file) {
+        }
+
+        void operator () (Equity* e) const {
+            delete e;
+        }
+
+        MappedFilePtr File;
+    };
+
+    // Splits text after the header line into about 'threads' chunks ending on
+    // line boundaries, and parses them concurrently.
+    static void LoadTextParallel( const StringRef& text, EquityMap& output, int flags, unsigned threads,
+                                  const MappedFilePtr& file=MappedFilePtr() ) {
+        const char* p=text.Data();
+        const char* end=p+text.Size();
+        if (p==end) {
+            throw std::runtime_error("No header line in input");
+        }
+        p=NextLine(p, end);
+
+        // Small inputs aren't worth a thread each:
+        const size_t MinChunkBytes=256*1024;
+        if (!threads)
+            threads=std::max(1u, std::thread::hardware_concurrency());
+        size_t nChunks=std::max((size_t)1, std::min((size_t)threads, (size_t)(end-p)/MinChunkBytes));
+
+        std::vector<Chunk> chunks(nChunks);
+        for (size_t i = 0; i < nChunks; ++i) {
+            chunks[i].Begin= i ? chunks[i-1].End : p;
+            chunks[i].End= (i+1==nChunks) ? end
+                           : NextLine(std::max(chunks[i].Begin, p+(end-p)*(i+1)/nChunks), end);
+            chunks[i].Flags=flags;
+            chunks[i].File=file;
+            if (flags & Load_Arena) {
+                chunks[i].Arena.reset(new EquityArena(PagePolicy(flags)));
+                if (file)
+                    chunks[i].Arena->RetainBacking(file);
+            }
+        }
+
+        std::vector<std::thread> workers;
+        for (size_t i = 1; i < nChunks; ++i)
+            workers.push_back(std::thread(&Chunk::Parse, &chunks[i]));
+        chunks[0].Parse();
+        for (size_t i = 0; i < workers.size(); ++i)
+            workers[i].join();
+
+        // Report bad records in input order; merge the sorted chunks in input
+        // order too, so std::inplace_merge's stability keeps equal codes in
+        // line order.
+        std::vector<EquityPtr> all;
+        std::vector<size_t> bounds(1, 0);
+        for (size_t i = 0; i < nChunks; ++i) {
+            if (!chunks[i].Error.empty())
+                throw std::runtime_error(chunks[i].Error);
+            cout << chunks[i].Report.str();
+            std::cerr << chunks[i].Diag.str();
+            all.insert(all.end(), chunks[i].Parsed.begin(), chunks[i].Parsed.end());
+            if (chunks[i].Arena)
+                output.RetainBacking(chunks[i].Arena);
+            bounds.push_back(all.size());
+            std::vector<EquityPtr>().swap(chunks[i].Parsed);
+        }
+        for (size_t width = 1; width < nChunks; width *= 2) {
+            for (size_t i = 0; i+width < nChunks; i += 2*width) {
+                std::inplace_merge(all.begin()+bounds[i], all.begin()+bounds[i+width],
+                                   all.begin()+bounds[std::min(i+2*width, nChunks)], ByCode());
+            }
+        }
+        FAST_LOOKUP_TIMED(Phase_Insert);
+        output.InsertSorted(all);
+        FAST_LOOKUP_COUNT(Metrics::Counter_Inserts, all.size());
+    }
+
+    struct ByCode {
+        bool operator () (const EquityPtr& left, const EquityPtr& right) const {
+            return left->GetEquityCode() < right->GetEquityCode();
+        }
+    };
+
+    // One thread's share of a parallel load:
+    struct Chunk {
+        Chunk() : Begin(0), End(0), Flags(0) {
+        }
+
+        void Parse() {
+            try {
+                EquityTextFactory fact(Report, Diag);
+                EquityTextFactory::Record rec;
+                for (const char* p = Begin; p < End; ) {
+                    const char* eol=(const char*)memchr(p, '\n', End-p);
+                    StringRef line(p, (eol ? eol : End)-p);
+                    p= eol ? eol+1 : End;
+                    FAST_LOOKUP_TIMED(Phase_Parse);
+                    if (fact.ParseRecord(line, rec))
+                        Parsed.push_back( MakeEquity(rec, Flags, Arena, File) );
+                }
+                std::stable_sort(Parsed.begin(), Parsed.end(), ByCode());
+            }
+            catch (std::exception& e) {
+                // The loading thread rethrows this as a runtime_error:
+                Error=e.what();
+            }
+        }
+
+        const char*            Begin;
+        const char*            End;
+        int                    Flags;
+        EquityArenaPtr         Arena;     // if Load_Arena
+        MappedFilePtr          File;      // if Load_BorrowDescriptions
+        std::vector<EquityPtr> Parsed;
+        std::ostringstream     Report;
+        std::ostringstream     Diag;
+        string                 Error;
+    };
+
+    static const char* NextLine(const char* p, const char* end) {
+        const char* eol=(const char*)memchr(p, '\n', end-p);
+        return eol ? eol+1 : end;
+    }
+};
+
+
+// EquityMapFile saves an EquityMap, indexes included, in a binary snapshot
+// format which loads without parsing: a load maps the file, checks it, and
+// copies the column and index arrays straight into the map.  Descriptions
+// are used in place in the mapping, and the Equity records are rebuilt in
+// an EquityArena.
+//
+// Layout: a Header, then these sections, each padded to 8 bytes:
+//
+//      uint64_t  Code[Rows]            EquityCode::Packed(), in row order
+//      double    PE[Rows]
+//      double    Price[Rows]
+//      int64_t   MarketCap[Rows]
+//      uint64_t  DescriptionEnd[Rows]  end offset of each row's text in Strings
+//      char      Strings[StringBytes]
+//      uint32_t  SortedRows[Rows]      rows in code order
+//      uint32_t  PERows[Rows]          rows in P/E index order
+//      uint8_t   IndexCtrl[IndexSlots] EquityHashIndex control bytes
+//      uint64_t  IndexSlots[IndexSlots]
+//
+// Numbers are in the writer's native byte order, which the header records.
+// The checksum covers everything after the header.  Bump Version whenever
+// the layout, or anything the stored index depends on (such as
+// EquityHashIndex's hash function), changes.
+class EquityMapFile {
+public:
+    enum { Version=1 };
+
+    // Writes 'map' to 'path', via a temporary file which is renamed over
+    // 'path' once complete, so readers of an existing snapshot never see a
+    // partial one.  Throws a runtime_error on failure.
+    static void Save(const EquityMap& map, const char* path) {
+        map.BuildIndexes();
+        const EquityMap::Columns& cols=map._Columns;
+        const size_t n=map._Rows.size();
+        const EquityHashIndex& index=map._Index;
+
+        std::vector<uint64_t> ends(n);
+        string strings;
+        for (size_t i = 0; i < n; ++i) {
+            strings.append(cols.Description[i].Data(), cols.Description[i].Size());
+            ends[i]=strings.size();
+        }
+        std::vector<EquityMap::RowT> byPE;
+        map.PERows(byPE);
+
+        Header h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.Magic, MagicText, sizeof(h.Magic));
+        h.Version=Version;
+        h.ByteOrder=ByteOrderMark;
+        h.Rows=n;
+        h.StringBytes=strings.size();
+        h.IndexSlots=index._Ctrl.size();
+        h.IndexSize=index._Size;
+        h.LowestPE=map._LowestPE;
+        h.FileSize=ExpectedSize(h);
+
+        string tmp=string(path)+".tmp";
+        std::ofstream out(tmp.c_str(), std::ios::binary | std::ios::trunc);
+        if (!out)
+            throw std::runtime_error("Can't create " + tmp);
+        out.write((const char*)&h, sizeof(h));
+        Writer w(out);
+        w.Put(n ? &cols.Code[0] : 0, n*sizeof(uint64_t));
+        w.Put(n ? &cols.PE[0] : 0, n*sizeof(double));
+        w.Put(n ? &cols.Price[0] : 0, n*sizeof(double));
+        w.Put(n ? &cols.MarketCap[0] : 0, n*sizeof(long long));
+        w.Put(n ? &ends[0] : 0, n*sizeof(uint64_t));
+        w.Put(strings.data(), strings.size());
+        w.Put(n ? &map._Sorted[0] : 0, n*sizeof(EquityMap::RowT));
+        w.Put(n ? &byPE[0] : 0, n*sizeof(EquityMap::RowT));
+        w.Put(h.IndexSlots ? &index._Ctrl[0] : 0, index._Ctrl.size());
+        w.Put(h.IndexSlots ? &index._Slots[0] : 0, index._Slots.size()*sizeof(uint64_t));
+
+        h.Checksum=w.Sum();
+        out.seekp(0);
+        out.write((const char*)&h, sizeof(h));
+        out.close();
+        if (!out) {
+            remove(tmp.c_str());
+            throw std::runtime_error("Can't write " + tmp);
+        }
+        if (rename(tmp.c_str(), path) != 0) {
+            remove(tmp.c_str());
+            throw std::runtime_error(string("Can't replace ") + path);
+        }
+    }
+
+    // Loads the snapshot at 'path' into the empty map 'map'.  Throws a
+    // runtime_error if the file isn't a complete snapshot of this version.
+    static void Load(const char* path, EquityMap& map) {
+        if (map.Size())
+            throw std::logic_error("EquityMapFile::Load() needs an empty map");
+        MappedFilePtr file( new MappedFile(path, true) );
+        StringRef text=file->GetText();
+        if (text.Size() < sizeof(Header))
+            throw std::runtime_error("Snapshot file is truncated");
+        const Header& h=*(const Header*)text.Data();
+        if ( memcmp(h.Magic, MagicText, sizeof(h.Magic)) != 0 || h.ByteOrder != ByteOrderMark )
+            throw std::runtime_error("Not a snapshot file for this platform");
+        if (h.Version != Version)
+            throw std::runtime_error("Unsupported snapshot version");
+        if ( h.Rows >= EquityHashIndex::MaxRows || h.FileSize != text.Size() || ExpectedSize(h) != h.FileSize )
+            throw std::runtime_error("Snapshot file is truncated or inconsistent");
+        if ( Checksum((const uint64_t*)(text.Data()+sizeof(Header)), (h.FileSize-sizeof(Header))/8) != h.Checksum )
+            throw std::runtime_error("Snapshot checksum mismatch");
+
+        const size_t n=(size_t)h.Rows;
+        Reader r(text.Data()+sizeof(Header));
+        const uint64_t*        code=r.Take<uint64_t>(n);
+        const double*          pe=r.Take<double>(n);
+        const double*          price=r.Take<double>(n);
+        const long long*       cap=r.Take<long long>(n);
+        const uint64_t*        ends=r.Take<uint64_t>(n);
+        const char*            strings=r.Take<char>((size_t)h.StringBytes);
+        const EquityMap::RowT* sorted=r.Take<EquityMap::RowT>(n);
+        const EquityMap::RowT* byPE=r.Take<EquityMap::RowT>(n);
+        const uint8_t*         ctrl=r.Take<uint8_t>((size_t)h.IndexSlots);
+        const uint64_t*        slots=r.Take<uint64_t>((size_t)h.IndexSlots);
+
+        // The checksum catches damage, but not a consistent file written by
+        // something else, so check anything we'd index with:
+        size_t groups=(size_t)h.IndexSlots/EquityHashIndex::GroupSize;
+        if ( (n && !groups) || groups*EquityHashIndex::GroupSize != h.IndexSlots || (groups & (groups-1)) ||
+                h.IndexSize != n || (n && h.LowestPE >= n) )
+            throw std::runtime_error("Snapshot index is inconsistent");
+        for (size_t i = 0; i < n; ++i) {
+            if ( sorted[i] >= n || byPE[i] >= n || ends[i] > h.StringBytes || (i && ends[i] < ends[i-1]) )
+                throw std::runtime_error("Snapshot row data is inconsistent");
+        }
+        for (size_t i = 0; i < h.IndexSlots; ++i) {
+            if ( ctrl[i] != EquityHashIndex::Ctrl_Empty && (slots[i] & (EquityHashIndex::MaxRows-1)) >= n )
+                throw std::runtime_error("Snapshot index is inconsistent");
+        }
+
+        EquityMap::Columns& cols=map._Columns;
+        cols.Code.assign(code, code+n);
+        cols.PE.assign(pe, pe+n);
+        cols.Price.assign(price, price+n);
+        cols.MarketCap.assign(cap, cap+n);
+        cols.Description.resize(n);
+        map._Rows.resize(n);
+        map._ByPE.resize(n);
+
+        // Building the Equity records is most of the work, and first touch
+        // of the memory for them most of that, so big snapshots share it out
+        // between threads, each with its own arena:
+        const size_t MinRowsPerThread=64*1024;
+        size_t nThreads=std::max((size_t)1, std::min((size_t)std::max(1u, std::thread::hardware_concurrency()),
+                                                       n/MinRowsPerThread));
+        std::vector<RowBuilder> builders(nThreads);
+        for (size_t i = 0; i < nThreads; ++i) {
+            RowBuilder& b=builders[i];
+            b.Map=&map;
+            b.Code=code;
+            b.Ends=ends;
+            b.Strings=strings;
+            b.ByPE=byPE;
+            b.Begin=n*i/nThreads;
+            b.End=n*(i+1)/nThreads;
+            b.Arena.reset(new EquityArena);
+            // Descriptions borrow from the mapping, so EquityPtrs into the
+            // arena must keep it alive too:
+            b.Arena->RetainBacking(file);
+            b.Ok=true;
+        }
+        std::vector<std::thread> workers;
+        for (size_t i = 1; i < nThreads; ++i)
+            workers.push_back(std::thread(&RowBuilder::Build, &builders[i]));
+        builders[0].Build();
+        for (size_t i = 0; i < workers.size(); ++i)
+            workers[i].join();
+        for (size_t i = 0; i < nThreads; ++i) {
+            if (!builders[i].Ok)
+                throw std::runtime_error("Snapshot holds an invalid equity code");
+            map.RetainBacking(builders[i].Arena);
+        }
+
+        EquityHashIndex& index=map._Index;
+        index._Ctrl.assign(ctrl, ctrl+h.IndexSlots);
+        index._Slots.assign(slots, slots+h.IndexSlots);
+        index._Size=n;
+        index._GroupMask= groups ? groups-1 : 0;
+
+        map._Sorted.assign(sorted, sorted+n);
+        map._SortedValid=true;
+        map._ByPEMoved.clear();
+        map._ByPEStale.assign(n, 0);
+        map._ByPEFront=0;
+        map._LowestPE=(EquityMap::RowT)h.LowestPE;
+        map._ByPEValid=true;
+
+        map.RetainBacking(file);
+    }
+
+private:
+    static const char     MagicText[8];
+    static const uint32_t ByteOrderMark=0x01020304;
+
+    struct Header {
+        char     Magic[8];
+        uint32_t Version;
+        uint32_t ByteOrder;     // ByteOrderMark, as the writer stored it
+        uint64_t FileSize;
+        uint64_t Rows;
+        uint64_t StringBytes;
+        uint64_t IndexSlots;
+        uint64_t IndexSize;
+        uint64_t LowestPE;      // row
+        uint64_t Checksum;
+    };
+
+    static uint64_t Padded(uint64_t bytes) {
+        return (bytes+7) & ~(uint64_t)7;
+    }
+
+    static uint64_t ExpectedSize(const Header& h) {
+        return sizeof(Header) + 5*Padded(h.Rows*8) + Padded(h.StringBytes) +
+               2*Padded(h.Rows*sizeof(EquityMap::RowT)) + Padded(h.IndexSlots) + Padded(h.IndexSlots*8);
+    }
+
+    // A word-at-a-time multiplicative hash, which only has to catch damage.
+    // Word i goes into lane i%Lanes; independent lanes keep several
+    // multiplies in flight, for a rate of many GB/s.
+    enum { Lanes=4 };
+
+    static uint64_t Mix(uint64_t sum, uint64_t word) {
+        sum=(sum ^ word) * 0x9E3779B97F4A7C15ULL;
+        return sum ^ (sum >> 29);
+    }
+
+    static uint64_t Combine(const uint64_t* lanes) {
+        uint64_t sum=0;
+        for (int i = 0; i < Lanes; ++i)
+            sum=Mix(sum, lanes[i]);
+        return sum;
+    }
+
+    static uint64_t Checksum(const uint64_t* words, size_t n) {
+        uint64_t lanes[Lanes] = { 0, 0, 0, 0 };
+        size_t i=0;
+        for ( ; i+Lanes <= n; i += Lanes) {
+            for (int k = 0; k < Lanes; ++k)
+                lanes[k]=Mix(lanes[k], words[i+k]);
+        }
+        for ( ; i < n; ++i)
+            lanes[i % Lanes]=Mix(lanes[i % Lanes], words[i]);
+        return Combine(lanes);
+    }
+
+    // Writes zero-padded sections, checksumming as it goes:
+    class Writer {
+    public:
+        Writer(std::ostream& out) : _Out(out), _Words(0) {
+            memset(_Lanes, 0, sizeof(_Lanes));
+        }
+        void Put(const void* data, size_t bytes) {
+            const char* p=(const char*)data;
+            size_t whole=bytes & ~(size_t)7;
+            for (size_t i = 0; i < whole; i += 8) {
+                uint64_t word;
+                memcpy(&word, p+i, 8);
+                Add(word);
+            }
+            _Out.write(p, bytes);
+            if (bytes != whole) {
+                uint64_t word=0;
+                memcpy(&word, p+whole, bytes-whole);
+                Add(word);
+                _Out.write((const char*)&word+(bytes-whole), 8-(bytes-whole));
+            }
+        }
+        uint64_t Sum() const {
+            return Combine(_Lanes);
+        }
+    private:
+        void Add(uint64_t word) {
+            uint64_t& lane=_Lanes[_Words++ % Lanes];
+            lane=Mix(lane, word);
+        }
+        std::ostream& _Out;
+        uint64_t      _Lanes[Lanes];
+        size_t        _Words;
+    };
+
+    // Fills in rows [Begin,End) of a map being loaded, and the same range of
+    // its P/E index.  The columns must already be loaded.
+    struct RowBuilder {
+        void Build() {
+            EquityMap::Columns& cols=Map->_Columns;
+            EquityTextFactory::Record rec;
+            for (size_t i = Begin; i < End; ++i) {
+                size_t begin= i ? (size_t)Ends[i-1] : 0;
+                cols.Description[i]=StringRef(Strings+begin, (size_t)Ends[i]-begin);
+                rec.Description=cols.Description[i];
+                rec.MarketCap=cols.MarketCap[i];
+                rec.Price=cols.Price[i];
+                rec.PE_ratio=cols.PE[i];
+                if (!EquityCode::Unpack(Code[i], rec.Code)) {
+                    Ok=false;
+                    return;
+                }
+                Map->_Rows[i]=EquityMap::value_type(rec.Code, EquityTextFactory::NewEquity(rec, Arena, true));
+                Map->_ByPE[i]=Map->KeyOf(ByPE[i]);
+            }
+        }
+
+        EquityMap*             Map;
+        const uint64_t*        Code;
+        const uint64_t*        Ends;
+        const char*            Strings;
+        const EquityMap::RowT* ByPE;
+        size_t                 Begin;
+        size_t                 End;
+        EquityArenaPtr         Arena;
+        bool                   Ok;
+    };
+
+    // Steps through the sections of a mapped snapshot, whose size has been
+    // checked against the header:
+    class Reader {
+    public:
+        Reader(const char* p) : _Pos(p) {
+        }
+        template <class T>
+        const T* Take(size_t count) {
+            const T* section=(const T*)_Pos;
+            _Pos += Padded(count*sizeof(T));
+            return section;
+        }
+    private:
+        const char* _Pos;
+    };
+};
+
+const char EquityMapFile::MagicText[8] = { 'F', 'L', 'S', 'N', 'A', 'P', 0, 0 };
+
+
+// Compares two Equity objects, returning the one with the lowest P/E.  If
+// the objects have the same P/E, it returns the one with the lowest price.
+class LowestPE_filter final : public EquityFilter {
+public:
+    const Equity& Compare(const Equity& left, const Equity& right) const {
+        double l_pe=left.GetPE_ratio(),
+               r_pe=right.GetPE_ratio();
+        if (l_pe < r_pe)
+            return left;
+        if (r_pe < l_pe)
+            return right;
+        // Fall-through: the P/E ratios are equal, so return the one
+        // with the lowest price:
+        if ( left.GetPrice() < right.GetPrice() ) {
+            return left;
+        }
+        return right;
+    }
+};
+
+// Selects Equity objects by comparing their P/E ratio to a caller-defined [min,max] range.
+class PE_RangeFilter final : public EquityFilter {
+public:
+    PE_RangeFilter( double minPE, double maxPE ): _minPE(minPE),_maxPE(maxPE) {
+    }
+
+    bool Select( const Equity& elem ) const {
+        double pe=elem.GetPE_ratio();
+        if ((pe < _minPE) || (pe > _maxPE))
+            return false;
+        return true;
+    }
+
+private:
+    double _minPE;
+    double _maxPE;
+
+};
+
+// FilterExpr is the base of composable screening criteria.  A criterion can
+// test an Equity, like an EquityFilter's Select(), or row 'row' of a map's
+// columns, which is how EquityMap::SelectRows() evaluates a whole screen in
+// one pass.  Criteria combine with && and ||, e.g.
+//
+//      PE_Range(5, 15) && ( PriceRange(0, 50) || MarketCapRange(1000000000, LLONG_MAX) )
+//
+// Everything is resolved at compile time, so the combined test inlines.
+template <class Derived>
+struct FilterExpr {
+    const Derived& Self() const {
+        return static_cast<const Derived&>(*this);
+    }
+};
+
+// Selects values of one field in [min,max]:
+template <class T, std::vector<T> EquityMap::Columns::*Column, T (Equity::*Field)() const>
+class FieldRange : public FilterExpr< FieldRange<T, Column, Field> > {
+public:
+    FieldRange(T min, T max) : _Min(min), _Max(max) {
+    }
+    bool Select(const Equity& e) const {
+        return In((e.*Field)());
+    }
+    bool Select(const EquityMap::Columns& cols, size_t row) const {
+        return In((cols.*Column)[row]);
+    }
+private:
+    // Written as PE_RangeFilter is, so the two agree for every value:
+    bool In(T v) const {
+        return !( (v < _Min) || (v > _Max) );
+    }
+    T _Min;
+    T _Max;
+};
+
+typedef FieldRange<double, &EquityMap::Columns::PE, &Equity::GetPE_ratio>           PE_Range;
+typedef FieldRange<double, &EquityMap::Columns::Price, &Equity::GetPrice>           PriceRange;
+typedef FieldRange<long long, &EquityMap::Columns::MarketCap, &Equity::GetMarketCap> MarketCapRange;
+
+// Column tests combine with non-short-circuit & and |: the criteria are
+// cheap and branch-free, and evaluating both sides keeps it that way.
+template <class L, class R>
+class AndFilter : public FilterExpr< AndFilter<L, R> > {
+public:
+    AndFilter(const L& left, const R& right) : _Left(left), _Right(right) {
+    }
+    bool Select(const Equity& e) const {
+        return _Left.Select(e) && _Right.Select(e);
+    }
+    bool Select(const EquityMap::Columns& cols, size_t row) const {
+        return _Left.Select(cols, row) & _Right.Select(cols, row);
+    }
+private:
+    L _Left;
+    R _Right;
+};
+
+template <class L, class R>
+class OrFilter : public FilterExpr< OrFilter<L, R> > {
+public:
+    OrFilter(const L& left, const R& right) : _Left(left), _Right(right) {
+    }
+    bool Select(const Equity& e) const {
+        return _Left.Select(e) || _Right.Select(e);
+    }
+    bool Select(const EquityMap::Columns& cols, size_t row) const {
+        return _Left.Select(cols, row) | _Right.Select(cols, row);
+    }
+private:
+    L _Left;
+    R _Right;
+};
+
+template <class L, class R>
+AndFilter<L, R> operator && (const FilterExpr<L>& left, const FilterExpr<R>& right) {
+    return AndFilter<L, R>(left.Self(), right.Self());
+}
+
+template <class L, class R>
+OrFilter<L, R> operator || (const FilterExpr<L>& left, const FilterExpr<R>& right) {
+    return OrFilter<L, R>(left.Self(), right.Self());
+}
+
+// EpochDomain implements epoch-based reclamation for structures which are
+// read without locks and replaced by an atomic pointer swap.
+//
+// A reader brackets its accesses with an EpochDomain::Guard, which announces
+// the current global epoch in the reader thread's slot, and clears it on
+// exit.  A writer which has unpublished an object calls Synchronize(): that
+// advances the global epoch and waits until every reader that might still
+// see the old object has left its critical section.  Readers never wait and
+// never take a lock; only writers block.
+//
+// Each thread claims a slot on first use, from a lock-free list of slots
+// which are recycled when their threads exit.
+class EpochDomain {
+    // One per reader thread:
+    struct Slot {
+        Slot() : Epoch(0), InUse(true), Next(0), Depth(0) {
+        }
+        std::atomic<uint64_t> Epoch;    // 0 when quiescent
+        std::atomic<bool>     InUse;
+        Slot*                 Next;
+        unsigned              Depth;    // Only touched by the owning thread
+    };
+
+public:
+    static EpochDomain& Global() {
+        static EpochDomain domain;
+        return domain;
+    }
+
+    EpochDomain() : _Epoch(1), _Slots(0) {
+    }
+
+    // Marks the calling thread as reading for the guard's lifetime.  Guards
+    // may nest.
+    class Guard {
+    public:
+        Guard(EpochDomain& domain=EpochDomain::Global()) : _Slot(domain.LocalSlot()) {
+            if (_Slot->Depth++ == 0)
+                _Slot->Epoch.store(domain._Epoch.load(std::memory_order_relaxed), std::memory_order_seq_cst);
+        }
+        ~Guard() {
+            if (--_Slot->Depth == 0)
+                _Slot->Epoch.store(0, std::memory_order_release);
+        }
+    private:
+        Guard(const Guard&);
+        void operator = (const Guard&);
+
+        Slot* _Slot;
+    };
+
+    // Waits until no reader can still be using anything unpublished before
+    // this call.  Must not be called from inside a Guard.
+    void Synchronize() {
+        uint64_t target=_Epoch.fetch_add(1, std::memory_order_seq_cst)+1;
+        for (Slot* s = _Slots.load(std::memory_order_acquire); s; s=s->Next) {
+            for (;;) {
+                uint64_t e=s->Epoch.load(std::memory_order_seq_cst);
+                if ( e==0 || e >= target )
+                    break;
+                std::this_thread::yield();
+            }
+        }
+    }
+
+private:
+    // Releases the thread's slot for reuse when the thread exits:
+    struct SlotHolder {
+        SlotHolder() : _Slot(0) {
+        }
+        ~SlotHolder() {
+            if (_Slot)
+                _Slot->InUse.store(false, std::memory_order_release);
+        }
+        Slot* _Slot;
+    };
+
+    Slot* LocalSlot() {
+        static thread_local SlotHolder holder;
+        if (!holder._Slot)
+            holder._Slot=ClaimSlot();
+        return holder._Slot;
+    }
+
+    // Reuses a released slot if there is one, otherwise pushes a new one.
+    // Slots are never freed, so walking the list is always safe.
+    Slot* ClaimSlot() {
+        for (Slot* s = _Slots.load(std::memory_order_acquire); s; s=s->Next) {
+            bool expected=false;
+            if ( !s->InUse.load(std::memory_order_relaxed) &&
+                    s->InUse.compare_exchange_strong(expected, true, std::memory_order_acquire) )
+                return s;
+        }
+        Slot* s=new Slot;
+        s->Next=_Slots.load(std::memory_order_relaxed);
+        while (!_Slots.compare_exchange_weak(s->Next, s, std::memory_order_release, std::memory_order_relaxed))
+            ;
+        return s;
+    }
+
+    std::atomic<uint64_t> _Epoch;
+    std::atomic<Slot*>    _Slots;
+};
+
+
+// NumaTopology describes the machine's NUMA nodes and the CPUs of each, as
+// listed under /sys/devices/system/node.  Without those (a kernel built
+// without NUMA, or no sysfs), the whole machine is one node.  Nodes are
+// numbered densely from 0 in the order the kernel lists them; memory-only
+// nodes, having no CPUs to read from them, are left out.
+class NumaTopology {
+public:
+    // The topology of this machine, read on first use:
+    static const NumaTopology& Get() {
+        static NumaTopology topology;
+        return topology;
+    }
+
+    size_t Nodes() const {
+        return _CPUs.size();
+    }
+
+    const std::vector<unsigned>& CPUs(size_t node) const {
+        return _CPUs[node];
+    }
+
+    // Returns the node of 'cpu', or 0 for a CPU we don't know of:
+    size_t NodeOf(int cpu) const {
+        return (cpu >= 0 && (size_t)cpu < _NodeOf.size()) ? _NodeOf[cpu] : 0;
+    }
+
+    // Returns the node the calling thread is running on.  It may move, of
+    // course, so this is only a locality hint.
+    size_t CurrentNode() const {
+        return _CPUs.size()==1 ? 0 : NodeOf(sched_getcpu());
+    }
+
+    // Runs tasks[n] on a thread bound to the CPUs of node n, for every task
+    // at once, and waits for them all.  Memory a task allocates is first
+    // touched on its node, so with the kernel's default policy it comes from
+    // there.  Rethrows the first task's exception, if any.
+    void RunOnNodes(const std::vector< std::function<void()> >& tasks) const {
+        std::vector< std::packaged_task<void()> > jobs;
+        std::vector< std::future<void> > done;
+        for (size_t n = 0; n < tasks.size(); ++n) {
+            jobs.push_back( std::packaged_task<void()>(tasks[n]) );
+            done.push_back( jobs.back().get_future() );
+        }
+        std::vector<std::thread> workers;
+        for (size_t n = 0; n < jobs.size(); ++n)
+            workers.push_back( std::thread(&NumaTopology::RunBound, &_CPUs[n % _CPUs.size()], &jobs[n]) );
+        for (size_t n = 0; n < workers.size(); ++n)
+            workers[n].join();
+        for (size_t n = 0; n < done.size(); ++n)
+            done[n].get();
+    }
+
+    // Parses a kernel CPU or node list ("0-3,8-11") into 'cpus', in order.
+    // Returns false if the text is malformed.
+    static bool ParseCPUList(const StringRef& text, std::vector<unsigned>& cpus) {
+        cpus.clear();
+        size_t n=text.Size();
+        while (n && isspace((unsigned char)text[n-1]))
+            --n;
+        for (size_t i = 0; i < n; ) {
+            unsigned lo, hi;
+            if (!ParseNumber(text, i, n, lo))
+                return false;
+            hi=lo;
+            if ( i < n && text[i]=='-' && (!ParseNumber(text, ++i, n, hi) || hi < lo) )
+                return false;
+            if ( i < n && (text[i] != ',' || ++i==n) )
+                return false;
+            for (unsigned cpu = lo; cpu <= hi; ++cpu)
+                cpus.push_back(cpu);
+        }
+        return true;
+    }
+
+private:
+    NumaTopology() {
+        std::vector<unsigned> nodes;
+        if (ReadList("/sys/devices/system/node/online", nodes)) {
+            for (size_t i = 0; i < nodes.size(); ++i) {
+                char path[64];
+                snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", nodes[i]);
+                std::vector<unsigned> cpus;
+                if (ReadList(path, cpus) && !cpus.empty())
+                    _CPUs.push_back(cpus);
+            }
+        }
+        if (_CPUs.empty()) {
+            _CPUs.resize(1);
+            for (unsigned cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency()); ++cpu)
+                _CPUs[0].push_back(cpu);
+        }
+        for (size_t node = 0; node < _CPUs.size(); ++node) {
+            for (size_t i = 0; i < _CPUs[node].size(); ++i) {
+                unsigned cpu=_CPUs[node][i];
+                if (cpu >= _NodeOf.size())
+                    _NodeOf.resize(cpu+1, 0);
+                _NodeOf[cpu]=node;
+            }
+        }
+    }
+
+    NumaTopology(const NumaTopology&);
+    void operator = (const NumaTopology&);
+
+    static bool ReadList(const char* path, std::vector<unsigned>& list) {
+        std::ifstream in(path);
+        string text;
+        return std::getline(in, text) && ParseCPUList(StringRef(text), list);
+    }
+
+    // Parses the decimal number at text[i], advancing 'i' past it.  Numbers
+    // are bounded, so a bad range can't run away with us.
+    static bool ParseNumber(const StringRef& text, size_t& i, size_t n, unsigned& value) {
+        if (i==n || !isdigit((unsigned char)text[i]))
+            return false;
+        for (value=0; i < n && isdigit((unsigned char)text[i]); ++i) {
+            value=value*10 + (text[i]-'0');
+            if (value > CPU_SETSIZE*16)
+                return false;
+        }
+        return true;
+    }
+
+    // A failure to bind (e.g. in a restricted cpuset) costs locality, not
+    // correctness, so it isn't an error:
+    static void RunBound(const std::vector<unsigned>* cpus, std::packaged_task<void()>* job) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (size_t i = 0; i < cpus->size(); ++i) {
+            if ((*cpus)[i] < CPU_SETSIZE)
+                CPU_SET((*cpus)[i], &set);
+        }
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        (*job)();
+    }
+
+    std::vector< std::vector<unsigned> > _CPUs;     // by node
+    std::vector<size_t>                  _NodeOf;   // by CPU
+};
+
+
+// An EquitySnapshot is one immutable, fully indexed generation of the
+// service's data.  Readers reach it through an atomic pointer, under an
+// EpochDomain::Guard.  A reader which needs the snapshot to outlive its guard
+// (e.g. for a result view) takes a Pin() instead, which counts as an owner.
+//
+// A snapshot may also hold a replica of its map for each NUMA node, each
+// allocated on its own node (see EquityMap::DeepCopy()), so readers can
+// query memory local to them.
+class EquitySnapshot {
+public:
+    typedef shared_ptr<EquitySnapshot> Ptr;
+
+    // Creates an empty snapshot, ready to be filled:
+    static Ptr Create() {
+        Ptr snap(new EquitySnapshot);
+        snap->_Self=snap;
+        return snap;
+    }
+
+    EquityMap& GetMapForBuild() {
+        return _Map;
+    }
+
+    const EquityMap& GetMap() const {
+        return _Map;
+    }
+
+    // Returns the replica for the calling thread's NUMA node, or the map
+    // itself if there are no replicas:
+    const EquityMap& GetLocalMap() const {
+        if (_Replicas.empty())
+            return _Map;
+        size_t node=NumaTopology::Get().CurrentNode();
+        return node < _Replicas.size() ? *_Replicas[node] : _Map;
+    }
+
+    // Replicas by node; empty, or one per NumaTopology node:
+    const std::vector< shared_ptr<EquityMap> >& GetReplicas() const {
+        return _Replicas;
+    }
+
+    std::vector< shared_ptr<EquityMap> >& GetReplicasForBuild() {
+        return _Replicas;
+    }
+
+    // Returns an owning reference to this snapshot.  Lock-free; safe inside
+    // a Guard, since the snapshot can't be reclaimed until the guard exits.
+    shared_ptr<const void> Pin() const {
+        return shared_ptr<const void>(_Self.lock());
+    }
+
+private:
+    EquitySnapshot() {
+    }
+
+    EquityMap                    _Map;
+    std::vector< shared_ptr<EquityMap> > _Replicas;
+    std::weak_ptr<EquitySnapshot> _Self;
+};
+
+
+// EquityService owns the service's data and provides application-level query
+// interfaces.
+//
+// The data lives in an immutable EquitySnapshot.  initialize() and reload()
+// build a complete new snapshot (map plus indexes) off to the side and then
+// publish it with an atomic pointer swap; the old snapshot is reclaimed once
+// every reader that could see it has finished (see EpochDomain), or later,
+// if result views still pin it.  The query methods are lock-free and may be
+// called from any number of threads, including during a reload.  Writers
+// (initialize/reload/applyUpdates) are serialized with each other.
+//
+// applyUpdates() keeps a standby replica of the published snapshot: a batch
+// is applied to the standby, which is then published, and once readers have
+// left the old snapshot the same batch is applied to that, making it the new
+// standby.  So a tick costs two O(log n) index updates rather than a rebuild.
+// The replica is made by cloning the published map on the first batch after
+// a load, or when the old snapshot is still pinned by a result view.
+//
+// With setNumaReplicas(), each published snapshot also gets a copy of the
+// data on every NUMA node, and readers query the copy on their own node.
+// The copies are rebuilt with each load and kept up to date by
+// applyUpdates(), at the cost of a full copy of the data per node.
+//
+class EquityService {
+public:
+    EquityService() : _Current(0), _NumaReplicas(false) {
+        Publish(EquitySnapshot::Create());
+    }
+
+    ~EquityService() {
+        WaitForReload();
+        // No readers may outlive the service, so there's nothing to wait for.
+        _Current.store(0);
+    }
+
+    // initialize() loads all security data from stdin, replacing any data
+    // already loaded.  Returns false, leaving the old data in place, on failure.
+    bool initialize(std::istream& input=std::cin) {
+        return initialize(input, EquityLoader::Load_Default);
+    }
+
+    // As above, with EquityLoader flags (e.g. Load_Parallel):
+    bool initialize(std::istream& input, int flags, unsigned threads=0) {
+        FAST_LOOKUP_TIMED(Op_Initialize);
+        std::lock_guard<std::mutex> lock(_WriterLock);
+        try {
+            EquitySnapshot::Ptr snap=EquitySnapshot::Create();
+            if (flags==EquityLoader::Load_Default)
+                EquityLoader( input, snap->GetMapForBuild() );
+            else
+                EquityLoader( input, snap->GetMapForBuild(), flags, threads );
+            return Publish(snap);
+        }
+        catch (...) {
+            std::cerr << "EquityService.initialize() failed" << std::endl;
+            return false;
+        }
+    }
+
+    // initialize() variant which loads a memory-mapped file, optionally keeping
+    // descriptions as views into the mapping or parsing in parallel (see
+    // EquityLoader):
+    bool initialize(const char* path, int flags=EquityLoader::Load_Default, unsigned threads=0) {
+        FAST_LOOKUP_TIMED(Op_Initialize);
+        std::lock_guard<std::mutex> lock(_WriterLock);
+        try {
+            EquitySnapshot::Ptr snap=EquitySnapshot::Create();
+            EquityLoader( path, snap->GetMapForBuild(), flags, threads );
+            return Publish(snap);
+        }
+        catch (...) {
+            std::cerr << "EquityService.initialize() failed" << std::endl;
+            return false;
+        }
+    }
+
+    // Writes the current data, indexes included, to a binary snapshot file
+    // (see EquityMapFile).  Returns false on failure.
+    bool saveSnapshot(const char* path) const {
+        FAST_LOOKUP_TIMED(Op_SaveSnapshot);
+        // Pin the data rather than holding a read guard through the I/O,
+        // which would hold up writers' reclamation:
+        const EquityMap* map;
+        shared_ptr<const void> pin;
+        {
+            ReadGuard snap(*this);
+            map=&*snap;
+            pin=snap.Pin();
+        }
+        try {
+            EquityMapFile::Save(*map, path);
+            return true;
+        }
+        catch (std::exception& e) {
+            std::cerr << "EquityService.saveSnapshot() failed: " << e.what() << std::endl;
+            return false;
+        }
+    }
+
+    // Replaces the current data with a snapshot written by saveSnapshot().
+    // Returns false, leaving the old data in place, on failure.
+    bool loadSnapshot(const char* path) {
+        FAST_LOOKUP_TIMED(Op_LoadSnapshot);
+        std::lock_guard<std::mutex> lock(_WriterLock);
+        try {
+            EquitySnapshot::Ptr snap=EquitySnapshot::Create();
+            EquityMapFile::Load( path, snap->GetMapForBuild() );
+            return Publish(snap);
+        }
+        catch (std::exception& e) {
+            std::cerr << "EquityService.loadSnapshot() failed: " << e.what() << std::endl;
+            return false;
+        }
+    }
+
+    // Reloads from 'path' on a background thread, as initialize() does.
+    // Queries keep being served from the current data until the new snapshot
+    // is published.  The future's value is the load's success.
+    std::shared_future<bool> reload(const string& path, int flags=EquityLoader::Load_Default, unsigned threads=0) {
+        std::lock_guard<std::mutex> lock(_ReloadLock);
+        _Reload=std::async(std::launch::async, &EquityService::ReloadFrom, this, path, flags, threads).share();
+        return _Reload;
+    }
+
+    // Turns per-node replicas of the data on or off, from the next load on.
+    void setNumaReplicas(bool on) {
+        std::lock_guard<std::mutex> lock(_WriterLock);
+        _NumaReplicas=on;
+    }
+
+    // Waits for the most recent reload(), if any, to finish.
+    void WaitForReload() {
+        std::shared_future<bool> pending;
+        {
+            std::lock_guard<std::mutex> lock(_ReloadLock);
+            pending=_Reload;
+        }
+        if (pending.valid())
+            pending.wait();
+    }
+
+    // Applies a batch of price/P/E/market cap updates to equities which are
+    // already loaded; updates for other codes are ignored.  Readers see the
+    // whole batch at once.  Returns the number of updates applied.
+    size_t applyUpdates(const std::vector<EquityUpdate>& batch) {
+        FAST_LOOKUP_TIMED(Op_ApplyUpdates);
+        std::lock_guard<std::mutex> lock(_WriterLock);
+        if (!Unshared(_Standby)) {
+            _Standby=EquitySnapshot::Create();
+            _Published->GetMap().Clone(_Standby->GetMapForBuild());
+            CloneReplicas(*_Published, *_Standby);
+        }
+
+        std::vector<EquityPtr> applied;
+        applied.reserve(batch.size());
+        EquityMap& standby=_Standby->GetMapForBuild();
+        for (size_t i = 0; i < batch.size(); ++i) {
+            EquityPtr e=standby.ApplyUpdate(batch[i]);
+            if (e)
+                applied.push_back(e);
+        }
+        FAST_LOOKUP_COUNT(Metrics::Counter_Updates, applied.size());
+        if (applied.empty())
+            return 0;
+        ReplayOnReplicas(*_Standby, applied);
+
+        _Standby=Exchange(_Standby);
+        if (Unshared(_Standby)) {
+            // Replay the batch, sharing the updated Equity objects:
+            EquityMap& replica=_Standby->GetMapForBuild();
+            for (size_t i = 0; i < applied.size(); ++i)
+                replica.Insert(applied[i]);
+            ReplayOnReplicas(*_Standby, applied);
+        }
+        else {
+            _Standby.reset();   // Pinned, so it can't be updated; clone next time.
+        }
+        return applied.size();
+    }
+
+    // Returns an EquityPtr containing attributes of the given equity.  EquityPtr
+    // will be null if equityName not found, and 'status', if given, says
+    // whether it wasn't found or wasn't a valid code.  A miss costs no more
+    // than a hit.
+    EquityPtr getSecurityInfo(const char* equityName, LookupStatus* status=0) const {
+        FAST_LOOKUP_TIMED(Op_GetSecurityInfo);
+        ReadGuard snap(*this);
+#ifdef _COMPILE_METRICS
+        LookupStatus st;
+        EquityPtr e=snap->TryFind(equityName, &st);
+        Metrics::Count(Metrics::LookupCounter(st));
+        if (status)
+            *status=st;
+        return e;
+#else
+        return snap->TryFind(equityName, status);
+#endif
+    }
+
+    // As above, for a code that has already been parsed:
+    EquityPtr getSecurityInfo(const EquityCode& equityCode, LookupStatus* status=0) const {
+        FAST_LOOKUP_TIMED(Op_GetSecurityInfo);
+        ReadGuard snap(*this);
+#ifdef _COMPILE_METRICS
+        LookupStatus st;
+        EquityPtr e=snap->TryFind(equityCode, &st);
+        Metrics::Count(Metrics::LookupCounter(st));
+        if (status)
+            *status=st;
+        return e;
+#else
+        return snap->TryFind(equityCode, status);
+#endif
+    }
+
+    // Looks up every code in 'codes', storing the results in the matching
+    // elements of 'result', which is resized to fit.  Codes not found, or not
+    // valid, give null EquityPtrs; if 'status' is given, it's filled in with
+    // the reason for each.  The whole batch is answered from one snapshot.
+    // Returns the number found.
+    size_t getSecurityInfoBatch( const std::vector<string>& codes, std::vector<EquityPtr>& result,
+                                 std::vector<LookupStatus>* status=0 ) const {
+        // Invalid codes are left null, which never matches:
+        std::vector<EquityCode> parsed(codes.size());
+        for (size_t i = 0; i < codes.size(); ++i)
+            EquityCode::Parse(codes[i], parsed[i]);
+        return getSecurityInfoBatch(parsed, result, status);
+    }
+
+    // As above, for codes that have already been parsed.  A null code is
+    // reported as Lookup_InvalidCode.
+    size_t getSecurityInfoBatch( const std::vector<EquityCode>& codes, std::vector<EquityPtr>& result,
+                                 std::vector<LookupStatus>* status=0 ) const {
+        FAST_LOOKUP_TIMED(Op_GetSecurityInfoBatch);
+        ReadGuard snap(*this);
+        std::vector<EquityMap::RowT> rows(codes.size());
+        if (!codes.empty())
+            snap->FindRows(&codes[0], codes.size(), &rows[0]);
+
+        // Prefetch the rows we found before copying their pointers out:
+        for (size_t i = 0; i < rows.size(); ++i) {
+            if (rows[i] != EquityHashIndex::NotFound)
+                __builtin_prefetch(&snap->GetRow(rows[i]));
+        }
+        result.resize(codes.size());
+        if (status)
+            status->resize(codes.size());
+        size_t found=0;
+        for (size_t i = 0; i < rows.size(); ++i) {
+            LookupStatus st;
+            if (rows[i] != EquityHashIndex::NotFound) {
+                result[i]=snap->GetRow(rows[i]);
+                st=Lookup_Found;
+                ++found;
+            }
+            else {
+                result[i].reset();
+                st= codes[i].IsNull() ? Lookup_InvalidCode : Lookup_NotFound;
+            }
+            if (status)
+                (*status)[i]=st;
+            FAST_LOOKUP_COUNT(Metrics::LookupCounter(st), 1);
+        }
+        return found;
+    }
+
+    // Returns all security names, ordered alphabetically:
+    string allSecurityCodes() const {
+
+        // Our Map iterates its elements ordered by packed EquityCode, whose
+        // integer ordering matches the std::string operator '<' on the code
+        // text.  So all we have to do is build a string with one equity name
+        // per line, sized exactly up front.
+
+        FAST_LOOKUP_TIMED(Op_AllSecurityCodes);
+        ReadGuard snap(*this);
+        EquityCodeList codes(*snap);
+        string result;
+        result.reserve(codes.TextSize());
+        char buf[EquityCode::MaxLen+1];
+        for (EquityCodeList::const_iterator it=codes.begin(); it != codes.end(); ++it) {
+            result.append(buf, it->Format(buf));
+            result += '\n';
+        }
+        return result;
+    }
+
+    // Appends all security names to 'out', one per line, ordered
+    // alphabetically.  'out' is told the exact size up front, so a buffer
+    // with its own storage writes the lot at once.  Returns the number of
+    // codes written.
+    size_t writeSecurityCodes( OutputBuffer& out ) const {
+        FAST_LOOKUP_TIMED(Op_WriteSecurityCodes);
+        ReadGuard snap(*this);
+        EquityCodeList codes(*snap);
+        out.Expect(codes.TextSize());
+        for (EquityCodeList::const_iterator it=codes.begin(); it != codes.end(); ++it)
+            out.AppendLine(*it);
+        return codes.Size();
+    }
+
+    // Appends a line to 'out' for each Equity whose P/E is in the range
+    // specified, in code order.  Returns the number of matches.
+    int writePERange( double min_pe, double max_pe, OutputBuffer& out ) const {
+        EquitySelection selected;
+        int count=getPERange( min_pe, max_pe, selected );
+        out.AppendLines(selected);
+        return count;
+    }
+
+    // Returns a lazily-generated view of all security codes, ordered
+    // alphabetically.  The view pins the data it was taken from.
+    EquityCodeList securityCodes() const {
+        ReadGuard snap(*this);
+        return EquityCodeList(*snap, snap.Pin());
+    }
+
+    // Returns the name of the security with the lowest P/E ratio:
+    string lowestPE() const {
+        FAST_LOOKUP_TIMED(Op_LowestPE);
+        ReadGuard snap(*this);
+        const EquityPtr result=snap->FindLowestPE();
+        if (result) {
+            return result->GetEquityName();
+        }
+        return "";
+    }
+
+    // Fills 'result' with a view of the Equity objects whose P/E values are in
+    // the range specified, in code order or P/E order.  Returns the number of
+    // matches.  The view pins the data it was taken from.
+    int getPERange( double min_pe, double max_pe, EquitySelection& result,
+                    EquityMap::ResultOrder order=EquityMap::Order_Code ) const {
+        FAST_LOOKUP_TIMED(Op_GetPERange);
+        ReadGuard snap(*this);
+        return (int)snap->SelectRowsByPERange( min_pe, max_pe, result.Reset(&*snap, snap.Pin()), order );
+    }
+
+    // As getPERange() in code order, for several ranges at once, all answered
+    // from one snapshot (see EquityMap::SelectRowsByPERanges()): results[i]
+    // gets a view of the matches for ranges[i].
+    void getPERanges( const std::vector<EquityMap::PERange>& ranges, std::vector<EquitySelection>& results ) const {
+        FAST_LOOKUP_TIMED(Op_GetPERange);
+        ReadGuard snap(*this);
+        std::vector< std::vector<EquityMap::RowT> > rows;
+        snap->SelectRowsByPERanges(ranges, rows);
+        shared_ptr<const void> pin=snap.Pin();
+        results.resize(ranges.size());
+        for (size_t i = 0; i < ranges.size(); ++i)
+            results[i].Reset(&*snap, pin).swap(rows[i]);
+    }
+
+    // Fills 'result' with a view of the first 'limit' Equity objects, in code
+    // order, whose codes start with 'prefix' ("AAP" for "AAP*").  Returns the
+    // number of matches.  An invalid prefix matches nothing.
+    int findByCodePrefix( const StringRef& prefix, size_t limit, EquitySelection& result ) const {
+        FAST_LOOKUP_TIMED(Op_FindByCode);
+        ReadGuard snap(*this);
+        return (int)snap->SelectRowsByCodePrefix( prefix, result.Reset(&*snap, snap.Pin()), limit );
+    }
+
+    // As above, for codes which end with 'suffix' ("HK" for "*HK"):
+    int findByCodeSuffix( const StringRef& suffix, size_t limit, EquitySelection& result ) const {
+        FAST_LOOKUP_TIMED(Op_FindByCode);
+        ReadGuard snap(*this);
+        return (int)snap->SelectRowsByCodeSuffix( suffix, result.Reset(&*snap, snap.Pin()), limit );
+    }
+
+    // Fills 'result' with a view of the first 'limit' Equity objects, in code
+    // order, whose descriptions contain every word of 'text', whole or in
+    // part, ignoring case ("china mob").  Returns the number of matches.
+    int findByDescription( const StringRef& text, size_t limit, EquitySelection& result ) const {
+        FAST_LOOKUP_TIMED(Op_FindByDescription);
+        ReadGuard snap(*this);
+        return (int)snap->SelectRowsByDescription( text, result.Reset(&*snap, snap.Pin()), limit );
+    }
+
+    // Fills 'result' with a view of the Equity objects which 'filter' (a
+    // FilterExpr) selects, in code order or P/E order.  Returns the number of
+    // matches.  All the criteria are checked in a single pass.
+    template <class F>
+    int screen( const F& filter, EquitySelection& result,
+                EquityMap::ResultOrder order=EquityMap::Order_Code ) const {
+        FAST_LOOKUP_TIMED(Op_Screen);
+        ReadGuard snap(*this);
+        return (int)snap->SelectRows( filter, result.Reset(&*snap, snap.Pin()), order );
+    }
+
+    // Fills 'result' with a view of the Equity objects 'query' selects, in its
+    // order and up to its limit.  Returns the number of matches.
+    int query( const EquityQuery& query, EquitySelection& result ) const {
+        FAST_LOOKUP_TIMED(Op_Query);
+        ReadGuard snap(*this);
+        return (int)snap->Query( query, result.Reset(&*snap, snap.Pin()) );
+    }
+
+    // Returns the number of Equity objects 'query' would select:
+    size_t count( const EquityQuery& query ) const {
+        FAST_LOOKUP_TIMED(Op_Count);
+        ReadGuard snap(*this);
+        return snap->Count(query);
+    }
+
+    // Writes the metrics recorded so far (see Metrics), as Prometheus text or
+    // as a readable summary.  Returns false, writing nothing, if this build
+    // doesn't collect metrics.
+    bool writeMetrics( std::ostream& out, bool prometheus=true ) const {
+#ifdef _COMPILE_METRICS
+        if (prometheus)
+            Metrics::WritePrometheus(out);
+        else
+            Metrics::WriteSummary(out);
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    // Returns the number of Equity objects whose P/E values are in the range specified,
+    // adding them to caller's collection.
+    int getPERange( double min_pe, double max_pe, EquityMap& result ) const {
+        EquitySelection selected;
+        getPERange( min_pe, max_pe, selected );
+        result.Reserve(result.Size()+selected.Size());
+        for (size_t i = 0; i < selected.Size(); ++i)
+            result.Insert(selected.GetPtr(i));
+        return (int)selected.Size();
+    }
+
+    // As above, appending the matches to 'result' in either code order (as the
+    // EquityMap overload does) or P/E order.
+    int getPERange( double min_pe, double max_pe, std::vector<EquityPtr>& result,
+                    EquityMap::ResultOrder order=EquityMap::Order_Code ) const {
+        EquitySelection selected;
+        getPERange( min_pe, max_pe, selected, order );
+        result.reserve(result.size()+selected.Size());
+        for (size_t i = 0; i < selected.Size(); ++i)
+            result.push_back(selected.GetPtr(i));
+        return (int)selected.Size();
+    }
+
+private:
+    EquityService(const EquityService&);
+    void operator = (const EquityService&);
+
+    // Gives a reader lock-free access to the current snapshot's map for the
+    // guard's lifetime:
+    class ReadGuard {
+    public:
+        ReadGuard(const EquityService& srv) :
+            _Snap(srv._Current.load(std::memory_order_seq_cst)), _Map(&_Snap->GetLocalMap()) {
+        }
+        const EquityMap* operator -> () const {
+            return _Map;
+        }
+        const EquityMap& operator * () const {
+            return *_Map;
+        }
+        shared_ptr<const void> Pin() const {
+            return _Snap->Pin();
+        }
+    private:
+        // Declared first, so we're inside the epoch before loading _Current:
+        EpochDomain::Guard    _Epoch;
+        const EquitySnapshot* _Snap;
+        const EquityMap*      _Map;     // _Snap's map for our node
+    };
+
+    bool ReloadFrom(const string& path, int flags, unsigned threads) {
+        return initialize(path.c_str(), flags, threads);
+    }
+
+    // Finishes building 'snap', swaps it in, and reclaims the old snapshot
+    // once no reader can still be looking at it.  Requires _WriterLock,
+    // except from the constructor.
+    bool Publish(const EquitySnapshot::Ptr& snap) {
+        snap->GetMap().BuildIndexes();
+        if (_NumaReplicas)
+            BuildReplicas(*snap);
+        _Standby.reset();
+        Exchange(snap);     // The old snapshot is freed now, unless a pinned view holds it.
+        return true;
+    }
+
+    // Gives 'snap' a deep copy of its map on each NUMA node, built there:
+    static void BuildReplicas(EquitySnapshot& snap) {
+        std::vector< shared_ptr<EquityMap> >& replicas=snap.GetReplicasForBuild();
+        std::vector< std::function<void()> > tasks;
+        replicas.resize(NumaTopology::Get().Nodes());
+        for (size_t n = 0; n < replicas.size(); ++n) {
+            replicas[n].reset(new EquityMap);
+            tasks.push_back( std::bind(&EquityMap::DeepCopy, &snap.GetMap(), std::ref(*replicas[n])) );
+        }
+        NumaTopology::Get().RunOnNodes(tasks);
+    }
+
+    // Gives the new standby 'to' shallow clones of the replicas of 'from',
+    // each made on its own node:
+    static void CloneReplicas(const EquitySnapshot& from, EquitySnapshot& to) {
+        const std::vector< shared_ptr<EquityMap> >& source=from.GetReplicas();
+        std::vector< shared_ptr<EquityMap> >& replicas=to.GetReplicasForBuild();
+        std::vector< std::function<void()> > tasks;
+        replicas.resize(source.size());
+        for (size_t n = 0; n < replicas.size(); ++n) {
+            replicas[n].reset(new EquityMap);
+            tasks.push_back( std::bind(&EquityMap::Clone, source[n].get(), std::ref(*replicas[n])) );
+        }
+        if (!tasks.empty())
+            NumaTopology::Get().RunOnNodes(tasks);
+    }
+
+    // Applies a batch already applied to the map of 'snap' to its replicas,
+    // sharing the updated Equity objects:
+    static void ReplayOnReplicas(EquitySnapshot& snap, const std::vector<EquityPtr>& applied) {
+        std::vector< shared_ptr<EquityMap> >& replicas=snap.GetReplicasForBuild();
+        for (size_t n = 0; n < replicas.size(); ++n) {
+            for (size_t i = 0; i < applied.size(); ++i)
+                replicas[n]->Insert(applied[i]);
+        }
+    }
+
+    // Swaps 'snap' in, and returns the old snapshot once no reader can still
+    // be looking at it.  Requires _WriterLock, as above.
+    EquitySnapshot::Ptr Exchange(const EquitySnapshot::Ptr& snap) {
+        EquitySnapshot::Ptr old=_Published;
+        _Published=snap;
+        _Current.store(snap.get(), std::memory_order_seq_cst);
+        if (old)
+            EpochDomain::Global().Synchronize();
+        return old;
+    }
+
+    // True if we hold the only reference to 'snap', so we may modify it.  Views
+    // pin a snapshot only from inside a read guard, so once a snapshot has been
+    // unpublished and synchronized, its count can only fall.
+    static bool Unshared(const EquitySnapshot::Ptr& snap) {
+        if (!snap || snap.use_count() != 1)
+            return false;
+        // Pairs with the release in the last view's unpin:
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return true;
+    }
+
+    std::atomic<const EquitySnapshot*> _Current;    // What readers see
+    EquitySnapshot::Ptr                _Published;  // Owns *_Current
+    EquitySnapshot::Ptr                _Standby;    // Replica of _Published for applyUpdates(), or null
+    bool                               _NumaReplicas;   // Publish() builds replicas
+    std::mutex                         _WriterLock;
+    std::mutex                         _ReloadLock;
+    std::shared_future<bool>           _Reload;
+};
+
+
+// EquityBatcher answers EquityService lookups and P/E range queries
+// asynchronously, coalescing the requests which arrive together.  Requests
+// are queued, and a dispatcher thread answers everything queued since its
+// last pass at once: all of its lookups with one getSecurityInfoBatch(), and
+// all of its P/E ranges with one getPERanges() pass, identical ranges being
+// asked for only once.  While one pass runs the next batch builds up, so
+// batches grow with the load, and an idle batcher adds no delay.
+//
+// Callbacks run on the dispatcher thread, in the order their requests were
+// made, lookups before ranges.  They should be quick, since a slow callback
+// holds up the next batch, and they may make further requests.  C++20 code
+// can co_await the same requests instead (see Lookup() and PERange()).
+//
+// The service must outlive the batcher.  Requests still queued when the
+// batcher is destroyed are answered first.
+class EquityBatcher {
+public:
+    typedef std::function<void(const EquityPtr&, LookupStatus)> LookupCallback;
+    typedef std::function<void(const EquitySelection&)>         RangeCallback;
+
+    explicit EquityBatcher(const EquityService& srv) :
+        _Service(srv), _Submitted(0), _Answered(0), _Batches(0), _Stop(false), _Thread(&EquityBatcher::Run, this) {
+    }
+
+    ~EquityBatcher() {
+        {
+            std::lock_guard<std::mutex> lock(_Lock);
+            _Stop=true;
+        }
+        _Wake.notify_all();
+        _Thread.join();
+    }
+
+    // Looks up 'name', calling 'done' with the Equity (null if not found) and
+    // the lookup's status, as getSecurityInfo() does:
+    void getSecurityInfo(const char* name, const LookupCallback& done) {
+        EquityCode code;
+        EquityCode::Parse(name, code);    // A null code reports Lookup_InvalidCode.
+        getSecurityInfo(code, done);
+    }
+
+    void getSecurityInfo(const EquityCode& code, const LookupCallback& done) {
+        std::lock_guard<std::mutex> lock(_Lock);
+        _Pending.Codes.push_back(code);
+        _Pending.LookupDone.push_back(done);
+        Submitted();
+    }
+
+    // Calls 'done' with a view of the Equity objects whose P/E values are in
+    // the range specified, in code order, as getPERange() does.  The view
+    // may be shared with other callers, so take a copy to keep it.
+    void getPERange(double min_pe, double max_pe, const RangeCallback& done) {
+        // A NaN bound is no bound, as in EquityQuery::Where().  Dropping it
+        // here lets the ranges be sorted:
+        if (std::isnan(min_pe))
+            min_pe=-HUGE_VAL;
+        if (std::isnan(max_pe))
+            max_pe=HUGE_VAL;
+        std::lock_guard<std::mutex> lock(_Lock);
+        _Pending.Ranges.push_back(EquityMap::PERange(min_pe, max_pe));
+        _Pending.RangeDone.push_back(done);
+        Submitted();
+    }
+
+    // Waits until every request made before the call has been answered.  Not
+    // for use from a callback, which would wait for itself.
+    void Flush() {
+        std::unique_lock<std::mutex> lock(_Lock);
+        size_t target=_Submitted;
+        while (_Answered < target)
+            _Idle.wait(lock);
+    }
+
+    // Number of dispatcher passes so far:
+    size_t Batches() const {
+        return _Batches.load();
+    }
+
+#if __cplusplus >= 202002L
+    // Awaitable forms of the requests above:
+    //
+    //      EquityPtr e=co_await batcher.Lookup("IBMUS");
+    //      EquitySelection cheap=co_await batcher.PERange(0, 10);
+    //
+    // The coroutine is resumed on the dispatcher thread.
+    class LookupAwaiter {
+    public:
+        LookupAwaiter(EquityBatcher& batcher, const EquityCode& code) : _Batcher(batcher), _Code(code), _Status(Lookup_NotFound) {
+        }
+        bool await_ready() const noexcept {
+            return false;
+        }
+        void await_suspend(std::coroutine_handle<> waiter) {
+            _Batcher.getSecurityInfo(_Code, Resume(this, waiter));
+        }
+        EquityPtr await_resume() {
+            return std::move(_Result);
+        }
+        LookupStatus Status() const {
+            return _Status;
+        }
+    private:
+        struct Resume {
+            Resume(LookupAwaiter* awaiter, std::coroutine_handle<> waiter) : _Awaiter(awaiter), _Waiter(waiter) {
+            }
+            void operator () (const EquityPtr& e, LookupStatus status) const {
+                _Awaiter->_Result=e;
+                _Awaiter->_Status=status;
+                _Waiter.resume();
+            }
+            LookupAwaiter*          _Awaiter;
+            std::coroutine_handle<> _Waiter;
+        };
+        EquityBatcher& _Batcher;
+        EquityCode     _Code;
+        EquityPtr      _Result;
+        LookupStatus   _Status;
+    };
+
+    class RangeAwaiter {
+    public:
+        RangeAwaiter(EquityBatcher& batcher, double min_pe, double max_pe) : _Batcher(batcher), _Min(min_pe), _Max(max_pe) {
+        }
+        bool await_ready() const noexcept {
+            return false;
+        }
+        void await_suspend(std::coroutine_handle<> waiter) {
+            _Batcher.getPERange(_Min, _Max, Resume(this, waiter));
+        }
+        EquitySelection await_resume() {
+            return std::move(_Result);
+        }
+    private:
+        struct Resume {
+            Resume(RangeAwaiter* awaiter, std::coroutine_handle<> waiter) : _Awaiter(awaiter), _Waiter(waiter) {
+            }
+            void operator () (const EquitySelection& selected) const {
+                _Awaiter->_Result=selected;
+                _Waiter.resume();
+            }
+            RangeAwaiter*           _Awaiter;
+            std::coroutine_handle<> _Waiter;
+        };
+        EquityBatcher&  _Batcher;
+        double          _Min;
+        double          _Max;
+        EquitySelection _Result;
+    };
+
+    LookupAwaiter Lookup(const char* name) {
+        EquityCode code;
+        EquityCode::Parse(name, code);
+        return LookupAwaiter(*this, code);
+    }
+
+    LookupAwaiter Lookup(const EquityCode& code) {
+        return LookupAwaiter(*this, code);
+    }
+
+    RangeAwaiter PERange(double min_pe, double max_pe) {
+        return RangeAwaiter(*this, min_pe, max_pe);
+    }
+#endif
+
+private:
+    EquityBatcher(const EquityBatcher&);
+    void operator = (const EquityBatcher&);
+
+    // The requests of one pass:
+    struct Batch {
+        std::vector<EquityCode>       Codes;
+        std::vector<LookupCallback>   LookupDone;
+        std::vector<EquityMap::PERange> Ranges;
+        std::vector<RangeCallback>    RangeDone;
+
+        size_t Size() const {
+            return Codes.size()+Ranges.size();
+        }
+        void Swap(Batch& other) {
+            Codes.swap(other.Codes);
+            LookupDone.swap(other.LookupDone);
+            Ranges.swap(other.Ranges);
+            RangeDone.swap(other.RangeDone);
+        }
+        void Clear() {
+            Codes.clear();
+            LookupDone.clear();
+            Ranges.clear();
+            RangeDone.clear();
+        }
+    };
+
+    // Requires _Lock:
+    void Submitted() {
+        if (_Submitted++ == _Answered)
+            _Wake.notify_one();
+    }
+
+    void Run() {
+        Batch batch;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(_Lock);
+                _Answered += batch.Size();
+                batch.Clear();
+                _Idle.notify_all();
+                while (!_Stop && !_Pending.Size())
+                    _Wake.wait(lock);
+                if (!_Pending.Size())
+                    return;
+                batch.Swap(_Pending);
+            }
+            ++_Batches;
+            Answer(batch);
+        }
+    }
+
+    void Answer(const Batch& batch) {
+        if (!batch.Codes.empty()) {
+            std::vector<EquityPtr> found;
+            std::vector<LookupStatus> status;
+            _Service.getSecurityInfoBatch(batch.Codes, found, &status);
+            for (size_t i = 0; i < found.size(); ++i) {
+                try {
+                    batch.LookupDone[i](found[i], status[i]);
+                }
+                catch (...) {
+                    std::cerr << "EquityBatcher lookup callback failed" << std::endl;
+                }
+            }
+        }
+        if (!batch.Ranges.empty()) {
+            std::vector<EquityMap::PERange> distinct(batch.Ranges);
+            std::sort(distinct.begin(), distinct.end());
+            distinct.erase(std::unique(distinct.begin(), distinct.end()), distinct.end());
+            std::vector<EquitySelection> results;
+            _Service.getPERanges(distinct, results);
+            for (size_t i = 0; i < batch.Ranges.size(); ++i) {
+                size_t ix=std::lower_bound(distinct.begin(), distinct.end(), batch.Ranges[i])-distinct.begin();
+                try {
+                    batch.RangeDone[i](results[ix]);
+                }
+                catch (...) {
+                    std::cerr << "EquityBatcher range callback failed" << std::endl;
+                }
+            }
+        }
+    }
+
+    const EquityService&    _Service;
+    std::mutex              _Lock;
+    std::condition_variable _Wake;      // for the dispatcher: requests, or _Stop
+    std::condition_variable _Idle;      // for Flush(): _Answered moved on
+    Batch                   _Pending;
+    size_t                  _Submitted; // requests made
+    size_t                  _Answered;  // requests whose callbacks have returned
+    std::atomic<size_t>     _Batches;
+    bool                    _Stop;
+    std::thread             _Thread;    // Last, so it starts after the rest is built
+};
+
+
+// PinnedWorker is a thread bound to one CPU which runs the tasks posted to
+// it, in order.  Memory the tasks allocate is first touched on that CPU, so
+// with the kernel's default first-touch policy it comes from the CPU's own
+// NUMA node.
+class PinnedWorker {
+public:
+    explicit PinnedWorker(int cpu) : _Stop(false), _Thread(&PinnedWorker::Run, this, cpu) {
+    }
+
+    ~PinnedWorker() {
+        {
+            std::lock_guard<std::mutex> lock(_Lock);
+            _Stop=true;
+        }
+        _Wake.notify_one();
+        _Thread.join();
+    }
+
+    // Waits for every task in 'done', then rethrows the first one's exception,
+    // if any.  Callers' tasks write through pointers into the callers' frames,
+    // which mustn't unwind while any task is still running.
+    static void WaitAll(std::vector< std::future<void> >& done) {
+        for (size_t i = 0; i < done.size(); ++i)
+            done[i].wait();
+        for (size_t i = 0; i < done.size(); ++i)
+            done[i].get();
+    }
+
+    // Queues 'task'.  The future reports its completion, or its exception:
+    std::future<void> Post(const std::function<void()>& task) {
+        shared_ptr< std::packaged_task<void()> > job( new std::packaged_task<void()>(task) );
+        std::future<void> done=job->get_future();
+        {
+            std::lock_guard<std::mutex> lock(_Lock);
+            _Tasks.push_back(job);
+        }
+        _Wake.notify_one();
+        return done;
+    }
+
+    // Pins the calling thread to 'cpu'.  Failing to pin (e.g. in a restricted
+    // cpuset) costs locality, not correctness, so it isn't an error.
+    static void PinCurrentThread(int cpu) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+
+    // Returns the n'th CPU this process may run on, wrapping around:
+    static int NthCPU(size_t n) {
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if ( sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || CPU_COUNT(&allowed)==0 )
+            return (int)(n % std::max(1u, std::thread::hardware_concurrency()));
+        n %= CPU_COUNT(&allowed);
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &allowed) && n-- == 0)
+                return cpu;
+        }
+        return 0;
+    }
+
+private:
+    PinnedWorker(const PinnedWorker&);
+    void operator = (const PinnedWorker&);
+
+    void Run(int cpu) {
+        PinCurrentThread(cpu);
+
+        for (;;) {
+            shared_ptr< std::packaged_task<void()> > job;
+            {
+                std::unique_lock<std::mutex> lock(_Lock);
+                while (!_Stop && _Tasks.empty())
+                    _Wake.wait(lock);
+                if (_Tasks.empty())
+                    return;
+                job=_Tasks.front();
+                _Tasks.pop_front();
+            }
+            (*job)();
+        }
+    }
+
+    std::mutex              _Lock;
+    std::condition_variable _Wake;
+    std::deque< shared_ptr< std::packaged_task<void()> > > _Tasks;
+    bool                    _Stop;
+    std::thread             _Thread;    // Last, so it starts after the rest is built
+};
+
+
+// ShardedEquityService serves the same queries as EquityService from
+// several EquityMap shards, each owned by a PinnedWorker on its own CPU.
+// Codes are hash-partitioned across the shards.  Each shard's equities,
+// descriptions and indexes are built by its own worker, so they're local to
+// that worker's CPU.
+//
+// Point lookups go straight to one shard on the calling thread.  P/E range
+// queries run on every shard's worker in parallel, and the per-shard results
+// (each already ordered) are k-way merged.  lowestPE() reduces the shards'
+// cached minimums with LowestPE_filter.
+//
+// Queries may be made from any number of threads, but unlike EquityService,
+// initialize() must not run concurrently with them.
+class ShardedEquityService {
+public:
+    // 'shards' of 0 means one per CPU available to the process:
+    explicit ShardedEquityService(unsigned shards=0) {
+        if (!shards) {
+            cpu_set_t allowed;
+            CPU_ZERO(&allowed);
+            shards= sched_getaffinity(0, sizeof(allowed), &allowed)==0 ? CPU_COUNT(&allowed)
+                    : std::thread::hardware_concurrency();
+            shards=std::max(1u, shards);
+        }
+        for (unsigned i = 0; i < shards; ++i) {
+            _Workers.push_back( shared_ptr<PinnedWorker>(new PinnedWorker(PinnedWorker::NthCPU(i))) );
+            _Shards.push_back( shared_ptr<Shard>(new Shard) );
+        }
+    }
+
+    // initialize() loads all security data from stdin, replacing any data
+    // already loaded.  Returns false, leaving the old data in place, on failure.
+    bool initialize(std::istream& input=std::cin) {
+        try {
+            std::ostringstream text;
+            text << input.rdbuf();
+            string all=text.str();
+            return LoadText(StringRef(all));
+        }
+        catch (...) {
+            std::cerr << "ShardedEquityService.initialize() failed" << std::endl;
+            return false;
+        }
+    }
+
+    // As above, from a memory-mapped file:
+    bool initialize(const char* path) {
+        try {
+            MappedFile file(path);
+            return LoadText(file.GetText());
+        }
+        catch (...) {
+            std::cerr << "ShardedEquityService.initialize() failed" << std::endl;
+            return false;
+        }
+    }
+
+    size_t ShardCount() const {
+        return _Shards.size();
+    }
+
+    // Returns the shard which holds 'code'.  This uses the high bits of a
+    // multiplicative hash, so it doesn't correlate with the bits each shard's
+    // EquityHashIndex uses.
+    size_t ShardOf(const EquityCode& code) const {
+        return (size_t)( ((code.Packed()*0x9E3779B97F4A7C15ULL) >> 32) % _Shards.size() );
+    }
+
+    // Returns an EquityPtr containing attributes of the given equity.  EquityPtr
+    // will be null if equityName not found; 'status', if given, says why.
+    EquityPtr getSecurityInfo(const char* equityName, LookupStatus* status=0) const {
+        EquityCode code;
+        if (!EquityCode::Parse(equityName, code)) {
+            if (status)
+                *status=Lookup_InvalidCode;
+            return EquityPtr();
+        }
+        return getSecurityInfo(code, status);
+    }
+
+    // As above, for a code that has already been parsed:
+    EquityPtr getSecurityInfo(const EquityCode& equityCode, LookupStatus* status=0) const {
+        return _Shards[ShardOf(equityCode)]->Map.TryFind(equityCode, status);
+    }
+
+    // Returns all security names, ordered alphabetically:
+    string allSecurityCodes() const {
+        OutputBuffer out;
+        writeSecurityCodes(out);
+        return string(out.Data(), out.Size());
+    }
+
+    // Appends all security names to 'out', one per line, ordered
+    // alphabetically, by merging the shards' code-ordered iterations.  Returns
+    // the number of codes written.
+    size_t writeSecurityCodes( OutputBuffer& out ) const {
+        size_t bytes=0, count=0;
+        std::vector<CodeCursor> heads;
+        for (size_t i = 0; i < _Shards.size(); ++i) {
+            const EquityMap& map=_Shards[i]->Map;
+            bytes += EquityCodeList(map).TextSize();
+            if (map.Size()) {
+                CodeCursor c={ map.begin(), map.end() };
+                heads.push_back(c);
+            }
+        }
+        std::make_heap(heads.begin(), heads.end(), CodeCursorAfter());
+
+        out.Expect(bytes);
+        while (!heads.empty()) {
+            std::pop_heap(heads.begin(), heads.end(), CodeCursorAfter());
+            CodeCursor& c=heads.back();
+            out.AppendLine(c.Pos->first);
+            ++count;
+            if (++c.Pos==c.End)
+                heads.pop_back();
+            else
+                std::push_heap(heads.begin(), heads.end(), CodeCursorAfter());
+        }
+        return count;
+    }
+
+    // Returns the name of the security with the lowest P/E ratio.  Each shard
+    // keeps its minimum cached, so there's nothing to gain by farming this
+    // out; the candidates are reduced in code order, so that ties resolve as
+    // they do in EquityMap::FindLowestPE().
+    string lowestPE() const {
+        std::vector<EquityPtr> candidates;
+        for (size_t i = 0; i < _Shards.size(); ++i) {
+            EquityPtr e=_Shards[i]->Map.FindLowestPE();
+            if (e)
+                candidates.push_back(e);
+        }
+        if (candidates.empty())
+            return "";
+        std::sort(candidates.begin(), candidates.end(), ByCode());
+        const EquityFilter& filter=LowestPE_filter();
+        const Equity* best=candidates[0].get();
+        for (size_t i = 1; i < candidates.size(); ++i)
+            best=&filter.Compare(*best, *candidates[i]);
+        return best->GetEquityName();
+    }
+
+    // Appends the Equity objects whose P/E values are in the range specified
+    // to 'result', in code order or P/E order.  Returns the number of matches.
+    int getPERange( double min_pe, double max_pe, std::vector<EquityPtr>& result,
+                    EquityMap::ResultOrder order=EquityMap::Order_Code ) const {
+        std::vector< std::vector<EquityMap::RowT> > rows(_Shards.size());
+        std::vector< std::future<void> > done;
+        for (size_t i = 0; i < _Shards.size(); ++i) {
+            done.push_back( _Workers[i]->Post( std::bind(&ShardedEquityService::SelectRows,
+                            &_Shards[i]->Map, min_pe, max_pe, &rows[i], order) ) );
+        }
+
+        PinnedWorker::WaitAll(done);
+        std::vector<RowCursor> heads;
+        size_t total=0;
+        for (size_t i = 0; i < _Shards.size(); ++i) {
+            if (!rows[i].empty()) {
+                RowCursor c={ &_Shards[i]->Map, &rows[i][0], &rows[i][0]+rows[i].size() };
+                heads.push_back(c);
+                total += rows[i].size();
+            }
+        }
+        RowCursorAfter after(order);
+        std::make_heap(heads.begin(), heads.end(), after);
+
+        result.reserve(result.size()+total);
+        while (!heads.empty()) {
+            std::pop_heap(heads.begin(), heads.end(), after);
+            RowCursor& c=heads.back();
+            result.push_back(c.Map->GetRow(*c.Pos));
+            if (++c.Pos==c.End)
+                heads.pop_back();
+            else
+                std::push_heap(heads.begin(), heads.end(), after);
+        }
+        return (int)total;
+    }
+
+private:
+    ShardedEquityService(const ShardedEquityService&);
+    void operator = (const ShardedEquityService&);
+
+    struct Shard {
+        EquityMap Map;
+    };
+    typedef std::vector<EquityTextFactory::Record> Records;
+
+    // Parses 'text' on the calling thread, reporting bad records in input
+    // order, and has each worker build its shard from its share of the
+    // records.  The new shards replace the old ones only if every build
+    // succeeds.
+    bool LoadText(const StringRef& text) {
+        const char* p=text.Data();
+        const char* end=p+text.Size();
+        if (p==end) {
+            throw std::runtime_error("No header line in input");
+        }
+        const char* eol=(const char*)memchr(p, '\n', end-p);
+        p= eol ? eol+1 : end;
+
+        std::vector<Records> parts(_Shards.size());
+        EquityTextFactory fact;
+        EquityTextFactory::Record rec;
+        while (p < end) {
+            eol=(const char*)memchr(p, '\n', end-p);
+            StringRef line(p, (eol ? eol : end)-p);
+            p= eol ? eol+1 : end;
+            if (fact.ParseRecord(line, rec))
+                parts[ShardOf(rec.Code)].push_back(rec);
+        }
+
+        std::vector< shared_ptr<Shard> > shards(_Shards.size());
+        std::vector< std::future<void> > done;
+        for (size_t i = 0; i < shards.size(); ++i)
+            done.push_back( _Workers[i]->Post( std::bind(&ShardedEquityService::Build, &parts[i], &shards[i]) ) );
+        PinnedWorker::WaitAll(done);
+        _Shards.swap(shards);
+        return true;
+    }
+
+    // Runs on a shard's worker.  Records with equal codes are in input
+    // order, so the last of them wins, as in a single-map load.
+    static void Build(const Records* records, shared_ptr<Shard>* result) {
+        shared_ptr<Shard> shard(new Shard);
+        EquityArenaPtr arena(new EquityArena);
+        shard->Map.Reserve(records->size());
+        for (size_t i = 0; i < records->size(); ++i)
+            shard->Map.Insert( EquityTextFactory::NewEquity((*records)[i], arena) );
+        shard->Map.RetainBacking(arena);
+        shard->Map.BuildIndexes();
+        *result=shard;
+    }
+
+    // Runs on a shard's worker:
+    static void SelectRows(const EquityMap* map, double min_pe, double max_pe,
+                           std::vector<EquityMap::RowT>* rows, EquityMap::ResultOrder order) {
+        map->SelectRowsByPERange(min_pe, max_pe, *rows, order);
+    }
+
+    struct ByCode {
+        bool operator () (const EquityPtr& left, const EquityPtr& right) const {
+            return left->GetEquityCode() < right->GetEquityCode();
+        }
+    };
+
+    // Merge cursors.  The heap comparators are "after", giving min-heaps.
+    struct CodeCursor {
+        EquityMap::const_iterator Pos;
+        EquityMap::const_iterator End;
+    };
+    struct CodeCursorAfter {
+        bool operator () (const CodeCursor& left, const CodeCursor& right) const {
+            return right.Pos->first < left.Pos->first;
+        }
+    };
+
+    struct RowCursor {
+        const EquityMap*        Map;
+        const EquityMap::RowT*  Pos;
+        const EquityMap::RowT*  End;
+    };
+    // Orders by code, or as EquityMap's P/E index does: (P/E, price), then
+    // code descending.
+    struct RowCursorAfter {
+        RowCursorAfter(EquityMap::ResultOrder order) : _Order(order) {
+        }
+        bool operator () (const RowCursor& left, const RowCursor& right) const {
+            const Equity& l=*left.Map->GetRow(*left.Pos);
+            const Equity& r=*right.Map->GetRow(*right.Pos);
+            if (_Order==EquityMap::Order_PE) {
+                if (l.GetPE_ratio() != r.GetPE_ratio())
+                    return r.GetPE_ratio() < l.GetPE_ratio();
+                if (l.GetPrice() != r.GetPrice())
+                    return r.GetPrice() < l.GetPrice();
+                return l.GetEquityCode() < r.GetEquityCode();
+            }
+            return r.GetEquityCode() < l.GetEquityCode();
+        }
+        EquityMap::ResultOrder _Order;
+    };
+
+    std::vector< shared_ptr<PinnedWorker> > _Workers;   // _Workers[i] serves _Shards[i]
+    std::vector< shared_ptr<Shard> >        _Shards;
+};
+
+
+// CompactEquityStore holds a read-only copy of an EquityMap's data in a few
+// flat arrays, for data sets too big to keep as Equity objects:
+//
+//  - The codes are sorted and cut into blocks of CodeBlock.  A sparse index
+//    holds each block's first packed code; the rest of the block is varint
+//    deltas, which is about how front coding the code text would come out.
+//    A lookup binary searches the sparse index and then decodes at most one
+//    block, which is usually within a cache line.
+//  - Descriptions are deduplicated into a sorted dictionary, front coded in
+//    blocks of TextBlock, and each row keeps its description's number.
+//  - Prices and P/Es are kept as thousandths in 32 bits, since operator<<
+//    prints 3 decimals.  Values that don't survive the round trip exactly
+//    (more decimals, or out of range) go in a side table, so every value
+//    reads back as the double it was built from.
+//
+// Rows are numbered in code order.
+class CompactEquityStore {
+public:
+    typedef uint32_t RowT;
+    enum { CodeBlock=16, TextBlock=8 };
+    static const RowT NotFound=(RowT)-1;
+
+    CompactEquityStore() : _Rows(0) {
+    }
+
+    // Replaces our contents with 'map's:
+    void Build(const EquityMap& map) {
+        *this=CompactEquityStore();
+        _Rows=map.Size();
+        if ( _Rows >= (size_t)NotFound )
+            throw std::length_error("Too many equities for a CompactEquityStore");
+
+        // The description dictionary, in text order:
+        std::vector<StringRef> texts;
+        texts.reserve(_Rows);
+        for (EquityMap::const_iterator it=map.begin(); it != map.end(); ++it)
+            texts.push_back(it->second->GetDescription());
+        std::sort(texts.begin(), texts.end(), TextOrder());
+        texts.erase(std::unique(texts.begin(), texts.end(), TextEqual()), texts.end());
+        for (size_t i = 0; i < texts.size(); ++i) {
+            size_t shared=0;
+            if (i % TextBlock)
+                shared=Shared(texts[i-1], texts[i]);
+            else
+                _TextOffset.push_back((uint32_t)_Text.size());
+            Varint::Put(_Text, shared);
+            Varint::Put(_Text, texts[i].Size()-shared);
+            _Text.insert(_Text.end(), texts[i].Data()+shared, texts[i].Data()+texts[i].Size());
+        }
+        if ( _Text.size() > (size_t)UINT32_MAX )
+            throw std::length_error("Too much description text for a CompactEquityStore");
+
+        _Price.reserve(_Rows);
+        _PE.reserve(_Rows);
+        _MarketCap.reserve(_Rows);
+        _Description.reserve(_Rows);
+        uint64_t prev=0;
+        RowT row=0;
+        for (EquityMap::const_iterator it=map.begin(); it != map.end(); ++it, ++row) {
+            const Equity& e=*it->second;
+            uint64_t code=e.GetEquityCode().Packed();
+            if (row % CodeBlock==0) {
+                _BlockFirst.push_back(code);
+                _BlockOffset.push_back((uint32_t)_CodeDeltas.size());
+            }
+            else {
+                Varint::Put(_CodeDeltas, code-prev);
+            }
+            prev=code;
+            _Price.push_back(Scaled(e.GetPrice(), row, _PriceExceptions));
+            _PE.push_back(Scaled(e.GetPE_ratio(), row, _PEExceptions));
+            _MarketCap.push_back(e.GetMarketCap());
+            _Description.push_back((uint32_t)(std::lower_bound(texts.begin(), texts.end(), e.GetDescription(), TextOrder())-texts.begin()));
+        }
+    }
+
+    size_t Size() const {
+        return _Rows;
+    }
+
+    // Returns the bytes of memory we use:
+    size_t BytesUsed() const {
+        return sizeof(*this) + Bytes(_BlockFirst) + Bytes(_BlockOffset) + Bytes(_CodeDeltas)
+               + Bytes(_Price) + Bytes(_PE) + Bytes(_MarketCap) + Bytes(_Description)
+               + Bytes(_TextOffset) + Bytes(_Text) + Bytes(_PriceExceptions) + Bytes(_PEExceptions);
+    }
+
+    // Returns the row of 'code', or NotFound:
+    RowT FindRow(const EquityCode& code) const {
+        uint64_t target=code.Packed();
+        std::vector<uint64_t>::const_iterator next=std::upper_bound(_BlockFirst.begin(), _BlockFirst.end(), target);
+        if ( code.IsNull() || next==_BlockFirst.begin() )
+            return NotFound;
+        size_t block=(next-_BlockFirst.begin())-1;
+        uint64_t value=_BlockFirst[block];
+        const uint8_t* p=_CodeDeltas.data()+_BlockOffset[block];
+        RowT row=(RowT)(block*CodeBlock);
+        RowT end=(RowT)std::min(_Rows, (size_t)row+CodeBlock);
+        for (;;) {
+            if (value >= target)
+                return value==target ? row : NotFound;
+            if (++row==end)
+                return NotFound;
+            value += Varint::Get(p);
+        }
+    }
+
+    EquityCode Code(RowT row) const {
+        size_t block=row/CodeBlock;
+        uint64_t value=_BlockFirst[block];
+        const uint8_t* p=_CodeDeltas.data()+_BlockOffset[block];
+        for (size_t i = 0; i < row % CodeBlock; ++i)
+            value += Varint::Get(p);
+        return CodeOf(value);
+    }
+
+    double Price(RowT row) const {
+        return Unscaled(_Price[row], row, _PriceExceptions);
+    }
+    double PE(RowT row) const {
+        return Unscaled(_PE[row], row, _PEExceptions);
+    }
+    long long MarketCap(RowT row) const {
+        return _MarketCap[row];
+    }
+
+    // Decodes the row's description into 'scratch', and returns it:
+    StringRef Description(RowT row, string& scratch) const {
+        uint32_t id=_Description[row];
+        const uint8_t* p=_Text.data()+_TextOffset[id/TextBlock];
+        for (uint32_t i = 0; i <= id % TextBlock; ++i) {
+            size_t shared=Varint::Get(p), len=Varint::Get(p);
+            scratch.resize(shared);
+            scratch.append((const char*)p, len);
+            p += len;
+        }
+        return StringRef(scratch);
+    }
+
+    // Returns a new Equity with the row's data:
+    EquityPtr Get(RowT row) const {
+        string desc;
+        Description(row, desc);
+        char code[EquityCode::MaxLen+1];
+        Code(row).Format(code);
+        return EquityPtr(new Equity(code, desc.c_str(), MarketCap(row), Price(row), PE(row)));
+    }
+
+    // Renders the row as operator<< renders an Equity, and a newline:
+    void AppendLine(RowT row, OutputBuffer& out) const {
+        string desc;
+        Description(row, desc);
+        char local[512];
+        size_t len=EquityFormatter::Format(Code(row), StringRef(desc), Price(row), MarketCap(row), PE(row), local, sizeof(local));
+        if (len <= sizeof(local)) {
+            out.Append(local, len);
+        }
+        else {
+            std::vector<char> big(len);
+            EquityFormatter::Format(Code(row), StringRef(desc), Price(row), MarketCap(row), PE(row), &big[0], len);
+            out.Append(&big[0], len);
+        }
+        out.Append('\n');
+    }
+
+    // Appends every code, in order, one per line:
+    void AppendCodes(OutputBuffer& out) const {
+        for (size_t block = 0; block < _BlockFirst.size(); ++block) {
+            uint64_t value=_BlockFirst[block];
+            const uint8_t* p=_CodeDeltas.data()+_BlockOffset[block];
+            size_t end=std::min(_Rows, (block+1)*CodeBlock);
+            for (size_t row = block*CodeBlock; row < end; ++row) {
+                if (row % CodeBlock)
+                    value += Varint::Get(p);
+                out.AppendLine(CodeOf(value));
+            }
+        }
+    }
+
+    // Appends the rows whose P/E is in [minPE,maxPE], in code order:
+    size_t SelectRowsByPERange(double minPE, double maxPE, std::vector<RowT>& rows) const {
+        size_t first=rows.size();
+        for (RowT row = 0; row < _Rows; ++row) {
+            double pe=PE(row);
+            if (pe >= minPE && pe <= maxPE)
+                rows.push_back(row);
+        }
+        return rows.size()-first;
+    }
+
+    // Returns the row with the lowest P/E, ties broken as EquityMap does
+    // (lower price first, then the later code), or NotFound if we're empty:
+    RowT LowestPE() const {
+        if (!_Rows)
+            return NotFound;
+        RowT best=0;
+        for (RowT row = 1; row < _Rows; ++row) {
+            double pe=PE(row), bestPE=PE(best);
+            if ( pe < bestPE || (pe==bestPE && Price(row) <= Price(best)) )
+                best=row;
+        }
+        return best;
+    }
+
+private:
+    typedef std::vector< std::pair<RowT,double> > Exceptions;
+
+    static const int32_t Exception=INT32_MIN;
+
+    // Returns 'v' in thousandths, if that's exact, or else records it in
+    // 'exceptions' and returns Exception:
+    static int32_t Scaled(double v, RowT row, Exceptions& exceptions) {
+        double scaled=std::floor(v*1000.0+0.5);
+        if ( scaled > (double)INT32_MIN && scaled <= (double)INT32_MAX && scaled/1000.0==v && !(v==0 && std::signbit(v)) )
+            return (int32_t)scaled;
+        exceptions.push_back(std::make_pair(row, v));
+        return Exception;
+    }
+
+    static double Unscaled(int32_t value, RowT row, const Exceptions& exceptions) {
+        if (value != Exception)
+            return (double)value/1000.0;
+        return std::lower_bound(exceptions.begin(), exceptions.end(), std::make_pair(row, -HUGE_VAL))->second;
+    }
+
+    static EquityCode CodeOf(uint64_t packed) {
+        EquityCode code;
+        EquityCode::Unpack(packed, code);
+        return code;
+    }
+
+    static size_t Shared(const StringRef& a, const StringRef& b) {
+        size_t n=0, max=std::min(a.Size(), b.Size());
+        while (n < max && a.Data()[n]==b.Data()[n])
+            ++n;
+        return n;
+    }
+
+    struct TextOrder {
+        bool operator () (const StringRef& a, const StringRef& b) const {
+            int c=memcmp(a.Data(), b.Data(), std::min(a.Size(), b.Size()));
+            return c ? c < 0 : a.Size() < b.Size();
+        }
+    };
+    struct TextEqual {
+        bool operator () (const StringRef& a, const StringRef& b) const {
+            return a.Size()==b.Size() && memcmp(a.Data(), b.Data(), a.Size())==0;
+        }
+    };
+
+    template <class T>
+    static size_t Bytes(const std::vector<T>& v) {
+        return v.capacity()*sizeof(T);
+    }
+
+    size_t                _Rows;
+    std::vector<uint64_t> _BlockFirst;      // first packed code of each block
+    std::vector<uint32_t> _BlockOffset;     // each block's deltas in _CodeDeltas
+    std::vector<uint8_t>  _CodeDeltas;
+    std::vector<int32_t>  _Price;           // thousandths, or Exception
+    std::vector<int32_t>  _PE;
+    std::vector<long long> _MarketCap;
+    std::vector<uint32_t> _Description;     // dictionary entry numbers
+    std::vector<uint32_t> _TextOffset;      // each dictionary block in _Text
+    std::vector<uint8_t>  _Text;            // (shared, length, suffix) entries
+    Exceptions            _PriceExceptions; // by row
+    Exceptions            _PEExceptions;
+};
+
+// CompactEquityService answers the same read calls as EquityService (those
+// main() uses), from a CompactEquityStore.  The data is loaded once and then
+// only read, so there's no snapshot machinery and initialize() must not run
+// concurrently with queries.  getSecurityInfo() builds its result on demand.
+class CompactEquityService {
+public:
+    bool initialize(std::istream& input=std::cin) {
+        try {
+            EquityMap map;
+            EquityLoader( input, map );
+            _Store.Build(map);
+            return true;
+        }
+        catch (...) {
+            std::cerr << "CompactEquityService.initialize() failed" << std::endl;
+            return false;
+        }
+    }
+
+    // Loads a file in the usual way, then compacts it; the full form is only
+    // kept while compacting.
+    bool initialize(const char* path) {
+        try {
+            EquityMap map;
+            EquityLoader( path, map, EquityLoader::Load_BorrowDescriptions );
+            _Store.Build(map);
+            return true;
+        }
+        catch (...) {
+            std::cerr << "CompactEquityService.initialize() failed" << std::endl;
+            return false;
+        }
+    }
+
+    EquityPtr getSecurityInfo(const char* equityName, LookupStatus* status=0) const {
+        EquityCode code;
+        if (!EquityCode::Parse(equityName, code)) {
+            if (status)
+                *status=Lookup_InvalidCode;
+            return EquityPtr();
+        }
+        CompactEquityStore::RowT row=_Store.FindRow(code);
+        if (status)
+            *status= (row==CompactEquityStore::NotFound) ? Lookup_NotFound : Lookup_Found;
+        return (row==CompactEquityStore::NotFound) ? EquityPtr() : _Store.Get(row);
+    }
+
+    string allSecurityCodes() const {
+        OutputBuffer out;
+        writeSecurityCodes(out);
+        return string(out.Data(), out.Size());
+    }
+
+    size_t writeSecurityCodes( OutputBuffer& out ) const {
+        _Store.AppendCodes(out);
+        return _Store.Size();
+    }
+
+    string lowestPE() const {
+        CompactEquityStore::RowT row=_Store.LowestPE();
+        return (row==CompactEquityStore::NotFound) ? string() : _Store.Code(row).ToString();
+    }
+
+    int getPERange( double min_pe, double max_pe, std::vector<EquityPtr>& result ) const {
+        std::vector<CompactEquityStore::RowT> rows;
+        _Store.SelectRowsByPERange(min_pe, max_pe, rows);
+        for (size_t i = 0; i < rows.size(); ++i)
+            result.push_back(_Store.Get(rows[i]));
+        return (int)rows.size();
+    }
+
+    int writePERange( double min_pe, double max_pe, OutputBuffer& out ) const {
+        std::vector<CompactEquityStore::RowT> rows;
+        _Store.SelectRowsByPERange(min_pe, max_pe, rows);
+        for (size_t i = 0; i < rows.size(); ++i)
+            _Store.AppendLine(rows[i], out);
+        return (int)rows.size();
+    }
+
+    const CompactEquityStore& store() const {
+        return _Store;
+    }
+
+private:
+    CompactEquityStore _Store;
+};
+
+
+// EquityServer puts an EquityService on the network.  Each event loop is a
+// thread pinned to its own core, with its own SO_REUSEPORT listening socket
+// (so the kernel spreads connections across loops) and its own epoll set.
+// Requests go straight to the service's lock-free read path.
+//
+// The protocol is line based.  Each request is one line, and may be
+// pipelined: a client can send many requests without waiting.  Responses come
+// back in request order, and everything a read's worth of requests produced
+// goes out in one write.
+//
+//      GET <code>              OK 1, then the record (or "Not found" or
+//                              "Invalid code")
+//      MGET <code> [<code>...] OK <n>, then a GET line for each code
+//      PERANGE <min> <max>     OK <n>, then the records in code order
+//      LOWESTPE                OK 1, then the code (or "Not found")
+//      ALLCODES                OK <n>, then the codes in order
+//      CODES <pattern> [<max>] OK <n>, then the first <max> (default all)
+//                              codes matching "AAP*" or "*HK", in order
+//      SEARCH <word> [<word>...]
+//                              OK <n>, then the records, in code order, whose
+//                              descriptions contain every word (see
+//                              DescriptionIndex)
+//
+// Records are printed as operator<< prints them.  A malformed request gets a
+// one-line "ERR <reason>" response.  Only epoll is supported; io_uring would
+// save little here, since each wakeup already batches a whole read of
+// requests into a single write.
+class EquityServer {
+public:
+    enum { MaxRequest=64*1024, MaxPendingOutput=4*1024*1024, ReadSize=64*1024 };
+
+    // Listens on 'port' (0 picks any free port; see Port()) with 'loops' event
+    // loops, one per usable CPU if 0.  Throws std::runtime_error if the port
+    // can't be opened.
+    EquityServer(const EquityService& srv, int port, unsigned loops=0) : _Service(srv), _Port(port) {
+        if (!loops)
+            loops=std::max(1u, std::thread::hardware_concurrency());
+        try {
+            for (unsigned i = 0; i < loops; ++i) {
+                _Loops.push_back(shared_ptr<Loop>(new Loop(*this)));
+                Listen(*_Loops.back());
+            }
+        }
+        catch (...) {
+            _Loops.clear();
+            throw;
+        }
+        for (size_t i = 0; i < _Loops.size(); ++i)
+            _Loops[i]->Thread=std::thread(&EquityServer::Run, this, _Loops[i].get(), PinnedWorker::NthCPU(i));
+    }
+
+    ~EquityServer() {
+        Stop();
+    }
+
+    // Stops the loops and closes every connection:
+    void Stop() {
+        for (size_t i = 0; i < _Loops.size(); ++i) {
+            uint64_t one=1;
+            ssize_t r=write(_Loops[i]->Wake, &one, sizeof(one));
+            (void)r;    // The eventfd can't be full; nothing to do on failure.
+        }
+        for (size_t i = 0; i < _Loops.size(); ++i) {
+            if (_Loops[i]->Thread.joinable())
+                _Loops[i]->Thread.join();
+        }
+    }
+
+    // Returns the port we're listening on:
+    int Port() const {
+        return _Port;
+    }
+
+private:
+    EquityServer(const EquityServer&);
+    void operator = (const EquityServer&);
+
+    // One client.  Responses not yet sent are Out's contents from Sent on.
+    struct Connection {
+        Connection(int fd) : Fd(fd), Sent(0), Writing(false) {
+        }
+        ~Connection() {
+            close(Fd);
+        }
+        int          Fd;
+        string       In;        // request bytes not yet handled
+        OutputBuffer Out;
+        size_t       Sent;
+        bool         Writing;   // waiting for EPOLLOUT, and not reading meanwhile
+    };
+
+    struct Loop {
+        Loop(EquityServer& server) : Server(server), Epoll(-1), Listen(-1), Wake(-1) {
+        }
+        ~Loop() {
+            for (std::set<Connection*>::iterator it=Connections.begin(); it != Connections.end(); ++it)
+                delete *it;
+            if (Listen >= 0)
+                close(Listen);
+            if (Wake >= 0)
+                close(Wake);
+            if (Epoll >= 0)
+                close(Epoll);
+        }
+        EquityServer&         Server;
+        int                   Epoll;
+        int                   Listen;
+        int                   Wake;     // an eventfd, for Stop()
+        std::set<Connection*> Connections;
+        std::thread           Thread;
+    };
+
+    // Opens the loop's epoll set, eventfd and listening socket.  The first
+    // loop to bind port 0 fixes the port for the rest.
+    void Listen(Loop& loop) {
+        loop.Epoll=epoll_create1(EPOLL_CLOEXEC);
+        loop.Wake=eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        loop.Listen=socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if ( loop.Epoll < 0 || loop.Wake < 0 || loop.Listen < 0 )
+            throw std::runtime_error(string("EquityServer setup failed: ") + strerror(errno));
+        int on=1;
+        setsockopt(loop.Listen, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        setsockopt(loop.Listen, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family=AF_INET;
+        addr.sin_addr.s_addr=htonl(INADDR_ANY);
+        addr.sin_port=htons((uint16_t)_Port);
+        socklen_t len=sizeof(addr);
+        if ( bind(loop.Listen, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(loop.Listen, SOMAXCONN) != 0 ||
+                getsockname(loop.Listen, (struct sockaddr*)&addr, &len) != 0 )
+            throw std::runtime_error(string("EquityServer can't listen: ") + strerror(errno));
+        _Port=ntohs(addr.sin_port);
+
+        // The listening socket and the eventfd are told apart from connections
+        // by their (null) data pointers and file descriptors:
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events=EPOLLIN;
+        ev.data.fd=loop.Listen;
+        epoll_ctl(loop.Epoll, EPOLL_CTL_ADD, loop.Listen, &ev);
+        ev.data.fd=loop.Wake;
+        epoll_ctl(loop.Epoll, EPOLL_CTL_ADD, loop.Wake, &ev);
+    }
+
+    void Run(Loop* loop, int cpu) {
+        PinnedWorker::PinCurrentThread(cpu);
+        struct epoll_event events[64];
+        for (;;) {
+            int n=epoll_wait(loop->Epoll, events, 64, -1);
+            if (n < 0 && errno != EINTR)
+                return;
+            for (int i = 0; i < n; ++i) {
+                if (events[i].data.fd==loop->Wake)
+                    return;
+                if (events[i].data.fd==loop->Listen) {
+                    Accept(*loop);
+                    continue;
+                }
+                Connection* c=(Connection*)events[i].data.ptr;
+                bool ok=true;
+                if (events[i].events & (EPOLLERR | EPOLLHUP))
+                    ok=false;
+                if ( ok && (events[i].events & EPOLLOUT) )
+                    ok=Send(*loop, *c) && Handle(*loop, *c);
+                if ( ok && (events[i].events & EPOLLIN) )
+                    ok=Receive(*loop, *c);
+                if (!ok) {
+                    loop->Connections.erase(c);
+                    delete c;   // Closing it takes it out of the epoll set.
+                }
+            }
+        }
+    }
+
+    void Accept(Loop& loop) {
+        for (;;) {
+            int fd=accept4(loop.Listen, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0)
+                return;     // EAGAIN, or a connection that gave up
+            int on=1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            Connection* c=new Connection(fd);
+            struct epoll_event ev;
+            memset(&ev, 0, sizeof(ev));
+            ev.events=EPOLLIN;
+            ev.data.ptr=c;
+            if (epoll_ctl(loop.Epoll, EPOLL_CTL_ADD, fd, &ev) != 0) {
+                delete c;
+                continue;
+            }
+            loop.Connections.insert(c);
+        }
+    }
+
+    // Reads what's there, answers every complete request, and sends the
+    // answers.  Returns false if the connection should be closed.  Isn't
+    // called while Writing, so a client that doesn't read its answers can't
+    // queue up requests without limit, and by the time a client that has
+    // shut down its side is seen to have done so, it has all its answers.
+    bool Receive(Loop& loop, Connection& c) {
+        char buf[ReadSize];
+        ssize_t n=recv(c.Fd, buf, sizeof(buf), 0);
+        if (n==0)
+            return false;
+        if (n < 0)
+            return errno==EAGAIN || errno==EWOULDBLOCK || errno==EINTR;
+        c.In.append(buf, (size_t)n);
+        return Handle(loop, c);
+    }
+
+    // Answers the complete requests in c.In, sending the answers whenever
+    // there's too much output waiting.  Stops when no complete request is
+    // left, or the socket is full; Send() calls us again once it's caught up.
+    bool Handle(Loop& loop, Connection& c) {
+        while (!c.Writing) {
+            size_t start=0;
+            bool full=false;
+            for (;;) {
+                if (c.Out.Size()-c.Sent >= MaxPendingOutput) {
+                    full=true;
+                    break;
+                }
+                size_t eol=c.In.find('\n', start);
+                if (eol==string::npos)
+                    break;
+                size_t end= (eol > start && c.In[eol-1]=='\r') ? eol-1 : eol;
+                Answer(c.In.data()+start, end-start, c.Out);
+                start=eol+1;
+            }
+            c.In.erase(0, start);
+            if (c.In.size() > MaxRequest && c.In.find('\n') == string::npos) {
+                c.Out.Append(StringRef("ERR request too long\n"));
+                Send(loop, c);
+                return false;
+            }
+            if (!Send(loop, c))
+                return false;
+            if (!full)
+                break;
+        }
+        return true;
+    }
+
+    // Sends as much pending output as the socket takes, waiting for EPOLLOUT
+    // (instead of EPOLLIN) if it doesn't take it all.  Returns false on a
+    // write error.
+    bool Send(Loop& loop, Connection& c) {
+        while (c.Sent < c.Out.Size()) {
+            ssize_t n=send(c.Fd, c.Out.Data()+c.Sent, c.Out.Size()-c.Sent, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno==EINTR)
+                    continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    return false;
+                if (!c.Writing)
+                    Watch(loop, c, EPOLLOUT);
+                c.Writing=true;
+                return true;
+            }
+            c.Sent += (size_t)n;
+        }
+        c.Out.Clear();
+        c.Sent=0;
+        if (c.Writing) {
+            Watch(loop, c, EPOLLIN);
+            c.Writing=false;
+        }
+        return true;
+    }
+
+    static void Watch(Loop& loop, Connection& c, uint32_t events) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events=events;
+        ev.data.ptr=&c;
+        epoll_ctl(loop.Epoll, EPOLL_CTL_MOD, c.Fd, &ev);
+    }
+
+    // Appends the response to one request line to 'out':
+    void Answer(const char* line, size_t len, OutputBuffer& out) const {
+        std::vector<StringRef> words;
+        for (size_t i = 0; i < len; ) {
+            while (i < len && (line[i]==' ' || line[i]=='\t'))
+                ++i;
+            size_t begin=i;
+            while (i < len && line[i] != ' ' && line[i] != '\t')
+                ++i;
+            if (i > begin)
+                words.push_back(StringRef(line+begin, i-begin));
+        }
+        if (words.empty())
+            return Error(out, "empty request");
+        const StringRef& cmd=words[0];
+
+        if ( Is(cmd, "GET") || Is(cmd, "MGET") ) {
+            if ( words.size() < 2 || (Is(cmd, "GET") && words.size() != 2) )
+                return Error(out, "usage: GET <code> | MGET <code> [<code>...]");
+            std::vector<EquityCode> codes(words.size()-1);
+            for (size_t i = 1; i < words.size(); ++i)
+                EquityCode::Parse(words[i].Data(), words[i].Size(), codes[i-1]);
+            std::vector<EquityPtr> found;
+            std::vector<LookupStatus> status;
+            _Service.getSecurityInfoBatch(codes, found, &status);
+            Count(out, found.size());
+            for (size_t i = 0; i < found.size(); ++i) {
+                if (found[i])
+                    out.AppendLine(*found[i]);
+                else
+                    out.Append(StringRef(status[i]==Lookup_InvalidCode ? "Invalid code\n" : "Not found\n"));
+            }
+        }
+        else if (Is(cmd, "PERANGE")) {
+            double min, max;
+            if ( words.size() != 3 || !Number(words[1], min) || !Number(words[2], max) )
+                return Error(out, "usage: PERANGE <min> <max>");
+            EquitySelection selected;
+            _Service.getPERange(min, max, selected);
+            Count(out, selected.Size());
+            out.AppendLines(selected);
+        }
+        else if (Is(cmd, "LOWESTPE")) {
+            string code=_Service.lowestPE();
+            Count(out, 1);
+            out.Append(StringRef(code.empty() ? string("Not found") : code));
+            out.Append('\n');
+        }
+        else if (Is(cmd, "CODES")) {
+            double max=HUGE_VAL;
+            if ( words.size() < 2 || words.size() > 3 || (words.size()==3 && (!Number(words[2], max) || max < 0)) )
+                return Error(out, "usage: CODES <prefix>* | *<suffix> [<max>]");
+            const StringRef& pattern=words[1];
+            size_t limit= (max >= (double)EquityQuery::NoLimit) ? EquityQuery::NoLimit : (size_t)max;
+            EquitySelection selected;
+            if (pattern[pattern.Size()-1]=='*')
+                _Service.findByCodePrefix(StringRef(pattern.Data(), pattern.Size()-1), limit, selected);
+            else if (pattern[0]=='*')
+                _Service.findByCodeSuffix(StringRef(pattern.Data()+1, pattern.Size()-1), limit, selected);
+            else
+                return Error(out, "usage: CODES <prefix>* | *<suffix> [<max>]");
+            Count(out, selected.Size());
+            for (EquitySelection::const_iterator it=selected.begin(); it != selected.end(); ++it)
+                out.AppendLine(it->GetEquityCode());
+        }
+        else if (Is(cmd, "SEARCH")) {
+            if (words.size() < 2)
+                return Error(out, "usage: SEARCH <word> [<word>...]");
+            EquitySelection selected;
+            _Service.findByDescription(StringRef(words[1].Data(), line+len-words[1].Data()), EquityQuery::NoLimit, selected);
+            Count(out, selected.Size());
+            out.AppendLines(selected);
+        }
+        else if (Is(cmd, "ALLCODES")) {
+            EquityCodeList codes=_Service.securityCodes();
+            Count(out, codes.Size());
+            out.Expect(codes.TextSize());
+            for (EquityCodeList::const_iterator it=codes.begin(); it != codes.end(); ++it)
+                out.AppendLine(*it);
+        }
+        else {
+            Error(out, "unknown command");
+        }
+    }
+
+    // strtod() rules, so negative and infinite bounds work too:
+    static bool Number(const StringRef& word, double& value) {
+        char buf[64];
+        if (word.Size() >= sizeof(buf))
+            return false;
+        memcpy(buf, word.Data(), word.Size());
+        buf[word.Size()]='\0';
+        char* end;
+        value=strtod(buf, &end);
+        return end==buf+word.Size() && value==value;
+    }
+
+    static bool Is(const StringRef& word, const char* cmd) {
+        size_t len=strlen(cmd);
+        return word.Size()==len && strncasecmp(word.Data(), cmd, len)==0;
+    }
+
+    static void Count(OutputBuffer& out, size_t n) {
+        char buf[32];
+        out.Append(buf, (size_t)snprintf(buf, sizeof(buf), "OK %lu\n", (unsigned long)n));
+    }
+
+    static void Error(OutputBuffer& out, const char* reason) {
+        out.Append(StringRef("ERR "));
+        out.Append(reason, strlen(reason));
+        out.Append('\n');
+    }
+
+    const EquityService&              _Service;
+    int                               _Port;
+    std::vector< shared_ptr<Loop> >   _Loops;
+};
+
+
+#ifdef _COMPILE_UNIT_TESTS
+
+// TestFile names a scratch file for a test, unique to this process so that
+// concurrent -t runs don't clobber each other's files, and removes the file
+// when it goes out of scope.
+class TestFile {
+public:
+    explicit TestFile(const char* name) {
+        std::ostringstream path;
+        path << "/tmp/fast-lookup-test-" << getpid() << "-" << name;
+        _Path=path.str();
+    }
+
+    ~TestFile() {
+        remove(_Path.c_str());
+    }
+
+    const char* Path() const {
+        return _Path.c_str();
+    }
+
+    // Writes an input file: the header line, then 'records'.
+    void WriteFeed(const string& records) const {
+        std::ofstream out(Path());
+        out << "HEADER:Code|Description|Market Cap|Price|P/E Ratio\n" << records;
+        if (!out)
+            throw std::runtime_error("Can't write " + _Path);
+    }
+
+    // Writes 'count' generated records, the i'th of them
+    // "<prefix><(i*1237) % codes>|<tag> <i % 10>|<i>|<i % 7>|<(i % 40) / 2>".
+    // With fewer codes than records, codes repeat (the last line wins), and
+    // there are plenty of tied prices and P/Es either way.
+    void WriteFeed(const char* prefix, const char* tag, int count, int codes) const {
+        std::ostringstream records;
+        for (int i = 0; i < count; ++i)
+            records << prefix << (long long)i*1237 % codes << "|" << tag << " " << i % 10 << "|" << i << "|" << i % 7 << "|" << (i % 40) / 2.0 << "\n";
+        WriteFeed(records.str());
+    }
+
+private:
+    TestFile(const TestFile&);
+    void operator = (const TestFile&);
+
+    string _Path;
+};
+
+class test_EquityCode {
+public:
+    test_EquityCode() {
+        // Packed ordering must agree with string ordering, including
+        // digits-before-letters and prefix-before-longer:
+        const char* codes[] = { "1398HK", "30HK", "5HK", "5HKA", "857HK", "A", "AALLN", "AAPLUS", "ZZZZZZ" };
+        const size_t n=sizeof(codes)/sizeof(*codes);
+        for (size_t i = 0; i < n; ++i) {
+            EquityCode c;
+            if (!EquityCode::Parse(codes[i], c) || c.ToString() != codes[i])
+                throw std::runtime_error("EquityCode round-trip failed");
+            for (size_t j = 0; j < n; ++j) {
+                EquityCode d;
+                EquityCode::Parse(codes[j], d);
+                if ( (c < d) != (string(codes[i]) < string(codes[j])) )
+                    throw std::runtime_error("EquityCode ordering differs from string ordering");
+            }
+        }
+
+        // Business-rule violations are rejected:
+        const char* bad[] = { "", "ibmus", "IBM US", "TOOLONG", "A-B" };
+        for (size_t i = 0; i < sizeof(bad)/sizeof(*bad); ++i) {
+            EquityCode c;
+            if (EquityCode::Parse(bad[i], c))
+                throw std::runtime_error("EquityCode accepted an invalid code");
+        }
+    }
+};
+
+class test_EquityMap {
+public:
+    test_EquityMap() {
+        // Insert enough generated codes, out of order, to force several rehashes:
+        const int n=20000;
+        EquityMap map;
+        for (int i = 0; i < n; ++i) {
+            int k=(i*7919) % n;
+            char name[8];
+            snprintf(name, sizeof(name), "T%05d", k);
+            map.Insert(EquityPtr(new Equity(name, "generated", k, k, k)));
+        }
+        // Re-inserting a code replaces its Equity (last wins):
+        map.Insert(EquityPtr(new Equity("T00042", "replaced", 1, 2, 3)));
+        if (map.Size() != (size_t)n)
+            throw std::runtime_error("EquityMap size mismatch");
+        if (map.FindByEquityName("T00042")->GetDescription() != "replaced")
+            throw std::runtime_error("EquityMap Insert is not last-wins");
+        if (map.FindByEquityName("T19999")->GetMarketCap() != 19999)
+            throw std::runtime_error("EquityMap lookup returned wrong Equity");
+
+        // Misses are reported without exceptions by TryFind(), and as a
+        // catchable domain_error by the Find methods:
+        LookupStatus status=Lookup_Found;
+        if ( map.TryFind("U00001", &status) || status != Lookup_NotFound ||
+                map.TryFind("bad", &status) || status != Lookup_InvalidCode ||
+                !map.TryFind("T00001", &status) || status != Lookup_Found )
+            throw std::runtime_error("EquityMap TryFind() status mismatch");
+        bool threw=false;
+        try {
+            map.FindByEquityName("U00001");
+        }
+        catch (std::domain_error&) {
+            threw=true;
+        }
+        if (!threw)
+            throw std::runtime_error("EquityMap FindByEquityName() did not throw on a miss");
+
+        // Batched lookups must agree with single ones, hits and misses alike,
+        // including a ragged last batch:
+        std::vector<EquityCode> probes;
+        for (int i = 0; i < 1003; ++i) {
+            char name[8];
+            snprintf(name, sizeof(name), (i % 3) ? "T%05d" : "U%05d", (i*31) % n);
+            probes.push_back(EquityCode());
+            EquityCode::Parse(name, probes.back());
+        }
+        std::vector<EquityMap::RowT> rows(probes.size());
+        map.FindRows(&probes[0], probes.size(), &rows[0]);
+        for (size_t i = 0; i < probes.size(); ++i) {
+            bool hit=(i % 3) != 0;
+            if ( hit ? (rows[i]==EquityHashIndex::NotFound || map.GetRow(rows[i]) != map.FindByEquityCode(probes[i]))
+                     : (rows[i] != EquityHashIndex::NotFound) )
+                throw std::runtime_error("EquityMap batched lookup disagrees with Find");
+        }
+
+        // Iteration must be in code order and cover every element:
+        size_t count=0;
+        EquityCode prev;
+        for (EquityMap::const_iterator it=map.begin(); it != map.end(); ++it, ++count) {
+            if (count && !(prev < it->first))
+                throw std::runtime_error("EquityMap iteration out of order");
+            prev=it->first;
+        }
+        if (count != (size_t)n)
+            throw std::runtime_error("EquityMap iteration count mismatch");
+
+        // The columnar store must track the rows, including replacements:
+        const EquityMap::Columns& cols=map.GetColumns();
+        for (size_t row = 0; row < map.Size(); ++row) {
+            const Equity& e=*map.GetRow((EquityMap::RowT)row);
+            if ( cols.Code[row] != e.GetEquityCode().Packed() || cols.PE[row] != e.GetPE_ratio() ||
+                    cols.Price[row] != e.GetPrice() || cols.MarketCap[row] != e.GetMarketCap() ||
+                    cols.Description[row] != e.GetDescription() )
+                throw std::runtime_error("EquityMap columns out of step with rows");
+        }
+
+        // Column scans must agree with the filter-based scans:
+        EquityMap byColumn, byFilter;
+        if ( map.SelectByPERange(100, 200, byColumn) != map.SelectByFilter(PE_RangeFilter(100, 200), byFilter) )
+            throw std::runtime_error("SelectByPERange disagrees with PE_RangeFilter");
+        if ( map.FindLowestPE() != map.FindByCompareFilter(LowestPE_filter()) )
+            throw std::runtime_error("FindLowestPE disagrees with LowestPE_filter");
+    }
+};
+
+class test_PEIndex {
+public:
+    test_PEIndex() {
+        // Lots of duplicate P/Es and prices, so the tie-breaks get exercised:
+        EquityMap map;
+        for (int i = 0; i < 3000; ++i) {
+            char name[8];
+            snprintf(name, sizeof(name), "P%04d", (i*1237) % 3000);
+            map.Insert(EquityPtr(new Equity(name, "", i, (double)(i % 7), (double)(i % 50) / 2.0)));
+        }
+
+        // Scan results (no index) are the reference:
+        const double ranges[][2] = { {0, 100}, {3.5, 3.5}, {5, 12.5}, {30, 40}, {-1, -0.5} };
+        std::vector< std::vector<EquityMap::RowT> > byCode, byPE;
+        for (size_t r = 0; r < sizeof(ranges)/sizeof(*ranges); ++r) {
+            byCode.push_back(std::vector<EquityMap::RowT>());
+            byPE.push_back(std::vector<EquityMap::RowT>());
+            map.SelectRowsByPERange(ranges[r][0], ranges[r][1], byCode.back(), EquityMap::Order_Code);
+            map.SelectRowsByPERange(ranges[r][0], ranges[r][1], byPE.back(), EquityMap::Order_PE);
+        }
+        EquityPtr lowest=map.FindLowestPE();
+
+        map.BuildIndexes();
+        if (!map.HasPEIndex())
+            throw std::runtime_error("BuildIndexes() did not build the P/E index");
+        for (size_t r = 0; r < sizeof(ranges)/sizeof(*ranges); ++r) {
+            std::vector<EquityMap::RowT> rows;
+            map.SelectRowsByPERange(ranges[r][0], ranges[r][1], rows, EquityMap::Order_Code);
+            if (rows != byCode[r])
+                throw std::runtime_error("P/E index range (code order) disagrees with scan");
+            rows.clear();
+            map.SelectRowsByPERange(ranges[r][0], ranges[r][1], rows, EquityMap::Order_PE);
+            if (rows != byPE[r])
+                throw std::runtime_error("P/E index range (P/E order) disagrees with scan");
+        }
+        if ( map.FindLowestPE() != lowest || lowest != map.FindByCompareFilter(LowestPE_filter()) )
+            throw std::runtime_error("P/E index lowest P/E disagrees with LowestPE_filter");
+
+        // Inserting drops the index, and queries still work:
+        map.Insert(EquityPtr(new Equity("A", "", 0, 0, -1)));
+        if ( map.HasPEIndex() || map.FindLowestPE()->GetEquityName() != "A" )
+            throw std::runtime_error("Insert() did not invalidate the P/E index");
+    }
+};
+
+class test_TickUpdates {
+public:
+    test_TickUpdates() {
+        // Updating rows in place must leave the P/E index answering exactly
+        // as a freshly built one would, across several compactions and with
+        // plenty of ties:
+        const int n=3000;
+        EquityMap map;
+        std::vector<EquityCode> codes;
+        for (int i = 0; i < n; ++i) {
+            char name[8];
+            snprintf(name, sizeof(name), "T%04d", (i*1237) % n);
+            map.Insert(EquityPtr(new Equity(name, "tick", i, (double)(i % 7), (double)(i % 50) / 2.0)));
+            codes.push_back(map.GetRow((EquityMap::RowT)i)->GetEquityCode());
+        }
+        map.BuildIndexes();
+
+        EquityUpdate missing={ EquityCode(), 1, 1, 1 };
+        EquityCode::Parse("NOPE", missing.Code);
+        if (map.ApplyUpdate(missing))
+            throw std::runtime_error("ApplyUpdate() accepted an unknown code");
+
+        unsigned seed=12345;
+        for (int i = 1; i <= 6000; ++i) {
+            seed=seed*1103515245+12345;
+            EquityUpdate u={ codes[(seed >> 8) % n], (double)((seed >> 4) % 7), (double)((seed >> 12) % 60) / 2.0 - 3, i };
+            if (i % 500==0) {
+                // Move the current minimum up, which forces a search for the next one:
+                u.Code=map.FindLowestPE()->GetEquityCode();
+                u.PE_ratio=100;
+            }
+            EquityPtr old=map.FindByEquityCode(u.Code);
+            long long oldCap=old->GetMarketCap();
+            EquityPtr e=map.ApplyUpdate(u);
+            if ( !e || e != map.FindByEquityCode(u.Code) || e->GetPE_ratio() != u.PE_ratio ||
+                 old->GetMarketCap() != oldCap || e->GetDescription() != "tick" )
+                throw std::runtime_error("ApplyUpdate() did not replace the equity");
+            if (i % 250==0)
+                Check(map);
+        }
+        if (!map.HasPEIndex())
+            throw std::runtime_error("ApplyUpdate() dropped the P/E index");
+
+        // Through the service, each batch is published whole, and is applied
+        // to both replicas even while views pin one of them:
+        EquityService srv;
+        if (!srv.initialize("test_cases/input000.txt"))
+            throw std::runtime_error("initialize() failed");
+        EquitySelection pinned;
+        srv.getPERange(-1000, 1000, pinned);
+        std::atomic<bool> stop(false), failed(false);
+        std::thread reader(&test_TickUpdates::Reader, &srv, &stop, &failed);
+        for (int k = 1; k <= 200; ++k) {
+            std::vector<EquityUpdate> batch;
+            for (size_t i = 0; i < pinned.Size(); ++i) {
+                EquityUpdate u={ pinned[i].GetEquityCode(), (double)k, (double)k, k };
+                batch.push_back(u);
+            }
+            if (k % 50==0)
+                pinned.Reset(0, shared_ptr<const void>());
+            if (srv.applyUpdates(batch) != batch.size())
+                throw std::runtime_error("applyUpdates() skipped updates");
+            string lowest=srv.lowestPE();
+            EquityPtr e=srv.getSecurityInfo(lowest.c_str());
+            if ( !e || e->GetPE_ratio() != k || e->GetPrice() != k )
+                throw std::runtime_error("applyUpdates() did not publish the batch");
+            if (k % 50==0)
+                srv.getPERange(-1000, 1000, pinned);
+        }
+        stop=true;
+        reader.join();
+        if (failed)
+            throw std::runtime_error("A reader saw a partly-applied batch");
+        EquitySelection inverted;
+        if (srv.getPERange(15.0, 6.0, inverted) != 0)
+            throw std::runtime_error("An inverted P/E range matched after updates");
+
+        // An updated record whose description is borrowed from an arena
+        // outlives the load it came from:
+        EquityService arenaSrv;
+        if (!arenaSrv.initialize("test_cases/input000.txt", EquityLoader::Load_Arena))
+            throw std::runtime_error("initialize() failed");
+        string want=arenaSrv.getSecurityInfo("MSFTUS")->GetDescription().ToString();
+        std::vector<EquityUpdate> tick(1);
+        EquityCode::Parse("MSFTUS", tick[0].Code);
+        tick[0].Price=1;
+        tick[0].PE_ratio=2;
+        tick[0].MarketCap=3;
+        if (arenaSrv.applyUpdates(tick) != 1)
+            throw std::runtime_error("applyUpdates() failed");
+        EquityPtr kept=arenaSrv.getSecurityInfo("MSFTUS");
+        if ( !arenaSrv.initialize("test_cases/input000.txt", EquityLoader::Load_Arena)
+             || !arenaSrv.initialize("test_cases/input000.txt", EquityLoader::Load_Arena) )
+            throw std::runtime_error("initialize() failed");
+        if ( kept->GetDescription() != want || kept->GetPrice() != 1 || EquityFormatter::Cached(*kept).Empty() )
+            throw std::runtime_error("An updated equity lost its description");
+    }
+
+private:
+    // Compares 'map' against a map holding the same rows with no index:
+    static void Check(const EquityMap& map) {
+        EquityMap ref;
+        for (EquityMap::RowT row = 0; row < map.Size(); ++row)
+            ref.Insert(map.GetRow(row));
+        if ( map.FindLowestPE() != ref.FindLowestPE() )
+            throw std::runtime_error("Updated P/E index lowest P/E disagrees with scan");
+        const double ranges[][2] = { {-100, 1000}, {3.5, 3.5}, {-3, 0}, {5, 12.5}, {99, 101}, {12.5, 5} };
+        for (size_t r = 0; r < sizeof(ranges)/sizeof(*ranges); ++r) {
+            for (int order = EquityMap::Order_Code; order <= EquityMap::Order_PE; ++order) {
+                std::vector<EquityMap::RowT> want, got;
+                ref.SelectRowsByPERange(ranges[r][0], ranges[r][1], want, (EquityMap::ResultOrder)order);
+                map.SelectRowsByPERange(ranges[r][0], ranges[r][1], got, (EquityMap::ResultOrder)order);
+                if (want != got)
+                    throw std::runtime_error("Updated P/E index range disagrees with scan");
+            }
+        }
+    }
+
+    static void Reader(EquityService* srv, std::atomic<bool>* stop, std::atomic<bool>* failed) {
+        while (!*stop) {
+            EquitySelection sel;
+            srv->getPERange(-1000, 1000, sel, EquityMap::Order_PE);
+            // Every batch sets all P/Es equal; the sample data's highest is 19.57:
+            if ( sel.Size() != 17 ||
+                 (sel[0].GetPE_ratio() != sel[16].GetPE_ratio() && sel[16].GetPE_ratio() != 19.57) )
+                *failed=true;
+        }
+    }
+};
+
+class test_RangeScan {
+public:
+    test_RangeScan() {
+        // Every kernel this CPU supports must agree with the scalar one,
+        // including on the ragged tail and on the range bounds themselves:
+        std::vector<double> v;
+        for (int i = 0; i < 1000; ++i)
+            v.push_back((double)((i*37) % 101) / 4.0);
+
+        for (size_t n = 0; n <= v.size(); n += 97) {
+            std::vector<uint32_t> want(n+1), got(n+1);
+            std::vector<uint64_t> wantBits(n/64+1), gotBits(n/64+1);
+            size_t nWant=RangeScan::GetSelect(RangeScan::L_Scalar)(&v[0], n, 5.0, 15.0, &want[0]);
+            RangeScan::GetBitmap(RangeScan::L_Scalar)(&v[0], n, 5.0, 15.0, &wantBits[0]);
+
+            for (int level = RangeScan::L_Scalar+1; level < RangeScan::L_COUNT; ++level) {
+                if (!RangeScan::Supported((RangeScan::Level)level))
+                    continue;
+                size_t nGot=RangeScan::GetSelect((RangeScan::Level)level)(&v[0], n, 5.0, 15.0, &got[0]);
+                if ( nGot != nWant || !std::equal(want.begin(), want.begin()+nWant, got.begin()) )
+                    throw std::runtime_error("RangeScan select kernel disagrees with scalar");
+                RangeScan::GetBitmap((RangeScan::Level)level)(&v[0], n, 5.0, 15.0, &gotBits[0]);
+                if ( !std::equal(wantBits.begin(), wantBits.begin()+(n+63)/64, gotBits.begin()) )
+                    throw std::runtime_error("RangeScan bitmap kernel disagrees with scalar");
+            }
+        }
+    }
+};
+
+class test_FilterExpr {
+public:
+    test_FilterExpr() {
+        EquityMap map;
+        for (int i = 0; i < 2000; ++i) {
+            char name[8];
+            snprintf(name, sizeof(name), "F%04d", (i*1237) % 2000);
+            map.Insert(EquityPtr(new Equity(name, "", (long long)(i % 13)*1000, (double)(i % 17), (double)(i % 40) / 2.0)));
+        }
+
+        // A combined screen, checked row by row against the plain getters:
+        std::vector<EquityMap::RowT> rows;
+        size_t n=map.SelectRows( PE_Range(5, 15) && (PriceRange(0, 4) || MarketCapRange(10000, 12000)), rows );
+        size_t want=0;
+        for (EquityMap::RowT row = 0; row < map.Size(); ++row) {
+            const Equity& e=*map.GetRow(row);
+            if ( e.GetPE_ratio() >= 5 && e.GetPE_ratio() <= 15 &&
+                    ( e.GetPrice() <= 4 || (e.GetMarketCap() >= 10000 && e.GetMarketCap() <= 12000) ) )
+                ++want;
+        }
+        if ( n != want || n != rows.size() || !n )
+            throw std::runtime_error("SelectRows() combined screen count is wrong");
+        for (size_t i = 1; i < rows.size(); ++i) {
+            if ( !(map.GetRow(rows[i-1])->GetEquityCode() < map.GetRow(rows[i])->GetEquityCode()) )
+                throw std::runtime_error("SelectRows() result is not in code order");
+        }
+
+        // A P/E-only screen agrees with the P/E index, in both orders:
+        for (int order = EquityMap::Order_Code; order <= EquityMap::Order_PE; ++order) {
+            std::vector<EquityMap::RowT> screened, indexed;
+            map.SelectRows( PE_Range(3.5, 12), screened, (EquityMap::ResultOrder)order );
+            map.SelectRowsByPERange( 3.5, 12, indexed, (EquityMap::ResultOrder)order );
+            if (screened != indexed)
+                throw std::runtime_error("SelectRows() disagrees with SelectRowsByPERange()");
+        }
+
+        // Template and virtual dispatch give the same answers:
+        const EquityFilter& byPE=PE_RangeFilter(5, 15);
+        EquityMap templated, virtualized, combined;
+        if ( map.SelectByFilter(PE_RangeFilter(5, 15), templated) != map.SelectByFilter(byPE, virtualized) ||
+                map.SelectByFilter(PE_Range(5, 15) && PriceRange(0, 1000), combined) != (int)templated.Size() ||
+                templated.Size() != virtualized.Size() )
+            throw std::runtime_error("Templated SelectByFilter() disagrees with the virtual one");
+        const EquityFilter& lowest=LowestPE_filter();
+        if ( map.FindByCompareFilter(LowestPE_filter()) != map.FindByCompareFilter(lowest) )
+            throw std::runtime_error("Templated FindByCompareFilter() disagrees with the virtual one");
+    }
+};
+
+class test_QueryEngine {
+public:
+    test_QueryEngine() {
+        // Duplicate values in every column, so each order's tie-break matters:
+        EquityMap map;
+        for (int i = 0; i < 5000; ++i) {
+            char name[8];
+            snprintf(name, sizeof(name), "Q%04d", (i*1237) % 5000);
+            map.Insert(EquityPtr(new Equity(name, "", (long long)(i % 97)*1000, (double)(i % 31) / 2.0, (double)(i % 61) / 2.0)));
+        }
+
+        const EquityQuery queries[] = {
+            EquityQuery().Where(EquityQuery::Price, 2, 6.5),
+            EquityQuery().Where(EquityQuery::MarketCap, 10000.5, 40000).Where(EquityQuery::PE, 3, 18),
+            EquityQuery().Where(EquityQuery::PE, 4, 4).OrderBy(EquityQuery::Price),
+            EquityQuery().OrderBy(EquityQuery::MarketCap, true).Limit(10),
+            EquityQuery().Where(EquityQuery::Price, 0, 3).OrderBy(EquityQuery::PE).Limit(25),
+            EquityQuery().Where(EquityQuery::PE, 0, 5).OrderBy(EquityQuery::PE, true).Limit(2000),
+            EquityQuery().OrderBy(EquityQuery::PE).Limit(1),
+            EquityQuery().Where(EquityQuery::MarketCap, 5, 1).Limit(3),
+        };
+        const size_t count=sizeof(queries)/sizeof(*queries);
+        for (int indexed = 0; indexed < 2; ++indexed) {
+            if (indexed)
+                map.BuildIndexes();
+            for (size_t q = 0; q < count; ++q) {
+                std::vector<EquityMap::RowT> rows, want;
+                BruteForce(map, queries[q], want);
+                if ( map.Query(queries[q], rows) != want.size() || rows != want )
+                    throw std::runtime_error("EquityMap::Query() disagrees with brute force");
+                if ( map.Count(queries[q]) != want.size() )
+                    throw std::runtime_error("EquityMap::Count() disagrees with brute force");
+            }
+        }
+    }
+
+private:
+    // The reference: test every row, sort everything, then truncate.
+    static void BruteForce(const EquityMap& map, const EquityQuery& query, std::vector<EquityMap::RowT>& rows) {
+        for (EquityMap::RowT row = 0; row < map.Size(); ++row) {
+            const Equity& e=*map.GetRow(row);
+            if ( InRange(query, EquityQuery::PE, e.GetPE_ratio()) && InRange(query, EquityQuery::Price, e.GetPrice()) &&
+                    InRange(query, EquityQuery::MarketCap, (double)e.GetMarketCap()) )
+                rows.push_back(row);
+        }
+        std::sort(rows.begin(), rows.end(), Order(map, query));
+        if (rows.size() > query.GetLimit())
+            rows.resize(query.GetLimit());
+    }
+
+    static bool InRange(const EquityQuery& query, EquityQuery::Field field, double value) {
+        return !query.HasRange(field) || (value >= query.Min(field) && value <= query.Max(field));
+    }
+
+    struct Order {
+        Order(const EquityMap& map, const EquityQuery& query) : _Map(map), _Query(query) {
+        }
+        bool operator () (EquityMap::RowT left, EquityMap::RowT right) const {
+            return _Query.IsDescending() ? Before(right, left) : Before(left, right);
+        }
+        bool Before(EquityMap::RowT left, EquityMap::RowT right) const {
+            const Equity& l=*_Map.GetRow(left);
+            const Equity& r=*_Map.GetRow(right);
+            switch (_Query.GetOrder()) {
+            case EquityQuery::PE:
+                if (l.GetPE_ratio() != r.GetPE_ratio())
+                    return l.GetPE_ratio() < r.GetPE_ratio();
+                if (l.GetPrice() != r.GetPrice())
+                    return l.GetPrice() < r.GetPrice();
+                return r.GetEquityCode() < l.GetEquityCode();
+            case EquityQuery::Price:
+                if (l.GetPrice() != r.GetPrice())
+                    return l.GetPrice() < r.GetPrice();
+                break;
+            case EquityQuery::MarketCap:
+                if (l.GetMarketCap() != r.GetMarketCap())
+                    return l.GetMarketCap() < r.GetMarketCap();
+                break;
+            default:
+                break;
+            }
+            return l.GetEquityCode() < r.GetEquityCode();
+        }
+        const EquityMap&   _Map;
+        const EquityQuery& _Query;
+    };
+};
+
+class test_ParallelQuery {
+public:
+    test_ParallelQuery() {
+        // Every morsel runs exactly once, including when a second caller finds
+        // the pool busy and runs its job inline:
+        MorselPool pool(4);
+        std::vector< std::atomic<int> > runs(1000);
+        for (size_t i = 0; i < runs.size(); ++i)
+            runs[i].store(0);
+        std::thread other(&test_ParallelQuery::RunAll, &pool, &runs);
+        RunAll(&pool, &runs);
+        other.join();
+        for (size_t i = 0; i < runs.size(); ++i) {
+            if (runs[i].load() != 2)
+                throw std::runtime_error("MorselPool ran a morsel the wrong number of times");
+        }
+
+        // Big enough to run in parallel, with ties in every column:
+        EquityMap map;
+        for (int i = 0; i < 150000; ++i) {
+            char name[8];
+            snprintf(name, sizeof(name), "P%X", (i*7919) % 150000);
+            map.Insert(EquityPtr(new Equity(name, "", (long long)(i % 997)*1000, (double)(i % 31) / 2.0, (double)(i % 61) / 2.0)));
+        }
+        const EquityQuery queries[] = {
+            EquityQuery().Where(EquityQuery::PE, -1, 1000),
+            EquityQuery().Where(EquityQuery::PE, 6, 15).OrderBy(EquityQuery::Code, true).Limit(50000),
+            EquityQuery().Where(EquityQuery::MarketCap, 10000.5, 40000).Where(EquityQuery::Price, 3, 9),
+            EquityQuery().Where(EquityQuery::Price, 2, 6.5).OrderBy(EquityQuery::Price),
+            EquityQuery().OrderBy(EquityQuery::MarketCap, true).Limit(300),
+            EquityQuery().Where(EquityQuery::Price, 0, 3).OrderBy(EquityQuery::PE).Limit(25),
+            EquityQuery().OrderBy(EquityQuery::PE).Limit(1),
+            EquityQuery().Where(EquityQuery::PE, 0, 5).OrderBy(EquityQuery::PE, true).Limit(2000),
+        };
+        for (int indexed = 0; indexed < 2; ++indexed) {
+            if (indexed)
+                map.BuildIndexes();
+            for (size_t q = 0; q < sizeof(queries)/sizeof(*queries); ++q) {
+                std::vector<EquityMap::RowT> serial, parallel;
+                map.SetMorselPool(0);
+                size_t n=map.Query(queries[q], serial);
+                size_t count=map.Count(queries[q]);
+                map.SetMorselPool(&pool);
+                if ( map.Query(queries[q], parallel) != n || parallel != serial || map.Count(queries[q]) != count )
+                    throw std::runtime_error("Parallel EquityMap::Query() disagrees with the serial one");
+            }
+
+            // A batch of ranges, wide and narrow, answers as one query each:
+            std::vector<EquityMap::PERange> ranges;
+            ranges.push_back(EquityMap::PERange(-1, 1000));
+            ranges.push_back(EquityMap::PERange(3, 3));
+            ranges.push_back(EquityMap::PERange(6, 15));
+            ranges.push_back(EquityMap::PERange(20, 10));
+            ranges.push_back(EquityMap::PERange(14.5, 29));
+            std::vector< std::vector<EquityMap::RowT> > batched;
+            map.SelectRowsByPERanges(ranges, batched);
+            for (size_t r = 0; r < ranges.size(); ++r) {
+                std::vector<EquityMap::RowT> rows;
+                map.SelectRowsByPERange(ranges[r].first, ranges[r].second, rows, EquityMap::Order_Code);
+                if (batched[r] != rows)
+                    throw std::runtime_error("EquityMap::SelectRowsByPERanges() disagrees with SelectRowsByPERange()");
+            }
+        }
+        map.SetMorselPool(&MorselPool::Global());
+    }
+
+private:
+    struct Bump {
+        Bump(std::vector< std::atomic<int> >* runs) : _Runs(runs) {
+        }
+        void operator () (size_t i) const {
+            ++(*_Runs)[i];
+        }
+        std::vector< std::atomic<int> >* _Runs;
+    };
+
+    static void RunAll(MorselPool* pool, std::vector< std::atomic<int> >* runs) {
+        pool->Run(runs->size(), Bump(runs));
+    }
+};
+
+class test_CodeSearch {
+public:
+    test_CodeSearch() {
+        // Codes of every length, over several exchange tags:
+        const char* tags[] = { "US", "LN", "HK", "9", "" };
+        EquityMap map;
+        for (int i = 0; i < 3000; ++i) {
+            string code;
+            for (int v = (i*7907) % 2000; ; v /= 36) {
+                code += "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ"[v % 36];
+                if (v < 36)
+                    break;
+            }
+            code=(code+tags[i % 5]).substr(0, EquityCode::MaxLen);
+            map.Insert(EquityPtr(new Equity(code.c_str(), "search", i, i, i)));
+        }
+
+        // Without the suffix index, with it, and after a new code drops it:
+        for (int pass = 0; pass < 3; ++pass) {
+            if (pass==1)
+                map.BuildIndexes();
+            if (pass==2)
+                map.Insert(EquityPtr(new Equity("AUS", "search", 0, 0, 0)));
+            const char* patterns[] = { "", "A", "AU", "1B", "US", "HK", "S", "9", "ZZZZZZ", "ZZZZZZZ", "a", "A-" };
+            const size_t limits[] = { EquityQuery::NoLimit, 0, 1, 5 };
+            for (size_t p = 0; p < sizeof(patterns)/sizeof(*patterns); ++p) {
+                for (size_t l = 0; l < sizeof(limits)/sizeof(*limits); ++l) {
+                    for (int suffix = 0; suffix < 2; ++suffix) {
+                        std::vector<EquityMap::RowT> rows;
+                        size_t n= suffix ? map.SelectRowsByCodeSuffix(patterns[p], rows, limits[l])
+                                  : map.SelectRowsByCodePrefix(patterns[p], rows, limits[l]);
+                        if ( n != rows.size() || Codes(map, rows) != Expected(map, patterns[p], suffix, limits[l]) )
+                            throw std::runtime_error("Code search results are wrong");
+                    }
+                }
+            }
+        }
+    }
+
+private:
+    static string Codes(const EquityMap& map, const std::vector<EquityMap::RowT>& rows) {
+        string codes;
+        for (size_t i = 0; i < rows.size(); ++i)
+            codes += map.GetRow(rows[i])->GetEquityCode().ToString()+" ";
+        return codes;
+    }
+
+    static string Expected(const EquityMap& map, const string& pattern, bool suffix, size_t limit) {
+        string codes;
+        size_t n=0;
+        for (EquityMap::const_iterator it=map.begin(); it != map.end() && n < limit; ++it) {
+            string code=it->first.ToString();
+            if ( code.size() >= pattern.size()
+                 && code.compare(suffix ? code.size()-pattern.size() : 0, pattern.size(), pattern)==0 ) {
+                codes += code+" ";
+                ++n;
+            }
+        }
+        return codes;
+    }
+};
+
+class test_DescriptionSearch {
+public:
+    test_DescriptionSearch() {
+        // Long lists, for galloping, and short ones; 1- and 2-char words, and
+        // words which only occur across a separator:
+        const char* words[] = { "International", "Business", "Machines", "CHINA", "Mobile", "Holdings",
+                                "Bank", "of", "A", "B2B", "Co.", "Ltd" };
+        const size_t nWords=sizeof(words)/sizeof(*words);
+        EquityMap map;
+        for (int i = 0; i < 5000; ++i) {
+            char name[8];
+            snprintf(name, sizeof(name), "D%d", (i*4099) % 5000);
+            std::ostringstream desc;
+            for (size_t w = 0; w < nWords; ++w) {
+                if ((i*(w+3)) % (w+2)==0)
+                    desc << words[w] << ((w % 3) ? " " : "-");
+            }
+            map.Insert(EquityPtr(new Equity(name, desc.str().c_str(), i, i, i)));
+        }
+
+        // Scans, the index, the index grown by new rows and by changed
+        // descriptions, and the index dropped by too many changes:
+        const char* queries[] = { "china", "MOB hold", "mobile-holdings", "b", "of a", "bank of",
+                                  "2b", "ernational co", "chinamobile", "zzz", "", " - ", "ltd b2b ma" };
+        for (int pass = 0; pass < 5; ++pass) {
+            if (pass==1)
+                map.BuildIndexes();
+            if (pass==2 || pass==4) {
+                for (int i = 0; i < (pass==2 ? 100 : 1000); ++i) {
+                    char name[8];
+                    snprintf(name, sizeof(name), "D%d", i*37 % 5500);
+                    map.Insert(EquityPtr(new Equity(name, (i % 2) ? "Changed Mobile Bank" : "china b", 0, 0, 0)));
+                }
+            }
+            for (size_t q = 0; q < sizeof(queries)/sizeof(*queries); ++q) {
+                const size_t limits[] = { EquityQuery::NoLimit, 0, 3 };
+                for (size_t l = 0; l < sizeof(limits)/sizeof(*limits); ++l) {
+                    std::vector<EquityMap::RowT> rows;
+                    size_t n=map.SelectRowsByDescription(queries[q], rows, limits[l]);
+                    if ( n != rows.size() || Codes(map, rows) != Expected(map, queries[q], limits[l]) )
+                        throw std::runtime_error("Description search results are wrong");
+                }
+            }
+        }
+    }
+
+private:
+    static string Codes(const EquityMap& map, const std::vector<EquityMap::RowT>& rows) {
+        string codes;
+        for (size_t i = 0; i < rows.size(); ++i)
+            codes += map.GetRow(rows[i])->GetEquityCode().ToString()+" ";
+        return codes;
+    }
+
+    // The slow way: lower-case everything, and look for each word:
+    static string Expected(const EquityMap& map, const string& query, size_t limit) {
+        std::vector<string> words;
+        std::istringstream split(Lower(query));
+        for (string word; split >> word; )
+            words.push_back(word);
+        string codes;
+        size_t n=0;
+        for (EquityMap::const_iterator it=map.begin(); it != map.end() && n < limit && !words.empty(); ++it) {
+            string text=Lower(it->second->GetDescription().ToString());
+            bool all=true;
+            for (size_t w = 0; w < words.size(); ++w)
+                all = all && text.find(words[w]) != string::npos;
+            if (all) {
+                codes += it->first.ToString()+" ";
+                ++n;
+            }
+        }
+        return codes;
+    }
+
+    static string Lower(string text) {
+        for (size_t i = 0; i < text.size(); ++i)
+            text[i]= isalnum((unsigned char)text[i]) ? (char)tolower((unsigned char)text[i]) : ' ';
+        return text;
+    }
+};
+
+class test_FieldScanner {
+public:
+    test_FieldScanner() {
+        // Compare against the std::stoll/std::stod rules FieldScanner replaces,
+        // on generated fields mixing digits, dots and leading blanks:
+        const char alphabet[]="0123456789.. \t";
+        unsigned seed=12345;
+        for (int i = 0; i < 200000; ++i) {
+            string field;
+            int len=Next(seed) % 24;
+            for (int j = 0; j < len; ++j)
+                field += alphabet[Next(seed) % (sizeof(alphabet)-1)];
+
+            double want=0, got=0;
+            bool wantOk=ReferenceDouble(field, want);
+            bool gotOk=FieldScanner::ParseDouble(field, got);
+            if ( wantOk != gotOk || (wantOk && memcmp(&want, &got, sizeof(want)) != 0) )
+                throw std::runtime_error("FieldScanner::ParseDouble disagrees with std::stod on '" + field + "'");
+
+            long long wantI=0, gotI=0;
+            wantOk=ReferenceInt(field, wantI);
+            gotOk=FieldScanner::ParseInt(field, gotI);
+            if ( wantOk != gotOk || (wantOk && wantI != gotI) )
+                throw std::runtime_error("FieldScanner::ParseInt disagrees with std::stoll on '" + field + "'");
+        }
+
+        // Range limits:
+        long long v;
+        if ( !FieldScanner::ParseInt(string("9223372036854775807"), v) || FieldScanner::ParseInt(string("9223372036854775808"), v) )
+            throw std::runtime_error("FieldScanner::ParseInt range check failed");
+        double d;
+        if ( FieldScanner::ParseDouble(string(400, '9'), d) || FieldScanner::ParseDouble("." + string(400, '0') + "1", d) )
+            throw std::runtime_error("FieldScanner::ParseDouble range check failed");
+    }
+
+private:
+    static unsigned Next(unsigned& seed) {
+        seed=seed*1103515245u+12345u;
+        return seed >> 8;
+    }
+
+    static bool ReferenceInt(const string& field, long long& target) {
+        string input=LTrim(field);
+        if ( input.find_first_not_of("0123456789") != string::npos )
+            return false;
+        try {
+            target=std::stoll(input);
+        }
+        catch (std::exception&) {
+            return false;
+        }
+        return true;
+    }
+
+    static bool ReferenceDouble(const string& field, double& target) {
+        string input=LTrim(field);
+        if ( input.find_first_not_of("0123456789.") != string::npos )
+            return false;
+        try {
+            target=std::stod(input);
+        }
+        catch (std::exception&) {
+            return false;
+        }
+        return true;
+    }
+};
+
+class test_EquityFormatter {
+public:
+    test_EquityFormatter() {
+        // Fixed3() against printf, on random values and on values at and
+        // around the rounding boundaries:
+        unsigned seed=4242;
+        for (int i = 0; i < 200000; ++i) {
+            double v;
+            switch (i % 4) {
+            case 0:
+                v=(double)Next(seed) / 1000.0 - 8000.0;
+                break;
+            case 1:
+                v=((double)(Next(seed) % 2000000) + 0.5) / 1000.0;
+                break;
+            case 2:
+                v=std::ldexp((double)Next(seed), (int)(Next(seed) % 120) - 60);
+                break;
+            default:
+                v=std::nextafter(((double)(Next(seed) % 100000) + 0.5) / 1000.0, (i & 4) ? HUGE_VAL : -HUGE_VAL);
+                break;
+            }
+            CheckFixed3(v);
+            CheckFixed3(-v);
+        }
+        const double special[] = { 0.0, -0.0, 0.0005, -0.0004999, 1e15, 4.5e12, 1e300, HUGE_VAL, -HUGE_VAL, NAN };
+        for (size_t i = 0; i < sizeof(special)/sizeof(*special); ++i)
+            CheckFixed3(special[i]);
+
+        // Whole records against the iostream rendering, including one too long
+        // for the stack buffer:
+        Equity plain("IBMUS", "International Business Machines", 198657057012LL, 182.95, 11.18);
+        Equity longer("ABC", string(2000, 'x').c_str(), -5, 0.0005, -1e300);
+        const Equity* records[] = { &plain, &longer };
+        for (size_t i = 0; i < sizeof(records)/sizeof(*records); ++i) {
+            std::ostringstream want, got;
+            want << "code: " << records[i]->GetEquityCode() << " description: " << records[i]->GetDescription()
+                 << std::fixed << std::setprecision(3) << " last price: " << records[i]->GetPrice()
+                 << " market cap: " << (double)records[i]->GetMarketCap()/(double)1000000.0 << " Million "
+                 << " P/E: " << records[i]->GetPE_ratio();
+            got << *records[i];
+            if (got.str() != want.str())
+                throw std::runtime_error("Equity rendering differs from iostreams: " + got.str());
+
+            // The cached rendering is the same text, and is only made once:
+            StringRef first=EquityFormatter::Cached(*records[i]);
+            StringRef again=EquityFormatter::Cached(*records[i]);
+            std::ostringstream cached;
+            cached << *records[i];
+            if ( string(first.Data(), first.Size()) != want.str() || first.Data() != again.Data() || cached.str() != want.str() )
+                throw std::runtime_error("Cached Equity rendering is wrong");
+        }
+
+        // A tick replaces the record, so it's rendered afresh:
+        EquityMap map;
+        map.Insert(EquityPtr(new Equity(plain)));
+        EquityFormatter::Cached(*map.TryFind("IBMUS"));
+        EquityUpdate tick;
+        EquityCode::Parse("IBMUS", tick.Code);
+        tick.Price=200;
+        tick.MarketCap=plain.GetMarketCap();
+        tick.PE_ratio=12.5;
+        StringRef line=EquityFormatter::Cached(*map.ApplyUpdate(tick));
+        if ( string(line.Data(), line.Size()).find("last price: 200.000 ") == string::npos )
+            throw std::runtime_error("Cached rendering survived a tick update");
+    }
+
+private:
+    static unsigned Next(unsigned& seed) {
+        seed=seed*1103515245u+12345u;
+        return seed >> 8;
+    }
+
+    static void CheckFixed3(double v) {
+        char want[EquityFormatter::NumberMax], got[EquityFormatter::NumberMax];
+        snprintf(want, sizeof(want), "%.3f", v);
+        size_t len=EquityFormatter::Fixed3(v, got);
+        if (string(got, len) != want)
+            throw std::runtime_error(string("EquityFormatter::Fixed3 disagrees with printf on ") + want);
+    }
+};
+
+class test_OutputBuffer {
+public:
+    test_OutputBuffer() {
+        EquityMap map;
+        for (int i = 0; i < 300; ++i) {
+            char name[8];
+            snprintf(name, sizeof(name), "W%03d", i);
+            map.Insert(EquityPtr(new Equity(name, (i % 100) ? "Widgets" : string(500, 'w').c_str(), i*1000000LL, i/4.0, i/8.0)));
+        }
+        EquityFormatter::Cached(*map.TryFind("W007"));
+        EquitySelection all;
+        map.SelectRowsByPERange(-HUGE_VAL, HUGE_VAL, all.Reset(&map, shared_ptr<const void>()), EquityMap::Order_Code);
+        std::ostringstream want;
+        for (EquitySelection::const_iterator it=all.begin(); it != all.end(); ++it)
+            want << it->GetEquityCode() << '\n';
+        for (EquitySelection::const_iterator it=all.begin(); it != all.end(); ++it)
+            want << *it << '\n';
+
+        // Growing storage holds it all, and reuses its storage after Clear():
+        OutputBuffer grown(-1, 16);
+        for (int pass = 0; pass < 2; ++pass) {
+            grown.Clear();
+            Fill(grown, map, all);
+            if (string(grown.Data(), grown.Size()) != want.str())
+                throw std::runtime_error("OutputBuffer contents are wrong");
+        }
+
+        // Fixed storage bound to a file descriptor flushes as it fills, even
+        // for lines bigger than the whole buffer:
+        int fds[2];
+        if (pipe(fds) != 0)
+            throw std::runtime_error("pipe() failed");
+        {
+            char storage[100];
+            OutputBuffer piped(storage, sizeof(storage), fds[1]);
+            Fill(piped, map, all);
+            piped.Flush();
+        }
+        close(fds[1]);
+        string got;
+        char chunk[4096];
+        for (ssize_t n; (n=read(fds[0], chunk, sizeof(chunk))) > 0; )
+            got.append(chunk, n);
+        close(fds[0]);
+        if (got != want.str())
+            throw std::runtime_error("OutputBuffer output via a pipe is wrong");
+
+        // Fixed storage with nowhere to flush to:
+        char tiny[8];
+        OutputBuffer unbound(tiny, sizeof(tiny));
+        bool threw=false;
+        try {
+            unbound.Append("too long", 8);
+            unbound.Append('!');
+        }
+        catch (std::length_error&) {
+            threw=true;
+        }
+        if (!threw)
+            throw std::runtime_error("OutputBuffer overflowed its storage");
+    }
+
+private:
+    static void Fill(OutputBuffer& out, const EquityMap& map, const EquitySelection& all) {
+        EquityCodeList codes(map);
+        out.Expect(codes.TextSize());
+        for (EquityCodeList::const_iterator it=codes.begin(); it != codes.end(); ++it)
+            out.AppendLine(*it);
+        out.AppendLines(all);
+    }
+};
+
+#ifdef _COMPILE_METRICS
+class test_Metrics {
+public:
+    test_Metrics() {
+        // Bucket bounds: exact below 16ns, and within 1/16th above:
+        for (uint64_t ns = 0; ns < 1000000; ns += 1 + ns/50) {
+            size_t b=LatencyHistogram::Bucket(ns);
+            uint64_t upper=LatencyHistogram::UpperBound(b);
+            uint64_t lower= b ? LatencyHistogram::UpperBound(b-1)+1 : 0;
+            if ( ns < lower || ns > upper || (ns < 16 && upper != ns) || (double)(upper-lower) > (double)ns/16.0 )
+                throw std::runtime_error("LatencyHistogram bucket bounds are wrong");
+        }
+        LatencyHistogram h;
+        for (uint64_t ns = 1; ns <= 1000; ++ns)
+            h.Record(ns*1000);
+        LatencyHistogram::Totals t;
+        h.AddTo(t);
+        uint64_t median=t.Quantile(0.5), top=t.Quantile(1.0);
+        if ( t.Count != 1000 || t.Sum != 500500000 || median < 500000 || median > 500000*17/16 || top < 1000000 )
+            throw std::runtime_error("LatencyHistogram quantiles are wrong");
+
+        // The service's counters and timers move:
+        std::ostringstream before, after;
+        EquityService srv;
+        srv.writeMetrics(before);
+        if ( !srv.initialize("test_cases/input000.txt") )
+            throw std::runtime_error("initialize() failed");
+        std::istringstream feed("HEADER:Code|Description|Market Cap|Price|P/E Ratio\nIBMUS|IBM|1|2|3\nnot a record\n");
+        if ( !srv.initialize(feed) )
+            throw std::runtime_error("initialize() failed");
+        srv.getSecurityInfo("IBMUS");
+        srv.getSecurityInfo("NOSUCH");
+        srv.getSecurityInfo("not valid");
+        if ( !srv.writeMetrics(after) )
+            throw std::runtime_error("writeMetrics() failed");
+        const char* events[] = { "lookup_hit", "lookup_miss", "lookup_invalid_code", "parse_reject", "insert" };
+        for (size_t i = 0; i < sizeof(events)/sizeof(*events); ++i) {
+            string line=string("fast_lookup_events_total{event=\"") + events[i] + "\"} ";
+            if ( !(Value(after.str(), line) > Value(before.str(), line)) )
+                throw std::runtime_error(string("Metrics counter didn't move: ") + events[i]);
+        }
+        const char* ops[] = { "initialize", "getSecurityInfo", "load_read", "load_parse", "load_insert", "load_index_build" };
+        for (size_t i = 0; i < sizeof(ops)/sizeof(*ops); ++i) {
+            string line=string("fast_lookup_latency_seconds_count{op=\"") + ops[i] + "\"} ";
+            if ( !(Value(after.str(), line) > Value(before.str(), line)) )
+                throw std::runtime_error(string("Metrics timer didn't move: ") + ops[i]);
+        }
+    }
+
+private:
+    // Returns the value on the line of Prometheus text starting with 'prefix':
+    static double Value(const string& text, const string& prefix) {
+        size_t at=text.find("\n" + prefix);
+        if (at==string::npos)
+            throw std::runtime_error("Missing metric: " + prefix);
+        return atof(text.c_str()+at+1+prefix.size());
+    }
+};
+#endif
+
+class test_EquityParser {
+public:
+    test_EquityParser() {
+        EquityTextFactory fact_00;
+        try {
+            EquityPtr ptr=fact_00.ParseEquity("IBMUS|International Business Machines|198657057012|182.95|11.18");
+            std::cerr <<  *ptr << std::endl;
+        }
+        catch (std::exception e) {
+            std::cerr << e.what() << std::endl;
+        }
+
+        // Field-count rules: a single trailing '|' is tolerated, others are not.
+        if ( !fact_00.ParseEquity("IBMUS|IBM|1|2|3|") || fact_00.ParseEquity("IBMUS|IBM|1|2|3||") ||
+                fact_00.ParseEquity("IBMUS|IBM|1|2") || fact_00.ParseEquity("") )
+            throw std::runtime_error("EquityTextFactory field-count validation failed");
+        if ( fact_00.ParseEquity("IBMUS|IBM|1|2|") || fact_00.ParseEquity("IBMUS|IBM| |2|3") ||
+                fact_00.ParseEquity("ibmus|IBM|1|2|3") || fact_00.ParseEquity("IBMUS|IBM|1|-2|3") )
+            throw std::runtime_error("EquityTextFactory field validation failed");
+        EquityPtr spaced=fact_00.ParseEquity("30HK|ABC| 261544852|0.158|0.11");
+        if ( !spaced || spaced->GetMarketCap() != 261544852 || spaced->GetPrice() != 0.158 )
+            throw std::runtime_error("EquityTextFactory mis-parsed a record");
+    }
+};
+
+class test_EquityLoader {
+public:
+    test_EquityLoader() {
+        // Stream, mapped and mapped-with-borrowed-descriptions loads must agree:
+        EquityMap streamed, mapped, borrowed;
+        std::ifstream test_input("test_cases/input000.txt");
+        if (! test_input.is_open()) {
+            throw std::runtime_error("Can't open input000.txt");
         }
-        return EquityPtr();
+        EquityLoader( test_input, streamed );
+        EquityLoader( "test_cases/input000.txt", mapped );
+        EquityLoader( "test_cases/input000.txt", borrowed, EquityLoader::Load_BorrowDescriptions );
+
+        if ( streamed.Size() != 17 || mapped.Size() != 17 || borrowed.Size() != 17 )
+            throw std::runtime_error("EquityLoader record count mismatch");
+        EquityMap::const_iterator m=mapped.begin(), b=borrowed.begin();
+        for (EquityMap::const_iterator it=streamed.begin(); it != streamed.end(); ++it, ++m, ++b) {
+            const Equity& e=*it->second;
+            if ( !Same(e, *m->second) || !Same(e, *b->second) )
+                throw std::runtime_error("Mapped load differs from stream load");
+            if ( !m->second->OwnsDescription() || b->second->OwnsDescription() )
+                throw std::runtime_error("Load_BorrowDescriptions not honoured");
+        }
+
+        // Arena loads (sequential and parallel) must agree too, with repeated
+        // descriptions stored once:
+        EquityPtr survivor;
+        {
+            EquityMap arena, parallelArena;
+            EquityLoader( "test_cases/input000.txt", arena, EquityLoader::Load_Arena );
+            EquityLoader( "test_cases/input000.txt", parallelArena, EquityLoader::Load_Arena|EquityLoader::Load_Parallel );
+            EquityMap::const_iterator a=arena.begin(), pa=parallelArena.begin();
+            for (EquityMap::const_iterator it=streamed.begin(); it != streamed.end(); ++it, ++a, ++pa) {
+                if ( !Same(*it->second, *a->second) || !Same(*it->second, *pa->second) )
+                    throw std::runtime_error("Arena load differs from stream load");
+                if (a->second->OwnsDescription())
+                    throw std::runtime_error("Arena record owns its description");
+            }
+            survivor=arena.FindByEquityName("IBMUS");
+        }
+        // The arena outlives its map for as long as a record is referenced:
+        if (survivor->GetDescription() != "International Business Machines")
+            throw std::runtime_error("Arena released while a record was still referenced");
+
+        // A string exactly one chunk long gets a chunk of its own, which
+        // later strings mustn't be written into:
+        {
+            StringPool pool;
+            string big(StringPool::ChunkSize, 'x');
+            pool.Add("abc");
+            StringRef added=pool.Add(big);
+            StringRef after=pool.Add("yyyy");
+            if ( added != big || after != "yyyy" )
+                throw std::runtime_error("StringPool overwrote a chunk-sized string");
+        }
+
+        EquityArenaPtr arena(new EquityArena);
+        StringRef first=arena->Intern("CHINA MOBILE");
+        if ( arena->Intern(string("CHINA MOBILE")).Data() != first.Data() || arena->Intern("CHINA").Data()==first.Data() )
+            throw std::runtime_error("EquityArena::Intern does not de-duplicate");
+
+        // An empty file has no header line:
+        bool threw=false;
+        try {
+            EquityMap empty;
+            EquityLoader( "/dev/null", empty );
+        }
+        catch (std::runtime_error&) {
+            threw=true;
+        }
+        if (!threw)
+            throw std::runtime_error("EquityLoader accepted an empty file");
     }
 
 private:
+    static bool Same(const Equity& a, const Equity& b) {
+        return a.GetEquityCode()==b.GetEquityCode() && a.GetDescription()==b.GetDescription() &&
+               a.GetMarketCap()==b.GetMarketCap() && a.GetPrice()==b.GetPrice() && a.GetPE_ratio()==b.GetPE_ratio();
+    }
+};
+
+class test_ParallelLoader {
+public:
+    test_ParallelLoader() {
+        // Enough text for several chunks, with duplicate codes (the last line
+        // must win) and bad records (reported in input order):
+        std::ostringstream text;
+        for (int i = 0; i < 60000; ++i) {
+            if (i % 997 == 0)
+                text << "BAD LINE " << i << "\n";
+            text << "Q" << (i*31) % 20000 << "|line " << i << "|" << i << "|" << i % 100 << ".5|" << i % 37 << "\n";
+        }
+        TestFile file("parallel.txt");
+        file.WriteFeed(text.str());
 
+        EquityMap sequential, parallel;
+        string seqReport=CaptureReport(file.Path(), sequential, EquityLoader::Load_Default);
+        string parReport=CaptureReport(file.Path(), parallel, EquityLoader::Load_Parallel);
 
-    void printBadRecordMsg(const string& context) const {
-        cout << "Not found\n";
-        Stub() << "Failed at " << context << std::endl;
+        if ( parallel.Size() != 20000 || parallel.Size() != sequential.Size() )
+            throw std::runtime_error("Parallel load record count mismatch");
+        if ( parReport != seqReport || parReport.empty() )
+            throw std::runtime_error("Parallel load reported bad records differently");
+        EquityMap::const_iterator p=parallel.begin();
+        for (EquityMap::const_iterator it=sequential.begin(); it != sequential.end(); ++it, ++p) {
+            if ( it->first != p->first || it->second->GetDescription() != p->second->GetDescription() )
+                throw std::runtime_error("Parallel load differs from sequential load");
+        }
     }
 
-    // Validates the EquityName against business rules: it must conform to:
-    //      1.  charset: [A-Z0-9]+
-    //      2.  length: 1 <= length <= 6 chars
-    bool parse_EquityName( const string& rawField, string& target ) {
+private:
+    // Loads 'path', returning what was written to stdout:
+    static string CaptureReport(const char* path, EquityMap& map, int flags) {
+        std::ostringstream report;
+        std::streambuf* orig=cout.rdbuf(report.rdbuf());
+        try {
+            EquityLoader( path, map, flags, 4 );
+        }
+        catch (...) {
+            cout.rdbuf(orig);
+            throw;
+        }
+        cout.rdbuf(orig);
+        return report.str();
+    }
+};
+
+class test_EquityReload {
+public:
+    test_EquityReload() {
+        // Two data sets to flip between: the sample input, and one whose P/Es
+        // all fall outside [6,15].
+        TestFile file("reload.txt");
+        {
+            std::ostringstream records;
+            for (int i = 0; i < 1000; ++i)
+                records << "R" << i << "|other|" << i << "|1.5|5\n";
+            file.WriteFeed(records.str());
+        }
+        const char* other=file.Path();
+
+        EquityService srv;
+        if (!srv.initialize("test_cases/input000.txt"))
+            throw std::runtime_error("initialize() failed");
+
+        // A pinned view must survive the snapshot it came from being replaced:
+        EquitySelection pinned;
+        srv.getPERange(6.0, 15.0, pinned);
+
+        // Readers must see one data set or the other, never a mixture or a
+        // freed one, while reloads swap them underneath:
+        std::atomic<bool> stop(false), failed(false);
+        std::vector<std::thread> readers;
+        for (int i = 0; i < 3; ++i)
+            readers.push_back(std::thread(&test_EquityReload::Reader, &srv, &stop, &failed));
+
+        for (int i = 0; i < 20; ++i) {
+            if ( !srv.reload( (i % 2) ? "test_cases/input000.txt" : other ).get() )
+                throw std::runtime_error("reload() failed");
+        }
+        stop=true;
+        for (size_t i = 0; i < readers.size(); ++i)
+            readers[i].join();
+        if (failed)
+            throw std::runtime_error("A reader saw inconsistent data during reload");
+
+        if ( srv.allSecurityCodes().find("R10\n") != string::npos || !srv.getSecurityInfo("IBMUS") )
+            throw std::runtime_error("reload() did not publish the last load");
+        double total=0;
+        for (EquitySelection::const_iterator it=pinned.begin(); it != pinned.end(); ++it)
+            total += it->GetPE_ratio();
+        if ( pinned.Size() != 11 || total <= 0 )
+            throw std::runtime_error("Pinned view was not preserved across reloads");
+
+        // A failed load leaves the current data in place:
+        if ( srv.initialize("/nonexistent/input.txt") || !srv.getSecurityInfo("IBMUS") )
+            throw std::runtime_error("Failed initialize() replaced the current data");
+    }
+
+private:
+    static void Reader(EquityService* srv, std::atomic<bool>* stop, std::atomic<bool>* failed) {
+        while (!*stop) {
+            EquitySelection sel;
+            int n=srv->getPERange(6.0, 15.0, sel);
+            string lowest=srv->lowestPE();
+            bool sample = (lowest=="AALLN");
+            if ( (n != 11 && n != 0) || (!sample && lowest.compare(0, 1, "R") != 0) )
+                *failed=true;
+            for (EquitySelection::const_iterator it=sel.begin(); it != sel.end(); ++it) {
+                if ( it->GetPE_ratio() < 6.0 || it->GetPE_ratio() > 15.0 )
+                    *failed=true;
+            }
+        }
+    }
+};
+
+class test_EquityService {
+public:
+    test_EquityService() {
+        EquityService srv;
+
+        // Test loading the EquityService with a known data stream:
+        std::ifstream test_input("test_cases/input000.txt");
+        if (! test_input.is_open()) {
+            throw std::runtime_error("Can't open input000.txt");
+        }
+        const int input000_record_count=17;
+        srv.initialize(test_input);
+
+        {
+            // Select all the equities in given range:
+            EquityMap selected;
+            int count=srv.getPERange( 6.0, 15.0, selected );
+            if (count != 11) {
+                throw std::runtime_error("Incorrect number of P/E-range matches");
+            }
+
+            // The view must hold the same equities, in the same order:
+            EquitySelection view;
+            if (srv.getPERange( 6.0, 15.0, view ) != count)
+                throw std::runtime_error("Incorrect number of P/E-range view matches");
+            EquitySelection::const_iterator v=view.begin();
+            for (EquityMap::const_iterator it=selected.begin(); it != selected.end(); ++it, ++v) {
+                if ( &*v != &*it->second )
+                    throw std::runtime_error("P/E-range view differs from EquityMap result");
+            }
+
+            // A screen on the same range finds the same equities:
+            EquitySelection screened;
+            if ( srv.screen( PE_Range(6.0, 15.0), screened ) != count || screened.GetRows() != view.GetRows() )
+                throw std::runtime_error("screen() differs from getPERange()");
+
+            // P/E order is ascending:
+            srv.getPERange( 6.0, 15.0, view, EquityMap::Order_PE );
+            for (size_t i = 1; i < view.Size(); ++i) {
+                if ( view[i].GetPE_ratio() < view[i-1].GetPE_ratio() )
+                    throw std::runtime_error("P/E-range view is not in P/E order");
+            }
+        }
+
+        {
+            // Make sure we can retrieve a security:
+            EquityPtr p=srv.getSecurityInfo("MSFTUS");
+            if ( !p || (p->GetEquityName() != "MSFTUS" ))
+                throw std::runtime_error("Can't find MSFTUS");
+
+            // ...and that a miss just gives a null pointer:
+            LookupStatus status;
+            if ( srv.getSecurityInfo("NOSUCH", &status) || status != Lookup_NotFound )
+                throw std::runtime_error("getSecurityInfo() miss mishandled");
+        }
+
+        {
+            // A batch reports each miss in its own slot:
+            const char* names[] = { "MSFTUS", "NOSUCH", "ibm us", "30HK", "", "IBMUS" };
+            const LookupStatus want[] = { Lookup_Found, Lookup_NotFound, Lookup_InvalidCode,
+                                          Lookup_Found, Lookup_InvalidCode, Lookup_Found };
+            std::vector<string> codes(names, names+sizeof(names)/sizeof(*names));
+            std::vector<EquityPtr> found;
+            std::vector<LookupStatus> status;
+            if ( srv.getSecurityInfoBatch(codes, found, &status) != 3 || found.size() != codes.size() )
+                throw std::runtime_error("getSecurityInfoBatch() found the wrong number of codes");
+            for (size_t i = 0; i < codes.size(); ++i) {
+                if ( status[i] != want[i] || (found[i] ? found[i]->GetEquityName() != codes[i] : want[i]==Lookup_Found) )
+                    throw std::runtime_error("getSecurityInfoBatch() result mismatch");
+            }
+        }
+
+        {
+            // Verify that we can retrieve all security codes:
+            string allCodes=srv.allSecurityCodes();
+            // How many records did we get?
+            StringSplitter sp( allCodes, '\n');
+            if (sp.size() != input000_record_count)
+                throw std::runtime_error("Invalid record count for allSecurityCodes()");
+
+            // The lazy list must produce the same codes:
+            EquityCodeList codes=srv.securityCodes();
+            if (codes.TextSize() != allCodes.size())
+                throw std::runtime_error("EquityCodeList::TextSize() mismatch");
+            size_t i=0;
+            for (EquityCodeList::const_iterator it=codes.begin(); it != codes.end(); ++it, ++i) {
+                if (it->ToString() != sp[i])
+                    throw std::runtime_error("EquityCodeList differs from allSecurityCodes()");
+            }
+
+        }
+        {
+            // Find the lowest P/E:
+            string lowestPe=srv.lowestPE();
+            Stub() << "Lowest P/E:" << lowestPe << std::endl;
+        }
+
+        {
+            // Equities borrowing descriptions from a mapped file outlive it,
+            // in or out of an arena:
+            const int flags[] = { EquityLoader::Load_BorrowDescriptions,
+                                  EquityLoader::Load_BorrowDescriptions|EquityLoader::Load_Arena,
+                                  EquityLoader::Load_BorrowDescriptions|EquityLoader::Load_Arena|EquityLoader::Load_Parallel };
+            for (size_t i = 0; i < sizeof(flags)/sizeof(*flags); ++i) {
+                EquityService borrowed;
+                if (!borrowed.initialize("test_cases/input000.txt", flags[i]))
+                    throw std::runtime_error("initialize() failed");
+                EquityPtr kept=borrowed.getSecurityInfo("MSFTUS");
+                string want=kept->GetDescription().ToString();
+                if ( !borrowed.initialize("test_cases/input000.txt") || !borrowed.initialize("test_cases/input000.txt") )
+                    throw std::runtime_error("initialize() failed");
+                if ( kept->GetDescription() != want || EquityFormatter::Cached(*kept).Empty() )
+                    throw std::runtime_error("A borrowing equity lost its description");
+            }
+        }
+
+    }
+};
+
+class test_EquityBatcher {
+public:
+    test_EquityBatcher() {
+        EquityService srv;
+        if (!srv.initialize("test_cases/input000.txt"))
+            throw std::runtime_error("initialize() failed");
+
+        const char* codes[] = { "IBMUS", "AAPLUS", "AALLN", "30HK", "NOSUCH", "bad code", "IBMUS" };
+        const double ranges[][2] = { {6, 15}, {-1000, 1000}, {6, 15}, {3, 3}, {NAN, 5}, {15, 6} };
+        const size_t nCodes=sizeof(codes)/sizeof(*codes), nRanges=sizeof(ranges)/sizeof(*ranges);
+        std::vector<EquityPtr> found(nCodes);
+        std::vector<LookupStatus> status(nCodes);
+        std::vector<EquitySelection> selected(nRanges);
+        std::promise<void> entered, go;
+        {
+            EquityBatcher batcher(srv);
+            // Hold the dispatcher in the first request's callback, so the rest
+            // queue up behind it and are answered in a single pass:
+            batcher.getSecurityInfo("IBMUS", Wait(&entered, go.get_future().share()));
+            entered.get_future().wait();
+            for (size_t i = 0; i < nCodes; ++i)
+                batcher.getSecurityInfo(codes[i], StoreLookup(&found[i], &status[i]));
+            for (size_t i = 0; i < nRanges; ++i)
+                batcher.getPERange(ranges[i][0], ranges[i][1], StoreRange(&selected[i]));
+            go.set_value();
+            batcher.Flush();
+            if (batcher.Batches() != 2)
+                throw std::runtime_error("EquityBatcher didn't coalesce the queued requests");
+
+            // Callbacks may make requests of their own:
+            EquityPtr again;
+            LookupStatus againStatus;
+            batcher.getSecurityInfo("AAPLUS", Chain(&batcher, &again, &againStatus));
+            batcher.Flush();    // The chained request is made before this returns,
+            batcher.Flush();    // so this waits for it.
+            if (again != srv.getSecurityInfo("30HK"))
+                throw std::runtime_error("EquityBatcher chained request failed");
+        }
+
+        for (size_t i = 0; i < nCodes; ++i) {
+            LookupStatus want;
+            EquityPtr e=srv.getSecurityInfo(codes[i], &want);
+            if (found[i] != e || status[i] != want)
+                throw std::runtime_error("EquityBatcher lookup differs from getSecurityInfo()");
+        }
+        for (size_t i = 0; i < nRanges; ++i) {
+            EquitySelection want;
+            srv.getPERange(ranges[i][0], ranges[i][1], want);
+            if (selected[i].GetRows() != want.GetRows())
+                throw std::runtime_error("EquityBatcher P/E range differs from getPERange()");
+        }
+        if (selected[0].Size() != 11)
+            throw std::runtime_error("EquityBatcher P/E range is wrong");
+    }
+
+private:
+    struct Wait {
+        Wait(std::promise<void>* entered, const std::shared_future<void>& go) : _Entered(entered), _Go(go) {
+        }
+        void operator () (const EquityPtr&, LookupStatus) const {
+            _Entered->set_value();
+            _Go.wait();
+        }
+        std::promise<void>*      _Entered;
+        std::shared_future<void> _Go;
+    };
+
+    struct StoreLookup {
+        StoreLookup(EquityPtr* e, LookupStatus* status) : _Equity(e), _Status(status) {
+        }
+        void operator () (const EquityPtr& e, LookupStatus status) const {
+            *_Equity=e;
+            *_Status=status;
+        }
+        EquityPtr*    _Equity;
+        LookupStatus* _Status;
+    };
+
+    struct StoreRange {
+        StoreRange(EquitySelection* selected) : _Selected(selected) {
+        }
+        void operator () (const EquitySelection& selected) const {
+            *_Selected=selected;
+        }
+        EquitySelection* _Selected;
+    };
+
+    struct Chain {
+        Chain(EquityBatcher* batcher, EquityPtr* e, LookupStatus* status) : _Batcher(batcher), _Equity(e), _Status(status) {
+        }
+        void operator () (const EquityPtr&, LookupStatus) const {
+            _Batcher->getSecurityInfo("30HK", StoreLookup(_Equity, _Status));
+        }
+        EquityBatcher* _Batcher;
+        EquityPtr*     _Equity;
+        LookupStatus*  _Status;
+    };
+};
+
+class test_EquityServer {
+public:
+    test_EquityServer() {
+        // Enough codes that ALLCODES overflows the socket buffers: S0 to
+        // S59999, each once.
+        TestFile feed("server.txt");
+        feed.WriteFeed("S", "server", 60000, 60000);
+        EquityService srv;
+        if (!srv.initialize(feed.Path()))
+            throw std::runtime_error("initialize() failed");
+        EquityServer server(srv, 0, 2);
+
+        // Pipelined requests, split mid-line, and what they should produce:
+        string requests="GET S17\r\nMGET S1 NOPE bad!code S2\nPERANGE 3 3.5\nLOWESTPE\nALLCODES\nBOGUS\nCODES S123* 4\nCODES *999\nCODES S1\nSEARCH Server 7\nGET S4\n";
+        std::ostringstream want;
+        want << "OK 1\n" << *srv.getSecurityInfo("S17") << "\n";
+        want << "OK 4\n" << *srv.getSecurityInfo("S1") << "\nNot found\nInvalid code\n" << *srv.getSecurityInfo("S2") << "\n";
+        EquitySelection range;
+        srv.getPERange(3, 3.5, range);
+        want << "OK " << range.Size() << "\n";
+        for (EquitySelection::const_iterator it=range.begin(); it != range.end(); ++it)
+            want << *it << "\n";
+        want << "OK 1\n" << srv.lowestPE() << "\n";
+        want << "OK 60000\n" << srv.allSecurityCodes();
+        want << "ERR unknown command\n";
+        want << "OK 4\nS123\nS1230\nS12300\nS12301\n";
+        std::istringstream all(srv.allSecurityCodes());
+        std::ostringstream ending;
+        size_t endingCount=0;
+        for (string code; all >> code; ) {
+            if (code.size() >= 3 && code.compare(code.size()-3, 3, "999")==0) {
+                ending << code << "\n";
+                ++endingCount;
+            }
+        }
+        want << "OK " << endingCount << "\n" << ending.str();
+        want << "ERR usage: CODES <prefix>* | *<suffix> [<max>]\n";
+        EquitySelection named;
+        srv.findByDescription("server 7", EquityQuery::NoLimit, named);
+        if (named.Size() != 6000)
+            throw std::runtime_error("findByDescription() found the wrong rows");
+        want << "OK 6000\n";
+        for (EquitySelection::const_iterator it=named.begin(); it != named.end(); ++it)
+            want << *it << "\n";
+        want << "OK 1\n" << *srv.getSecurityInfo("S4") << "\n";
+
+        // Two clients at once, to use both loops (probably):
+        for (int client = 0; client < 2; ++client) {
+            int fd=Connect(server.Port());
+            size_t half=requests.size()/2+3;
+            SendAll(fd, requests.substr(0, half));
+            usleep(10000);
+            SendAll(fd, requests.substr(half));
+            string got=ReadAtLeast(fd, want.str().size());
+            close(fd);
+            if (got != want.str())
+                throw std::runtime_error("EquityServer responses are wrong");
+        }
+
+        // Requests pipelined behind answers which cross MaxPendingOutput are
+        // still answered, even when the socket takes all the output at once:
+        {
+            EquitySelection everything;
+            srv.getPERange(-100, 100, everything);
+            std::ostringstream bulk;
+            bulk << "OK " << everything.Size() << "\n";
+            for (EquitySelection::const_iterator it=everything.begin(); it != everything.end(); ++it)
+                bulk << *it << "\n";
+            string expect;
+            size_t copies=0;
+            while (expect.size() <= (size_t)EquityServer::MaxPendingOutput) {
+                expect += bulk.str();
+                ++copies;
+            }
+            expect += "OK 1\n" + srv.lowestPE() + "\n";
+            string pipelined;
+            for (size_t i = 0; i < copies; ++i)
+                pipelined += "PERANGE -100 100\n";
+            pipelined += "LOWESTPE\n";
+
+            int fd=Connect(server.Port());
+            struct timeval timeout={ 10, 0 };     // fail rather than hang
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            SendAll(fd, pipelined);
+            string got=ReadAtLeast(fd, expect.size());
+            close(fd);
+            if (got != expect)
+                throw std::runtime_error("EquityServer dropped requests queued behind a full output buffer");
+
+            // A client which shuts down its side after requests whose answers
+            // overflow the socket buffers still gets every answer before the
+            // server closes:
+            fd=Connect(server.Port());
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            SendAll(fd, pipelined+pipelined+pipelined);
+            shutdown(fd, SHUT_WR);
+            usleep(100000);     // let the server see the shutdown while it's writing
+            got=ReadAtLeast(fd, 3*expect.size()+1);
+            close(fd);
+            if (got != expect+expect+expect)
+                throw std::runtime_error("EquityServer dropped answers to a half-closed client");
+        }
+
+        // A client which pipelines requests without reading the answers is
+        // held back: once its answers back up, the server stops reading.
+        {
+            int fd=Connect(server.Port());
+            fcntl(fd, F_SETFL, O_NONBLOCK);
+            string requests;
+            for (int i = 0; i < 1024; ++i)
+                requests += "ALLCODES\n";
+            const size_t limit=64*1024*1024;
+            size_t sent=0;
+            int idle=0;
+            while (sent < limit && idle < 20) {
+                size_t offset=sent % requests.size();
+                ssize_t n=send(fd, requests.data()+offset, requests.size()-offset, MSG_NOSIGNAL);
+                if (n > 0) {
+                    sent += n;
+                    idle=0;
+                    continue;
+                }
+                if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+                    throw std::runtime_error("send() to EquityServer failed");
+                ++idle;     // Blocked, unless the server's just slow to read.
+                usleep(10000);
+            }
+            close(fd);
+            if (sent >= limit)
+                throw std::runtime_error("EquityServer kept reading requests it couldn't answer");
+        }
+    }
+
+private:
+    static int Connect(int port) {
+        int fd=socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family=AF_INET;
+        addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+        addr.sin_port=htons((uint16_t)port);
+        if ( fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 )
+            throw std::runtime_error("Can't connect to EquityServer");
+        return fd;
+    }
+
+    static void SendAll(int fd, const string& data) {
+        for (size_t sent = 0; sent < data.size(); ) {
+            ssize_t n=send(fd, data.data()+sent, data.size()-sent, MSG_NOSIGNAL);
+            if (n <= 0)
+                throw std::runtime_error("send() to EquityServer failed");
+            sent += n;
+        }
+    }
+
+    static string ReadAtLeast(int fd, size_t bytes) {
+        string got;
+        char buf[4096];
+        while (got.size() < bytes) {
+            ssize_t n=recv(fd, buf, sizeof(buf), 0);
+            if (n <= 0)
+                break;
+            got.append(buf, n);
+        }
+        return got;
+    }
+};
+
+class test_SnapshotFile {
+public:
+    test_SnapshotFile() {
+        TestFile feed("snapshot.txt"), snapshot("snapshot.snap");
+        feed.WriteFeed("Q", "snap", 5000, 4000);
+        const char* generated=feed.Path();
+        const char* path=snapshot.Path();
+
+        const char* inputs[] = { "test_cases/input000.txt", generated };
+        for (size_t f = 0; f < sizeof(inputs)/sizeof(*inputs); ++f) {
+            EquityService original;
+            if (!original.initialize(inputs[f]))
+                throw std::runtime_error("initialize() failed");
+            // Leave some updates in the P/E index's moved set:
+            std::vector<EquityUpdate> batch;
+            std::vector<EquityPtr> some;
+            original.getPERange(0, 5, some);
+            for (size_t i = 0; i < some.size(); i += 3) {
+                EquityUpdate u={ some[i]->GetEquityCode(), 1.25, 7.5 - (double)(i % 5), (long long)i };
+                batch.push_back(u);
+            }
+            original.applyUpdates(batch);
+
+            if (!original.saveSnapshot(path))
+                throw std::runtime_error("saveSnapshot() failed");
+            EquityService restored;
+            if (!restored.loadSnapshot(path))
+                throw std::runtime_error("loadSnapshot() failed");
+            Compare(original, restored);
+        }
+
+        // Damaged and truncated snapshots are rejected, leaving the data in place:
+        EquityService srv;
+        if ( !srv.loadSnapshot(path) || !srv.getSecurityInfo("Q17") )
+            throw std::runtime_error("loadSnapshot() failed");
+
+        // Equities from a snapshot outlive it, descriptions and all:
+        EquityPtr kept=srv.getSecurityInfo("Q17");
+        string want=kept->GetDescription().ToString();
+        if ( !srv.initialize("test_cases/input000.txt") || !srv.initialize("test_cases/input000.txt") )
+            throw std::runtime_error("initialize() failed");
+        if ( kept->GetDescription() != want || EquityFormatter::Cached(*kept).Empty() )
+            throw std::runtime_error("A snapshot equity lost its description");
+        if (!srv.loadSnapshot(path))
+            throw std::runtime_error("loadSnapshot() failed");
+        string bytes;
+        {
+            std::ifstream in(path, std::ios::binary);
+            std::ostringstream all;
+            all << in.rdbuf();
+            bytes=all.str();
+        }
+        for (int damage = 0; damage < 3; ++damage) {
+            string bad=bytes;
+            if (damage==0)
+                bad[bad.size()/2] ^= 0x10;
+            else if (damage==1)
+                bad.resize(bad.size()-8);
+            else
+                bad[0]='X';
+            {
+                std::ofstream out(path, std::ios::binary | std::ios::trunc);
+                out << bad;
+            }
+            if ( srv.loadSnapshot(path) || !srv.getSecurityInfo("Q17") )
+                throw std::runtime_error("loadSnapshot() accepted a damaged snapshot");
+        }
+    }
+
+private:
+    static void Compare(EquityService& original, EquityService& restored) {
+        if ( restored.allSecurityCodes() != original.allSecurityCodes() ||
+                restored.lowestPE() != original.lowestPE() )
+            throw std::runtime_error("Restored snapshot codes or lowest P/E differ");
+        const double ranges[][2] = { {-100, 1000}, {6, 15}, {3.5, 3.5} };
+        for (size_t r = 0; r < sizeof(ranges)/sizeof(*ranges); ++r) {
+            for (int order = EquityMap::Order_Code; order <= EquityMap::Order_PE; ++order) {
+                std::vector<EquityPtr> want, got;
+                original.getPERange(ranges[r][0], ranges[r][1], want, (EquityMap::ResultOrder)order);
+                restored.getPERange(ranges[r][0], ranges[r][1], got, (EquityMap::ResultOrder)order);
+                if (want.size() != got.size())
+                    throw std::runtime_error("Restored snapshot range count differs");
+                for (size_t i = 0; i < want.size(); ++i) {
+                    EquityPtr e=restored.getSecurityInfo(want[i]->GetEquityCode());
+                    if ( want[i]->GetEquityCode() != got[i]->GetEquityCode() || e != got[i] ||
+                            e->GetDescription() != want[i]->GetDescription() || e->GetPrice() != want[i]->GetPrice() ||
+                            e->GetPE_ratio() != want[i]->GetPE_ratio() || e->GetMarketCap() != want[i]->GetMarketCap() )
+                        throw std::runtime_error("Restored snapshot data differs");
+                }
+            }
+        }
+    }
+};
+
+class test_ShardedService {
+public:
+    test_ShardedService() {
+        // Plenty of tied P/Es and prices, and repeated codes, which must
+        // resolve as they do in a single map:
+        TestFile feed("shards.txt");
+        feed.WriteFeed("S", "shard", 5000, 4000);
+        const char* generated=feed.Path();
+
+        const char* inputs[] = { "test_cases/input000.txt", generated };
+        const unsigned shardCounts[] = { 1, 3, 8 };
+        for (size_t f = 0; f < sizeof(inputs)/sizeof(*inputs); ++f) {
+            EquityService single;
+            if (!single.initialize(inputs[f]))
+                throw std::runtime_error("initialize() failed");
+            for (size_t s = 0; s < sizeof(shardCounts)/sizeof(*shardCounts); ++s) {
+                ShardedEquityService sharded(shardCounts[s]);
+                if ( sharded.ShardCount() != shardCounts[s] || !sharded.initialize(inputs[f]) )
+                    throw std::runtime_error("ShardedEquityService.initialize() failed");
+                Compare(single, sharded);
+            }
+        }
+
+        // Stream loads, concurrent queries, and a failed reload:
+        ShardedEquityService sharded(4);
+        std::ifstream in("test_cases/input000.txt");
+        if ( !sharded.initialize(in) || sharded.lowestPE() != "AALLN" )
+            throw std::runtime_error("ShardedEquityService stream load failed");
+        std::atomic<bool> failed(false);
+        std::vector<std::thread> readers;
+        for (int i = 0; i < 4; ++i)
+            readers.push_back(std::thread(&test_ShardedService::Reader, &sharded, &failed));
+        for (size_t i = 0; i < readers.size(); ++i)
+            readers[i].join();
+        if (failed)
+            throw std::runtime_error("Concurrent sharded queries disagreed");
+        if ( sharded.initialize("/nonexistent/input.txt") || !sharded.getSecurityInfo("IBMUS") )
+            throw std::runtime_error("Failed initialize() replaced the current data");
+
+        // A failed task is rethrown only once every other task is finished:
+        {
+            PinnedWorker first(PinnedWorker::NthCPU(0)), second(PinnedWorker::NthCPU(1));
+            std::atomic<bool> finished(false);
+            std::vector< std::future<void> > done;
+            done.push_back( first.Post(&test_ShardedService::Fail) );
+            done.push_back( second.Post(std::bind(&test_ShardedService::SlowFinish, &finished)) );
+            bool threw=false;
+            try {
+                PinnedWorker::WaitAll(done);
+            }
+            catch (std::runtime_error&) {
+                threw=true;
+            }
+            if ( !threw || !finished )
+                throw std::runtime_error("PinnedWorker::WaitAll() returned before every task finished");
+        }
+    }
+
+private:
+    static void Compare(EquityService& single, const ShardedEquityService& sharded) {
+        if ( sharded.allSecurityCodes() != single.allSecurityCodes() )
+            throw std::runtime_error("Sharded allSecurityCodes() differs");
+        if ( sharded.lowestPE() != single.lowestPE() )
+            throw std::runtime_error("Sharded lowestPE() differs");
+
+        const double ranges[][2] = { {-1, 1000}, {6, 15}, {3.5, 3.5}, {100, 200} };
+        for (size_t r = 0; r < sizeof(ranges)/sizeof(*ranges); ++r) {
+            for (int order = EquityMap::Order_Code; order <= EquityMap::Order_PE; ++order) {
+                std::vector<EquityPtr> want, got;
+                single.getPERange(ranges[r][0], ranges[r][1], want, (EquityMap::ResultOrder)order);
+                sharded.getPERange(ranges[r][0], ranges[r][1], got, (EquityMap::ResultOrder)order);
+                if (want.size() != got.size())
+                    throw std::runtime_error("Sharded getPERange() count differs");
+                for (size_t i = 0; i < want.size(); ++i) {
+                    if ( want[i]->GetEquityCode() != got[i]->GetEquityCode() )
+                        throw std::runtime_error("Sharded getPERange() order differs");
+                    EquityPtr e=sharded.getSecurityInfo(want[i]->GetEquityCode());
+                    if ( !e || e->GetMarketCap() != want[i]->GetMarketCap() || e->GetDescription() != want[i]->GetDescription() )
+                        throw std::runtime_error("Sharded getSecurityInfo() differs");
+                }
+            }
+        }
+    }
+
+    static void Fail() {
+        throw std::runtime_error("task failed");
+    }
+
+    static void SlowFinish(std::atomic<bool>* finished) {
+        usleep(50000);
+        *finished=true;
+    }
+
+    static void Reader(const ShardedEquityService* srv, std::atomic<bool>* failed) {
+        for (int i = 0; i < 200; ++i) {
+            std::vector<EquityPtr> selected;
+            if ( srv->getPERange(6.0, 15.0, selected) != 11 || selected.front()->GetEquityName() != "5HK" )
+                *failed=true;
+        }
+    }
+};
+
+class test_CompactStore {
+public:
+    test_CompactStore() {
+        // Shared and repeated descriptions, zero and negative values, values
+        // with more than 3 decimals, and ties on the lowest P/E:
+        EquityMap map;
+        for (int i = 0; i < 1000; ++i) {
+            char name[8];
+            snprintf(name, sizeof(name), "C%d", (i*7919) % 1000);
+            std::ostringstream desc;
+            desc << ((i % 3) ? "Consolidated Widgets " : "Widgets ") << i % 40;
+            double price= (i % 11) ? i/8.0 : i/3.0;
+            double pe= (i % 13) ? (i % 50)-5 : (i % 50)/7.0;
+            map.Insert(EquityPtr(new Equity(name, desc.str().c_str(), (i % 5) ? i*1000003LL : -i, price, pe)));
+        }
+        map.Insert(EquityPtr(new Equity("LONGDS", string(600, 'x').c_str(), 1, 1e12, -5)));
+
+        CompactEquityStore store;
+        store.Build(map);
+        if (store.Size() != map.Size())
+            throw std::runtime_error("CompactEquityStore size is wrong");
+        CompactEquityStore::RowT row=0;
+        OutputBuffer want(-1), got(-1);
+        for (EquityMap::const_iterator it=map.begin(); it != map.end(); ++it, ++row) {
+            const Equity& e=*it->second;
+            string scratch;
+            if ( store.FindRow(e.GetEquityCode()) != row || store.Code(row) != e.GetEquityCode() )
+                throw std::runtime_error("CompactEquityStore code lookup is wrong");
+            if ( store.Price(row) != e.GetPrice() || store.PE(row) != e.GetPE_ratio()
+                 || store.MarketCap(row) != e.GetMarketCap() || store.Description(row, scratch) != e.GetDescription() )
+                throw std::runtime_error("CompactEquityStore values are wrong");
+            want.AppendLine(e);
+            store.AppendLine(row, got);
+        }
+        if (string(want.Data(), want.Size()) != string(got.Data(), got.Size()))
+            throw std::runtime_error("CompactEquityStore rendering is wrong");
+        const char* missing[] = { "C1000", "A", "ZZZZZZ", "D0" };
+        for (size_t i = 0; i < sizeof(missing)/sizeof(*missing); ++i) {
+            EquityCode code;
+            EquityCode::Parse(missing[i], code);
+            if (store.FindRow(code) != CompactEquityStore::NotFound)
+                throw std::runtime_error("CompactEquityStore found a missing code");
+        }
+        if (store.FindRow(EquityCode()) != CompactEquityStore::NotFound)
+            throw std::runtime_error("CompactEquityStore found the null code");
+
+        // Ranges and the lowest P/E agree with the map:
+        if ( map.FindLowestPE()->GetEquityCode() != store.Code(store.LowestPE()) )
+            throw std::runtime_error("CompactEquityStore lowest P/E is wrong");
+        const double ranges[][2] = { {-1000, 1000}, {6, 15}, {3, 3}, {100, 200} };
+        for (size_t r = 0; r < sizeof(ranges)/sizeof(*ranges); ++r) {
+            std::vector<EquityMap::RowT> mapRows;
+            std::vector<CompactEquityStore::RowT> rows;
+            map.SelectRowsByPERange(ranges[r][0], ranges[r][1], mapRows, EquityMap::Order_Code);
+            store.SelectRowsByPERange(ranges[r][0], ranges[r][1], rows);
+            if (mapRows.size() != rows.size())
+                throw std::runtime_error("CompactEquityStore P/E range count is wrong");
+            for (size_t i = 0; i < rows.size(); ++i) {
+                if (map.GetRow(mapRows[i])->GetEquityCode() != store.Code(rows[i]))
+                    throw std::runtime_error("CompactEquityStore P/E range is wrong");
+            }
+        }
+
+        // The service answers as EquityService does:
+        EquityService full;
+        CompactEquityService compact;
+        if ( !full.initialize("test_cases/input000.txt") || !compact.initialize("test_cases/input000.txt") )
+            throw std::runtime_error("initialize() failed");
+        if ( compact.allSecurityCodes() != full.allSecurityCodes() || compact.lowestPE() != full.lowestPE() )
+            throw std::runtime_error("CompactEquityService codes differ");
+        OutputBuffer fullRange(-1), compactRange(-1);
+        if ( full.writePERange(6, 15, fullRange) != compact.writePERange(6, 15, compactRange)
+             || string(fullRange.Data(), fullRange.Size()) != string(compactRange.Data(), compactRange.Size()) )
+            throw std::runtime_error("CompactEquityService P/E range differs");
+        LookupStatus status;
+        EquityPtr e=compact.getSecurityInfo("IBMUS", &status);
+        if ( !e || status != Lookup_Found || e->GetDescription() != full.getSecurityInfo("IBMUS")->GetDescription() )
+            throw std::runtime_error("CompactEquityService lookup failed");
+        if ( compact.getSecurityInfo("NOSUCH", &status) || status != Lookup_NotFound
+             || compact.getSecurityInfo("bad code", &status) || status != Lookup_InvalidCode )
+            throw std::runtime_error("CompactEquityService missing lookups are wrong");
+    }
+};
+
+
+class test_NumaReplicas {
+public:
+    test_NumaReplicas() {
+        std::vector<unsigned> cpus;
+        if ( !NumaTopology::ParseCPUList(StringRef("0-2,8,10-11\n"), cpus) || cpus.size() != 6
+             || cpus[2] != 2 || cpus[3] != 8 || cpus[5] != 11 )
+            throw std::runtime_error("ParseCPUList failed");
+        const char* bad[] = { "1-", "3-1", "1,", "a", "0-99999999" };
+        for (size_t i = 0; i < sizeof(bad)/sizeof(*bad); ++i) {
+            if (NumaTopology::ParseCPUList(StringRef(bad[i]), cpus))
+                throw std::runtime_error("ParseCPUList accepted a bad list");
+        }
+        const NumaTopology& topology=NumaTopology::Get();
+        if ( !topology.Nodes() || topology.CurrentNode() >= topology.Nodes() )
+            throw std::runtime_error("NumaTopology is wrong");
+
+        // Huge page memory is usable whether or not any huge pages are free:
+        const HugePages::Policy policies[] = { HugePages::Pages_Default, HugePages::Pages_Transparent, HugePages::Pages_2MB };
+        for (size_t i = 0; i < sizeof(policies)/sizeof(*policies); ++i) {
+            char* p=(char*)HugePages::Allocate(3*HugePages::Size2MB+1, policies[i]);
+            p[0]=1;
+            p[3*HugePages::Size2MB]=2;
+            if (policies[i] != HugePages::Pages_Default && ((uintptr_t)p % HugePages::Size2MB))
+                throw std::runtime_error("HugePages allocation isn't aligned");
+            HugePages::Free(p, 3*HugePages::Size2MB+1, policies[i]);
+        }
+
+        // Under huge pages a chunk is a whole page, and a string of exactly
+        // that size still gets a chunk of its own:
+        {
+            StringPool pool(HugePages::Pages_Transparent);
+            string big(HugePages::Size2MB, 'x');
+            pool.Add("abc");
+            StringRef added=pool.Add(big);
+            StringRef after=pool.Add("yyyy");
+            if ( added != big || after != "yyyy" )
+                throw std::runtime_error("Huge page StringPool overwrote a page-sized string");
+        }
+
+        // A service with huge pages and replicas answers as a plain one does,
+        // before and after updates:
+        EquityService plain, numa;
+        numa.setNumaReplicas(true);
+        if ( !plain.initialize("test_cases/input000.txt")
+             || !numa.initialize("test_cases/input000.txt", EquityLoader::Load_HugePages) )
+            throw std::runtime_error("initialize() failed");
+        for (int batch = 0; batch < 3; ++batch) {
+            if ( numa.allSecurityCodes() != plain.allSecurityCodes() || numa.lowestPE() != plain.lowestPE() )
+                throw std::runtime_error("NUMA replica codes differ");
+            OutputBuffer plainRange(-1), numaRange(-1);
+            if ( plain.writePERange(6, 15, plainRange) != numa.writePERange(6, 15, numaRange)
+                 || string(plainRange.Data(), plainRange.Size()) != string(numaRange.Data(), numaRange.Size()) )
+                throw std::runtime_error("NUMA replica P/E range differs");
+            EquityPtr e=numa.getSecurityInfo("AAPLUS");
+            if ( !e || e->GetDescription() != plain.getSecurityInfo("AAPLUS")->GetDescription()
+                 || e->GetPE_ratio() != plain.getSecurityInfo("AAPLUS")->GetPE_ratio() )
+                throw std::runtime_error("NUMA replica lookup differs");
+
+            std::vector<EquityUpdate> updates(1);
+            EquityCode::Parse("AAPLUS", updates[0].Code);
+            updates[0].Price=100+batch;
+            updates[0].PE_ratio=-50-batch;
+            updates[0].MarketCap=batch;
+            if ( plain.applyUpdates(updates) != 1 || numa.applyUpdates(updates) != 1 )
+                throw std::runtime_error("applyUpdates() failed");
+        }
+    }
+};
+#endif
+
+#ifdef _COMPILE_BENCHMARKS
+
+// Benchmark builds count heap allocations, so each benchmark can report
+// allocations per operation:
+static std::atomic<size_t> BenchmarkAllocations(0);
+
+// The full set of replaceable allocation functions, so that every form is
+// counted and released the way it was allocated.  They're kept out of line:
+// inlined into callers, the compiler would see free() applied to the result
+// of operator new, and rightly warn (-Wmismatched-new-delete).
+#define FAST_LOOKUP_ALLOCATOR __attribute__((noinline))
+
+static void* BenchmarkAllocate(size_t size, size_t align) {
+    BenchmarkAllocations.fetch_add(1, std::memory_order_relaxed);
+    void* p=0;
+    if (align <= alignof(std::max_align_t))
+        p=malloc(size ? size : 1);
+    else if (posix_memalign(&p, align, size ? size : 1) != 0)
+        p=0;
+    return p;
+}
+
+FAST_LOOKUP_ALLOCATOR void* operator new(size_t size) {
+    if (void* p=BenchmarkAllocate(size, 0))
+        return p;
+    throw std::bad_alloc();
+}
 
-        const size_t EquityName_MaxLen=6;
+FAST_LOOKUP_ALLOCATOR void* operator new[](size_t size) {
+    return operator new(size);
+}
 
-        // Check the character set:
-        if ( rawField.find_first_not_of("ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789") != std::string::npos) {
-            return false;
-        }
+FAST_LOOKUP_ALLOCATOR void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    return BenchmarkAllocate(size, 0);
+}
 
-        if (
-            (rawField.size() < 1) ||   // Bounds-check the length.
-            ( rawField.size() > EquityName_MaxLen )
-        )
-            return false;
+FAST_LOOKUP_ALLOCATOR void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    return BenchmarkAllocate(size, 0);
+}
 
-        // Having passed validation, now we can assign the result:
-        target=rawField;
+FAST_LOOKUP_ALLOCATOR void operator delete(void* p) noexcept {
+    free(p);
+}
 
-        return true;
+FAST_LOOKUP_ALLOCATOR void operator delete[](void* p) noexcept {
+    free(p);
+}
 
-    }
+FAST_LOOKUP_ALLOCATOR void operator delete(void* p, const std::nothrow_t&) noexcept {
+    free(p);
+}
 
+FAST_LOOKUP_ALLOCATOR void operator delete[](void* p, const std::nothrow_t&) noexcept {
+    free(p);
+}
 
-    bool ParseEquity(const char* inputString, /*out*/ Equity& result) {
+#if __cpp_sized_deallocation
+FAST_LOOKUP_ALLOCATOR void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
 
-        // Split the input string into tokens, using '|' as a delimiter.
-        StringSplitter splitter(inputString,'|');
+FAST_LOOKUP_ALLOCATOR void operator delete[](void* p, size_t) noexcept {
+    free(p);
+}
+#endif
 
-        // Sanity-check the number of tokens:
-        if ( splitter.size() != (size_t)F_COUNT ) {
-            printBadRecordMsg(inputString);
-            return false;
-        }
+#if __cpp_aligned_new
+FAST_LOOKUP_ALLOCATOR void* operator new(size_t size, std::align_val_t align) {
+    if (void* p=BenchmarkAllocate(size, (size_t)align))
+        return p;
+    throw std::bad_alloc();
+}
 
-        // The EquityName field requires validation:
-        if (! parse_EquityName( splitter[ F_EquityName ], result._EquityName )) {
-            printBadRecordMsg(inputString);
-            return false;
-        }
+FAST_LOOKUP_ALLOCATOR void* operator new[](size_t size, std::align_val_t align) {
+    return operator new(size, align);
+}
 
-        // We have no particular requirements for description validation, so a
-        // simple assignment should serve:
-        result._Description = splitter[ F_Description ];
+FAST_LOOKUP_ALLOCATOR void* operator new(size_t size, std::align_val_t align, const std::nothrow_t&) noexcept {
+    return BenchmarkAllocate(size, (size_t)align);
+}
 
-        // Parse the MarketCap field:
-        if (! ParseString( splitter[ F_MarketCap ], result._MarketCap )) {
-            printBadRecordMsg(inputString);
-            return false;
-        }
+FAST_LOOKUP_ALLOCATOR void* operator new[](size_t size, std::align_val_t align, const std::nothrow_t&) noexcept {
+    return BenchmarkAllocate(size, (size_t)align);
+}
 
-        // Parse the Price field:
-        if (! ParseString( splitter[ F_Price ], result._Price )) {
-            printBadRecordMsg(inputString);
-            return false;
-        }
+FAST_LOOKUP_ALLOCATOR void operator delete(void* p, std::align_val_t) noexcept {
+    free(p);
+}
 
-        // Parse the PE_ratio field:
-        if (! ParseString( splitter[ F_PE_ratio ], result._PE_ratio )) {
-            printBadRecordMsg(inputString);
-            return false;
-        }
-        return true;
-    }
-};
+FAST_LOOKUP_ALLOCATOR void operator delete[](void* p, std::align_val_t) noexcept {
+    free(p);
+}
 
+FAST_LOOKUP_ALLOCATOR void operator delete(void* p, size_t, std::align_val_t) noexcept {
+    free(p);
+}
 
-// Given an input stream or filename, this class parses the stream and fills
-// the caller's EquityMap with Equity objects.   If a record error occurs, we
-// just print an error and skip it.  For other errors, we throw std::runtime_error
-//
-class EquityLoader {
-public:
-    EquityLoader( std::istream& input, EquityMap& output ) {
+FAST_LOOKUP_ALLOCATOR void operator delete[](void* p, size_t, std::align_val_t) noexcept {
+    free(p);
+}
 
-        EquityTextFactory fact;
+FAST_LOOKUP_ALLOCATOR void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept {
+    free(p);
+}
 
-        string header;
-        if (!std::getline(input,header)) {
-            throw std::runtime_error("No header line in input");
-        }
-        // Loop the input stream until end-of-file:
-        string line;
+FAST_LOOKUP_ALLOCATOR void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept {
+    free(p);
+}
+#endif
 
-        try {
-            while ( std::getline(input, line) ) {
-                try {
-                    EquityPtr newEquity=fact.ParseEquity( line.c_str() );
-                    if (!newEquity) {
-                        // If parse failed, keep going...
-                        continue;
+#undef FAST_LOOKUP_ALLOCATOR
 
-                    }
+// EquityFeedGenerator writes a synthetic input file in the format
+// EquityTextFactory reads.  Codes follow the shape of the real ones: one to
+// four letters, or up to four digits, then a two-letter exchange suffix, all
+// unique and in shuffled order.  Every 'malformed'th line is damaged in one
+// of the ways a real feed can be (bad code, missing field, bad number).
+class EquityFeedGenerator {
+public:
+    static const double MaxPE;
 
-                    // Save our new Equity object in the caller's collection:
-                    output.Insert(newEquity);
+    EquityFeedGenerator(size_t records, size_t malformed=100) :
+        _Records(records), _Malformed(malformed) {
+    }
 
-                    Stub() << "Inserted " << newEquity->GetEquityName() << std::endl;
-                }
-                catch (std::exception e) {
-                    std::cerr << e.what() << std::endl;
+    // Returns the number of valid records written:
+    size_t Write(const char* path) const {
+        std::ofstream out(path);
+        out << "HEADER:Code|Description|Market Cap|Price|P/E Ratio\n";
+        unsigned seed=20240229;
+        size_t valid=0;
+        for (size_t i = 0; i < _Records; ++i) {
+            // A multiplicative permutation keeps the codes unique but unordered:
+            char code[EquityCode::MaxLen+1];
+            Code(Permute(i), code);
+            double price=(double)(Next(seed) % 200000) / 100.0 + 0.01;
+            long long cap=(long long)(Next(seed) % 1000000) * 1000000LL + (long long)(Next(seed) % 1000000);
+            double pe=(double)(Next(seed) % (unsigned)(MaxPE*100)) / 100.0;
+            if (_Malformed && i % _Malformed==_Malformed-1) {
+                switch (Next(seed) % 3) {
+                case 0:
+                    out << code << "TOOLONG|Bad code|" << cap << "|" << price << "|" << pe << "\n";
+                    break;
+                case 1:
+                    out << code << "|Missing field|" << cap << "|" << price << "\n";
+                    break;
+                default:
+                    out << code << "|Bad number|12x4|" << price << "|" << pe << "\n";
+                    break;
                 }
+                continue;
             }
+            out << code << "|Synthetic holdings " << i % 1000 << " plc|" << cap << "|" << price << "|" << pe << "\n";
+            ++valid;
         }
-        catch (std::exception e) {
-            std::cerr << e.what() << std::endl;
-        }
-
+        return valid;
     }
-};
 
-
-// Compares two Equity objects, returning the one with the lowest P/E.  If
-// the objects have the same P/E, it returns the one with the lowest price.
-class LowestPE_filter : public EquityFilter {
-    const Equity& Compare(const Equity& left, const Equity& right) const {
-        double l_pe=left.GetPE_ratio(),
-               r_pe=right.GetPE_ratio();
-        if (l_pe < r_pe)
-            return left;
-        if (r_pe < l_pe)
-            return right;
-        // Fall-through: the P/E ratios are equal, so return the one
-        // with the lowest price:
-        if ( left.GetPrice() < right.GetPrice() ) {
-            return left;
+    // Writes the code of the 'i'th record to 'buf' (MaxLen+1 chars).  Codes
+    // for i >= records are valid but absent from the feed.
+    void Code(size_t i, char* buf) const {
+        static const char* suffixes[] = { "US", "LN", "HK", "JP", "DE", "FP" };
+        const size_t kinds=sizeof(suffixes)/sizeof(*suffixes);
+        size_t n=i/kinds;
+        char* p=buf;
+        if (i % kinds==2 && n < 10000) {
+            p += snprintf(p, 5, "%u", (unsigned)n);
         }
-        return right;
-    }
-};
-
-// Selects Equity objects by comparing their P/E ratio to a caller-defined [min,max] range.
-class PE_RangeFilter : public EquityFilter {
-public:
-    PE_RangeFilter( double minPE, double maxPE ): _minPE(minPE),_maxPE(maxPE) {
+        else {
+            // Bijective base 26, so each length gets its own block of names:
+            char letters[8];
+            int len=0;
+            for (size_t v = n+1; v; v=(v-1)/26)
+                letters[len++]=(char)('A' + (v-1) % 26);
+            while (len)
+                *p++=letters[--len];
+        }
+        memcpy(p, suffixes[i % kinds], 3);
     }
 
-    bool Select( const Equity& elem ) const {
-        double pe=elem.GetPE_ratio();
-        if ((pe < _minPE) || (pe > _maxPE))
-            return false;
-        return true;
+    size_t Permute(size_t i) const {
+        return (size_t)(((uint64_t)i * 2654435761u) % _Records);
     }
 
 private:
-    double _minPE;
-    double _maxPE;
+    static unsigned Next(unsigned& seed) {
+        seed=seed*1103515245u+12345u;
+        return seed >> 8;
+    }
 
+    size_t _Records;
+    size_t _Malformed;
 };
 
-// EquityService owns the EquityMap and provides application-level query
-// interfaces.
-//
-class EquityService {
+const double EquityFeedGenerator::MaxPE=60.0;
+
+// EquityBenchmarks times EquityService against a generated feed and prints
+// a table: mean ns/op, latency percentiles, and allocations per operation.
+// The per-operation percentiles have the cost of reading the clock taken out.
+class EquityBenchmarks {
 public:
-    EquityService() {
-    }
+    EquityBenchmarks(size_t records) : _Feed(records), _Records(records), _Out(cout.rdbuf()) {
+        const char* path="/tmp/fast-lookup-bench.txt";
+        size_t valid=_Feed.Write(path);
+        _ClockCost=ClockCost();
+        _Out << "Feed: " << records << " lines, " << valid << " valid, in " << path << std::endl;
+        Header();
 
-    // initialize() loads all security data from stdin, filling _Map:
-    bool initialize(std::istream& input=std::cin) {
-        try {
-            EquityLoader( input, _Map);
+        // Loading, from the mapped file and from a stream.  The loaders' reports
+        // of bad records are silenced, but still formatted:
+        Quiet quiet;
+        {
+            Samples s;
+            for (int i = 0; i < 5; ++i) {
+                EquityService srv;
+                Timer t(s);
+                if (!srv.initialize(path))
+                    throw std::runtime_error("initialize() failed");
+            }
+            Report("initialize(path)", s);
         }
-        catch (...) {
-            std::cerr << "EquityService.initialize() failed" << std::endl;
-            return false;
+        {
+            Samples s;
+            for (int i = 0; i < 3; ++i) {
+                EquityService srv;
+                std::ifstream in(path);
+                Timer t(s);
+                if (!srv.initialize(in))
+                    throw std::runtime_error("initialize() failed");
+            }
+            Report("initialize(istream)", s);
         }
-        return true;
-    }
 
-    // Returns an EquityPtr containing attributes of the given equity.  EquityPtr
-    // will be null if equityName not found.
-    EquityPtr getSecurityInfo(const char* equityName) {
+        EquityService srv;
+        srv.initialize(path);
+        quiet.Restore();
+        _Out << "RSS after load: " << ResidentKB("VmRSS:") << " kB (peak " << ResidentKB("VmHWM:") << " kB)" << std::endl;
 
-        try {
-            return _Map.FindByEquityName(equityName);
-        }
-        catch (std::exception e) {
-            std::cerr << e.what() << std::endl;
+        // Lookups, by text as main() does, hitting and missing:
+        std::vector<string> hits, misses;
+        unsigned seed=7;
+        for (int i = 0; i < 100000; ++i) {
+            char code[EquityCode::MaxLen+1];
+            seed=seed*1103515245u+12345u;
+            _Feed.Code(_Feed.Permute((seed >> 8) % records), code);
+            hits.push_back(code);
+            _Feed.Code(records + (seed >> 8) % records, code);
+            misses.push_back(code);
         }
-        return EquityPtr();
-
-    }
-
-    // Returns all security names, ordered alphabetically:
-    string allSecurityCodes() const {
+        Lookups("getSecurityInfo hit", srv, hits);
+        Lookups("getSecurityInfo miss", srv, misses);
 
-        // Our Map stores its elements indexed by equity name, and the
-        // underlying comparison operator uses the std::string operator '<'.
-        // So all we have to do is build a string with one equity name per
-        // line.
-
-        std::stringstream ss;
-        EquityMap::const_iterator it=_Map.begin();
-        while (it != _Map.end()) {
-            ss << it->first << "\n";
-            ++it;
+        // P/E range views at several selectivities:
+        const double selectivity[] = { 0.0001, 0.001, 0.01, 0.1, 0.5 };
+        for (size_t i = 0; i < sizeof(selectivity)/sizeof(*selectivity); ++i) {
+            double lo=EquityFeedGenerator::MaxPE/4, hi=lo + EquityFeedGenerator::MaxPE*selectivity[i];
+            EquitySelection selected;
+            Samples s;
+            int reps= selectivity[i] < 0.01 ? 10000 : 100;
+            for (int r = 0; r < reps; ++r) {
+                Timer t(s);
+                srv.getPERange(lo, hi, selected);
+            }
+            std::ostringstream name;
+            name << "getPERange " << selectivity[i]*100 << "% (" << selected.Size() << ")";
+            Report(name.str(), s);
         }
-        return ss.str();
-    }
 
-    // Returns the name of the security with the lowest P/E ratio:
-    string lowestPE() const {
-        const EquityPtr result=_Map.FindByCompareFilter(  LowestPE_filter() );
-        if (result) {
-            return result->GetEquityName();
+        {
+            Samples s;
+            for (int r = 0; r < 100000; ++r) {
+                Timer t(s);
+                srv.lowestPE();
+            }
+            Report("lowestPE", s);
+        }
+        {
+            Samples s;
+            for (int r = 0; r < 20; ++r) {
+                Timer t(s);
+                srv.allSecurityCodes();
+            }
+            Report("allSecurityCodes", s);
+        }
+        {
+            Samples s;
+            OutputBuffer out;
+            for (int r = 0; r < 20; ++r) {
+                out.Clear();
+                Timer t(s);
+                srv.writeSecurityCodes(out);
+            }
+            Report("writeSecurityCodes", s);
         }
-        return "";
-    }
-
-    // Returns the number of Equity objects whose P/E values are in the range specified,
-    // adding them to caller's collection.
-    int getPERange( double min_pe, double max_pe, EquityMap& result ) const {
-        return _Map.SelectByFilter( PE_RangeFilter( min_pe, max_pe), result  );
     }
 
 private:
-    EquityMap _Map;
-};
+    typedef std::chrono::steady_clock Clock;
 
-
-#define _COMPILE_UNIT_TESTS
-#ifdef _COMPILE_UNIT_TESTS
-
-class test_EquityParser {
-public:
-    test_EquityParser() {
-        EquityTextFactory fact_00;
-        try {
-            EquityPtr ptr=fact_00.ParseEquity("IBMUS|International Business Machines|198657057012|182.95|11.18");
-            std::cerr <<  *ptr << std::endl;
+    // Discards output to cout and std::cerr while it's in scope:
+    class Quiet {
+    public:
+        Quiet() : _Out(cout.rdbuf(&_Null)), _Err(std::cerr.rdbuf(&_Null)) {
         }
-        catch (std::exception e) {
-            std::cerr << e.what() << std::endl;
+        ~Quiet() {
+            Restore();
         }
-    }
-};
-
-class test_EquityService {
-public:
-    test_EquityService() {
-        EquityService srv;
+        void Restore() {
+            if (_Out) {
+                cout.rdbuf(_Out);
+                std::cerr.rdbuf(_Err);
+            }
+            _Out=0;
+        }
+    private:
+        struct NullBuf : std::streambuf {
+            int overflow(int c) {
+                return c==EOF ? 0 : c;
+            }
+        };
+        NullBuf         _Null;
+        std::streambuf* _Out;
+        std::streambuf* _Err;
+    };
 
-        // Test loading the EquityService with a known data stream:
-        std::ifstream test_input("test_cases/input000.txt");
-        if (! test_input.is_open()) {
-            throw std::runtime_error("Can't open input000.txt");
+    // Latencies, and the allocations made while they were measured:
+    struct Samples {
+        Samples() : Allocations(0) {
         }
-        const int input000_record_count=17;
-        srv.initialize(test_input);
+        std::vector<double> Ns;
+        size_t              Allocations;
+    };
 
-        {
-            // Select all the equities in given range:
-            EquityMap selected;
-            int count=srv.getPERange( 6.0, 15.0, selected );
-            if (count != 11) {
-                throw std::runtime_error("Incorrect number of P/E-range matches");
-            }
+    // Times its own lifetime into a Samples:
+    class Timer {
+    public:
+        Timer(Samples& s) : _S(s), _Allocs(BenchmarkAllocations.load()), _Start(Clock::now()) {
+        }
+        ~Timer() {
+            Clock::time_point end=Clock::now();
+            _S.Ns.push_back((double)std::chrono::duration_cast<std::chrono::nanoseconds>(end-_Start).count());
+            _S.Allocations += BenchmarkAllocations.load()-_Allocs;
         }
+    private:
+        Samples&          _S;
+        size_t            _Allocs;
+        Clock::time_point _Start;
+    };
 
-        {
-            // Make sure we can retrieve a security:
-            EquityPtr p=srv.getSecurityInfo("MSFTUS");
-            if ( !p || (p->GetEquityName() != "MSFTUS" ))
-                throw std::runtime_error("Can't find MSFTUS");
+    void Lookups(const char* name, const EquityService& srv, const std::vector<string>& codes) {
+        Samples s;
+        s.Ns.reserve(codes.size());
+        size_t found=0;
+        for (size_t i = 0; i < codes.size(); ++i) {
+            Timer t(s);
+            found += !!srv.getSecurityInfo(codes[i].c_str());
         }
+        std::ostringstream label;
+        label << name << " (" << found << " found)";
+        Report(label.str(), s);
+    }
 
-        {
-            // Verify that we can retrieve all security codes:
-            string allCodes=srv.allSecurityCodes();
-            // How many records did we get?
-            StringSplitter sp( allCodes, '\n');
-            if (sp.size() != input000_record_count)
-                throw std::runtime_error("Invalid record count for allSecurityCodes()");
+    void Header() {
+        _Out << std::left << std::setw(36) << "benchmark" << std::right
+             << std::setw(8) << "ops" << std::setw(14) << "ns/op" << std::setw(14) << "p50"
+             << std::setw(14) << "p90" << std::setw(14) << "p99" << std::setw(14) << "p99.9"
+             << std::setw(14) << "allocs/op" << std::endl;
+    }
 
+    void Report(const string& name, Samples& s) {
+        double total=0;
+        for (size_t i = 0; i < s.Ns.size(); ++i) {
+            s.Ns[i]=std::max(0.0, s.Ns[i]-_ClockCost);
+            total += s.Ns[i];
         }
-        {
-            // Find the lowest P/E:
-            string lowestPe=srv.lowestPE();
-            Stub() << "Lowest P/E:" << lowestPe << std::endl;
-        }
+        std::sort(s.Ns.begin(), s.Ns.end());
+        double n=(double)s.Ns.size();
+        _Out << std::left << std::setw(36) << name << std::right << std::fixed << std::setprecision(1)
+             << std::setw(8) << s.Ns.size() << std::setw(14) << total/n
+             << std::setw(14) << Percentile(s, 0.5) << std::setw(14) << Percentile(s, 0.9)
+             << std::setw(14) << Percentile(s, 0.99) << std::setw(14) << Percentile(s, 0.999)
+             << std::setw(14) << std::setprecision(2) << (double)s.Allocations/n << std::endl;
+    }
 
+    static double Percentile(const Samples& s, double p) {
+        return s.Ns[std::min(s.Ns.size()-1, (size_t)(p*(double)s.Ns.size()))];
     }
+
+    // The median cost of an empty timed block:
+    static double ClockCost() {
+        Samples s;
+        for (int i = 0; i < 10000; ++i)
+            Timer t(s);
+        std::sort(s.Ns.begin(), s.Ns.end());
+        return s.Ns[s.Ns.size()/2];
+    }
+
+    // Reads a "VmXXX:" line of /proc/self/status, in kB:
+    static long ResidentKB(const char* field) {
+        std::ifstream status("/proc/self/status");
+        string line;
+        while (std::getline(status, line)) {
+            if (line.compare(0, strlen(field), field)==0)
+                return atol(line.c_str()+strlen(field));
+        }
+        return -1;
+    }
+
+    EquityFeedGenerator _Feed;
+    size_t              _Records;
+    double              _ClockCost;
+    std::ostream        _Out;   // stdout, even while Quiet
 };
 
 #endif
@@ -615,11 +9605,30 @@ public:
 class ParseArgs {
 public:
     ParseArgs(int argc, char* argv[]) :
-        RunUnitTests(false) {
+        RunUnitTests(false),
+        DumpMetrics(false),
+        Compact(false),
+        ServerPort(-1),
+        BenchmarkRecords(0) {
         for (int i = 1; i < argc ; ++i) {
             if ( match(argv[i], "-t" )) {
                 RunUnitTests=true;
             }
+            else if ( match(argv[i], "-m" )) {
+                DumpMetrics=true;
+            }
+            else if ( match(argv[i], "-c" )) {
+                Compact=true;
+            }
+            else if ( match(argv[i], "-s" ) && i+1 < argc ) {
+                ServerPort=atoi(argv[++i]);
+            }
+            else if ( match(argv[i], "-b" )) {
+                // An optional record count follows:
+                BenchmarkRecords=500000;
+                if ( i+1 < argc && isdigit((unsigned char)argv[i+1][0]) )
+                    BenchmarkRecords=strtoul(argv[++i], 0, 10);
+            }
             else {
                 // We're expecting an input filename.  If we don't get it, stdin is the default:
                 InputFile=argv[i];
@@ -628,6 +9637,10 @@ public:
     }
 
     bool RunUnitTests;
+    bool DumpMetrics;
+    bool Compact;
+    int ServerPort;         // -1 unless serving
+    size_t BenchmarkRecords;
     string InputFile;
 
     bool match( const char* left, const char* right) const {
@@ -638,77 +9651,161 @@ public:
     }
 };
 
+// Prints main()'s standard report from 'srv', which is an EquityService or a
+// CompactEquityService:
+template <class Service>
+void PrintReport(const Service& srv) {
+    // Print out these securities:
+    const char* printItems[] = {"IBMUS","AAPLUS", "AALLN", "30HK"};
+    for (int i = 0; i < sizeof(printItems)/sizeof(*printItems); ++i) {
+        cout << "Lookup for Code " << printItems[i] << std::endl;
+        EquityPtr e=srv.getSecurityInfo( printItems[i] );
+        if (e)
+            cout << EquityFormatter::Cached(*e) << std::endl;
+        else
+            cout << "Not found" << std::endl;
+    }
+
+    cout << "All codes:" << std::endl;
+    // Print out all security codes, in one write:
+    {
+        OutputBuffer out(STDOUT_FILENO);
+        srv.writeSecurityCodes(out);
+        out.Append('\n');
+        out.Flush();
+    }
+
+    // Print the equity with the lowest P/E:
+    {
+        string lowestPE=srv.lowestPE();
+        EquityPtr eq=srv.getSecurityInfo(lowestPE.c_str());
+        if (eq)
+            cout << "Lowest P/E is " << std::fixed << std::setprecision(3) << eq->GetPE_ratio() << " from code " << lowestPE << std::endl;
+        else
+            cout << "Lowest P/E: Not found" << std::endl;
+    }
+
+    {
+        // Select and print the securities whose P/E is between 6 and 15.  The
+        // headers go (and are flushed) first, as a large range is written out
+        // as it's filled in:
+        OutputBuffer out(STDOUT_FILENO);
+
+        cout << "Get equity objects whose P/E is between 6 and 15" << std::endl;
+        cout << "The following have P/E between 6.000 and 15.000" << std::endl;
+        srv.writePERange(6.0,15.0,out);
+        out.Flush();
+    }
+}
+
 int main(int argc, char* argv[]) {
     // main() is our test driver:
     //
     //  Args:  -t:  Run unit tests.
+    //         -b [records]:  Run benchmarks against a generated feed
+    //                        (500000 records by default).
+    //         -m:  Print a metrics summary to stderr when done.
+    //         -c:  Answer from a CompactEquityService (not with -s).
+    //         -s port:  Load the input, then serve it on 'port' (see
+    //                   EquityServer) until interrupted.
     //
 
     ParseArgs args(argc,argv);
 
-    if ( args.RunUnitTests ) {
+    if ( args.BenchmarkRecords ) {
+#ifdef _COMPILE_BENCHMARKS
+        EquityBenchmarks benchmarks(args.BenchmarkRecords);
+#else
+        throw std::runtime_error( "Benchmarks are not enabled for this build." );
+#endif
+    }
+    else if ( args.RunUnitTests ) {
 #ifdef _COMPILE_UNIT_TESTS
+        test_EquityCode test_code;
+        test_EquityMap test_map;
+        test_RangeScan test_scan;
+        test_PEIndex test_peindex;
+        test_TickUpdates test_ticks;
+        test_FilterExpr test_filters;
+        test_QueryEngine test_query;
+        test_ParallelQuery test_parallel_query;
+        test_CodeSearch test_search;
+        test_DescriptionSearch test_text;
+        test_FieldScanner test_fields;
+        test_EquityFormatter test_format;
+        test_OutputBuffer test_output;
+#ifdef _COMPILE_METRICS
+        test_Metrics test_metrics;
+#endif
         test_EquityParser test_00;
+        test_EquityLoader test_loader;
+        test_ParallelLoader test_parallel;
+        test_EquityReload test_reload;
+        test_ShardedService test_shards;
+        test_CompactStore test_compact;
+        test_NumaReplicas test_numa;
+        test_EquityServer test_server;
+        test_SnapshotFile test_snapshot;
         test_EquityService test_01;
+        test_EquityBatcher test_batcher;
 #else
         throw std::runtime_error( "Unit tests are not enabled for this build." );
 #endif
     }
+    else if ( args.Compact ) {
+        try {
+            CompactEquityService srv;
+            bool ok= args.InputFile.length() ? srv.initialize( args.InputFile.c_str() )
+                     : srv.initialize( std::cin );
+            if (!ok) {
+                std::cerr << "CompactEquityService.initialize() failed" << std::endl;
+                return 1;
+            }
+            PrintReport(srv);
+        }
+        catch (std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    }
     else
     {   // Main line logic:
         try {
             EquityService srv;
-            std::ifstream inputFile( args.InputFile.length() ? args.InputFile : "/dev/zero");
 
-            // We'll either use stdin or the input file, if the latter was specified:
-            std::istream & input( args.InputFile.length() ? inputFile :  std::cin );
-
-            // Load from stdin to EquityService:
-            bool ok=srv.initialize( input );
+            // We'll either map the input file, if one was specified, or read stdin:
+            bool ok= args.InputFile.length() ? srv.initialize( args.InputFile.c_str() )
+                     : srv.initialize( std::cin );
             if (!ok) {
                 std::cerr << "EquityService.initialize() failed" << std::endl;
                 return 1;
             }
 
-            // Print out these securities:
-            const char* printItems[] = {"IBMUS","AAPLUS", "AALLN", "30HK"};
-            for (int i = 0; i < sizeof(printItems)/sizeof(*printItems); ++i) {
-                cout << "Lookup for Code " << printItems[i] << std::endl;
-                EquityPtr e=srv.getSecurityInfo( printItems[i] );
-                cout << *e << std::endl;
-            }
-
-            cout << "All codes:" << std::endl;
-            // Print out all security codes:
-            cout << srv.allSecurityCodes() << std::endl;
-
-            // Print the equity with the lowest P/E:
-            {
-                string lowestPE=srv.lowestPE();
-                EquityPtr eq=srv.getSecurityInfo(lowestPE.c_str());
-                cout << "Lowest P/E is " << std::setprecision(3) << eq->GetPE_ratio() << " from code " << lowestPE << std::endl;
+            if ( args.ServerPort >= 0 ) {
+                // Block the signals we stop on before the loops start, so
+                // only this thread takes them:
+                sigset_t stop;
+                sigemptyset(&stop);
+                sigaddset(&stop, SIGINT);
+                sigaddset(&stop, SIGTERM);
+                pthread_sigmask(SIG_BLOCK, &stop, 0);
+                EquityServer server(srv, args.ServerPort);
+                std::cerr << "Serving on port " << server.Port() << std::endl;
+                int sig;
+                sigwait(&stop, &sig);
+                server.Stop();
+                if ( args.DumpMetrics && !srv.writeMetrics(std::cerr, false) )
+                    std::cerr << "Metrics are not enabled for this build." << std::endl;
+                return 0;
             }
 
-            {
-                // Fill and print an EquityMap containing the securities whose
-                // P/E is between 6 ands 16:
-                EquityMap selected;
-
-                cout << "Get equity objects whose P/E is between 6 and 15" << std::endl;
-                srv.getPERange(6.0,15.0,selected);
-
-                cout << "The following have P/E between 6.000 and 15.000" << std::endl;
+            PrintReport(srv);
 
-                for (EquityMap::const_iterator it= selected.begin();
-                        it != selected.end();
-                        ++it) {
-                    cout << *it->second << std::endl;
-
-                }
-            }
+            if ( args.DumpMetrics && !srv.writeMetrics(std::cerr, false) )
+                std::cerr << "Metrics are not enabled for this build." << std::endl;
 
         }
-        catch (std::exception e) {
+        catch (std::exception& e) {
             std::cerr << e.what() << std::endl;
             return 1;
         }